@@ -0,0 +1,321 @@
+#include <math.h>
+#include "ets_sys.h"
+#include "osapi.h"
+#include "os_type.h"
+#include "user_interface.h"
+#include "espconn.h"
+#include "user_config.h"
+#include "mqtt.h"
+#include "packets.h"
+#include "main.h"
+#include "fwupdate.h"
+#include "bench.h"
+#include "ntc.h"
+#include "jsonw.h"
+
+#ifdef BENCH
+
+#define FLASH_MAPPED 0x40200000 // where the cache maps flash
+#define CACHE_LINE 32
+#define RX_TOPIC "herps/00000000/ota"
+#define RX_PAYLOAD_LEN 40
+#define BIG_READING_LEN 200 // too long for the precompiled PUBLISH header
+
+typedef void (*bench_fn)(void);
+
+typedef struct {
+    const char *name;
+    bench_fn fn;
+    uint8_t cold;
+} bench_case_t;
+
+static os_timer_t startTimer;
+static mqtt_session_t precompiled, encoded;
+static uint8_t reading[] = "23.45";
+static uint8_t bigReading[BIG_READING_LEN];
+static uint8_t rxPublish[4 + sizeof(RX_TOPIC) - 1 + RX_PAYLOAD_LEN];
+static uint8_t rxPingresp[2] = { 0xD0, 0x00 };
+static uint8_t length4[4] = { 0xFF, 0xFF, 0xFF, 0x7F };
+static char formatted[20];
+static char json[128]; // a state payload, as main.c publishes it
+static uint32_t overhead; // cycles bench_call() takes around an empty case
+static volatile uint32_t sink; // results go here so nothing is optimised away
+static volatile uint32_t ntcCounts = 2048; // read back each call, so the conversions are not folded away
+
+sint8 ICACHE_FLASH_ATTR __wrap_espconn_send(struct espconn *conn, uint8 *psent, uint16 length) {
+    sink += length;
+    return ESPCONN_OK;
+}
+
+static inline uint32_t ccount(void) {
+#ifdef __XTENSA__
+    uint32_t c;
+    __asm__ __volatile__("rsr %0, ccount" : "=a"(c));
+    return c;
+#else
+    return system_get_time() * system_get_cpu_freq();
+#endif
+}
+
+// These two stay in IRAM, so emptying the cache does not slow the timing itself
+
+static uint32_t bench_call(bench_fn fn) {
+    uint32_t start = ccount();
+    fn();
+    return ccount() - start;
+}
+
+// reads a line of mapped flash for every line of the cache, twice over
+static void bench_evict(void) {
+    const volatile uint32_t *p = (const volatile uint32_t *)FLASH_MAPPED;
+    uint32_t i, sum = 0;
+    for (i = 0; i < BENCH_EVICT_LEN / 4; i += CACHE_LINE / 4) {
+        sum += p[i];
+    }
+    sink = sum;
+}
+
+static void ICACHE_FLASH_ATTR nothing(void) {
+}
+
+static void ICACHE_FLASH_ATTR encode_length_1(void) {
+    uint8_t buf[4];
+    sink = encodeLength(100, buf);
+}
+
+static void ICACHE_FLASH_ATTR encode_length_2(void) {
+    uint8_t buf[4];
+    sink = encodeLength(10000, buf);
+}
+
+static void ICACHE_FLASH_ATTR encode_length_4(void) {
+    uint8_t buf[4];
+    sink = encodeLength(268435455, buf);
+}
+
+static void ICACHE_FLASH_ATTR decode_length_4(void) {
+    uint32_t value;
+    sink = decodeLength(length4, sizeof(length4), &value);
+}
+
+static void ICACHE_FLASH_ATTR connect_encoded(void) {
+    mqttSend(&encoded, NULL, 0, MQTT_MSG_TYPE_CONNECT);
+}
+
+static void ICACHE_FLASH_ATTR subscribe_precompiled(void) {
+    mqttSend(&precompiled, NULL, 0, MQTT_MSG_TYPE_SUBSCRIBE);
+}
+
+static void ICACHE_FLASH_ATTR subscribe_encoded(void) {
+    mqttSend(&encoded, NULL, 0, MQTT_MSG_TYPE_SUBSCRIBE);
+}
+
+static void ICACHE_FLASH_ATTR publish_precompiled(void) {
+    mqttSend(&precompiled, reading, sizeof(reading) - 1, MQTT_MSG_TYPE_PUBLISH);
+}
+
+static void ICACHE_FLASH_ATTR publish_encoded(void) {
+    mqttSend(&encoded, reading, sizeof(reading) - 1, MQTT_MSG_TYPE_PUBLISH);
+}
+
+static void ICACHE_FLASH_ATTR publish_200(void) {
+    mqttSend(&encoded, bigReading, sizeof(bigReading), MQTT_MSG_TYPE_PUBLISH);
+}
+
+static void ICACHE_FLASH_ATTR pingreq(void) {
+    mqttSend(&encoded, NULL, 0, MQTT_MSG_TYPE_PINGREQ);
+}
+
+static void ICACHE_FLASH_ATTR recv_publish(void) {
+    data_recv_callback(&encoded.conn, (char *)rxPublish, sizeof(rxPublish));
+}
+
+// the PUBLISH in two segments, reassembled in the receive buffer
+static void ICACHE_FLASH_ATTR recv_publish_split(void) {
+    data_recv_callback(&encoded.conn, (char *)rxPublish, 7);
+    data_recv_callback(&encoded.conn, (char *)rxPublish + 7, sizeof(rxPublish) - 7);
+}
+
+static void ICACHE_FLASH_ATTR recv_pingresp(void) {
+    data_recv_callback(&encoded.conn, (char *)rxPingresp, sizeof(rxPingresp));
+}
+
+static void ICACHE_FLASH_ATTR format_ftoa(void) {
+    ftoa(23.45f, formatted, 2);
+}
+
+static void ICACHE_FLASH_ATTR format_int(void) {
+    intToStr(12345, formatted, 0);
+}
+
+static void ICACHE_FLASH_ATTR format_sprintf(void) {
+    os_sprintf(formatted, "%d", 12345);
+}
+
+static void ICACHE_FLASH_ATTR format_centi(void) {
+    ntc_format(2345, formatted);
+}
+
+static void ICACHE_FLASH_ATTR format_json_int(void) {
+    sink = jsonw_format_int(formatted, 12345);
+}
+
+static void ICACHE_FLASH_ATTR state_jsonw(void) {
+    jsonw_t w;
+    jsonw_init(&w, json, sizeof(json));
+    jsonw_fixed(&w, JSONW_TEMP, 2345, 2);
+    jsonw_bool(&w, JSONW_LED, 1);
+    jsonw_int(&w, JSONW_RSSI, -67);
+    jsonw_uint(&w, JSONW_HEAP, 41234);
+    jsonw_uint(&w, JSONW_SEQ, 1234);
+    jsonw_uint(&w, JSONW_UPTIME, 864000);
+    jsonw_uint(&w, JSONW_TS, 1700000000);
+    sink = jsonw_finish(&w);
+}
+
+// the same payload through the SDK's printf
+static void ICACHE_FLASH_ATTR state_sprintf(void) {
+    sink = os_sprintf(json, "{\"temp\":%d.%02d,\"led\":%s,\"rssi\":%d,\"heap\":%u,\"seq\":%u,\"uptime\":%u,\"ts\":%u}",
+                      23, 45, "true", -67, 41234, 1234, 864000, 1700000000);
+}
+
+static void ICACHE_FLASH_ATTR ntc_sample_16(void) {
+    sink = ntc_sample();
+}
+
+static void ICACHE_FLASH_ATTR ntc_table(void) {
+    sink = ntc_counts_to_centi(ntcCounts);
+}
+
+// what the table saves: the beta equation in soft-float, as mkntc.py evaluates it
+static void ICACHE_FLASH_ATTR ntc_equation(void) {
+    float mv = ntcCounts * (float)ntc_adc_mv / 4096.0f;
+    float r = ntc_series * (ntc_supply_mv - mv) / mv;
+    sink = (int32_t)(100.0f * (1.0f / (1.0f / 298.15f + logf(r / ntc_r25) / ntc_beta) - 273.15f));
+}
+
+static const bench_case_t cases[] = {
+    { "encode_length_1", encode_length_1, 0 },
+    { "encode_length_2", encode_length_2, 0 },
+    { "encode_length_4", encode_length_4, 0 },
+    { "decode_length_4", decode_length_4, 0 },
+    { "connect_encoded", connect_encoded, 0 },
+    { "subscribe_precompiled", subscribe_precompiled, 0 },
+    { "subscribe_encoded", subscribe_encoded, 0 },
+    { "publish_precompiled", publish_precompiled, 0 },
+    { "publish_encoded", publish_encoded, 0 },
+    { "publish_200", publish_200, 0 },
+    { "pingreq", pingreq, 0 },
+    { "recv_publish", recv_publish, 0 },
+    { "recv_publish_split", recv_publish_split, 0 },
+    { "recv_pingresp", recv_pingresp, 0 },
+    { "format_ftoa", format_ftoa, 0 },
+    { "format_int", format_int, 0 },
+    { "format_sprintf", format_sprintf, 0 },
+    { "format_centi", format_centi, 0 },
+    { "format_json_int", format_json_int, 0 },
+    { "state_jsonw", state_jsonw, 0 },
+    { "state_sprintf", state_sprintf, 0 },
+    { "ntc_sample_16", ntc_sample_16, 0 },
+    { "ntc_table", ntc_table, 0 },
+    { "ntc_equation", ntc_equation, 0 },
+    { "publish_precompiled_cold", publish_precompiled, 1 },
+    { "publish_encoded_cold", publish_encoded, 1 },
+    { "recv_publish_cold", recv_publish, 1 },
+    { "format_ftoa_cold", format_ftoa, 1 },
+    { "ntc_table_cold", ntc_table, 1 },
+};
+
+static void ICACHE_FLASH_ATTR bench_case(const bench_case_t *c, uint32_t mhz) {
+    uint32_t calls = c->cold ? BENCH_COLD_ITERATIONS : BENCH_ITERATIONS;
+    uint32_t min = 0xFFFFFFFF, max = 0, cycles, i;
+    uint64_t total = 0;
+    system_set_os_print(0);
+    c->fn(); // once untimed, for the timers and buffers it sets up the first time
+    for (i = 0; i < calls; i++) {
+        if (c->cold) {
+            bench_evict();
+        }
+        cycles = bench_call(c->fn);
+        cycles = (cycles > overhead) ? cycles - overhead : 0;
+        total += cycles;
+        if (cycles < min) {
+            min = cycles;
+        }
+        if (cycles > max) {
+            max = cycles;
+        }
+        if (i % 64 == 0) {
+            system_soft_wdt_feed();
+        }
+    }
+    system_set_os_print(1);
+    os_printf("BENCH %s %d %d %d %d %d\n", c->name, mhz, calls, min, (uint32_t)(total / calls), max);
+}
+
+static void ICACHE_FLASH_ATTR bench_run(void *arg) {
+    static const uint8_t freqs[] = { SYS_CPU_80MHZ, SYS_CPU_160MHZ };
+    uint32_t f, i, cycles;
+    os_printf("BENCH begin version=%d calls=%d cold_calls=%d\n", FW_VERSION, BENCH_ITERATIONS, BENCH_COLD_ITERATIONS);
+    for (f = 0; f < sizeof(freqs); f++) {
+        system_update_cpu_freq(freqs[f]);
+        overhead = 0xFFFFFFFF;
+        for (i = 0; i < 100; i++) {
+            cycles = bench_call(nothing);
+            if (cycles < overhead) {
+                overhead = cycles;
+            }
+        }
+        for (i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+            bench_case(&cases[i], freqs[f]);
+        }
+    }
+    system_update_cpu_freq(SYS_CPU_80MHZ);
+    os_printf("BENCH end\n");
+    twheel_disarm(&precompiled.keepAliveTimer);
+    twheel_disarm(&encoded.keepAliveTimer);
+    twheel_disarm(&encoded.replyTimer);
+}
+
+void ICACHE_FLASH_ATTR bench_init(void) {
+    uint32_t at;
+    wifi_set_opmode_current(NULL_MODE);
+    // a session as init_mqtt() sets one up, without the precompiled packets
+    encoded.client_id = (uint8_t *)"herps-00000000";
+    encoded.client_id_len = os_strlen((char *)encoded.client_id);
+    encoded.username = mqtt_username;
+    encoded.username_len = sizeof(mqtt_username) - 1;
+    encoded.password = mqtt_password;
+    encoded.password_len = sizeof(mqtt_password) - 1;
+    encoded.topic_name = mqtt_topic;
+    encoded.topic_name_len = sizeof(mqtt_topic) - 1;
+    encoded.will_topic = (uint8_t *)"herps/00000000/status";
+    encoded.will_topic_len = os_strlen((char *)encoded.will_topic);
+    encoded.will_message = (uint8_t *)mqtt_status_offline;
+    encoded.will_message_len = sizeof(mqtt_status_offline) - 1;
+    encoded.will_retain = 1;
+    encoded.persistent = mqtt_persistent;
+    encoded.keepalive = mqtt_keepalive;
+    encoded.activeConnection = &encoded.conn;
+    encoded.conn.reverse = &encoded;
+    encoded.validConnection = 1;
+    precompiled = encoded;
+    precompiled.activeConnection = &precompiled.conn;
+    precompiled.conn.reverse = &precompiled;
+    precompiled.precompiled = &mqttPrecompiled;
+
+    os_memset(bigReading, '7', sizeof(bigReading));
+    rxPublish[0] = MQTT_MSG_TYPE_PUBLISH << 4;
+    rxPublish[1] = sizeof(rxPublish) - 2;
+    rxPublish[2] = 0;
+    rxPublish[3] = sizeof(RX_TOPIC) - 1;
+    os_memcpy(rxPublish + 4, RX_TOPIC, sizeof(RX_TOPIC) - 1);
+    at = 4 + sizeof(RX_TOPIC) - 1;
+    os_memset(rxPublish + at, 'x', sizeof(rxPublish) - at);
+
+    os_timer_disarm(&startTimer);
+    os_timer_setfn(&startTimer, (os_timer_func_t *)bench_run, NULL);
+    os_timer_arm(&startTimer, BENCH_START_MS, 0);
+}
+
+#endif
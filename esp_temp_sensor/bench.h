@@ -0,0 +1,37 @@
+/**
+ * @file
+ * @brief Cycle counts for the hot paths, measured on the real core.
+ *
+ * "make bench" builds an image that runs this suite and nothing else. A
+ * second after boot, with the radio off, each case is called
+ * BENCH_ITERATIONS times and every call is timed with the CCOUNT register.
+ * The suite runs at 80 MHz and then again at 160 MHz, and the results go
+ * to the serial port once, as lines of
+ *
+ *   BENCH <case> <MHz> <calls> <min cycles> <mean cycles> <max cycles>
+ *
+ * between "BENCH begin" and "BENCH end". The cost of reading CCOUNT is
+ * subtracted. Cases ending in _cold empty the flash cache before every
+ * call, so they include the cache misses for the code and constants they
+ * touch; the rest run with the cache warm. espconn_send() is wrapped in
+ * this image, so packets are encoded in full but never sent.
+ *
+ * benchcmp.py compares a capture of this output with bench_baseline.txt.
+ */
+#ifndef BENCH_H
+#define BENCH_H
+
+#include "os_type.h"
+
+#define BENCH_ITERATIONS 1000 /**< Timed calls for each warm case */
+#define BENCH_COLD_ITERATIONS 50 /**< Timed calls for each _cold case, each after emptying the cache */
+#define BENCH_EVICT_LEN 0x10000 /**< Bytes of mapped flash read to empty the 32 KB instruction cache */
+#define BENCH_START_MS 1000 /**< Delay after boot, so the SDK's start-up output is done */
+
+/**
+ * Turns the radio off and starts the suite after BENCH_START_MS. Call from
+ * user_init() in place of everything after the timers are set up.
+ */
+void ICACHE_FLASH_ATTR bench_init(void);
+
+#endif
@@ -0,0 +1,135 @@
+#!/usr/bin/env python3
+##
+# @file
+# @brief Reads the bench image's serial output and compares it with a baseline
+#
+# The bench image (make bench, see bench.h) prints one line per case and
+# clock:
+#
+#   BENCH <case> <MHz> <calls> <min cycles> <mean cycles> <max cycles>
+#
+# between "BENCH begin" and "BENCH end". Anything else in the capture is
+# ignored; if the device was reset partway through, only the last complete
+# run counts. Each case is listed with its time in microseconds and, given a
+# baseline, how far it moved. A case that got slower by more than the
+# tolerance fails the run, so a change that costs cycles on the hot paths
+# has to be accepted on purpose with "make bench-baseline".
+#
+# Warm cases are compared on their minimum, which interrupts cannot raise;
+# _cold cases on their mean, since every call misses the cache anyway.
+#
+# usage: benchcmp.py <capture> [--baseline FILE | --write-baseline FILE]
+#                    [--tolerance PERCENT]
+
+import argparse
+import os
+import re
+import sys
+
+LINE = re.compile(r"BENCH (\S+) (\d+) (\d+) (\d+) (\d+) (\d+)\s*$")
+
+
+def parse_capture(path):
+    """Returns {(case, mhz): (calls, min, mean, max)} from the last complete run, and its begin line"""
+    run, last, header = None, None, ""
+    for line in open(path, errors="replace"):
+        line = line.rstrip("\r\n")
+        at = line.find("BENCH ")
+        if at < 0:
+            continue
+        line = line[at:]
+        if line.startswith("BENCH begin"):
+            run, header = {}, line[len("BENCH begin"):].strip()
+        elif line.startswith("BENCH end"):
+            if run is not None:
+                last = (run, header)
+            run = None
+        elif run is not None:
+            m = LINE.match(line)
+            if m:
+                run[(m.group(1), int(m.group(2)))] = tuple(int(g) for g in m.groups()[2:])
+    return last
+
+
+def compared(case, result):
+    """The number a case is judged by"""
+    calls, low, mean, high = result
+    return mean if case.endswith("_cold") else low
+
+
+def read_baseline(path):
+    baseline = {}
+    for line in open(path):
+        fields = line.split()
+        if len(fields) != 3 or fields[0].startswith("#"):
+            continue
+        baseline[(fields[0], int(fields[1]))] = int(fields[2])
+    return baseline
+
+
+def write_baseline(path, run, header):
+    with open(path, "w") as f:
+        f.write("# written by benchcmp.py --write-baseline from a run with {0}\n".format(header))
+        f.write("# case, MHz, cycles: the minimum for warm cases, the mean for _cold ones\n")
+        for key in sorted(run):
+            f.write("{0} {1} {2}\n".format(key[0], key[1], compared(key[0], run[key])))
+
+
+def report(run, baseline, tolerance):
+    """Prints the table, returns the number of regressions"""
+    failures = 0
+    print("{0:<26} {1:>4} {2:>6} {3:>9} {4:>9} {5:>9} {6:>9}  {7}".format(
+        "case", "MHz", "calls", "min", "mean", "max", "us", "against baseline" if baseline is not None else ""))
+    for key in sorted(run, key=lambda k: (k[1], k[0])):
+        case, mhz = key
+        calls, low, mean, high = run[key]
+        line = "{0:<26} {1:>4} {2:>6} {3:>9} {4:>9} {5:>9} {6:>9.2f}".format(case, mhz, calls, low, mean, high,
+                                                                          compared(case, run[key]) / float(mhz))
+        if baseline is not None:
+            old = baseline.get(key)
+            new = compared(case, run[key])
+            if old is None:
+                line += "  new"
+            else:
+                change = 100.0 * (new - old) / old if old > 0 else (100.0 if new > 0 else 0.0)
+                line += "  {0:>9} {1:+6.1f}%".format(old, change)
+                if change > tolerance:
+                    line += "  REGRESSION"
+                    failures += 1
+        print(line)
+    if baseline is not None:
+        for key in sorted(set(baseline) - set(run)):
+            print("{0:<26} {1:>4}  in the baseline but not in this run".format(key[0], key[1]))
+        print("\n{0}".format("{0} regressions".format(failures) if failures else "no regressions"))
+    return failures
+
+
+def main():
+    parser = argparse.ArgumentParser(description="bench image results against a baseline")
+    parser.add_argument("capture", help="serial output of the bench image")
+    parser.add_argument("--baseline", help="fail if a case got slower than in this file")
+    parser.add_argument("--write-baseline", help="record this run in this file")
+    parser.add_argument("--tolerance", type=float, default=5.0, help="percent a case may slow down before it counts")
+    args = parser.parse_args()
+
+    last = parse_capture(args.capture)
+    if last is None or not last[0]:
+        sys.exit("{0}: no complete BENCH run found".format(args.capture))
+    run, header = last
+    print("BENCH {0}\n".format(header))
+
+    if args.write_baseline:
+        report(run, None, args.tolerance)
+        write_baseline(args.write_baseline, run, header)
+        print("\nbaseline written to {0}".format(args.write_baseline))
+    elif args.baseline:
+        if not os.path.exists(args.baseline):
+            sys.exit("no baseline at {0}, make one with make bench-baseline".format(args.baseline))
+        if report(run, read_baseline(args.baseline), args.tolerance):
+            sys.exit(1)
+    else:
+        report(run, None, args.tolerance)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,223 @@
+#include "ets_sys.h"
+#include "osapi.h"
+#include "os_type.h"
+#include "user_interface.h"
+#include "espconn.h"
+#include "brokers.h"
+#include "mempool.h"
+
+static struct {
+    broker_t list[BROKERS_MAX];
+    uint8_t count;
+    uint8_t current;
+    uint8_t moving; // the session was closed to move it, not lost
+    uint32_t failovers;
+    uint32_t failbacks;
+    uint32_t connectUs; // system_get_time() when CONNECT went out on the session
+    mqtt_session_t *session;
+    mqtt_session_t *probe; // the probe session while one runs, from sessionPool
+    uint8_t probeIdx;
+    uint8_t probeDone; // its result has been recorded
+    uint32_t probeUs;
+    twheel_timer_t probeTimer;
+    twheel_timer_t probeEndTimer; // closes and frees the probe outside its callbacks
+} br;
+
+MEMPOOL(sessionPool, sizeof(mqtt_session_t), 1); // one probe runs at a time
+
+static char probeId[24]; // herps-probe-<chip id>, so it does not take over the session
+
+static uint32_t ICACHE_FLASH_ATTR score(uint8_t i) {
+    return br.list[i].rttMs + i * BROKERS_RANK_PENALTY_MS;
+}
+
+static void ICACHE_FLASH_ATTR record_rtt(broker_t *b, uint32_t us) {
+    uint32_t ms = us / 1000;
+    b->lastRttMs = ms;
+    b->rttMs = (b->rttMs == 0) ? ms : ((b->rttMs << BROKERS_RTT_SHIFT) - b->rttMs + ms) >> BROKERS_RTT_SHIFT;
+}
+
+static void ICACHE_FLASH_ATTR point_at(uint8_t i) {
+    br.current = i;
+    os_memcpy(br.session->ip, br.list[i].ip, 4);
+}
+
+static void ICACHE_FLASH_ATTR probe_result(uint8_t ok, uint32_t us) {
+    broker_t *b = &br.list[br.probeIdx];
+    br.probeDone = 1;
+    if (!ok) {
+        b->failures++;
+        b->healthy = 0;
+        b->streak = 0;
+        return;
+    }
+    record_rtt(b, us);
+    b->healthy = 1;
+    if (b->streak < 255) {
+        b->streak++;
+    }
+    os_printf("Brokers: probe of %d took %d ms\n", br.probeIdx, b->lastRttMs);
+    if (b->streak >= BROKERS_SWITCH_PROBES && !br.moving && br.session->validConnection &&
+        score(br.probeIdx) + BROKERS_HYSTERESIS_MS < score(br.current)) {
+        os_printf("Brokers: moving from %d to %d\n", br.current, br.probeIdx);
+        br.failbacks++;
+        br.moving = 1;
+        point_at(br.probeIdx);
+        twheel_disarm(&br.probeTimer);
+    }
+}
+
+static void ICACHE_FLASH_ATTR probe_end(void *arg) {
+    if (br.moving && br.session->validConnection) {
+        mqttSend(br.session, NULL, 0, MQTT_MSG_TYPE_DISCONNECT);
+        espconn_disconnect(br.session->activeConnection);
+    }
+    if (br.probe == NULL) {
+        return;
+    }
+    if (br.probe->validConnection) {
+        // its disconnect_cb comes back here to free it
+        mqttSend(br.probe, NULL, 0, MQTT_MSG_TYPE_DISCONNECT);
+        espconn_disconnect(br.probe->activeConnection);
+        return;
+    }
+    mempool_free(&sessionPool, br.probe);
+    br.probe = NULL;
+}
+
+static void ICACHE_FLASH_ATTR probe_connected(void *arg) {
+    if (br.session->secure) {
+        // the SDK has room for one TLS connection, so TLS brokers are timed by the TCP handshake
+        probe_result(1, system_get_time() - br.probeUs);
+        twheel_arm(&br.probeEndTimer, 0, 0);
+        return;
+    }
+    br.probeUs = system_get_time();
+    mqttSend(br.probe, NULL, 0, MQTT_MSG_TYPE_CONNECT);
+}
+
+static void ICACHE_FLASH_ATTR probe_connack(void *arg) {
+    probe_result(br.probe->connackCode == 0, system_get_time() - br.probeUs);
+    twheel_arm(&br.probeEndTimer, 0, 0);
+}
+
+static void ICACHE_FLASH_ATTR probe_lost(void *arg) {
+    if (!br.probeDone) {
+        probe_result(0, 0);
+    }
+    twheel_arm(&br.probeEndTimer, 0, 0);
+}
+
+// times CONNECT to CONNACK on the next broker other than the current one
+static void ICACHE_FLASH_ATTR probe_start(void *arg) {
+    mqtt_session_t *p;
+    if (br.probe != NULL) {
+        return;
+    }
+    p = (mqtt_session_t *)mempool_alloc(&sessionPool);
+    if (p == NULL) {
+        return;
+    }
+    do {
+        br.probeIdx = (br.probeIdx + 1) % br.count;
+    } while (br.probeIdx == br.current);
+    os_memcpy(p->ip, br.list[br.probeIdx].ip, 4);
+    p->port = br.session->port;
+    p->client_id = (uint8_t *)probeId;
+    p->client_id_len = os_strlen(probeId);
+    p->username = br.session->username;
+    p->username_len = br.session->username_len;
+    p->password = br.session->password;
+    p->password_len = br.session->password_len;
+    p->keepalive = br.session->keepalive;
+    p->connected_cb = probe_connected;
+    p->connack_cb = probe_connack;
+    p->disconnect_cb = probe_lost;
+    br.probe = p;
+    br.probeDone = 0;
+    br.probeUs = system_get_time();
+    tcpConnect(p);
+}
+
+void ICACHE_FLASH_ATTR brokers_init(mqtt_session_t *session, const uint8_t (*ips)[4], uint8_t count) {
+    uint8_t i;
+    if (count > BROKERS_MAX) {
+        count = BROKERS_MAX;
+    }
+    os_memset(&br, 0, sizeof(br));
+    mempool_init(&sessionPool);
+    for (i = 0; i < count; i++) {
+        os_memcpy(br.list[i].ip, ips[i], 4);
+        br.list[i].healthy = 1;
+    }
+    br.count = count;
+    br.session = session;
+    os_sprintf(probeId, "herps-probe-%08x", system_get_chip_id());
+    twheel_setfn(&br.probeTimer, probe_start, NULL);
+    twheel_setfn(&br.probeEndTimer, probe_end, NULL);
+    point_at(0);
+}
+
+void ICACHE_FLASH_ATTR brokers_connecting(void) {
+    br.connectUs = system_get_time();
+}
+
+void ICACHE_FLASH_ATTR brokers_connack(void) {
+    broker_t *b = &br.list[br.current];
+    if (br.session->connackCode != 0) {
+        return; // the broker closes the connection, brokers_lost() follows
+    }
+    record_rtt(b, system_get_time() - br.connectUs);
+    b->healthy = 1;
+    if (br.count > 1) {
+        twheel_arm(&br.probeTimer, BROKERS_PROBE_MS, 1);
+    }
+}
+
+void ICACHE_FLASH_ATTR brokers_lost(void) {
+    uint8_t i, next = br.current;
+    broker_t *b = &br.list[br.current];
+    twheel_disarm(&br.probeTimer);
+    if (br.moving) {
+        br.moving = 0;
+        return;
+    }
+    b->failures++;
+    b->healthy = 0;
+    b->streak = 0;
+    for (i = 0; i < br.count; i++) {
+        if (i != br.current && br.list[i].healthy && (next == br.current || score(i) < score(next))) {
+            next = i;
+        }
+    }
+    if (next == br.current && br.count > 1) {
+        // all of them have failed, go round them again
+        for (i = 0; i < br.count; i++) {
+            br.list[i].healthy = 1;
+        }
+        next = (br.current + 1) % br.count;
+    }
+    if (next != br.current) {
+        os_printf("Brokers: failing over from %d to %d\n", br.current, next);
+        br.failovers++;
+        point_at(next);
+    }
+}
+
+uint8_t ICACHE_FLASH_ATTR brokers_current(void) {
+    return br.current;
+}
+
+uint32_t ICACHE_FLASH_ATTR brokers_report(char *buf, uint32_t len) {
+    uint32_t used;
+    uint8_t i;
+    if (len < 64) {
+        return 0;
+    }
+    used = os_sprintf(buf, "current=%d;failovers=%d;failbacks=%d", br.current, br.failovers, br.failbacks);
+    for (i = 0; i < br.count && used + 64 <= len; i++) {
+        used += os_sprintf(buf + used, ";rtt_ms%d=%d;last_ms%d=%d;failures%d=%d", i, br.list[i].rttMs, i,
+                           br.list[i].lastRttMs, i, br.list[i].failures);
+    }
+    return used;
+}
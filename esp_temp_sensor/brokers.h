@@ -0,0 +1,86 @@
+/**
+ * @file
+ * @brief Choosing between several brokers, with failover and failback.
+ *
+ * The brokers are configured in order of preference, the first being the
+ * primary. Each one is scored by its smoothed CONNECT to CONNACK round trip
+ * plus BROKERS_RANK_PENALTY_MS for every place down the list, and the
+ * session goes to the lowest score among those that have not just failed.
+ *
+ * When the session fails, whether the TCP connection, CONNACK or a PINGRESP
+ * did not come in time, it moves straight to the next broker; mqtt.c notices
+ * a silent broker at 85% of the keepalive, so the move happens inside one
+ * keepalive. While connected, the other brokers are probed in turn with a
+ * short-lived second session. One that has answered BROKERS_SWITCH_PROBES
+ * probes in a row and scores better by more than BROKERS_HYSTERESIS_MS takes
+ * the session over, which is how it fails back to the primary.
+ */
+#ifndef BROKERS_H
+#define BROKERS_H
+
+#include "os_type.h"
+#include "mqtt.h"
+
+#define BROKERS_MAX 4 /**< Most brokers that can be configured */
+#ifndef BROKERS_PROBE_MS
+#define BROKERS_PROBE_MS 300000 /**< How often another broker is probed while connected; the host build probes faster */
+#endif
+#define BROKERS_SWITCH_PROBES 3 /**< Probes in a row a broker must answer before the session moves to it */
+#define BROKERS_RANK_PENALTY_MS 50 /**< Added to the score for each place down the list */
+#define BROKERS_HYSTERESIS_MS 20 /**< How much better a score must be to move a working session */
+#define BROKERS_RTT_SHIFT 2 /**< Round trips are smoothed with weight 1/4 for the newest */
+
+/**
+ * @struct broker_t
+ * One configured broker and what has been seen of it.
+ */
+typedef struct {
+    uint8_t ip[4];
+    uint32_t rttMs; /**< Smoothed CONNECT to CONNACK round trip, 0 until measured */
+    uint32_t lastRttMs; /**< The latest round trip */
+    uint16_t failures; /**< Sessions and probes that failed */
+    uint8_t streak; /**< Probes answered in a row */
+    uint8_t healthy; /**< 0 after a failure, until it answers again */
+} broker_t;
+
+/**
+ * Sets up the list and points the session at the primary.
+ * @param session the session to connect with; probes copy its port and credentials
+ * @param ips the broker addresses, in order of preference
+ * @param count how many, at most BROKERS_MAX
+ */
+void ICACHE_FLASH_ATTR brokers_init(mqtt_session_t *session, const uint8_t (*ips)[4], uint8_t count);
+
+/**
+ * To be called as CONNECT is sent on the session, to time the round trip.
+ */
+void ICACHE_FLASH_ATTR brokers_connecting(void);
+
+/**
+ * To be called from connack_cb. An accepted session records the round trip
+ * and starts probing the other brokers; a refused one counts as a failure.
+ */
+void ICACHE_FLASH_ATTR brokers_connack(void);
+
+/**
+ * To be called from disconnect_cb. Unless the session was closed to move it
+ * to a better broker, the current broker is marked failed and the session
+ * pointed at the next one. Connect the session again afterwards.
+ */
+void ICACHE_FLASH_ATTR brokers_lost(void);
+
+/**
+ * @return the index of the broker the session is pointed at
+ */
+uint8_t ICACHE_FLASH_ATTR brokers_current(void);
+
+/**
+ * Formats the per-broker metrics, as current=..;failovers=..;failbacks=..
+ * then rtt_ms, last_ms and failures for each broker with its index.
+ * @param buf where to write
+ * @param len its size
+ * @return the length written
+ */
+uint32_t ICACHE_FLASH_ATTR brokers_report(char *buf, uint32_t len);
+
+#endif
@@ -0,0 +1,276 @@
+#include "ets_sys.h"
+#include "osapi.h"
+#include "os_type.h"
+#include "user_interface.h"
+#include "espconn.h"
+#include "timebase.h"
+#include "mempool.h"
+#include "capture.h"
+
+#define PCAP_HEADER_LEN 24
+#define PCAP_RECORD_LEN 16
+#define IP_HEADER_LEN 20
+#define TCP_HEADER_LEN 20
+#define HEADERS_LEN (PCAP_RECORD_LEN + IP_HEADER_LEN + TCP_HEADER_LEN)
+#define UART_LINE_BYTES 32
+
+typedef struct {
+    uint64_t localUs; // timebase_local_us() when it went
+    uint16_t len; // as sent or received
+    uint16_t stored; // bytes kept after the record, which then takes up a whole number of words
+    uint16_t localPort;
+    uint16_t remotePort;
+    uint8_t remoteIp[4];
+    uint8_t dir;
+    uint8_t pad[3];
+} record_t;
+
+#define RECORD_SPAN(stored) (sizeof(record_t) + (((stored) + 3) & ~3UL))
+
+static capture_stats_t stats;
+
+#if CAPTURE_RING_LEN > 0
+
+MEMPOOL_ASSERT(capture_ring_words, CAPTURE_RING_LEN % 4 == 0);
+MEMPOOL_ASSERT(capture_ring_holds_two, CAPTURE_RING_LEN >= 2 * RECORD_SPAN(CAPTURE_SNAP_LEN));
+MEMPOOL_ASSERT(capture_chunk_holds_one, CAPTURE_CHUNK_LEN >= HEADERS_LEN + CAPTURE_SNAP_LEN);
+
+static struct {
+    uint32_t mem[CAPTURE_RING_LEN / 4];
+    uint32_t head; // oldest record
+    uint32_t used;
+    uint32_t count;
+    uint8_t paused;
+} ring;
+
+static uint32_t ICACHE_FLASH_ATTR ring_put(uint32_t at, const void *src, uint32_t len) {
+    uint8_t *base = (uint8_t *)ring.mem;
+    uint32_t first = (len < CAPTURE_RING_LEN - at) ? len : CAPTURE_RING_LEN - at;
+    os_memcpy(base + at, src, first);
+    os_memcpy(base, (const uint8_t *)src + first, len - first);
+    return (at + len) % CAPTURE_RING_LEN;
+}
+
+static uint32_t ICACHE_FLASH_ATTR ring_get(uint32_t at, void *dst, uint32_t len) {
+    const uint8_t *base = (const uint8_t *)ring.mem;
+    uint32_t first = (len < CAPTURE_RING_LEN - at) ? len : CAPTURE_RING_LEN - at;
+    os_memcpy(dst, base + at, first);
+    os_memcpy((uint8_t *)dst + first, base, len - first);
+    return (at + len) % CAPTURE_RING_LEN;
+}
+
+static void ICACHE_FLASH_ATTR drop_oldest(void) {
+    record_t r;
+    ring_get(ring.head, &r, sizeof(r));
+    ring.head = (ring.head + RECORD_SPAN(r.stored)) % CAPTURE_RING_LEN;
+    ring.used -= RECORD_SPAN(r.stored);
+    ring.count--;
+    stats.dropped++;
+}
+
+void ICACHE_FLASH_ATTR capture_record(const struct espconn *conn, uint8_t dir, const uint8_t *data, uint32_t len) {
+    record_t r;
+    uint32_t at;
+    if (ring.paused) {
+        stats.paused++;
+        return;
+    }
+    os_memset(&r, 0, sizeof(r));
+    r.localUs = timebase_local_us();
+    r.len = (len > 0xFFFF) ? 0xFFFF : len;
+    r.stored = (len > CAPTURE_SNAP_LEN) ? CAPTURE_SNAP_LEN : len;
+    r.dir = dir;
+    if (conn != NULL && conn->proto.tcp != NULL) {
+        r.localPort = conn->proto.tcp->local_port;
+        r.remotePort = conn->proto.tcp->remote_port;
+        os_memcpy(r.remoteIp, conn->proto.tcp->remote_ip, 4);
+    }
+    while (ring.used + RECORD_SPAN(r.stored) > CAPTURE_RING_LEN) {
+        drop_oldest();
+    }
+    at = (ring.head + ring.used) % CAPTURE_RING_LEN;
+    at = ring_put(at, &r, sizeof(r));
+    ring_put(at, data, r.stored);
+    ring.used += RECORD_SPAN(r.stored);
+    ring.count++;
+    stats.records++;
+    if (r.stored < len) {
+        stats.truncated++;
+    }
+}
+
+void ICACHE_FLASH_ATTR capture_clear(void) {
+    ring.head = 0;
+    ring.used = 0;
+    ring.count = 0;
+}
+
+void ICACHE_FLASH_ATTR capture_pcap_begin(capture_cursor_t *cursor) {
+    os_memset(cursor, 0, sizeof(*cursor));
+    cursor->at = ring.head;
+    cursor->left = ring.count;
+    ring.paused = 1;
+}
+
+void ICACHE_FLASH_ATTR capture_pcap_end(capture_cursor_t *cursor) {
+    cursor->left = 0;
+    ring.paused = 0;
+}
+
+static uint8_t * ICACHE_FLASH_ATTR put16(uint8_t *p, uint16_t v) {
+    p[0] = v >> 8;
+    p[1] = v;
+    return p + 2;
+}
+
+static uint8_t * ICACHE_FLASH_ATTR put32(uint8_t *p, uint32_t v) {
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+    return p + 4;
+}
+
+// the pcap headers are in our own byte order, which the magic number tells readers
+static uint8_t * ICACHE_FLASH_ATTR put32_native(uint8_t *p, uint32_t v) {
+    os_memcpy(p, &v, 4);
+    return p + 4;
+}
+
+static uint16_t ICACHE_FLASH_ATTR ip_checksum(const uint8_t *p, uint32_t len) {
+    uint32_t sum = 0, i;
+    for (i = 0; i < len; i += 2) {
+        sum += (p[i] << 8) | p[i + 1];
+    }
+    while (sum >> 16) {
+        sum = (sum & 0xFFFF) + (sum >> 16);
+    }
+    return ~sum;
+}
+
+// one record as a pcap record holding an IPv4 packet with a TCP segment in it
+static uint32_t ICACHE_FLASH_ATTR write_record(capture_cursor_t *cursor, const record_t *r, const uint8_t ip[4],
+                                               uint8_t *buf) {
+    uint64_t unixUs = timebase_now_us();
+    uint64_t ts = r->localUs;
+    const uint8_t *src = (r->dir == CAPTURE_TX) ? ip : r->remoteIp;
+    const uint8_t *dst = (r->dir == CAPTURE_TX) ? r->remoteIp : ip;
+    uint8_t *p = buf, *iph;
+    if (unixUs != 0) {
+        ts = unixUs - (timebase_local_us() - r->localUs);
+    }
+    if (r->localPort != cursor->port) {
+        // another connection, its sequence numbers start again
+        cursor->port = r->localPort;
+        cursor->seq[CAPTURE_TX] = 1;
+        cursor->seq[CAPTURE_RX] = 1;
+    }
+    p = put32_native(p, (uint32_t)(ts / 1000000));
+    p = put32_native(p, (uint32_t)(ts % 1000000));
+    p = put32_native(p, IP_HEADER_LEN + TCP_HEADER_LEN + r->stored);
+    p = put32_native(p, IP_HEADER_LEN + TCP_HEADER_LEN + r->len);
+
+    iph = p;
+    *p++ = 0x45; // version 4, 20 byte header
+    *p++ = 0;
+    p = put16(p, IP_HEADER_LEN + TCP_HEADER_LEN + r->len);
+    p = put16(p, 0);
+    p = put16(p, 0x4000); // don't fragment
+    *p++ = 64;
+    *p++ = 6; // TCP
+    p = put16(p, 0);
+    os_memcpy(p, src, 4);
+    os_memcpy(p + 4, dst, 4);
+    p += 8;
+    put16(iph + 10, ip_checksum(iph, IP_HEADER_LEN));
+
+    p = put16(p, (r->dir == CAPTURE_TX) ? r->localPort : r->remotePort);
+    p = put16(p, (r->dir == CAPTURE_TX) ? r->remotePort : r->localPort);
+    p = put32(p, cursor->seq[r->dir]);
+    p = put32(p, cursor->seq[r->dir ^ 1]);
+    *p++ = (TCP_HEADER_LEN / 4) << 4;
+    *p++ = 0x18; // PSH, ACK
+    p = put16(p, 5840);
+    p = put16(p, 0); // no checksum, Wireshark does not check by default
+    p = put16(p, 0);
+    cursor->seq[r->dir] += r->len;
+
+    ring_get((cursor->at + sizeof(record_t)) % CAPTURE_RING_LEN, p, r->stored);
+    return HEADERS_LEN + r->stored;
+}
+
+uint32_t ICACHE_FLASH_ATTR capture_pcap_next(capture_cursor_t *cursor, uint8_t *buf, uint32_t len) {
+    struct ip_info info;
+    uint32_t used = 0;
+    record_t r;
+    if (!cursor->started) {
+        uint8_t *p = buf;
+        cursor->started = 1;
+        p = put32_native(p, 0xA1B2C3D4); // microsecond timestamps
+        p = put32_native(p, 2 | (4 << 16)); // version 2.4, as two native 16-bit fields on a little-endian core
+        p = put32_native(p, 0); // UTC
+        p = put32_native(p, 0);
+        p = put32_native(p, IP_HEADER_LEN + TCP_HEADER_LEN + CAPTURE_SNAP_LEN);
+        put32_native(p, CAPTURE_LINKTYPE);
+        used = PCAP_HEADER_LEN;
+    }
+    wifi_get_ip_info(STATION_IF, &info);
+    while (cursor->left > 0) {
+        ring_get(cursor->at, &r, sizeof(r));
+        if (used + HEADERS_LEN + r.stored > len) {
+            break;
+        }
+        used += write_record(cursor, &r, (const uint8_t *)&info.ip.addr, buf + used);
+        cursor->at = (cursor->at + RECORD_SPAN(r.stored)) % CAPTURE_RING_LEN;
+        cursor->left--;
+    }
+    return used;
+}
+
+#else
+
+void ICACHE_FLASH_ATTR capture_record(const struct espconn *conn, uint8_t dir, const uint8_t *data, uint32_t len) {
+}
+
+void ICACHE_FLASH_ATTR capture_clear(void) {
+}
+
+void ICACHE_FLASH_ATTR capture_pcap_begin(capture_cursor_t *cursor) {
+    os_memset(cursor, 0, sizeof(*cursor));
+}
+
+void ICACHE_FLASH_ATTR capture_pcap_end(capture_cursor_t *cursor) {
+}
+
+uint32_t ICACHE_FLASH_ATTR capture_pcap_next(capture_cursor_t *cursor, uint8_t *buf, uint32_t len) {
+    return 0;
+}
+
+#endif
+
+void ICACHE_FLASH_ATTR capture_dump_uart(void) {
+    static const char hex[] = "0123456789abcdef";
+    uint8_t chunk[CAPTURE_CHUNK_LEN];
+    char line[2 * UART_LINE_BYTES + 1];
+    capture_cursor_t cursor;
+    uint32_t len, i, j;
+    capture_pcap_begin(&cursor);
+    os_printf("CAP begin\n");
+    while ((len = capture_pcap_next(&cursor, chunk, sizeof(chunk))) > 0) {
+        for (i = 0; i < len; i += UART_LINE_BYTES) {
+            for (j = 0; j < UART_LINE_BYTES && i + j < len; j++) {
+                line[2 * j] = hex[chunk[i + j] >> 4];
+                line[2 * j + 1] = hex[chunk[i + j] & 0xF];
+            }
+            line[2 * j] = 0;
+            os_printf("CAP %s\n", line);
+        }
+        system_soft_wdt_feed();
+    }
+    os_printf("CAP end\n");
+    capture_pcap_end(&cursor);
+}
+
+const capture_stats_t * ICACHE_FLASH_ATTR capture_stats(void) {
+    return &stats;
+}
@@ -0,0 +1,110 @@
+/**
+ * @file
+ * @brief A ring of the MQTT bytes sent and received, dumped as a pcap file.
+ *
+ * mqtt.c hands every segment it sends or receives to capture_record(), the
+ * plaintext MQTT stream even over TLS. The ring keeps the newest, dropping
+ * the oldest to make room: each record holds the time, the direction, the
+ * ports and broker address of its connection, and the first
+ * CAPTURE_SNAP_LEN bytes.
+ *
+ * The ring is read out as a pcap file of raw IPv4 (LINKTYPE_RAW). Each
+ * record becomes one TCP segment, with addresses, ports and sequence numbers
+ * made up from what was recorded, so Wireshark decodes the MQTT as it would
+ * from a tap. Timestamps are Unix time once the clock is known, time since
+ * boot before that. The file comes out a chunk at a time from
+ * capture_pcap_next(), for publishing over MQTT, or all at once over the
+ * serial port from capture_dump_uart() as lines of
+ *
+ *   CAP <hex>
+ *
+ * between "CAP begin" and "CAP end". host/replay reads either form.
+ *
+ * Recording stops while the ring is being read, so the dump does not
+ * capture itself. Build with CAPTURE=0 to leave the ring out; everything
+ * here then does nothing.
+ */
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include "os_type.h"
+#include "espconn.h"
+
+#ifndef CAPTURE_RING_LEN
+#define CAPTURE_RING_LEN 2048 /**< Bytes of RAM for the ring, records included; the Makefile sets 0 with CAPTURE=0 */
+#endif
+#define CAPTURE_SNAP_LEN 128 /**< Bytes kept of each segment; longer ones are cut, their length kept */
+#define CAPTURE_CHUNK_LEN 256 /**< Room capture_pcap_next() needs, enough for the largest record */
+#define CAPTURE_LINKTYPE 101 /**< LINKTYPE_RAW: each packet starts with its IPv4 header */
+
+#define CAPTURE_TX 0 /**< Sent to the broker */
+#define CAPTURE_RX 1 /**< Received from the broker */
+
+/**
+ * @struct capture_stats_t
+ * What went through the ring.
+ */
+typedef struct {
+    uint32_t records; /**< Segments recorded */
+    uint32_t dropped; /**< Records pushed out of the ring to make room */
+    uint32_t truncated; /**< Records cut to CAPTURE_SNAP_LEN */
+    uint32_t paused; /**< Segments not recorded because a dump was running */
+} capture_stats_t;
+
+/**
+ * @struct capture_cursor_t
+ * Where a dump has got to. Owned by the caller.
+ */
+typedef struct {
+    uint32_t at; /**< Ring offset of the next record */
+    uint32_t left; /**< Records still to write */
+    uint32_t seq[2]; /**< Next TCP sequence number each way, per connection */
+    uint16_t port; /**< Local port of the connection the sequence numbers are for */
+    uint8_t started; /**< The pcap header has been written */
+} capture_cursor_t;
+
+/**
+ * Adds a segment to the ring.
+ * @param conn the connection it went over, for its ports and addresses
+ * @param dir CAPTURE_TX or CAPTURE_RX
+ * @param data the MQTT bytes
+ * @param len their length
+ */
+void ICACHE_FLASH_ATTR capture_record(const struct espconn *conn, uint8_t dir, const uint8_t *data, uint32_t len);
+
+/**
+ * Empties the ring.
+ */
+void ICACHE_FLASH_ATTR capture_clear(void);
+
+/**
+ * Starts reading the ring out, and stops recording until
+ * capture_pcap_end().
+ */
+void ICACHE_FLASH_ATTR capture_pcap_begin(capture_cursor_t *cursor);
+
+/**
+ * Writes the next part of the pcap file: the file header first, then as
+ * many whole records as fit.
+ * @param buf where to write
+ * @param len its size, at least CAPTURE_CHUNK_LEN
+ * @return bytes written, 0 once the whole ring is out
+ */
+uint32_t ICACHE_FLASH_ATTR capture_pcap_next(capture_cursor_t *cursor, uint8_t *buf, uint32_t len);
+
+/**
+ * Starts recording again, whether or not the dump got to the end.
+ */
+void ICACHE_FLASH_ATTR capture_pcap_end(capture_cursor_t *cursor);
+
+/**
+ * Prints the whole ring as a pcap file in hex over the serial port.
+ */
+void ICACHE_FLASH_ATTR capture_dump_uart(void);
+
+/**
+ * @return the ring's counters
+ */
+const capture_stats_t * ICACHE_FLASH_ATTR capture_stats(void);
+
+#endif
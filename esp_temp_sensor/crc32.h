@@ -0,0 +1,19 @@
+/**
+ * @file
+ * @brief Incremental CRC32 (IEEE 802.3, the same as zlib.crc32() on the host).
+ */
+#ifndef CRC32_H
+#define CRC32_H
+
+#include "c_types.h"
+
+/**
+ * Extends a CRC32 over more data.
+ * @param crc the CRC of everything before data, or 0 to start
+ * @param data pointer to the bytes to add
+ * @param len the number of bytes at data
+ * @return the CRC including data
+ */
+uint32_t ICACHE_FLASH_ATTR crc32_update(uint32_t crc, const uint8_t *data, uint32_t len);
+
+#endif
@@ -0,0 +1,203 @@
+#include "ets_sys.h"
+#include "osapi.h"
+#include "os_type.h"
+#include "user_interface.h"
+#include "delta.h"
+
+#define DELTA_OLD_CACHE 64 // bytes of the old image read from flash at a time
+
+typedef enum {
+    LZ_FLAGS, // waiting for a flag byte
+    LZ_ITEM, // waiting for a literal or the first reference byte
+    LZ_REF, // waiting for the second reference byte
+} lz_state_t;
+
+typedef enum {
+    PATCH_DIFF_LEN,
+    PATCH_EXTRA_LEN,
+    PATCH_SEEK,
+    PATCH_DIFF,
+    PATCH_EXTRA,
+} patch_state_t;
+
+static struct {
+    // outer LZSS layer
+    uint8_t window[DELTA_WINDOW];
+    uint16_t windowPos;
+    uint8_t lzState;
+    uint8_t flags;
+    uint8_t flagBits; // flag bits still to use
+    uint8_t refHigh; // first byte of a back reference
+    // inner patch layer
+    uint8_t patchState;
+    uint8_t shift; // varint decoding
+    uint32_t value;
+    uint32_t diffLeft;
+    uint32_t extraLeft;
+    int32_t seek;
+    uint32_t oldAddr;
+    uint32_t oldSize;
+    uint32_t oldPos;
+    uint32_t oldCache[DELTA_OLD_CACHE / 4];
+    uint32_t oldCachePos; // image offset of oldCache, or oldSize when empty
+    // output
+    uint8_t out[DELTA_OUT_LEN];
+    uint8_t outLen;
+    delta_out_fn outFn;
+    int8_t error;
+} delta;
+
+void ICACHE_FLASH_ATTR delta_init(uint32_t oldAddr, uint32_t oldSize, delta_out_fn out) {
+    os_memset(&delta, 0, sizeof(delta));
+    delta.oldAddr = oldAddr;
+    delta.oldSize = oldSize;
+    delta.oldCachePos = oldSize;
+    delta.outFn = out;
+}
+
+static void ICACHE_FLASH_ATTR delta_emit(uint8_t byte) {
+    delta.out[delta.outLen++] = byte;
+    if (delta.outLen == DELTA_OUT_LEN) {
+        if (delta.outFn(delta.out, delta.outLen) != 0) {
+            delta.error = 1;
+        }
+        delta.outLen = 0;
+    }
+}
+
+static int ICACHE_FLASH_ATTR delta_old_byte(uint8_t *byte) {
+    uint32_t pos = delta.oldPos;
+    if (pos >= delta.oldSize) {
+        return -1;
+    }
+    if (pos < delta.oldCachePos || pos >= delta.oldCachePos + DELTA_OLD_CACHE) {
+        delta.oldCachePos = pos & ~(DELTA_OLD_CACHE - 1);
+        spi_flash_read(delta.oldAddr + delta.oldCachePos, delta.oldCache, DELTA_OLD_CACHE);
+    }
+    *byte = ((uint8_t *)delta.oldCache)[pos - delta.oldCachePos];
+    delta.oldPos++;
+    return 0;
+}
+
+// Moves on from a finished diff or extra block to whatever comes next
+static void ICACHE_FLASH_ATTR delta_next_block(void) {
+    if (delta.diffLeft > 0) {
+        delta.patchState = PATCH_DIFF;
+    } else if (delta.extraLeft > 0) {
+        delta.patchState = PATCH_EXTRA;
+    } else {
+        delta.oldPos += delta.seek;
+        delta.patchState = PATCH_DIFF_LEN;
+    }
+}
+
+// One byte of the inner patch layer
+static int ICACHE_FLASH_ATTR delta_patch_byte(uint8_t byte) {
+    uint8_t old;
+    switch (delta.patchState) {
+        case PATCH_DIFF_LEN:
+        case PATCH_EXTRA_LEN:
+        case PATCH_SEEK:
+            if (delta.shift > 28) {
+                return -1;
+            }
+            delta.value |= (uint32_t)(byte & 0x7F) << delta.shift;
+            delta.shift += 7;
+            if (byte & 0x80) {
+                return 0;
+            }
+            if (delta.patchState == PATCH_DIFF_LEN) {
+                delta.diffLeft = delta.value;
+                delta.patchState = PATCH_EXTRA_LEN;
+            } else if (delta.patchState == PATCH_EXTRA_LEN) {
+                delta.extraLeft = delta.value;
+                delta.patchState = PATCH_SEEK;
+            } else {
+                // zigzag: 0, -1, 1, -2, 2 ... map to 0, 1, 2, 3, 4 ...
+                delta.seek = (int32_t)(delta.value >> 1) ^ -(int32_t)(delta.value & 1);
+                delta_next_block();
+            }
+            delta.value = 0;
+            delta.shift = 0;
+            return 0;
+        case PATCH_DIFF:
+            if (delta_old_byte(&old) != 0) {
+                return -1;
+            }
+            delta_emit(old + byte);
+            if (--delta.diffLeft == 0) {
+                delta_next_block();
+            }
+            return 0;
+        case PATCH_EXTRA:
+            delta_emit(byte);
+            if (--delta.extraLeft == 0) {
+                delta_next_block();
+            }
+            return 0;
+        default:
+            return -1;
+    }
+}
+
+// Puts one byte through the LZSS window and on to the patch layer
+static int ICACHE_FLASH_ATTR delta_lz_out(uint8_t byte) {
+    delta.window[delta.windowPos] = byte;
+    delta.windowPos = (delta.windowPos + 1) % DELTA_WINDOW;
+    return delta_patch_byte(byte);
+}
+
+int ICACHE_FLASH_ATTR delta_feed(const uint8_t *data, uint32_t len) {
+    while (len-- > 0 && !delta.error) {
+        uint8_t byte = *data++;
+        switch (delta.lzState) {
+            case LZ_FLAGS:
+                delta.flags = byte;
+                delta.flagBits = 8;
+                delta.lzState = LZ_ITEM;
+                break;
+            case LZ_ITEM:
+                if (delta.flags & 1) {
+                    if (delta_lz_out(byte) != 0) {
+                        delta.error = 1;
+                    }
+                    delta.flags >>= 1;
+                    delta.lzState = (--delta.flagBits == 0) ? LZ_FLAGS : LZ_ITEM;
+                } else {
+                    delta.refHigh = byte;
+                    delta.lzState = LZ_REF;
+                }
+                break;
+            case LZ_REF: {
+                uint16_t distance = (((uint16_t)delta.refHigh << 2) | (byte >> 6)) + 1;
+                uint8_t count = (byte & 0x3F) + 3;
+                uint16_t from = (delta.windowPos + DELTA_WINDOW - distance) % DELTA_WINDOW;
+                while (count-- > 0 && !delta.error) {
+                    // the source can overlap what we are writing, so go a byte at a time
+                    if (delta_lz_out(delta.window[from]) != 0) {
+                        delta.error = 1;
+                    }
+                    from = (from + 1) % DELTA_WINDOW;
+                }
+                delta.flags >>= 1;
+                delta.lzState = (--delta.flagBits == 0) ? LZ_FLAGS : LZ_ITEM;
+                break;
+            }
+            default:
+                delta.error = 1;
+                break;
+        }
+    }
+    return delta.error ? -1 : 0;
+}
+
+int ICACHE_FLASH_ATTR delta_finish(void) {
+    if (delta.error || delta.lzState == LZ_REF || delta.patchState != PATCH_DIFF_LEN || delta.shift != 0) {
+        return -1;
+    }
+    if (delta.outLen > 0 && delta.outFn(delta.out, delta.outLen) != 0) {
+        return -1;
+    }
+    delta.outLen = 0;
+    return 0;
+}
@@ -0,0 +1,59 @@
+/**
+ * @file
+ * @brief Streaming decoder for compressed binary deltas made by mkdelta.py.
+ *
+ * A delta rebuilds the new image from the one in the running bank, so only
+ * the differences need to go over the air. It has two layers.
+ *
+ * The outer layer is LZSS with a DELTA_WINDOW byte window: groups of a flag
+ * byte followed by up to eight items, least significant flag bit first. A set
+ * bit is a literal byte. A clear bit is a two byte back reference, with a ten
+ * bit distance (1 to 1024) and a six bit length (3 to 66).
+ *
+ * The inner layer is a bsdiff style series of records:
+ *
+ *   varint diffLen, varint extraLen, zigzag varint seek
+ *   diffLen bytes, each added to the next byte of the old image
+ *   extraLen bytes copied as they are
+ *
+ * after which the old image position moves on by seek. Most diff bytes are
+ * zero where code has only moved, which is what the outer layer squeezes.
+ */
+#ifndef DELTA_H
+#define DELTA_H
+
+#include "os_type.h"
+
+#define DELTA_WINDOW 1024 /**< LZSS window size, the bulk of the decoder RAM */
+#define DELTA_OUT_LEN 64 /**< Decoded bytes collected before each call to the output function */
+
+/**
+ * Called with each run of rebuilt image bytes. Returns 0 on success; anything
+ * else stops the decoder.
+ */
+typedef int (*delta_out_fn)(const uint8_t *data, uint32_t len);
+
+/**
+ * Starts a new delta.
+ * @param oldAddr flash address of the image the delta was made against
+ * @param oldSize size of that image
+ * @param out where rebuilt bytes are sent
+ */
+void ICACHE_FLASH_ATTR delta_init(uint32_t oldAddr, uint32_t oldSize, delta_out_fn out);
+
+/**
+ * Decodes the next part of the delta stream. Parts can be split anywhere.
+ * @param data pointer to the delta bytes
+ * @param len the number of bytes at data
+ * @return 0 on success, -1 if the stream is corrupt or the output function failed
+ */
+int ICACHE_FLASH_ATTR delta_feed(const uint8_t *data, uint32_t len);
+
+/**
+ * Passes on any bytes still held back, and checks that the stream ended
+ * cleanly between records.
+ * @return 0 on success, -1 if the stream stopped part way through
+ */
+int ICACHE_FLASH_ATTR delta_finish(void);
+
+#endif
@@ -0,0 +1,209 @@
+#include "ets_sys.h"
+#include "osapi.h"
+#include "os_type.h"
+#include "user_interface.h"
+#include "mqtt.h"
+#include "flashmap.h"
+#include "crc32.h"
+#include "fwupdate.h"
+#include "mempool.h"
+#include "jsonw.h"
+#include "brokers.h"
+#include "discovery.h"
+
+#define DISCOVERY_SEC (SYSTEM_PARTITION_DISCOVERY_ADDR / SPI_FLASH_SEC_SIZE)
+
+// what every device has in common, kept in flash and read a word at a time
+#define TEMPLATE(name, text) \
+    static const char name[(sizeof(text) + 3) & ~3] ICACHE_RODATA_ATTR STORE_ATTR = text; \
+    enum { name##Len = sizeof(text) - 1 }
+
+TEMPLATE(tempFields, "\"name\":\"Temperature\",\"dev_cla\":\"temperature\",\"unit_of_meas\":\"\xc2\xb0" "C\","
+                     "\"stat_cla\":\"measurement\",\"val_tpl\":\"{{ value_json.temp }}\"");
+TEMPLATE(ledFields, "\"name\":\"LED\",\"val_tpl\":\"{{ 'ON' if value_json.led else 'OFF' }}\"");
+TEMPLATE(rssiFields, "\"name\":\"RSSI\",\"dev_cla\":\"signal_strength\",\"unit_of_meas\":\"dBm\","
+                     "\"stat_cla\":\"measurement\",\"ent_cat\":\"diagnostic\",\"val_tpl\":\"{{ value_json.rssi }}\"");
+TEMPLATE(deviceFields, "\"mf\":\"herps\",\"mdl\":\"ESP8266 sensor\"");
+
+typedef struct {
+    const char *component;
+    const char *object; // in the topic and the unique ID
+    const char *fields;
+    uint16_t fieldsLen;
+} discovery_channel_t;
+
+// the order is the cache's, so channels are only ever added at the end
+static const discovery_channel_t channels[] = {
+    { "sensor", "temp", tempFields, tempFieldsLen },
+    { "binary_sensor", "led", ledFields, ledFieldsLen },
+    { "sensor", "rssi", rssiFields, rssiFieldsLen },
+};
+#define CHANNELS (sizeof(channels) / sizeof(channels[0]))
+MEMPOOL_ASSERT(discovery_cache_fits, CHANNELS <= DISCOVERY_MAX_CHANNELS);
+MEMPOOL_ASSERT(discovery_brokers_fit, BROKERS_MAX <= DISCOVERY_MAX_BROKERS);
+
+typedef struct {
+    uint8_t ip[4]; // 0.0.0.0 for a free entry
+    uint32_t crc[DISCOVERY_MAX_CHANNELS]; // of each config this broker was last sent, 0 for none
+} discovery_broker_t;
+
+// Persisted across reboots with system_param_save_with_protect()
+typedef struct {
+    uint32_t magic;
+    discovery_broker_t brokers[DISCOVERY_MAX_BROKERS]; // the one last sent to first
+} discovery_cache_t;
+
+static struct {
+    mqtt_session_t *session;
+    const discovery_config_t *config;
+    char deviceId[16]; // herps_<chip id>
+    char haStatusTopic[DISCOVERY_PREFIX_MAX + 8]; // <prefix>/status
+    uint8_t enabled; // there is a prefix, and it fits
+    discovery_cache_t cache;
+    discovery_stats_t st;
+} dc;
+
+// writes the config for one channel, returning its length, 0 if it did not fit
+static uint16_t ICACHE_FLASH_ATTR write_config(const discovery_channel_t *ch, char *buf) {
+    const discovery_config_t *cfg = dc.config;
+    char uniqueId[32];
+    jsonw_t w;
+    os_sprintf(uniqueId, "%s_%s", dc.deviceId, ch->object);
+    jsonw_init(&w, buf, DISCOVERY_PAYLOAD_LEN);
+    jsonw_fields(&w, ch->fields, ch->fieldsLen);
+    jsonw_str(&w, JSONW_UNIQUE_ID, uniqueId, os_strlen(uniqueId));
+    jsonw_str(&w, JSONW_STATE_TOPIC, cfg->stateTopic, os_strlen(cfg->stateTopic));
+    jsonw_str(&w, JSONW_AVAILABILITY_TOPIC, cfg->statusTopic, os_strlen(cfg->statusTopic));
+    jsonw_str(&w, JSONW_PAYLOAD_AVAILABLE, cfg->online, os_strlen(cfg->online));
+    jsonw_str(&w, JSONW_PAYLOAD_NOT_AVAILABLE, cfg->offline, os_strlen(cfg->offline));
+    jsonw_object(&w, JSONW_DEVICE);
+    jsonw_str(&w, JSONW_IDENTIFIERS, dc.deviceId, os_strlen(dc.deviceId));
+    jsonw_str(&w, JSONW_NAME, dc.deviceId, os_strlen(dc.deviceId));
+    jsonw_fields(&w, deviceFields, deviceFieldsLen);
+    jsonw_uint(&w, JSONW_SW_VERSION, FW_VERSION);
+    return jsonw_finish(&w);
+}
+
+// the session's broker's entry, or the one to replace with it
+static uint8_t ICACHE_FLASH_ATTR cache_slot(void) {
+    uint8_t i;
+    for (i = 0; i < DISCOVERY_MAX_BROKERS - 1; i++) {
+        if (os_memcmp(dc.cache.brokers[i].ip, dc.session->ip, 4) == 0) {
+            break;
+        }
+    }
+    return i;
+}
+
+// builds each config in its PUBLISH and sends the ones the broker was not sent
+static void ICACHE_FLASH_ATTR publish_configs(uint8_t force) {
+    char topic[DISCOVERY_TOPIC_LEN];
+    mqtt_publish_buf_t pub;
+    discovery_broker_t br;
+    uint8_t changed = 0, slot, i;
+    uint16_t len;
+    uint32_t crc;
+    char *buf;
+    slot = cache_slot();
+    if (os_memcmp(dc.cache.brokers[slot].ip, dc.session->ip, 4) == 0) {
+        br = dc.cache.brokers[slot];
+    } else {
+        // a broker it has no record of has none of them
+        os_memset(&br, 0, sizeof(br));
+        os_memcpy(br.ip, dc.session->ip, 4);
+    }
+    for (i = 0; i < CHANNELS; i++) {
+        const discovery_channel_t *ch = &channels[i];
+        if (ch->fields == tempFields && !dc.config->thermistor) {
+            continue;
+        }
+        os_sprintf(topic, "%s/%s/%s/%s/config", dc.config->prefix, ch->component, dc.deviceId, ch->object);
+        buf = (char *)mqttPublishBegin(dc.session, &pub, (uint8_t *)topic, os_strlen(topic), DISCOVERY_PAYLOAD_LEN);
+        if (buf == NULL) {
+            dc.st.failures++;
+            break;
+        }
+        len = write_config(ch, buf);
+        crc = crc32_update(0, (const uint8_t *)&dc.config->version, sizeof(dc.config->version));
+        crc = crc32_update(crc, (const uint8_t *)topic, os_strlen(topic));
+        crc = crc32_update(crc, (const uint8_t *)buf, len);
+        if (len == 0) {
+            dc.st.failures++;
+            mqttPublishEnd(dc.session, &pub, 0, 0);
+        } else if (!force && crc == br.crc[i]) {
+            // the broker has this one retained already
+            dc.st.skipped++;
+            dc.st.skippedBytes += len;
+            mqttPublishEnd(dc.session, &pub, 0, 0);
+        } else if (mqttPublishEnd(dc.session, &pub, len, MQTT_PUBLISH_RETAIN) == 0) {
+            dc.st.sent++;
+            if (crc != br.crc[i]) {
+                br.crc[i] = crc;
+                changed = 1;
+            }
+        } else {
+            // not sent, so whatever the broker had stays what the cache says
+            dc.st.failures++;
+        }
+    }
+    if (changed) {
+        os_memmove(&dc.cache.brokers[1], &dc.cache.brokers[0], slot * sizeof(dc.cache.brokers[0]));
+        dc.cache.brokers[0] = br;
+        dc.cache.magic = DISCOVERY_CACHE_MAGIC;
+        system_param_save_with_protect(DISCOVERY_SEC, &dc.cache, sizeof(dc.cache));
+        dc.st.saves++;
+    }
+}
+
+void ICACHE_FLASH_ATTR discovery_init(mqtt_session_t *session, const discovery_config_t *config) {
+    os_memset(&dc, 0, sizeof(dc));
+    dc.session = session;
+    dc.config = config;
+    os_sprintf(dc.deviceId, "herps_%08x", system_get_chip_id());
+    if (os_strlen(config->prefix) > DISCOVERY_PREFIX_MAX) {
+        os_printf("Discovery prefix longer than %d, discovery is off\n", DISCOVERY_PREFIX_MAX);
+        return;
+    }
+    dc.enabled = (config->prefix[0] != '\0');
+    os_sprintf(dc.haStatusTopic, "%s/status", config->prefix);
+    system_param_load(DISCOVERY_SEC, 0, &dc.cache, sizeof(dc.cache));
+    if (dc.cache.magic != DISCOVERY_CACHE_MAGIC) {
+        os_memset(&dc.cache, 0, sizeof(dc.cache));
+    }
+}
+
+void ICACHE_FLASH_ATTR discovery_subscribe(void) {
+    if (dc.enabled) {
+        mqttSendTopic(dc.session, (uint8_t *)dc.haStatusTopic, os_strlen(dc.haStatusTopic), NULL, 0, MQTT_MSG_TYPE_SUBSCRIBE);
+    }
+}
+
+void ICACHE_FLASH_ATTR discovery_connected(void) {
+    if (dc.enabled) {
+        publish_configs(0);
+    }
+}
+
+uint8_t ICACHE_FLASH_ATTR discovery_message(uint8_t *topic, uint32_t topic_len, uint8_t *payload, uint32_t payload_len) {
+    if (!dc.enabled || topic_len != os_strlen(dc.haStatusTopic) ||
+        os_memcmp(topic, dc.haStatusTopic, topic_len) != 0) {
+        return 0;
+    }
+    // Home Assistant has (re)started: its birth message, which is "online" by default
+    if (payload_len == 6 && os_memcmp(payload, "online", 6) == 0) {
+        publish_configs(1);
+    }
+    return 1;
+}
+
+const discovery_stats_t * ICACHE_FLASH_ATTR discovery_stats(void) {
+    return &dc.st;
+}
+
+uint32_t ICACHE_FLASH_ATTR discovery_report(char *buf, uint32_t len) {
+    if (len < 160) {
+        return 0;
+    }
+    return os_sprintf(buf, "sent=%d;skipped=%d;skipped_bytes=%d;saves=%d;failures=%d", dc.st.sent, dc.st.skipped,
+                      dc.st.skippedBytes, dc.st.saves, dc.st.failures);
+}
@@ -0,0 +1,111 @@
+/**
+ * @file
+ * @brief Home Assistant MQTT discovery for the device's channels.
+ *
+ * Each channel, the temperature with a thermistor, the LED output and the
+ * RSSI, has a retained config on
+ *
+ *   <ha_discovery_prefix>/<component>/herps_<chip id>/<channel>/config
+ *
+ * that tells Home Assistant to read it from the JSON on herps/<chip id>/state
+ * and to take the device as unavailable while the status topic says
+ * offline. Each config is written straight into its PUBLISH with jsonw.h:
+ * what every device has in common comes from a template in flash, and the
+ * topics and IDs are added to it.
+ *
+ * The broker keeps the configs, so they need only go out when they change.
+ * The CRC of each one, with its topic and ha_discovery_version, is kept in
+ * flash at SYSTEM_PARTITION_DISCOVERY_ADDR, under the IP of the broker it
+ * was sent to, and only once the send went out. On every connect a config
+ * is built and its CRC compared with what that broker was sent: one that
+ * matches is not sent, so a reconnect costs the broker nothing; a broker
+ * that has not had it, after failing over, a new firmware version, a
+ * changed template or a raised ha_discovery_version sends it again. The
+ * cache has room for DISCOVERY_MAX_BROKERS brokers, and forgets the one it
+ * sent to longest ago to make room for another. When Home Assistant announces
+ * itself online on <ha_discovery_prefix>/status, every config is sent again
+ * whatever the cache says, in case the broker lost them.
+ */
+#ifndef DISCOVERY_H
+#define DISCOVERY_H
+
+#include "os_type.h"
+#include "mqtt.h"
+
+#define DISCOVERY_CACHE_MAGIC 0x48414432 /**< "HAD2", marks a cache that was written */
+#define DISCOVERY_PAYLOAD_LEN 400 /**< Room for the longest config */
+#define DISCOVERY_PREFIX_MAX 24 /**< Longest ha_discovery_prefix; a longer one leaves discovery off */
+#define DISCOVERY_TOPIC_LEN (DISCOVERY_PREFIX_MAX + 48) /**< Room for the longest config topic after the prefix */
+#define DISCOVERY_MAX_CHANNELS 4 /**< Channels the cache has room for */
+#define DISCOVERY_MAX_BROKERS 4 /**< Brokers the cache has room for, at least BROKERS_MAX */
+
+/**
+ * @struct discovery_config_t
+ * What the configs are built from, normally the defines in user_config.h.
+ */
+typedef struct {
+    const char *prefix; /**< ha_discovery_prefix, "" to leave discovery off */
+    uint32_t version; /**< ha_discovery_version */
+    const char *stateTopic; /**< Where the channels' JSON is published */
+    const char *statusTopic; /**< The retained online/offline topic */
+    const char *online; /**< mqtt_status_online */
+    const char *offline; /**< mqtt_status_offline */
+    uint8_t thermistor; /**< The temperature channel is there */
+} discovery_config_t;
+
+/**
+ * @struct discovery_stats_t
+ * Configs sent and left out.
+ */
+typedef struct {
+    uint32_t sent; /**< Configs published */
+    uint32_t skipped; /**< Configs the broker already had, by the cache */
+    uint32_t skippedBytes; /**< Payload bytes those would have been */
+    uint32_t saves; /**< Times the cache was written to flash */
+    uint32_t failures; /**< Configs that did not fit, had no session to go out on or were not sent */
+} discovery_stats_t;
+
+/**
+ * Sets up topic names and loads the cache. Call once before the first
+ * connection.
+ * @param session the session the configs go out on
+ * @param config what to build them from, which must outlive discovery
+ */
+void ICACHE_FLASH_ATTR discovery_init(mqtt_session_t *session, const discovery_config_t *config);
+
+/**
+ * Subscribes to Home Assistant's status. Call after each accepted CONNACK
+ * without a session present.
+ */
+void ICACHE_FLASH_ATTR discovery_subscribe(void);
+
+/**
+ * Publishes the configs the broker does not have yet. Call after each
+ * accepted CONNACK.
+ */
+void ICACHE_FLASH_ATTR discovery_connected(void);
+
+/**
+ * Offers a received message to discovery.
+ * @param topic pointer to the topic name
+ * @param topic_len length of the topic name
+ * @param payload pointer to the message payload
+ * @param payload_len length of the payload
+ * @return 1 if the message was for discovery, 0 otherwise
+ */
+uint8_t ICACHE_FLASH_ATTR discovery_message(uint8_t *topic, uint32_t topic_len, uint8_t *payload, uint32_t payload_len);
+
+/**
+ * @return the counters
+ */
+const discovery_stats_t * ICACHE_FLASH_ATTR discovery_stats(void);
+
+/**
+ * Formats the counters as sent=..;skipped=..;skipped_bytes=..;saves=..;failures=..
+ * @param buf where to write
+ * @param len its size, at least 160
+ * @return the length written, 0 if buf is too small
+ */
+uint32_t ICACHE_FLASH_ATTR discovery_report(char *buf, uint32_t len);
+
+#endif
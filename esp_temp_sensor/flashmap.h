@@ -40,6 +40,13 @@
 #error "The flash map is not supported"
 #endif
 
+// Three sectors outside both OTA banks, for system_param_save_with_protect()
+#define SYSTEM_PARTITION_OTA_STATE_ADDR						0xf8000
+// CA certificate for MQTT over TLS, written by "make flash-ca"
+#define SYSTEM_PARTITION_TLS_CA_ADDR						0xf7000
+// Three sectors below it for the Home Assistant discovery cache, see discovery.h
+#define SYSTEM_PARTITION_DISCOVERY_ADDR						0xf4000
+
 static const partition_item_t at_partition_table[] = {
     { SYSTEM_PARTITION_BOOTLOADER,          0x0,                                    0x1000},
     { SYSTEM_PARTITION_OTA_1,               0x1000,                                 SYSTEM_PARTITION_OTA_SIZE},
@@ -47,6 +54,9 @@ static const partition_item_t at_partition_table[] = {
     { SYSTEM_PARTITION_RF_CAL,              SYSTEM_PARTITION_RF_CAL_ADDR,           0x1000},
     { SYSTEM_PARTITION_PHY_DATA,            SYSTEM_PARTITION_PHY_DATA_ADDR,         0x1000},
     { SYSTEM_PARTITION_SYSTEM_PARAMETER,    SYSTEM_PARTITION_SYSTEM_PARAMETER_ADDR, 0x3000},
+    { SYSTEM_PARTITION_CUSTOMER_BEGIN,      SYSTEM_PARTITION_OTA_STATE_ADDR,        0x3000},
+    { SYSTEM_PARTITION_CUSTOMER_BEGIN + 1,  SYSTEM_PARTITION_TLS_CA_ADDR,           0x1000},
+    { SYSTEM_PARTITION_CUSTOMER_BEGIN + 2,  SYSTEM_PARTITION_DISCOVERY_ADDR,        0x3000},
 };
 
 void ICACHE_FLASH_ATTR user_pre_init(void);
\ No newline at end of file
@@ -0,0 +1,81 @@
+#!/usr/bin/env python3
+##
+# @file
+# @brief Publishes a firmware release for the whole fleet
+#
+# Puts each chunk of the bank images on a retained topic and then publishes
+# the retained manifests described in fwupdate.h. Devices pick the release up
+# by themselves, spread over the start window. With --old1/--old2 the
+# release is published as a delta against the previous images, which only
+# devices still running those images can use.
+#
+# usage: fwpublish.py <broker> <version> --user1 user1.bin --user2 user2.bin
+#                     [--old1 old_user1.bin --old2 old_user2.bin]
+#                     [--chunk 1024] [--window 600] [--watch]
+
+import argparse
+import time
+import zlib
+
+import mkdelta
+import mqttlite
+
+OTA_CHUNK_MAX = 1024  # must match ota.h
+
+parser = argparse.ArgumentParser(description="Publish a firmware release to the fleet")
+parser.add_argument("broker")
+parser.add_argument("version", type=int, help="must match FW_VERSION the images were built with")
+parser.add_argument("--port", type=int, default=1883)
+parser.add_argument("--user1", help="image linked for bank 1")
+parser.add_argument("--user2", help="image linked for bank 2")
+parser.add_argument("--old1", help="previous bank 1 image, devices running it get a delta to --user2")
+parser.add_argument("--old2", help="previous bank 2 image, devices running it get a delta to --user1")
+parser.add_argument("--chunk", type=int, default=OTA_CHUNK_MAX)
+parser.add_argument("--window", type=int, help="seconds to spread the fleet's start over")
+parser.add_argument("--watch", action="store_true", help="print device status messages until interrupted")
+args = parser.parse_args()
+
+if args.chunk > OTA_CHUNK_MAX:
+    parser.error("chunk size is limited to {0} by the device".format(OTA_CHUNK_MAX))
+
+client = mqttlite.Client(args.broker, args.port, client_id="herps-fwpublish")
+
+
+def publish_bank(bank, image_path, old_path):
+    image = open(image_path, "rb").read()
+    fields = ["version={0}".format(args.version), "size={0}".format(len(image)),
+              "crc={0:08x}".format(zlib.crc32(image)), "chunk={0}".format(args.chunk)]
+    payload = image
+    if old_path:
+        old = open(old_path, "rb").read()
+        payload = mkdelta.make_delta(old, image)[mkdelta.HEADER_LEN:]
+        fields += ["from={0:08x}".format(zlib.crc32(old)), "fromsize={0}".format(len(old)),
+                   "length={0}".format(len(payload))]
+    topic = "herps/fw/{0}/{1}".format(args.version, bank)
+    fields.append("topic=" + topic)
+    if args.window is not None:
+        fields.append("window={0}".format(args.window))
+    # chunks first, so no device can see the manifest before its chunks exist
+    for index, offset in enumerate(range(0, len(payload), args.chunk)):
+        client.publish("{0}/{1}".format(topic, index), payload[offset:offset + args.chunk], retain=True)
+    client.publish("herps/fw/manifest/" + bank, ";".join(fields), retain=True)
+    print("{0}: {1} bytes in {2} chunks on {3}".format(bank, len(payload), -(-len(payload) // args.chunk), topic))
+
+
+if args.user1:
+    publish_bank("user1", args.user1, args.old2)
+if args.user2:
+    publish_bank("user2", args.user2, args.old1)
+
+if args.watch:
+    client.subscribe("herps/+/fw/status")
+    try:
+        while True:
+            message = client.read_message(timeout=30)
+            if message is None:
+                client.ping()
+                continue
+            print(time.strftime("%H:%M:%S"), message[0], message[1].decode(errors="replace"))
+    except KeyboardInterrupt:
+        pass
+client.disconnect()
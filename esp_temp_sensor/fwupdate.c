@@ -0,0 +1,294 @@
+#include "ets_sys.h"
+#include "osapi.h"
+#include "os_type.h"
+#include "user_interface.h"
+#include "mqtt.h"
+#include "ota.h"
+#include "fwupdate.h"
+
+typedef enum {
+    FW_IDLE, // nothing to do, or manifest matches what we run
+    FW_WAITING, // waiting out the random start delay
+    FW_PULLING, // fetching chunks
+    FW_DONE, // image verified, rebooting
+    FW_FAILED, // last attempt failed
+} fw_state_t;
+
+static const char * const fw_state_names[] = { "current", "waiting", "downloading", "done", "failed" };
+
+static struct {
+    mqtt_session_t *session;
+    char manifestTopic[32];
+    char statusTopic[40];
+    char chunkTopic[64]; // base topic from the manifest
+    char pullTopic[76]; // <chunkTopic>/<index>, the chunk we are waiting for
+    uint8_t state;
+    // from the manifest
+    uint32_t version;
+    uint32_t size;
+    uint32_t crc;
+    uint32_t chunk;
+    uint32_t length; // bytes on the chunk topics: size, or the delta length
+    uint32_t from; // CRC of the delta source, 0 for a full image
+    uint32_t fromSize;
+    uint32_t window;
+    // progress
+    uint32_t index;
+    uint32_t chunks;
+    uint8_t retries;
+    uint8_t attempts; // failed attempts at attemptVersion
+    uint32_t attemptVersion;
+    uint8_t lastPercent;
+    twheel_timer_t timer;
+} fw;
+
+static void ICACHE_FLASH_ATTR fw_status(const char *reason) {
+    char buf[96];
+    uint32_t percent = fw.chunks ? (fw.index * 100) / fw.chunks : 0;
+    int len = os_sprintf(buf, "state=%s;version=%d;running=%d;progress=%d", fw_state_names[fw.state], fw.version, FW_VERSION, percent);
+    if (reason != NULL) {
+        len += os_sprintf(buf + len, ";reason=%s", reason);
+    }
+    mqttPublish(fw.session, (uint8_t *)fw.statusTopic, os_strlen(fw.statusTopic), (uint8_t *)buf, len, MQTT_PUBLISH_RETAIN);
+}
+
+static void ICACHE_FLASH_ATTR fw_fail(const char *reason) {
+    os_printf("Firmware update failed: %s\n", reason);
+    twheel_disarm(&fw.timer);
+    if (fw.pullTopic[0] != '\0') {
+        mqttSendTopic(fw.session, (uint8_t *)fw.pullTopic, os_strlen(fw.pullTopic), NULL, 0, MQTT_MSG_TYPE_UNSUBSCRIBE);
+        fw.pullTopic[0] = '\0';
+    }
+    ota_abort();
+    fw.state = FW_FAILED;
+    fw.attempts++;
+    fw_status(reason);
+}
+
+static void ICACHE_FLASH_ATTR fw_timeout(void *arg);
+
+// Subscribing to a retained chunk topic is how a chunk is asked for
+static void ICACHE_FLASH_ATTR fw_pull(void *arg) {
+    os_sprintf(fw.pullTopic, "%s/%d", fw.chunkTopic, fw.index);
+    mqttSendTopic(fw.session, (uint8_t *)fw.pullTopic, os_strlen(fw.pullTopic), NULL, 0, MQTT_MSG_TYPE_SUBSCRIBE);
+    twheel_disarm(&fw.timer);
+    twheel_setfn(&fw.timer, (twheel_fn)fw_timeout, NULL);
+    twheel_arm(&fw.timer, FWUPDATE_CHUNK_TIMEOUT_MS, 0);
+}
+
+static void ICACHE_FLASH_ATTR fw_timeout(void *arg) {
+    if (++fw.retries > FWUPDATE_CHUNK_RETRIES) {
+        fw_fail("timeout");
+        return;
+    }
+    os_printf("Chunk %d timed out, asking again\n", fw.index);
+    // a fresh SUBSCRIBE makes the broker send the retained chunk again
+    mqttSendTopic(fw.session, (uint8_t *)fw.pullTopic, os_strlen(fw.pullTopic), NULL, 0, MQTT_MSG_TYPE_UNSUBSCRIBE);
+    fw_pull(NULL);
+}
+
+static void ICACHE_FLASH_ATTR fw_start(void *arg) {
+    ota_result_t res;
+    if (fw.from != 0) {
+        res = ota_begin_delta(fw.fromSize, fw.from, fw.size, fw.crc);
+    } else {
+        res = ota_begin(fw.size, fw.crc);
+    }
+    if (res != OTA_OK) {
+        fw_fail((res == OTA_ERR_VERIFY) ? "delta source" : "begin");
+        return;
+    }
+    fw.state = FW_PULLING;
+    fw.index = 0;
+    fw.retries = 0;
+    fw.lastPercent = 0;
+    fw_status(NULL);
+    fw_pull(NULL);
+}
+
+static void ICACHE_FLASH_ATTR fw_chunk(uint8_t *payload, uint32_t len) {
+    uint32_t offset = fw.index * fw.chunk;
+    uint32_t expected = (fw.length - offset < fw.chunk) ? fw.length - offset : fw.chunk;
+    uint32_t percent;
+    twheel_disarm(&fw.timer);
+    mqttSendTopic(fw.session, (uint8_t *)fw.pullTopic, os_strlen(fw.pullTopic), NULL, 0, MQTT_MSG_TYPE_UNSUBSCRIBE);
+    fw.pullTopic[0] = '\0';
+    if (len != expected) {
+        fw_fail("chunk size");
+        return;
+    }
+    if (ota_data(offset, payload, len) != OTA_OK) {
+        fw_fail("write");
+        return;
+    }
+    fw.index++;
+    fw.retries = 0;
+    if (fw.index == fw.chunks) {
+        if (ota_end() != OTA_DONE) {
+            fw_fail("verify");
+            return;
+        }
+        fw.state = FW_DONE;
+        fw_status(NULL);
+        return;
+    }
+    percent = (fw.index * 100) / fw.chunks;
+    if (percent >= fw.lastPercent + 10) {
+        fw.lastPercent = percent;
+        fw_status(NULL);
+    }
+    twheel_setfn(&fw.timer, (twheel_fn)fw_pull, NULL);
+    twheel_arm(&fw.timer, FWUPDATE_CHUNK_INTERVAL_MS, 0);
+}
+
+static uint8_t ICACHE_FLASH_ATTR key_is(const uint8_t *key, uint32_t len, const char *name) {
+    return (len == os_strlen(name) && os_memcmp(key, name, len) == 0) ? 1 : 0;
+}
+
+static uint32_t ICACHE_FLASH_ATTR parse_number(const uint8_t *p, uint32_t len, uint8_t base) {
+    uint32_t value = 0;
+    uint32_t i;
+    for (i = 0; i < len; i++) {
+        uint8_t c = p[i];
+        uint8_t digit;
+        if (c >= '0' && c <= '9') {
+            digit = c - '0';
+        } else if (base == 16 && (c | 0x20) >= 'a' && (c | 0x20) <= 'f') {
+            digit = (c | 0x20) - 'a' + 10;
+        } else {
+            break;
+        }
+        value = value * base + digit;
+    }
+    return value;
+}
+
+// Fills in fw from the manifest. Returns 0 if the required keys were all there.
+static int ICACHE_FLASH_ATTR fw_parse_manifest(const uint8_t *p, uint32_t len) {
+    uint32_t pos = 0;
+    uint8_t found = 0;
+    fw.from = 0;
+    fw.fromSize = 0;
+    fw.length = 0;
+    fw.window = FWUPDATE_WINDOW_MS;
+    while (pos < len) {
+        uint32_t keyStart = pos;
+        uint32_t keyLen;
+        uint32_t valStart;
+        while (pos < len && p[pos] != '=' && p[pos] != ';') pos++;
+        keyLen = pos - keyStart;
+        if (pos < len && p[pos] == '=') pos++;
+        valStart = pos;
+        while (pos < len && p[pos] != ';') pos++;
+        const uint8_t *key = p + keyStart;
+        const uint8_t *val = p + valStart;
+        uint32_t valLen = pos - valStart;
+        pos++; // skip the ';'
+
+        if (key_is(key, keyLen, "version")) {
+            fw.version = parse_number(val, valLen, 10);
+            found |= 0x01;
+        } else if (key_is(key, keyLen, "size")) {
+            fw.size = parse_number(val, valLen, 10);
+            found |= 0x02;
+        } else if (key_is(key, keyLen, "crc")) {
+            fw.crc = parse_number(val, valLen, 16);
+            found |= 0x04;
+        } else if (key_is(key, keyLen, "chunk")) {
+            fw.chunk = parse_number(val, valLen, 10);
+            found |= 0x08;
+        } else if (key_is(key, keyLen, "topic")) {
+            if (valLen >= sizeof(fw.chunkTopic)) {
+                return -1;
+            }
+            os_memcpy(fw.chunkTopic, val, valLen);
+            fw.chunkTopic[valLen] = '\0';
+            found |= 0x10;
+        } else if (key_is(key, keyLen, "length")) {
+            fw.length = parse_number(val, valLen, 10);
+        } else if (key_is(key, keyLen, "from")) {
+            fw.from = parse_number(val, valLen, 16);
+        } else if (key_is(key, keyLen, "fromsize")) {
+            fw.fromSize = parse_number(val, valLen, 10);
+        } else if (key_is(key, keyLen, "window")) {
+            fw.window = parse_number(val, valLen, 10) * 1000;
+        }
+    }
+    if (found != 0x1F || fw.chunk == 0 || fw.chunk > OTA_CHUNK_MAX) {
+        return -1;
+    }
+    if (fw.length == 0) {
+        fw.length = fw.size;
+    }
+    fw.chunks = (fw.length + fw.chunk - 1) / fw.chunk;
+    return 0;
+}
+
+static void ICACHE_FLASH_ATTR fw_manifest(uint8_t *payload, uint32_t len) {
+    uint32_t oldVersion = fw.version;
+    uint32_t oldCrc = fw.crc;
+    int parsed = fw_parse_manifest(payload, len);
+    if (fw.state == FW_WAITING || fw.state == FW_PULLING || fw.state == FW_DONE) {
+        // already on it, unless the manifest has moved on to another image
+        if (parsed == 0 && fw.version == oldVersion && fw.crc == oldCrc) {
+            return;
+        }
+        fw_fail("superseded");
+    }
+    if (parsed != 0) {
+        os_printf("Bad firmware manifest\n");
+        return;
+    }
+    if (fw.version == FW_VERSION) {
+        if (fw.state != FW_IDLE || oldVersion != fw.version) {
+            fw.state = FW_IDLE;
+            fw.chunks = 0;
+            fw_status(NULL);
+        }
+        return;
+    }
+    if (ota_is_bad(fw.crc)) {
+        os_printf("Firmware %d was rolled back before, ignoring\n", fw.version);
+        return;
+    }
+    if (fw.version != fw.attemptVersion) {
+        fw.attemptVersion = fw.version;
+        fw.attempts = 0;
+    }
+    if (fw.attempts >= FWUPDATE_MAX_ATTEMPTS) {
+        return;
+    }
+    // spread the fleet over the window so the broker is not hit all at once
+    uint32_t delay = fw.window ? os_random() % fw.window : 0;
+    os_printf("Firmware %d available, starting in %dms\n", fw.version, delay);
+    fw.state = FW_WAITING;
+    fw.index = 0;
+    fw_status(NULL);
+    twheel_disarm(&fw.timer);
+    twheel_setfn(&fw.timer, (twheel_fn)fw_start, NULL);
+    twheel_arm(&fw.timer, delay + 1, 0);
+}
+
+void ICACHE_FLASH_ATTR fwupdate_init(mqtt_session_t *session) {
+    os_memset(&fw, 0, sizeof(fw));
+    fw.session = session;
+    // we want the image linked for the bank we are not running from
+    os_sprintf(fw.manifestTopic, "herps/fw/manifest/%s", (system_upgrade_userbin_check() == UPGRADE_FW_BIN1) ? "user2" : "user1");
+    os_sprintf(fw.statusTopic, "herps/%08x/fw/status", system_get_chip_id());
+}
+
+void ICACHE_FLASH_ATTR fwupdate_connected(void) {
+    mqttSendTopic(fw.session, (uint8_t *)fw.manifestTopic, os_strlen(fw.manifestTopic), NULL, 0, MQTT_MSG_TYPE_SUBSCRIBE);
+}
+
+uint8_t ICACHE_FLASH_ATTR fwupdate_message(uint8_t *topic, uint32_t topic_len, uint8_t *payload, uint32_t payload_len) {
+    if (key_is(topic, topic_len, fw.manifestTopic)) {
+        fw_manifest(payload, payload_len);
+        return 1;
+    }
+    if (fw.state == FW_PULLING && fw.pullTopic[0] != '\0' && key_is(topic, topic_len, fw.pullTopic)) {
+        fw_chunk(payload, payload_len);
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,58 @@
+/**
+ * @file
+ * @brief Fleet-wide firmware rollout driven by a retained manifest.
+ *
+ * Every device subscribes to the manifest for the bank it would update into,
+ * herps/fw/manifest/user1 or herps/fw/manifest/user2. The manifest is a
+ * retained message of key=value pairs separated by ';':
+ *
+ *   version=13;size=431232;crc=8a1f00c2;chunk=1024;topic=herps/fw/13/user2
+ *
+ * with from=<crc>;fromsize=<size> added when the image is a delta (see
+ * delta.h) against the image with that CRC, and window=<seconds> to override
+ * FWUPDATE_WINDOW_MS. The image itself is retained on <topic>/<index>, one
+ * chunk per message.
+ *
+ * When the manifest version differs from FW_VERSION, the device waits a
+ * random time within the window so the fleet does not all start at once,
+ * then pulls the chunks one at a time, FWUPDATE_CHUNK_INTERVAL_MS apart, and
+ * feeds them to ota.c. Progress and result go to herps/<chip id>/fw/status.
+ */
+#ifndef FWUPDATE_H
+#define FWUPDATE_H
+
+#include "os_type.h"
+#include "mqtt.h"
+
+#ifndef FW_VERSION
+#define FW_VERSION 1 /**< Build ID compared with the manifest, normally set by the Makefile */
+#endif
+
+#define FWUPDATE_WINDOW_MS 600000 /**< Default window the start time is spread over */
+#define FWUPDATE_CHUNK_INTERVAL_MS 200 /**< Pause between chunks, limits the load on the broker */
+#define FWUPDATE_CHUNK_TIMEOUT_MS 5000 /**< How long to wait for a chunk before asking again */
+#define FWUPDATE_CHUNK_RETRIES 3 /**< Times a chunk is asked for before giving up */
+#define FWUPDATE_MAX_ATTEMPTS 3 /**< Failed downloads of one version before we stop trying it */
+
+/**
+ * Sets up topic names. Call once before the first connection.
+ * @param session the session used for all firmware traffic
+ */
+void ICACHE_FLASH_ATTR fwupdate_init(mqtt_session_t *session);
+
+/**
+ * Subscribes to the manifest. Call after each accepted CONNACK.
+ */
+void ICACHE_FLASH_ATTR fwupdate_connected(void);
+
+/**
+ * Offers a received message to the updater.
+ * @param topic pointer to the topic name
+ * @param topic_len length of the topic name
+ * @param payload pointer to the message payload
+ * @param payload_len length of the payload
+ * @return 1 if the message was for the updater, 0 otherwise
+ */
+uint8_t ICACHE_FLASH_ATTR fwupdate_message(uint8_t *topic, uint32_t topic_len, uint8_t *payload, uint32_t payload_len);
+
+#endif
@@ -0,0 +1,271 @@
+// Bytes on air for the same readings over MQTT/TCP (mqtt.c) and MQTT-SN/UDP
+// (mqttsn.c). Each step is run for real against a broker and a gateway,
+// normally mqttsn_gw.py, and the packets the firmware sent and received are
+// counted. Headers below the application are added from a model:
+//
+//   802.11 data frame with CCMP   52 bytes, plus a 14 byte link layer ACK
+//   IPv4                          20 bytes
+//   TCP                           20 bytes, 24 for SYN and SYN-ACK
+//   UDP                            8 bytes
+//
+// Each TCP data segment is taken to draw a pure ACK unless the other side
+// answers it with data; delayed ACKs are rare at one reading a minute.
+//
+// usage: airbytes [options]
+//   -b host:port broker (127.0.0.1:1883)
+//   -g host:port MQTT-SN gateway (127.0.0.1:1883)
+//   -t topic     topic for MQTT/TCP (test)
+//   -T id        predefined topic ID for MQTT-SN, mapped to the same topic at the gateway (1)
+//   -n count     readings sent in each measured step (10)
+//   -i seconds   interval between readings, for the hourly totals (60)
+//   -k seconds   keepalive, for the hourly totals (50)
+//   -v           print the firmware's debug output
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+#include "osapi.h"
+#include "mqtt.h"
+#include "mqttsn.h"
+#include "twheel.h"
+#include "host.h"
+
+#define WIFI_FRAME 52
+#define WIFI_ACK 14
+#define IP_HEADER 20
+#define TCP_HEADER 20
+#define TCP_SYN_OPTIONS 4
+#define UDP_HEADER 8
+#define READING "23.45"
+#define STEP_WAIT_MS 300
+
+typedef struct {
+    const char *name;
+    uint32_t count; // readings or exchanges the step was run for
+    uint32_t frames; // data and pure ACK frames, per one
+    uint32_t appBytes; // MQTT or MQTT-SN bytes, per one
+    uint32_t airBytes; // everything on air, per one
+} step_t;
+
+static struct {
+    uint8_t brokerIp[4];
+    uint16_t brokerPort;
+    uint8_t gwIp[4];
+    uint16_t gwPort;
+    const char *topic;
+    uint16_t topicId;
+    uint32_t count;
+    uint32_t intervalS;
+    uint32_t keepaliveS;
+} opt = { { 127, 0, 0, 1 }, 1883, { 127, 0, 0, 1 }, 1883, "test", 1, 10, 60, 50 };
+
+static mqtt_session_t tcp;
+static mqttsn_session_t sn;
+static volatile int done;
+static uint8_t accepted; // CONNACK from the broker took us
+static host_net_stats_t mark;
+
+static void wait_for(uint32_t ms) {
+    done = 0;
+    host_loop_run(host_time_us() + (uint64_t)ms * 1000, &done);
+}
+
+static void begin(const host_net_stats_t *net) {
+    mark = *net;
+}
+
+// what happened on the socket since begin(), spread over count repetitions
+static step_t finish(const char *name, const host_net_stats_t *net, uint32_t count, uint8_t udp) {
+    step_t s;
+    uint32_t tx = net->txPackets - mark.txPackets;
+    uint32_t rx = net->rxPackets - mark.rxPackets;
+    uint32_t bytes = net->txBytes - mark.txBytes + net->rxBytes - mark.rxBytes;
+    uint32_t handshakes = net->connects - mark.connects;
+    uint32_t frames = tx + rx;
+    uint32_t headers = udp ? UDP_HEADER : TCP_HEADER;
+    uint32_t air = bytes + frames * (WIFI_FRAME + WIFI_ACK + IP_HEADER + headers);
+    if (!udp) {
+        uint32_t acks = (tx > rx) ? tx : rx;
+        acks += handshakes * 3; // SYN, SYN-ACK, ACK
+        frames += acks;
+        air += acks * (WIFI_FRAME + WIFI_ACK + IP_HEADER + TCP_HEADER) + handshakes * 2 * TCP_SYN_OPTIONS;
+    }
+    s.name = name;
+    s.count = count;
+    s.frames = (frames + count / 2) / count;
+    s.appBytes = (bytes + count / 2) / count;
+    s.airBytes = (air + count / 2) / count;
+    printf("  %-22s %6u %10u %13u\n", name, s.frames, s.appBytes, s.airBytes);
+    return s;
+}
+
+static void tcp_up(void *arg) {
+    mqttSend(&tcp, NULL, 0, MQTT_MSG_TYPE_CONNECT);
+}
+
+static void tcp_connack(void *arg) {
+    accepted = (tcp.connackCode == 0);
+    done = 1;
+}
+
+static void tcp_lost(void *arg) {
+    done = 1;
+}
+
+static void sn_connack(void *session, uint8_t returnCode) {
+    if (returnCode != 0) {
+        fprintf(stderr, "gateway refused CONNECT with code %u\n", returnCode);
+        exit(1);
+    }
+    done = 1;
+}
+
+static void sn_lost(void *session) {
+    fprintf(stderr, "gateway stopped answering\n");
+    exit(1);
+}
+
+// pings per reading when the keepalive fires after idle seconds of silence
+static double pings_per_reading(double idleS) {
+    uint32_t pings = 0;
+    while ((pings + 1) * idleS < opt.intervalS) {
+        pings++;
+    }
+    return pings;
+}
+
+static void hourly(const char *name, double perReading, double perPing, double pings, double extra) {
+    double readings = 3600.0 / opt.intervalS;
+    printf("  %-26s %8.0f bytes\n", name, readings * (perReading + pings * perPing) + extra);
+}
+
+static void parse_addr(const char *arg, uint8_t ip[4], uint16_t *port) {
+    char host[64];
+    struct in_addr addr;
+    const char *colon = strchr(arg, ':');
+    size_t len = colon ? (size_t)(colon - arg) : strlen(arg);
+    if (len >= sizeof(host)) {
+        len = sizeof(host) - 1;
+    }
+    memcpy(host, arg, len);
+    host[len] = 0;
+    if (inet_pton(AF_INET, host, &addr) != 1) {
+        fprintf(stderr, "bad address %s\n", arg);
+        exit(2);
+    }
+    memcpy(ip, &addr.s_addr, 4);
+    if (colon != NULL) {
+        *port = atoi(colon + 1);
+    }
+}
+
+int main(int argc, char **argv) {
+    step_t tcpPub, tcpPing, snPub, snPing, snPubM1, snWake;
+    uint32_t i;
+    int c;
+
+    host_verbose = 0;
+    while ((c = getopt(argc, argv, "b:g:t:T:n:i:k:v")) != -1) {
+        switch (c) {
+            case 'b': parse_addr(optarg, opt.brokerIp, &opt.brokerPort); break;
+            case 'g': parse_addr(optarg, opt.gwIp, &opt.gwPort); break;
+            case 't': opt.topic = optarg; break;
+            case 'T': opt.topicId = atoi(optarg); break;
+            case 'n': opt.count = atoi(optarg); break;
+            case 'i': opt.intervalS = atoi(optarg); break;
+            case 'k': opt.keepaliveS = atoi(optarg); break;
+            case 'v': host_verbose = 1; break;
+            default:
+                fprintf(stderr, "usage: airbytes [-b host:port] [-g host:port] [-t topic] [-T topic_id] [-n count] [-i interval_s] [-k keepalive_s] [-v]\n");
+                return 2;
+        }
+    }
+    if (opt.count == 0 || opt.intervalS == 0 || opt.keepaliveS == 0) {
+        return 2;
+    }
+    twheel_init();
+
+    printf("per step                  frames  app bytes  on-air bytes\n");
+    os_memcpy(tcp.ip, opt.brokerIp, 4);
+    tcp.port = opt.brokerPort;
+    tcp.client_id = (uint8_t *)"airbytes-tcp";
+    tcp.client_id_len = strlen((char *)tcp.client_id);
+    tcp.topic_name = (uint8_t *)opt.topic;
+    tcp.topic_name_len = strlen(opt.topic);
+    tcp.keepalive = opt.keepaliveS;
+    tcp.connected_cb = tcp_up;
+    tcp.connack_cb = tcp_connack;
+    tcp.disconnect_cb = tcp_lost;
+    begin(&host_tcp_stats);
+    tcpConnect(&tcp);
+    wait_for(5000);
+    if (!accepted) {
+        fprintf(stderr, "no MQTT connection to the broker\n");
+        return 1;
+    }
+    wait_for(STEP_WAIT_MS);
+    finish("MQTT connect", &host_tcp_stats, 1, 0);
+    begin(&host_tcp_stats);
+    for (i = 0; i < opt.count; i++) {
+        mqttSend(&tcp, (uint8_t *)READING, strlen(READING), MQTT_MSG_TYPE_PUBLISH);
+        wait_for(10);
+    }
+    wait_for(STEP_WAIT_MS);
+    tcpPub = finish("MQTT publish", &host_tcp_stats, opt.count, 0);
+    begin(&host_tcp_stats);
+    mqttSend(&tcp, NULL, 0, MQTT_MSG_TYPE_PINGREQ);
+    wait_for(STEP_WAIT_MS);
+    tcpPing = finish("MQTT keepalive", &host_tcp_stats, 1, 0);
+    mqttSend(&tcp, NULL, 0, MQTT_MSG_TYPE_DISCONNECT);
+    espconn_disconnect(tcp.activeConnection);
+    wait_for(STEP_WAIT_MS);
+
+    os_memcpy(sn.ip, opt.gwIp, 4);
+    sn.port = opt.gwPort;
+    sn.client_id = (const uint8_t *)"airbytes-sn";
+    sn.client_id_len = strlen((const char *)sn.client_id);
+    sn.duration = 1; // so the keepalive step does not take long
+    sn.connack_cb = sn_connack;
+    sn.disconnect_cb = sn_lost;
+    begin(&host_udp_stats);
+    mqttsn_connect(&sn);
+    wait_for(5000);
+    if (sn.state != MQTTSN_ACTIVE) {
+        fprintf(stderr, "no MQTT-SN connection to the gateway\n");
+        return 1;
+    }
+    finish("MQTT-SN connect", &host_udp_stats, 1, 1);
+    begin(&host_udp_stats);
+    for (i = 0; i < opt.count; i++) {
+        mqttsn_publish(&sn, opt.topicId, (const uint8_t *)READING, strlen(READING), MQTTSN_QOS_0);
+        wait_for(10);
+    }
+    snPub = finish("MQTT-SN publish QoS 0", &host_udp_stats, opt.count, 1);
+    begin(&host_udp_stats);
+    wait_for(sn.duration * 1000);
+    snPing = finish("MQTT-SN keepalive", &host_udp_stats, 1, 1);
+    mqttsn_sleep(&sn, opt.keepaliveS);
+    wait_for(STEP_WAIT_MS);
+    begin(&host_udp_stats);
+    for (i = 0; i < opt.count; i++) {
+        mqttsn_publish(&sn, opt.topicId, (const uint8_t *)READING, strlen(READING), MQTTSN_QOS_M1);
+        wait_for(10);
+    }
+    snPubM1 = finish("MQTT-SN publish QoS -1", &host_udp_stats, opt.count, 1);
+    begin(&host_udp_stats);
+    mqttsn_wake(&sn);
+    wait_for(STEP_WAIT_MS);
+    snWake = finish("MQTT-SN wake", &host_udp_stats, 1, 1);
+    mqttsn_disconnect(&sn);
+    wait_for(STEP_WAIT_MS);
+
+    // mqtt.c pings after 60% of the keepalive without sending, mqttsn.c after 75%
+    printf("\non air per hour, a reading every %u s, keepalive %u s:\n", opt.intervalS, opt.keepaliveS);
+    hourly("MQTT, connected", tcpPub.airBytes, tcpPing.airBytes, pings_per_reading(opt.keepaliveS * 0.6), 0);
+    hourly("MQTT-SN QoS 0, active", snPub.airBytes, snPing.airBytes, pings_per_reading(opt.keepaliveS * 0.75), 0);
+    hourly("MQTT-SN QoS -1, asleep", snPubM1.airBytes, 0, 0, 3600.0 / (opt.keepaliveS * 0.75) * snWake.airBytes);
+    return 0;
+}
@@ -0,0 +1,348 @@
+// Measures how long an alarm takes from outq_alarm() to a broker, with the
+// telemetry lane kept busy, over a real connection to a local broker.
+//
+// One session publishes through outq.c the way main.c does: a reading every
+// -r ms into the telemetry lane, and alarms at random times in between, the
+// way check_alarm() raises one when a reading crosses a limit. A second
+// session subscribes to both topics, and for each message the time from
+// raising or queuing it to the broker's PUBACK and to the subscriber getting
+// it is kept. power.c runs as on the device, with its hold released, so
+// each alarm is also checked to have taken the radio out of sleep.
+//
+// The device has main.c's send queue. After the last alarm the queue is
+// filled with publishes until it refuses one, and one more alarm raised:
+// it has to reach the subscriber ahead of every one of them but the one the
+// SDK already had.
+//
+// usage: alarmlat [options] -b ip
+//   -b ip        the broker
+//   -p port      broker port (1883)
+//   -n count     alarms to raise (20)
+//   -r ms        between readings (1000)
+//   -v           print the firmware's debug output
+//
+// Exits 1 if an alarm was not acknowledged and delivered, did not wake the
+// radio, took as long as a reading can wait in the lane, or waited behind
+// the full queue.
+
+#include <getopt.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+
+#include "osapi.h"
+#include "mqtt.h"
+#include "outq.h"
+#include "power.h"
+#include "twheel.h"
+#include "host.h"
+
+#define MAX_ALARMS 1000
+#define MAX_READINGS 10000
+#define ALARM_GAP_MIN_MS 200 // alarms come between this
+#define ALARM_GAP_MAX_MS 2000 // and this far apart
+#define DRAIN_MS 2000 // after the last alarm, for the last messages to arrive
+
+typedef struct {
+    uint64_t raisedUs;
+    uint64_t ackUs;
+    uint64_t deliveredUs;
+    uint8_t woke; // the radio was held awake straight after
+} alarm_t;
+
+typedef struct {
+    uint64_t queuedUs;
+    uint64_t deliveredUs;
+} reading_t;
+
+static mqtt_session_t device, monitor;
+static uint8_t txQueue[MQTT_TX_QUEUE_LEN];
+static char readingTopic[48], alarmTopic[48];
+static twheel_timer_t readingTimer, alarmTimer, fullTimer, stopTimer;
+static alarm_t alarms[MAX_ALARMS];
+static reading_t readings[MAX_READINGS];
+static uint32_t alarmCount = 20, raised, readingCount, readingMs = 1000;
+static uint8_t deviceUp, subacks;
+static void (*outqPuback)(void *session, uint16_t packetId);
+static uint16_t pendingIds[OUTQ_ALARMS * 2]; // packet identifier of each alarm awaiting PUBACK
+static uint32_t pendingAlarm[OUTQ_ALARMS * 2];
+static volatile int stop;
+static uint32_t fillers, fillersDelivered, fillersAhead; // the full-queue case's publishes, and those that beat its alarm
+static uint8_t fullDelivered;
+
+static void on_reading(void *arg) {
+    char data[OUTQ_READING_LEN];
+    if (readingCount == MAX_READINGS) {
+        return;
+    }
+    readings[readingCount].queuedUs = host_time_us();
+    outq_reading((uint8_t *)data, sprintf(data, "r%u", readingCount));
+    readingCount++;
+}
+
+static void arm_alarm(void) {
+    twheel_arm(&alarmTimer, ALARM_GAP_MIN_MS + rand() % (ALARM_GAP_MAX_MS - ALARM_GAP_MIN_MS), 0);
+}
+
+static void on_alarm(void *arg) {
+    char data[OUTQ_ALARM_LEN];
+    uint16_t id = device.packetId;
+    uint32_t i;
+    alarms[raised].raisedUs = host_time_us();
+    outq_alarm((uint8_t *)alarmTopic, strlen(alarmTopic), (uint8_t *)data, sprintf(data, "state=high;seq=%u", raised));
+    alarms[raised].woke = power_stats()->mode == POWER_AWAKE;
+    // outq.c took the next packet identifier for it
+    if (device.packetId != id) {
+        for (i = 0; i < sizeof(pendingIds) / sizeof(pendingIds[0]); i++) {
+            if (pendingIds[i] == 0) {
+                pendingIds[i] = device.packetId;
+                pendingAlarm[i] = raised;
+                break;
+            }
+        }
+    }
+    if (++raised < alarmCount) {
+        arm_alarm();
+    } else {
+        twheel_disarm(&readingTimer);
+        twheel_arm(&fullTimer, ALARM_GAP_MIN_MS, 0);
+    }
+}
+
+// the send queue filled until it refuses one, then an alarm that has to go next
+static void on_full(void *arg) {
+    char data[OUTQ_READING_LEN];
+    while (mqttPublish(&device, (uint8_t *)readingTopic, strlen(readingTopic), (uint8_t *)data,
+                       sprintf(data, "f%u", fillers), 0) == 0) {
+        fillers++;
+    }
+    printf("full queue: %u publishes, %u of %u bytes queued\n", fillers, device.txQueued, device.txQueueLen);
+    outq_alarm((uint8_t *)alarmTopic, strlen(alarmTopic), (uint8_t *)data, sprintf(data, "state=high;full"));
+    twheel_arm(&stopTimer, DRAIN_MS, 0);
+}
+
+static void on_puback(void *session, uint16_t packetId) {
+    uint32_t i;
+    for (i = 0; i < sizeof(pendingIds) / sizeof(pendingIds[0]); i++) {
+        if (pendingIds[i] == packetId) {
+            alarms[pendingAlarm[i]].ackUs = host_time_us();
+            pendingIds[i] = 0;
+            break;
+        }
+    }
+    outqPuback(session, packetId);
+}
+
+static void on_message(void *arg, uint8_t *topic, uint32_t topic_len, uint8_t *payload, uint32_t payload_len) {
+    char text[64];
+    unsigned seq;
+    uint32_t n = (payload_len < sizeof(text) - 1) ? payload_len : sizeof(text) - 1;
+    memcpy(text, payload, n);
+    text[n] = '\0';
+    if (strcmp(text, "state=high;full") == 0) {
+        fullDelivered = 1;
+        fillersAhead = fillersDelivered;
+    } else if (sscanf(text, "f%u", &seq) == 1) {
+        fillersDelivered++;
+    } else if (sscanf(text, "state=high;seq=%u", &seq) == 1 && seq < raised && alarms[seq].deliveredUs == 0) {
+        alarms[seq].deliveredUs = host_time_us();
+    } else if (sscanf(text, "r%u", &seq) == 1 && seq < readingCount && readings[seq].deliveredUs == 0) {
+        readings[seq].deliveredUs = host_time_us();
+    }
+}
+
+static void start(void) {
+    if (!deviceUp || subacks < 2) {
+        return;
+    }
+    printf("connected, %u alarms between %d and %d ms apart, a reading every %u ms\n", alarmCount,
+           ALARM_GAP_MIN_MS, ALARM_GAP_MAX_MS, readingMs);
+    fflush(stdout);
+    power_release(); // into modem- or light-sleep, as main.c does on CONNACK
+    twheel_arm(&readingTimer, readingMs, 1);
+    arm_alarm();
+}
+
+static void on_connected(void *session) {
+    mqttSend(session, NULL, 0, MQTT_MSG_TYPE_CONNECT);
+}
+
+static void on_device_connack(void *arg) {
+    if (device.connackCode != 0) {
+        fprintf(stderr, "broker refused the device session, code %d\n", device.connackCode);
+        stop = 1;
+        return;
+    }
+    outq_connected();
+    deviceUp = 1;
+    start();
+}
+
+static void on_monitor_connack(void *arg) {
+    if (monitor.connackCode != 0) {
+        fprintf(stderr, "broker refused the monitor session, code %d\n", monitor.connackCode);
+        stop = 1;
+        return;
+    }
+    mqttSendTopic(&monitor, (uint8_t *)alarmTopic, strlen(alarmTopic), NULL, 0, MQTT_MSG_TYPE_SUBSCRIBE);
+    mqttSendTopic(&monitor, (uint8_t *)readingTopic, strlen(readingTopic), NULL, 0, MQTT_MSG_TYPE_SUBSCRIBE);
+}
+
+static void on_suback(void *arg) {
+    // the second SUBACK, for the readings
+    if (++subacks == 2) {
+        start();
+    }
+}
+
+static void on_lost(void *arg) {
+    fprintf(stderr, "lost the %s session\n", (arg == &device) ? "device" : "monitor");
+    stop = 1;
+}
+
+static void on_stop(void *arg) {
+    stop = 1;
+}
+
+static void on_signal(int sig) {
+    stop = 1;
+}
+
+static int cmp_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+// median, 95th percentile and worst of n latencies in microseconds, sorted in place
+static void summary(const char *name, uint64_t *us, uint32_t n, uint32_t missing) {
+    if (n == 0) {
+        printf("%-22s %6u %9s %9s %9s %8u\n", name, 0, "-", "-", "-", missing);
+        return;
+    }
+    qsort(us, n, sizeof(us[0]), cmp_u64);
+    printf("%-22s %6u %9.1f %9.1f %9.1f %8u\n", name, n, us[n / 2] / 1000.0, us[(n * 95 + 99) / 100 - 1] / 1000.0,
+           us[n - 1] / 1000.0, missing);
+}
+
+static void usage(void) {
+    fprintf(stderr, "usage: alarmlat [-p port] [-n alarms] [-r reading_ms] [-v] -b ip\n");
+    exit(2);
+}
+
+int main(int argc, char **argv) {
+    static uint64_t acked[MAX_ALARMS], delivered[MAX_ALARMS], telemetry[MAX_READINGS];
+    uint32_t i, nAcked = 0, nDelivered = 0, nTelemetry = 0, woke = 0, port = 1883;
+    uint64_t worst = 0;
+    struct in_addr addr;
+    char report[160];
+    int c, haveBroker = 0, failed = 0;
+
+    host_verbose = 0;
+    while ((c = getopt(argc, argv, "b:p:n:r:v")) != -1) {
+        switch (c) {
+            case 'b':
+                if (inet_pton(AF_INET, optarg, &addr) != 1) {
+                    usage();
+                }
+                memcpy(device.ip, &addr.s_addr, 4);
+                memcpy(monitor.ip, &addr.s_addr, 4);
+                haveBroker = 1;
+                break;
+            case 'p': port = atoi(optarg); break;
+            case 'n': alarmCount = atoi(optarg); break;
+            case 'r': readingMs = atoi(optarg); break;
+            case 'v': host_verbose = 1; break;
+            default: usage();
+        }
+    }
+    if (!haveBroker || alarmCount == 0 || alarmCount > MAX_ALARMS || readingMs == 0) {
+        usage();
+    }
+    signal(SIGINT, on_signal);
+    srand(1);
+
+    twheel_init();
+    power_init();
+    sprintf(readingTopic, "alarmlat/%d/reading", (int)getpid());
+    sprintf(alarmTopic, "alarmlat/%d/alarm", (int)getpid());
+
+    device.port = monitor.port = port;
+    device.keepalive = monitor.keepalive = 30;
+    device.client_id = (uint8_t *)"alarmlat-device";
+    device.client_id_len = strlen((char *)device.client_id);
+    device.topic_name = (uint8_t *)readingTopic;
+    device.topic_name_len = strlen(readingTopic);
+    device.connected_cb = on_connected;
+    device.connack_cb = on_device_connack;
+    device.disconnect_cb = on_lost;
+    mqttSetSendQueue(&device, txQueue, sizeof(txQueue));
+    outq_init(&device);
+    outqPuback = device.puback_cb;
+    device.puback_cb = on_puback;
+
+    monitor.client_id = (uint8_t *)"alarmlat-monitor";
+    monitor.client_id_len = strlen((char *)monitor.client_id);
+    monitor.connected_cb = on_connected;
+    monitor.connack_cb = on_monitor_connack;
+    monitor.suback_cb = on_suback;
+    monitor.message_cb = on_message;
+    monitor.disconnect_cb = on_lost;
+
+    twheel_setfn(&readingTimer, (twheel_fn)on_reading, NULL);
+    twheel_setfn(&alarmTimer, (twheel_fn)on_alarm, NULL);
+    twheel_setfn(&fullTimer, (twheel_fn)on_full, NULL);
+    twheel_setfn(&stopTimer, (twheel_fn)on_stop, NULL);
+    tcpConnect(&monitor);
+    tcpConnect(&device);
+    host_loop_run(UINT64_MAX, &stop);
+
+    for (i = 0; i < raised; i++) {
+        if (alarms[i].ackUs != 0) {
+            acked[nAcked++] = alarms[i].ackUs - alarms[i].raisedUs;
+        }
+        if (alarms[i].deliveredUs != 0) {
+            delivered[nDelivered] = alarms[i].deliveredUs - alarms[i].raisedUs;
+            if (delivered[nDelivered] > worst) {
+                worst = delivered[nDelivered];
+            }
+            nDelivered++;
+        }
+        woke += alarms[i].woke;
+    }
+    for (i = 0; i < readingCount; i++) {
+        if (readings[i].deliveredUs != 0) {
+            telemetry[nTelemetry++] = readings[i].deliveredUs - readings[i].queuedUs;
+        }
+    }
+    printf("\n%-22s %6s %9s %9s %9s %8s\n", "ms from raised/queued", "count", "median", "p95", "worst", "missing");
+    summary("alarm to PUBACK", acked, nAcked, raised - nAcked);
+    summary("alarm to subscriber", delivered, nDelivered, raised - nDelivered);
+    summary("reading to subscriber", telemetry, nTelemetry, readingCount - nTelemetry);
+    outq_report(report, sizeof(report));
+    printf("\n%u of %u alarms woke the radio\n%s\n", woke, raised, report);
+
+    if (raised < alarmCount || nAcked < raised || nDelivered < raised) {
+        printf("FAIL: %u alarms raised, %u acknowledged, %u delivered of %u\n", raised, nAcked, nDelivered, alarmCount);
+        failed = 1;
+    }
+    if (woke < raised) {
+        printf("FAIL: %u alarms left the radio asleep\n", raised - woke);
+        failed = 1;
+    }
+    if (worst >= OUTQ_BATCH_MS * 1000ULL) {
+        printf("FAIL: an alarm took %.1f ms, as long as a reading can wait to be batched\n", worst / 1000.0);
+        failed = 1;
+    }
+    printf("full queue: the alarm came after %u of %u publishes queued before it\n", fillersAhead, fillers);
+    if (!fullDelivered || fillersAhead > 1) {
+        printf("FAIL: the alarm behind a full queue %s\n", fullDelivered ? "waited for the queue" : "was not delivered");
+        failed = 1;
+    }
+    if (!failed) {
+        printf("PASS\n");
+    }
+    return failed;
+}
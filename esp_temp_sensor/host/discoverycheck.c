@@ -0,0 +1,365 @@
+// Checks discovery.c through the packets it hands espconn_send(), which is
+// wrapped so nothing goes on the network:
+//
+//   - the first connect publishes a retained config for each channel, the
+//     temperature only with a thermistor, on the topics Home Assistant
+//     looks for, each one valid JSON with its unique ID and topics in it
+//   - a reconnect, and one after a restart that loads the cache from flash,
+//     publishes none of them
+//   - a raised version publishes them all again, and only once
+//   - Home Assistant's "online" publishes them all again, and nothing else
+//     on its status topic does
+//   - failing over to a broker that was not sent them publishes them all,
+//     and going back to one that was publishes none, until so many other
+//     brokers have been sent them that the cache forgot it
+//   - configs the SDK refused to send are not cached, so they go out on
+//     the next connect
+//   - without a session, or without a prefix, nothing is sent or saved
+//
+// then reconnects over and over and prints the bytes the cache kept off
+// the network, and what building and checking the configs costs a connect.
+//
+// usage: discoverycheck [options]
+//   -n count     reconnects (1000)
+//   -v           print every config published
+//
+// Exits 1 if a check fails.
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "osapi.h"
+#include "mqtt.h"
+#include "twheel.h"
+#include "discovery.h"
+#include "host.h"
+
+#define MAX_PUBLISHES 8
+
+typedef struct {
+    char topic[DISCOVERY_TOPIC_LEN + 1];
+    char payload[DISCOVERY_PAYLOAD_LEN + 1];
+    uint8_t retained;
+} publish_t;
+
+static publish_t published[MAX_PUBLISHES];
+static uint32_t publishes, subscribes, others, sentBytes;
+static uint8_t verbose, refuse;
+
+// what each packet is, from its fixed header, and the PUBLISHes kept whole
+sint8 __wrap_espconn_send(struct espconn *espconn, uint8 *psent, uint16 length) {
+    uint32_t rest = 0, shift = 0, i = 1, topicLen;
+    uint8_t type = psent[0] >> 4;
+    sentBytes += length;
+    do {
+        rest |= (psent[i] & 0x7F) << shift;
+        shift += 7;
+    } while (psent[i++] & 0x80);
+    if (type == MQTT_MSG_TYPE_SUBSCRIBE) {
+        subscribes++;
+    } else if (type != MQTT_MSG_TYPE_PUBLISH) {
+        others++;
+    } else {
+        topicLen = (psent[i] << 8) | psent[i + 1];
+        if (publishes < MAX_PUBLISHES && topicLen <= DISCOVERY_TOPIC_LEN &&
+            rest - 2 - topicLen <= DISCOVERY_PAYLOAD_LEN) {
+            publish_t *p = &published[publishes];
+            memcpy(p->topic, psent + i + 2, topicLen);
+            p->topic[topicLen] = '\0';
+            memcpy(p->payload, psent + i + 2 + topicLen, rest - 2 - topicLen);
+            p->payload[rest - 2 - topicLen] = '\0';
+            p->retained = psent[0] & MQTT_PUBLISH_RETAIN;
+            if (verbose) {
+                printf("%s%s %s\n", p->topic, p->retained ? " (retained)" : "", p->payload);
+            }
+        }
+        publishes++;
+    }
+    return refuse ? ESPCONN_CONN : ESPCONN_OK;
+}
+
+static void clear_sent(void) {
+    publishes = subscribes = others = sentBytes = 0;
+}
+
+// just enough of a JSON parser for what jsonw.c writes: objects, strings,
+// numbers and booleans, with nothing left over
+static const char *json_value(const char *p);
+
+static const char *json_string(const char *p) {
+    if (*p++ != '"') {
+        return NULL;
+    }
+    while (*p != '"') {
+        if ((uint8_t)*p < 0x20) {
+            return NULL;
+        }
+        if (*p++ == '\\') {
+            if (*p == 'u') {
+                p += 4;
+            } else if (strchr("\"\\/bfnrt", *p) == NULL) {
+                return NULL;
+            }
+            p++;
+        }
+    }
+    return p + 1;
+}
+
+static const char *json_object(const char *p) {
+    if (*p++ != '{') {
+        return NULL;
+    }
+    if (*p == '}') {
+        return p + 1;
+    }
+    for (;;) {
+        if ((p = json_string(p)) == NULL || *p++ != ':' || (p = json_value(p)) == NULL) {
+            return NULL;
+        }
+        if (*p == '}') {
+            return p + 1;
+        }
+        if (*p++ != ',') {
+            return NULL;
+        }
+    }
+}
+
+static const char *json_value(const char *p) {
+    if (*p == '{') {
+        return json_object(p);
+    }
+    if (*p == '"') {
+        return json_string(p);
+    }
+    if (strncmp(p, "true", 4) == 0) {
+        return p + 4;
+    }
+    if (strncmp(p, "false", 5) == 0) {
+        return p + 5;
+    }
+    if (*p == '-') {
+        p++;
+    }
+    if (*p < '0' || *p > '9') {
+        return NULL;
+    }
+    while ((*p >= '0' && *p <= '9') || *p == '.') {
+        p++;
+    }
+    return p;
+}
+
+static int check_config(const publish_t *p, const char *component, const char *object) {
+    char topic[DISCOVERY_TOPIC_LEN + 1], uniqueId[64];
+    const char *end = json_object(p->payload);
+    const char *want[] = { uniqueId, "\"stat_t\":\"herps/00c0ffee/state\"", "\"avty_t\":\"herps/00c0ffee/status\"",
+                           "\"pl_avail\":\"online\"", "\"pl_not_avail\":\"offline\"",
+                           "\"dev\":{\"ids\":\"herps_00c0ffee\"", "\"val_tpl\":\"{{", "\"sw\":" };
+    uint32_t i;
+    int wrong = 0;
+    snprintf(topic, sizeof(topic), "homeassistant/%s/herps_00c0ffee/%s/config", component, object);
+    snprintf(uniqueId, sizeof(uniqueId), "\"uniq_id\":\"herps_00c0ffee_%s\"", object);
+    if (strcmp(p->topic, topic) != 0) {
+        printf("%s: published on %s\n", topic, p->topic);
+        wrong++;
+    }
+    if (!p->retained) {
+        printf("%s: not retained\n", topic);
+        wrong++;
+    }
+    if (end == NULL || *end != '\0') {
+        printf("%s: not one JSON object: %s\n", topic, p->payload);
+        wrong++;
+    }
+    for (i = 0; i < sizeof(want) / sizeof(want[0]); i++) {
+        if (strstr(p->payload, want[i]) == NULL) {
+            printf("%s: no %s in %s\n", topic, want[i], p->payload);
+            wrong++;
+        }
+    }
+    return wrong;
+}
+
+// what a connect publishes, by count, with the saves to flash it made
+static int expect_connect(const char *what, uint32_t sent, uint32_t saves) {
+    uint32_t savesBefore = discovery_stats()->saves;
+    clear_sent();
+    discovery_connected();
+    if (publishes != sent || others != 0 || discovery_stats()->saves - savesBefore != saves) {
+        printf("%s: %u configs sent and %u saves, want %u and %u\n", what, publishes,
+               discovery_stats()->saves - savesBefore, sent, saves);
+        return 1;
+    }
+    return 0;
+}
+
+static double elapsed_ns(const struct timespec *start) {
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return (end.tv_sec - start->tv_sec) * 1e9 + (end.tv_nsec - start->tv_nsec);
+}
+
+int main(int argc, char **argv) {
+    static mqtt_session_t session;
+    static char topic[] = "homeassistant/status", online[] = "online", offline[] = "offline", other[] = "herps/x";
+    discovery_config_t config = { "homeassistant", 1, "herps/00c0ffee/state", "herps/00c0ffee/status",
+                                  "online", "offline", 1 };
+    struct timespec start;
+    uint32_t n = 1000, i, configBytes, failures;
+    int opt, wrong = 0;
+    while ((opt = getopt(argc, argv, "n:v")) != -1) {
+        switch (opt) {
+        case 'n':
+            n = atoi(optarg);
+            break;
+        case 'v':
+            verbose = 1;
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-n count] [-v]\n", argv[0]);
+            return 2;
+        }
+    }
+    host_verbose = 0;
+    twheel_init();
+    session.activeConnection = &session.conn;
+    session.validConnection = 1;
+    session.keepalive = 50;
+    os_memcpy(session.ip, ((uint8_t[4]){ 10, 0, 81, 1 }), 4);
+
+    // the first connect, on erased flash
+    discovery_init(&session, &config);
+    clear_sent();
+    discovery_subscribe();
+    if (subscribes != 1) {
+        printf("subscribe: %u SUBSCRIBEs, want 1\n", subscribes);
+        wrong++;
+    }
+    wrong += expect_connect("first connect", 3, 1);
+    if (publishes == 3) {
+        wrong += check_config(&published[0], "sensor", "temp");
+        wrong += check_config(&published[1], "binary_sensor", "led");
+        wrong += check_config(&published[2], "sensor", "rssi");
+    }
+    configBytes = sentBytes;
+    wrong += expect_connect("reconnect", 0, 0);
+    if (discovery_stats()->skipped != 3) {
+        printf("reconnect: %u configs skipped, want 3\n", discovery_stats()->skipped);
+        wrong++;
+    }
+    // a restart, with the cache only in flash
+    discovery_init(&session, &config);
+    wrong += expect_connect("restart", 0, 0);
+
+    config.version = 2;
+    discovery_init(&session, &config);
+    wrong += expect_connect("version raised", 3, 1);
+    wrong += expect_connect("version raised, reconnect", 0, 0);
+
+    clear_sent();
+    if (discovery_message((uint8_t *)topic, strlen(topic), (uint8_t *)online, strlen(online)) != 1 || publishes != 3) {
+        printf("online: %u configs sent, want 3\n", publishes);
+        wrong++;
+    }
+    clear_sent();
+    if (discovery_message((uint8_t *)topic, strlen(topic), (uint8_t *)offline, strlen(offline)) != 1 ||
+        discovery_message((uint8_t *)other, strlen(other), (uint8_t *)online, strlen(online)) != 0 || publishes != 0) {
+        printf("offline: %u configs sent, want none\n", publishes);
+        wrong++;
+    }
+    wrong += expect_connect("online, reconnect", 0, 0);
+
+    // without a thermistor, after the temperature's config was sent
+    config.thermistor = 0;
+    config.version = 3;
+    discovery_init(&session, &config);
+    wrong += expect_connect("no thermistor", 2, 1);
+    if (publishes == 2) {
+        wrong += check_config(&published[0], "binary_sensor", "led");
+        wrong += check_config(&published[1], "sensor", "rssi");
+    }
+    config.thermistor = 1;
+    config.version = 1;
+    discovery_init(&session, &config);
+    wrong += expect_connect("thermistor back", 3, 1);
+
+    // failing over, and back to the broker that has them
+    session.ip[3] = 2;
+    wrong += expect_connect("other broker", 3, 1);
+    wrong += expect_connect("other broker, reconnect", 0, 0);
+    session.ip[3] = 1;
+    wrong += expect_connect("first broker again", 0, 0);
+    // with as many other brokers as there is room for sent them since, it is forgotten
+    for (i = 0; i < DISCOVERY_MAX_BROKERS; i++) {
+        session.ip[3] = 10 + i;
+        wrong += expect_connect("more brokers", 3, 1);
+    }
+    discovery_init(&session, &config);
+    wrong += expect_connect("last broker, restart", 0, 0);
+    session.ip[3] = 1;
+    wrong += expect_connect("first broker, forgotten", 3, 1);
+
+    // the SDK would not take them
+    session.ip[3] = 3;
+    refuse = 1;
+    failures = discovery_stats()->failures;
+    wrong += expect_connect("send refused", 3, 0);
+    if (discovery_stats()->failures - failures != 3) {
+        printf("send refused: %u failures, want 3\n", discovery_stats()->failures - failures);
+        wrong++;
+    }
+    refuse = 0;
+    wrong += expect_connect("send refused, reconnect", 3, 1);
+    session.ip[3] = 1;
+    wrong += expect_connect("first broker, after", 0, 0);
+
+    // the session went while connecting
+    session.validConnection = 0;
+    failures = discovery_stats()->failures;
+    wrong += expect_connect("no session", 0, 0);
+    if (discovery_stats()->failures == failures) {
+        printf("no session: not counted as a failure\n");
+        wrong++;
+    }
+    session.validConnection = 1;
+    wrong += expect_connect("session back", 0, 0);
+
+    config.prefix = "";
+    discovery_init(&session, &config);
+    clear_sent();
+    discovery_subscribe();
+    wrong += expect_connect("no prefix", 0, 0);
+    if (subscribes != 0 ||
+        discovery_message((uint8_t *)topic, strlen(topic), (uint8_t *)online, strlen(online)) != 0) {
+        printf("no prefix: subscribed, or took Home Assistant's status\n");
+        wrong++;
+    }
+    config.prefix = "a-prefix-that-is-longer-than-it-may-be";
+    discovery_init(&session, &config);
+    wrong += expect_connect("long prefix", 0, 0);
+
+    config.prefix = "homeassistant";
+    discovery_init(&session, &config);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < n; i++) {
+        discovery_connected();
+    }
+    printf("%u reconnects: %u bytes of configs each left unsent, %llu in all, %.0f ns a connect to build and check them\n",
+           n, configBytes, (unsigned long long)configBytes * n, elapsed_ns(&start) / (n ? n : 1));
+    if (discovery_stats()->sent != 0 || discovery_stats()->skipped != 3 * n) {
+        printf("reconnects: %u configs sent, want none\n", discovery_stats()->sent);
+        wrong++;
+    }
+    twheel_disarm(&session.keepAliveTimer);
+    if (wrong > 0) {
+        printf("FAIL: %d checks failed\n", wrong);
+        return 1;
+    }
+    printf("PASS\n");
+    return 0;
+}
@@ -0,0 +1,125 @@
+// Keeps one MQTT session up through brokers.c, the way main.c does, and
+// prints each connect, failover and failback. Run two brokers on
+// different loopback addresses, stop the first partway through and start
+// it again to watch the session move away and, after BROKERS_SWITCH_PROBES
+// probes, back. The host build probes every 5 s.
+//
+// usage: failover [options] -b ip [-b ip ...]
+//   -b ip        a broker, in order of preference (up to BROKERS_MAX)
+//   -p port      broker port (1883)
+//   -k seconds   keepalive (10)
+//   -d seconds   how long to run (60)
+//   -v           print the firmware's debug output
+
+#include <getopt.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+#include "osapi.h"
+#include "mqtt.h"
+#include "brokers.h"
+#include "twheel.h"
+#include "host.h"
+
+#define RECONNECT_MS 1000
+
+static uint8_t ips[BROKERS_MAX][4];
+static uint8_t count;
+static mqtt_session_t session;
+static twheel_timer_t reconnectTimer;
+static uint8_t upIp[4]; // brokers.c repoints session.ip before closing it to move
+static uint64_t lostUs; // when the session was last lost, 0 while up
+static volatile int stop;
+
+static double now_s(void) {
+    return host_time_us() / 1e6;
+}
+
+static void on_connected(void *arg) {
+    brokers_connecting();
+    mqttSend(&session, NULL, 0, MQTT_MSG_TYPE_CONNECT);
+}
+
+static void on_connack(void *arg) {
+    char report[160];
+    brokers_connack();
+    if (session.connackCode != 0) {
+        return;
+    }
+    brokers_report(report, sizeof(report));
+    printf("%8.3f up on %d.%d.%d.%d", now_s(), IP2STR(session.ip));
+    if (lostUs != 0) {
+        printf(" after %.3f s down", (host_time_us() - lostUs) / 1e6);
+    }
+    printf("  %s\n", report);
+    fflush(stdout);
+    lostUs = 0;
+    memcpy(upIp, session.ip, 4);
+}
+
+static void on_lost(void *arg) {
+    if (lostUs == 0) {
+        lostUs = host_time_us();
+    }
+    printf("%8.3f lost %d.%d.%d.%d\n", now_s(), IP2STR(upIp));
+    fflush(stdout);
+    brokers_lost();
+    twheel_arm(&reconnectTimer, RECONNECT_MS, 0);
+}
+
+static void on_signal(int sig) {
+    stop = 1;
+}
+
+static void usage(void) {
+    fprintf(stderr, "usage: failover [-p port] [-k keepalive_s] [-d seconds] [-v] -b ip [-b ip ...]\n");
+    exit(2);
+}
+
+int main(int argc, char **argv) {
+    struct in_addr addr;
+    uint32_t seconds = 60;
+    char report[160];
+    int c;
+
+    host_verbose = 0;
+    session.port = 1883;
+    session.keepalive = 10;
+    while ((c = getopt(argc, argv, "b:p:k:d:v")) != -1) {
+        switch (c) {
+            case 'b':
+                if (count == BROKERS_MAX || inet_pton(AF_INET, optarg, &addr) != 1) {
+                    usage();
+                }
+                memcpy(ips[count++], &addr.s_addr, 4);
+                break;
+            case 'p': session.port = atoi(optarg); break;
+            case 'k': session.keepalive = atoi(optarg); break;
+            case 'd': seconds = atoi(optarg); break;
+            case 'v': host_verbose = 1; break;
+            default: usage();
+        }
+    }
+    if (count == 0 || session.keepalive == 0) {
+        usage();
+    }
+    signal(SIGINT, on_signal);
+
+    twheel_init();
+    session.client_id = (uint8_t *)"failover";
+    session.client_id_len = strlen((char *)session.client_id);
+    session.connected_cb = on_connected;
+    session.connack_cb = on_connack;
+    session.disconnect_cb = on_lost;
+    brokers_init(&session, (const uint8_t (*)[4])ips, count);
+    twheel_setfn(&reconnectTimer, (twheel_fn)tcpConnect, &session);
+    tcpConnect(&session);
+
+    host_loop_run(host_time_us() + (uint64_t)seconds * 1000000, &stop);
+    brokers_report(report, sizeof(report));
+    printf("%8.3f %s\n", now_s(), report);
+    return 0;
+}
@@ -0,0 +1,80 @@
+/**
+ * @file
+ * @brief Host-only additions to the SDK stand-in.
+ *
+ * The firmware sources never include this; it is for the tools in this
+ * directory that drive them. There is one thread: timers, socket callbacks
+ * and deferred SDK callbacks all run from host_loop_once(), the way the SDK
+ * runs everything from its own task loop.
+ */
+#ifndef HOST_H
+#define HOST_H
+
+#include <stdint.h>
+
+#define HOST_HEAP_SIZE 81920 /**< Heap we pretend to have, for system_get_free_heap_size() */
+#define HOST_RECV_LEN 1460 /**< Most bytes handed to one recv callback, one TCP segment like lwIP */
+#define HOST_RTC_CALI (5 << 12) /**< system_rtc_clock_cali_proc(): the RTC ticks every 5 us */
+#define HOST_FLASH_SIZE 0x100000 /**< Flash behind spi_flash_read() and friends, 1 MB like SPI_FLASH_SIZE_MAP 2 */
+
+/**
+ * @struct host_net_stats_t
+ * Traffic through the espconn stand-in, counted as the firmware sees it:
+ * one packet per espconn_send() or receive callback.
+ */
+typedef struct {
+    uint32_t connects; /**< espconn_connect() calls, TCP only */
+    uint32_t txPackets;
+    uint32_t txBytes;
+    uint32_t rxPackets;
+    uint32_t rxBytes;
+} host_net_stats_t;
+
+extern int host_verbose; /**< os_printf() only prints when set, 1 by default */
+extern uint32_t host_chip_id; /**< Returned by system_get_chip_id() */
+extern uint32_t host_time_base; /**< Added to system_get_time(), to reach its 32-bit wrap sooner */
+extern uint32_t host_rst_reason; /**< Reset reason reported by system_get_rst_info() */
+extern const char *host_rtc_file; /**< File holding RTC memory between runs, or NULL to keep it in memory */
+extern uint8_t host_virtual_time; /**< Set before anything runs for a simulated clock, see host_loop_once() */
+extern uint8_t host_wifi_status; /**< Returned by wifi_station_get_connect_status(), STATION_GOT_IP by default */
+extern uint16_t (*host_adc)(void); /**< Gives system_adc_read() its conversions, which read 0 while NULL */
+extern host_net_stats_t host_tcp_stats; /**< TCP traffic */
+extern host_net_stats_t host_udp_stats; /**< UDP traffic */
+extern void (*host_hw_timer_fn)(void); /**< The FRC1 interrupt handler, which only runs when a tool calls it */
+extern uint32_t host_hw_timer_us; /**< The FRC1 period it was armed with */
+
+/**
+ * @return microseconds since the program started, or of simulated time
+ * with host_virtual_time set
+ */
+uint64_t host_time_us(void);
+
+/**
+ * Runs due timers, then waits for socket events for at most max_wait_ms or
+ * until the next timer is due, and dispatches them. With host_virtual_time
+ * set it does not wait: the clock jumps straight to the next timer, or by
+ * max_wait_ms, so a tool can run days of timers in seconds as long as its
+ * network is simulated too.
+ * @param max_wait_ms longest time to block, 0 to only poll
+ */
+void host_loop_once(int max_wait_ms);
+
+/**
+ * Calls host_loop_once() until host_time_us() reaches deadline_us or
+ * *stop becomes non-zero.
+ * @param deadline_us when to return, in host_time_us() terms
+ * @param stop optional flag checked between iterations, may be NULL
+ */
+void host_loop_run(uint64_t deadline_us, volatile int *stop);
+
+/**
+ * @return bytes currently allocated through os_zalloc() and os_malloc()
+ */
+uint32_t host_heap_used(void);
+
+/**
+ * @return the most bytes that were allocated at once
+ */
+uint32_t host_heap_peak(void);
+
+#endif
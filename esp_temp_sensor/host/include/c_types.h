@@ -0,0 +1,40 @@
+/**
+ * @file
+ * @brief Host stand-in for the SDK's c_types.h.
+ *
+ * The headers in this directory replace the ESP8266 NonOS SDK headers so the
+ * firmware sources build unchanged for Linux. Only what the firmware uses is
+ * provided; sdk_host.c implements it.
+ */
+#ifndef _C_TYPES_H_
+#define _C_TYPES_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+typedef uint8_t uint8;
+typedef uint16_t uint16;
+typedef uint32_t uint32;
+typedef uint64_t uint64;
+typedef int8_t sint8;
+typedef int16_t sint16;
+typedef int32_t sint32;
+typedef int64_t sint64;
+typedef uint8_t u8;
+typedef uint16_t u16;
+typedef uint32_t u32;
+typedef int8_t s8;
+typedef int16_t s16;
+typedef int32_t s32;
+
+#define BOOL bool
+#define TRUE true
+#define FALSE false
+#define LOCAL static
+
+#define ICACHE_FLASH_ATTR
+#define ICACHE_RODATA_ATTR
+#define STORE_ATTR __attribute__((aligned(4)))
+
+#endif
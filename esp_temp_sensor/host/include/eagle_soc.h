@@ -0,0 +1,34 @@
+#ifndef _EAGLE_SOC_H_
+#define _EAGLE_SOC_H_
+
+#include "c_types.h"
+
+// GPIO registers are plain memory on the host
+extern volatile uint32 host_gpio_regs[8];
+
+#define GPIO_OUT_ADDRESS 0x00
+#define GPIO_OUT_W1TS_ADDRESS 0x04
+#define GPIO_OUT_W1TC_ADDRESS 0x08
+#define GPIO_ENABLE_ADDRESS 0x0C
+#define GPIO_REG_READ(reg) (host_gpio_regs[(reg) / 4])
+#define GPIO_REG_WRITE(reg, val) host_gpio_write((reg), (val))
+void host_gpio_write(uint32 reg, uint32 val);
+
+#define PERIPHS_IO_MUX_GPIO0_U 0
+#define PERIPHS_IO_MUX_GPIO2_U 1
+#define PERIPHS_IO_MUX_MTDI_U 2
+#define PERIPHS_IO_MUX_MTCK_U 3
+#define PERIPHS_IO_MUX_MTMS_U 4
+#define PERIPHS_IO_MUX_MTDO_U 5
+#define FUNC_GPIO0 0
+#define FUNC_GPIO2 0
+#define FUNC_GPIO12 3
+#define FUNC_GPIO13 3
+#define FUNC_GPIO14 3
+#define FUNC_GPIO15 3
+#define PIN_FUNC_SELECT(reg, func) ((void)(reg), (void)(func))
+
+#define BIT(n) (1UL << (n))
+#define UART_CLK_FREQ 80000000
+
+#endif
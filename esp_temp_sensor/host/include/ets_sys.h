@@ -0,0 +1,12 @@
+#ifndef _ETS_SYS_H
+#define _ETS_SYS_H
+
+#include "c_types.h"
+#include "os_type.h"
+#include "eagle_soc.h"
+
+// there are no interrupts on the host, everything runs from the event loop
+#define ETS_INTR_LOCK()
+#define ETS_INTR_UNLOCK()
+
+#endif
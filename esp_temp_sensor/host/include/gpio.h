@@ -0,0 +1,9 @@
+#ifndef _GPIO_H_
+#define _GPIO_H_
+
+#include "c_types.h"
+
+void gpio_output_set(uint32 set_mask, uint32 clear_mask, uint32 enable_mask, uint32 disable_mask);
+void gpio_init(void);
+
+#endif
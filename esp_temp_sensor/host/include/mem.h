@@ -0,0 +1,10 @@
+#ifndef __MEM_H__
+#define __MEM_H__
+
+#include "c_types.h"
+
+void *os_zalloc(size_t size);
+void *os_malloc(size_t size);
+void os_free(void *ptr);
+
+#endif
@@ -0,0 +1,26 @@
+#ifndef _OS_TYPE_H_
+#define _OS_TYPE_H_
+
+#include "c_types.h"
+
+typedef void os_timer_func_t(void *timer_arg);
+
+typedef struct _os_timer_t {
+    struct _os_timer_t *timer_next;
+    uint32 timer_expire;
+    uint32 timer_period;
+    os_timer_func_t *timer_func;
+    void *timer_arg;
+    // host only: deadline in host microseconds and slot in the timer heap
+    uint64 host_deadline;
+    int host_slot;
+} os_timer_t;
+
+typedef struct {
+    uint32 sig;
+    uint32 par;
+} os_event_t;
+
+typedef void (*os_task_t)(os_event_t *e);
+
+#endif
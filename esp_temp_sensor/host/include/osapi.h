@@ -0,0 +1,31 @@
+#ifndef _OSAPI_H_
+#define _OSAPI_H_
+
+#include <string.h>
+#include <stdio.h>
+#include "os_type.h"
+#include "user_interface.h"
+
+#define os_memcpy memcpy
+#define os_memmove memmove
+#define os_memset memset
+#define os_memcmp memcmp
+#define os_strlen strlen
+#define os_strcmp strcmp
+#define os_strncmp strncmp
+#define os_strcpy strcpy
+#define os_strncpy strncpy
+#define os_strstr strstr
+#define os_sprintf sprintf
+#define os_snprintf snprintf
+
+int os_printf(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+unsigned long os_random(void);
+void os_delay_us(uint32 us);
+
+void os_timer_arm(os_timer_t *ptimer, uint32 msec, bool repeat_flag);
+void os_timer_arm_us(os_timer_t *ptimer, uint32 usec, bool repeat_flag);
+void os_timer_disarm(os_timer_t *ptimer);
+void os_timer_setfn(os_timer_t *ptimer, os_timer_func_t *pfunction, void *parg);
+
+#endif
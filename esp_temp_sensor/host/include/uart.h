@@ -0,0 +1,8 @@
+#ifndef UART_APP_H
+#define UART_APP_H
+
+#include "c_types.h"
+
+void uart_div_modify(uint8 uart_no, uint32 DivLatchValue);
+
+#endif
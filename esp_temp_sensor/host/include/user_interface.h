@@ -0,0 +1,141 @@
+#ifndef __USER_INTERFACE_H__
+#define __USER_INTERFACE_H__
+
+#include "os_type.h"
+#include "ets_sys.h"
+
+struct ip_addr {
+    uint32 addr;
+};
+typedef struct ip_addr ip_addr_t;
+
+struct ip_info {
+    struct ip_addr ip;
+    struct ip_addr netmask;
+    struct ip_addr gw;
+};
+
+#define IP2STR(ipaddr) ((uint8 *)(ipaddr))[0], ((uint8 *)(ipaddr))[1], ((uint8 *)(ipaddr))[2], ((uint8 *)(ipaddr))[3]
+
+#define STATION_IF 0x00
+#define NULL_MODE 0x00
+#define STATION_MODE 0x01
+
+enum {
+    STATION_IDLE = 0,
+    STATION_CONNECTING,
+    STATION_WRONG_PASSWORD,
+    STATION_NO_AP_FOUND,
+    STATION_CONNECT_FAIL,
+    STATION_GOT_IP,
+};
+
+struct station_config {
+    uint8 ssid[32];
+    uint8 password[64];
+    uint8 bssid_set;
+    uint8 bssid[6];
+};
+
+bool wifi_get_ip_info(uint8 if_index, struct ip_info *info);
+uint8 wifi_station_get_connect_status(void);
+bool wifi_set_opmode(uint8 opmode);
+bool wifi_set_opmode_current(uint8 opmode);
+bool wifi_station_set_config_current(struct station_config *config);
+void wifi_status_led_install(uint8 gpio_id, uint32 gpio_name, uint8 gpio_func);
+sint8 wifi_station_get_rssi(void);
+
+enum sleep_type {
+    NONE_SLEEP_T = 0,
+    LIGHT_SLEEP_T,
+    MODEM_SLEEP_T,
+};
+
+bool wifi_set_sleep_type(enum sleep_type type);
+enum sleep_type wifi_get_sleep_type(void);
+
+void system_set_os_print(uint8 onoff);
+uint32 system_get_time(void);
+uint32 system_get_free_heap_size(void);
+uint32 system_get_chip_id(void);
+uint8 system_get_cpu_freq(void);
+
+#define SYS_CPU_80MHZ 80
+#define SYS_CPU_160MHZ 160
+
+bool system_update_cpu_freq(uint8 freq);
+void system_soft_wdt_feed(void);
+uint16 system_adc_read(void);
+void system_restart(void);
+
+enum rst_reason {
+    REASON_DEFAULT_RST = 0,
+    REASON_WDT_RST,
+    REASON_EXCEPTION_RST,
+    REASON_SOFT_WDT_RST,
+    REASON_SOFT_RESTART,
+    REASON_DEEP_SLEEP_AWAKE,
+    REASON_EXT_SYS_RST,
+};
+
+struct rst_info {
+    uint32 reason;
+    uint32 exccause;
+    uint32 epc1;
+    uint32 epc2;
+    uint32 epc3;
+    uint32 excvaddr;
+    uint32 depc;
+};
+
+struct rst_info *system_get_rst_info(void);
+uint32 system_get_rtc_time(void);
+uint32 system_rtc_clock_cali_proc(void);
+bool system_rtc_mem_read(uint8 src_addr, void *des_addr, uint16 load_size);
+bool system_rtc_mem_write(uint8 des_addr, const void *src_addr, uint16 save_size);
+
+#define UPGRADE_FW_BIN1 0x00
+#define UPGRADE_FW_BIN2 0x01
+#define UPGRADE_FLAG_IDLE 0x00
+#define UPGRADE_FLAG_START 0x01
+#define UPGRADE_FLAG_FINISH 0x02
+
+uint8 system_upgrade_userbin_check(void);
+void system_upgrade_reboot(void);
+uint8 system_upgrade_flag_check(void);
+void system_upgrade_flag_set(uint8 flag);
+
+#define SPI_FLASH_SEC_SIZE 4096
+
+typedef enum {
+    SPI_FLASH_RESULT_OK,
+    SPI_FLASH_RESULT_ERR,
+    SPI_FLASH_RESULT_TIMEOUT,
+} SpiFlashOpResult;
+
+SpiFlashOpResult spi_flash_erase_sector(uint16 sec);
+SpiFlashOpResult spi_flash_write(uint32 des_addr, uint32 *src_addr, uint32 size);
+SpiFlashOpResult spi_flash_read(uint32 src_addr, uint32 *des_addr, uint32 size);
+bool system_param_save_with_protect(uint16 start_sec, void *param, uint16 len);
+bool system_param_load(uint16 start_sec, uint16 offset, void *param, uint16 len);
+
+typedef enum {
+    SYSTEM_PARTITION_INVALID = 0,
+    SYSTEM_PARTITION_BOOTLOADER,
+    SYSTEM_PARTITION_OTA_1,
+    SYSTEM_PARTITION_OTA_2,
+    SYSTEM_PARTITION_RF_CAL,
+    SYSTEM_PARTITION_PHY_DATA,
+    SYSTEM_PARTITION_SYSTEM_PARAMETER,
+    SYSTEM_PARTITION_CUSTOMER_BEGIN = 100,
+} partition_type_t;
+
+typedef struct {
+    partition_type_t type;
+    uint32_t addr;
+    uint32_t size;
+} partition_item_t;
+
+bool system_partition_table_regist(const partition_item_t *partition_table, uint32 partition_num, uint32 map);
+
+#endif
@@ -0,0 +1,282 @@
+// Checks jsonw.c and compares it with printf for the state payload main.c
+// publishes. The SDK's json library is not built for the host, so printf,
+// which the firmware formats everything else with, is the comparison here;
+// bench.c times both on the device.
+//
+//   - every field type writes what snprintf() and a reference escaper do,
+//     over random values from the whole range
+//   - nested objects close in order, and jsonw_finish() closes the rest
+//   - with every buffer too small for a payload, jsonw_finish() returns 0
+//     and nothing is written past the end
+//
+// then writes the state payload over and over both ways, and prints bytes a
+// second and the most stack each took, measured on a painted stack of its
+// own. Neither touches the heap.
+//
+// usage: jsonbench [options]
+//   -n count     random values per field type (200000)
+//   -s seed      for the values (1)
+//
+// Exits 1 if a check fails.
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <ucontext.h>
+
+#include "osapi.h"
+#include "jsonw.h"
+#include "host.h"
+
+#define STATE_LEN 128 // STATE_JSON_LEN in main.c
+#define PROBE_STACK_LEN 65536
+#define PAINT 0x5A
+#define GUARD_LEN 16
+
+static volatile uint32_t sink;
+static char state[STATE_LEN];
+static uint32_t stateLen; // of the last payload written there
+
+static uint32_t random32(void) {
+    return ((uint32_t)rand() << 16) ^ (uint32_t)rand();
+}
+
+// a value from every order of magnitude, not just the large ones
+static uint32_t random_magnitude(void) {
+    return random32() >> (rand() % 32);
+}
+
+static int expect(const char *what, const char *got, uint16_t len, const char *want) {
+    if (len != strlen(want) || memcmp(got, want, len) != 0) {
+        printf("%s: got %.*s, want %s\n", what, len, got, want);
+        return 1;
+    }
+    return 0;
+}
+
+static int check_numbers(uint32_t n) {
+    char buf[64], want[320]; // room for anything snprintf() could make of the arguments
+    uint32_t i, wrong = 0;
+    jsonw_t w;
+    for (i = 0; i < n; i++) {
+        int32_t v = (int32_t)random_magnitude() * ((rand() & 1) ? -1 : 1);
+        uint32_t u = random_magnitude();
+        uint8_t decimals = rand() % 5;
+        uint32_t abs = (v < 0) ? -(uint32_t)v : (uint32_t)v, scale = 1, d;
+        for (d = 0; d < decimals; d++) {
+            scale *= 10;
+        }
+        jsonw_init(&w, buf, sizeof(buf));
+        jsonw_int(&w, JSONW_RSSI, v);
+        snprintf(want, sizeof(want), "{\"rssi\":%d}", v);
+        wrong += expect("int", buf, jsonw_finish(&w), want);
+        jsonw_init(&w, buf, sizeof(buf));
+        jsonw_uint(&w, JSONW_HEAP, u);
+        snprintf(want, sizeof(want), "{\"heap\":%u}", u);
+        wrong += expect("uint", buf, jsonw_finish(&w), want);
+        jsonw_init(&w, buf, sizeof(buf));
+        jsonw_fixed(&w, JSONW_TEMP, v, decimals);
+        if (decimals == 0) {
+            snprintf(want, sizeof(want), "{\"temp\":%d}", v);
+        } else {
+            snprintf(want, sizeof(want), "{\"temp\":%s%u.%0*u}", (v < 0) ? "-" : "", abs / scale, decimals, abs % scale);
+        }
+        wrong += expect("fixed", buf, jsonw_finish(&w), want);
+        if (wrong > 5) {
+            break;
+        }
+    }
+    jsonw_init(&w, buf, sizeof(buf));
+    jsonw_int(&w, JSONW_RSSI, -2147483647 - 1);
+    jsonw_bool(&w, JSONW_LED, 0);
+    jsonw_bool(&w, JSONW_LED, 1);
+    wrong += expect("limits", buf, jsonw_finish(&w), "{\"rssi\":-2147483648,\"led\":false,\"led\":true}");
+    return wrong;
+}
+
+static int check_strings(uint32_t n) {
+    char s[32], buf[256], want[256];
+    uint32_t i, j, len, wrong = 0;
+    jsonw_t w;
+    for (i = 0; i < n && wrong <= 5; i++) {
+        char *p = want + sprintf(want, "{\"seq\":1,\"ts\":\"");
+        len = rand() % sizeof(s);
+        for (j = 0; j < len; j++) {
+            // mostly printable, with quotes, backslashes and control characters among them
+            uint8_t c = (rand() % 4 == 0) ? "\"\\\n\t\x01\x1f"[rand() % 6] : 0x20 + rand() % 0x5F;
+            s[j] = c;
+            if (c == '"' || c == '\\') {
+                p += sprintf(p, "\\%c", c);
+            } else if (c < 0x20) {
+                p += sprintf(p, "\\u%04x", c);
+            } else {
+                *p++ = c;
+            }
+        }
+        strcpy(p, "\"}");
+        jsonw_init(&w, buf, sizeof(buf));
+        jsonw_uint(&w, JSONW_SEQ, 1);
+        jsonw_str(&w, JSONW_TS, s, len);
+        wrong += expect("string", buf, jsonw_finish(&w), want);
+    }
+    return wrong;
+}
+
+static int check_nesting(void) {
+    char buf[128];
+    int wrong = 0;
+    jsonw_t w;
+    jsonw_init(&w, buf, sizeof(buf));
+    jsonw_object(&w, JSONW_TEMP);
+    jsonw_object(&w, JSONW_HUMIDITY);
+    jsonw_close(&w);
+    jsonw_uint(&w, JSONW_SEQ, 7);
+    jsonw_close(&w);
+    jsonw_object(&w, JSONW_RSSI);
+    jsonw_int(&w, JSONW_HEAP, -1);
+    jsonw_object(&w, JSONW_LED);
+    jsonw_bool(&w, JSONW_LED, 1);
+    wrong += expect("nesting", buf, jsonw_finish(&w),
+                    "{\"temp\":{\"humidity\":{},\"seq\":7},\"rssi\":{\"heap\":-1,\"led\":{\"led\":true}}}");
+    jsonw_init(&w, buf, sizeof(buf));
+    while (w.depth < JSONW_DEPTH) {
+        jsonw_object(&w, JSONW_SEQ);
+    }
+    jsonw_object(&w, JSONW_SEQ);
+    if (jsonw_finish(&w) != 0) {
+        printf("nesting: more than JSONW_DEPTH objects accepted\n");
+        wrong++;
+    }
+    return wrong;
+}
+
+static uint16_t write_state(char *buf, uint16_t cap) {
+    jsonw_t w;
+    jsonw_init(&w, buf, cap);
+    jsonw_fixed(&w, JSONW_TEMP, -505, 2);
+    jsonw_bool(&w, JSONW_LED, 1);
+    jsonw_int(&w, JSONW_RSSI, -67);
+    jsonw_uint(&w, JSONW_HEAP, 41234);
+    jsonw_uint(&w, JSONW_SEQ, 1234);
+    jsonw_str(&w, JSONW_HUMIDITY, "\"dry\"", 5);
+    jsonw_uint(&w, JSONW_UPTIME, 864000);
+    jsonw_uint(&w, JSONW_TS, 1700000000);
+    return jsonw_finish(&w);
+}
+
+static int check_overflow(void) {
+    char full[STATE_LEN], buf[STATE_LEN + GUARD_LEN];
+    uint16_t len = write_state(full, sizeof(full)), cap, i;
+    int wrong = 0;
+    if (len == 0) {
+        printf("overflow: the state payload does not fit in %d bytes\n", STATE_LEN);
+        return 1;
+    }
+    for (cap = 0; cap <= len; cap++) {
+        memset(buf, PAINT, sizeof(buf));
+        uint16_t got = write_state(buf, cap);
+        if (got != ((cap == len) ? len : 0)) {
+            printf("overflow: %u bytes of room gave %u\n", cap, got);
+            wrong++;
+        }
+        for (i = cap; i < sizeof(buf); i++) {
+            if ((uint8_t)buf[i] != PAINT) {
+                printf("overflow: %u bytes of room, written at %u\n", cap, i);
+                wrong++;
+                break;
+            }
+        }
+    }
+    return wrong;
+}
+
+static void state_jsonw(void) {
+    stateLen = write_state(state, sizeof(state));
+    sink += stateLen;
+}
+
+static void state_printf(void) {
+    stateLen = snprintf(state, sizeof(state),
+                        "{\"temp\":%s%d.%02d,\"led\":%s,\"rssi\":%d,\"heap\":%u,\"seq\":%u,\"humidity\":\"\\\"dry\\\"\","
+                        "\"uptime\":%u,\"ts\":%u}",
+                        "-", 5, 5, "true", -67, 41234, 1234, 864000, 1700000000);
+    sink += stateLen;
+}
+
+static ucontext_t probeCaller, probeContext;
+static uint8_t probeStack[PROBE_STACK_LEN];
+
+// the deepest either writer reaches, on a stack painted beforehand
+static uint32_t stack_used(void (*fn)(void)) {
+    uint32_t i;
+    memset(probeStack, PAINT, sizeof(probeStack));
+    getcontext(&probeContext);
+    probeContext.uc_stack.ss_sp = probeStack;
+    probeContext.uc_stack.ss_size = sizeof(probeStack);
+    probeContext.uc_link = &probeCaller;
+    makecontext(&probeContext, fn, 0);
+    swapcontext(&probeCaller, &probeContext);
+    for (i = 0; i < sizeof(probeStack) && probeStack[i] == PAINT; i++) {
+    }
+    return sizeof(probeStack) - i;
+}
+
+static double elapsed_ns(const struct timespec *start) {
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return (end.tv_sec - start->tv_sec) * 1e9 + (end.tv_nsec - start->tv_nsec);
+}
+
+static void time_writer(const char *name, void (*fn)(void)) {
+    struct timespec start;
+    uint32_t i, n = 2000000, bytes;
+    double ns;
+    fn();
+    bytes = stateLen;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < n; i++) {
+        fn();
+    }
+    ns = elapsed_ns(&start) / n;
+    printf("%-8s %3u bytes, %6.1f ns a payload, %6.1f MB/s, %5u bytes of stack\n", name, bytes, ns, bytes * 1e3 / ns,
+           stack_used(fn));
+}
+
+int main(int argc, char **argv) {
+    uint32_t n = 200000, seed = 1;
+    char want[STATE_LEN];
+    int opt, wrong;
+    while ((opt = getopt(argc, argv, "n:s:")) != -1) {
+        switch (opt) {
+        case 'n':
+            n = atoi(optarg);
+            break;
+        case 's':
+            seed = atoi(optarg);
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-n count] [-s seed]\n", argv[0]);
+            return 2;
+        }
+    }
+    srand(seed);
+    wrong = check_numbers(n);
+    wrong += check_strings(n / 10);
+    wrong += check_nesting();
+    wrong += check_overflow();
+    // and the two write the same payload
+    state_printf();
+    strcpy(want, state);
+    state_jsonw();
+    wrong += expect("state", state, stateLen, want);
+    time_writer("jsonw", state_jsonw);
+    time_writer("printf", state_printf);
+    if (wrong > 0) {
+        printf("FAIL: %d payloads wrong\n", wrong);
+        return 1;
+    }
+    printf("PASS\n");
+    return 0;
+}
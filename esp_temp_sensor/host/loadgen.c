@@ -0,0 +1,403 @@
+// Broker load generator. Runs N virtual sensors, each a real mqtt_session_t
+// driven through mqtt.c exactly as the firmware drives it, and reports how
+// the broker copes: connect latency percentiles, publish and delivery rates.
+//
+// usage: loadgen [options]
+//   -h host      broker IPv4 address (127.0.0.1)
+//   -p port      broker port (1883)
+//   -n count     number of sensors (100)
+//   -r rate      publishes per second per sensor (0.2)
+//   -s bytes     publish payload size (5, like "23.45"), up to MEMPOOL_SCRATCH_LEN - 64
+//   -k seconds   keepalive sent in CONNECT (50)
+//   -R rate      sensors started per second, 0 starts them all at once (0)
+//   -B ms        reconnect backoff, each sensor waits ms..2*ms (1000)
+//   -S seconds   drop every connection this often, like a power cut (off)
+//   -d seconds   run time (30)
+//   -P prefix    client id and topic prefix (loadgen)
+//   -u user      username
+//   -w password  password
+//   -L           like the firmware: retained will and birth on <prefix>/<n>/status,
+//                and SUBSCRIBE to <prefix>/<n>/cmd after CONNACK
+//   -c           persistent sessions: no clean session, and with -L no SUBSCRIBE
+//                when the broker still has the session
+//   -m           add a monitor session subscribed to <prefix>/# to count deliveries
+//   -v           print the firmware's debug output
+
+#include <getopt.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+
+#include "osapi.h"
+#include "mem.h"
+#include "mqtt.h"
+#include "mempool.h"
+#include "host.h"
+
+#define REPORT_MS 1000
+#define RAMP_TICK_MS 10
+
+typedef struct {
+    mqtt_session_t session; // first, so callbacks can cast the session back
+    uint32_t index;
+    char clientId[32];
+    char topic[48];
+    char statusTopic[48];
+    char cmdTopic[48];
+    os_timer_t pubTimer;
+    os_timer_t reconnectTimer;
+    uint64_t connectStart; // when tcpConnect() was called, for latency
+    uint8_t subscribing; // SUBSCRIBE sent, ready at SUBACK
+    uint8_t up; // CONNACK accepted
+} sensor_t;
+
+static struct {
+    uint8_t ip[4];
+    uint32_t port;
+    uint32_t count;
+    double rate;
+    uint32_t payloadLen;
+    uint16_t keepalive;
+    uint32_t ramp;
+    uint32_t backoffMs;
+    uint32_t stormS;
+    uint32_t durationS;
+    const char *prefix;
+    const char *user;
+    const char *password;
+    uint8_t monitor;
+    uint8_t lifecycle;
+    uint8_t persistent;
+} opt = {
+    { 127, 0, 0, 1 }, 1883, 100, 0.2, 5, 50, 0, 1000, 0, 30, "loadgen", "", "", 0, 0, 0
+};
+
+static struct {
+    uint64_t connects; // CONNECTs sent
+    uint64_t accepted;
+    uint64_t refused;
+    uint64_t subscribes; // SUBSCRIBEs sent after CONNACK
+    uint64_t resumed; // CONNACKs with the session present
+    uint64_t failures; // TCP connections lost or never made
+    uint64_t published;
+    uint64_t delivered; // PUBLISHes seen by the monitor
+    uint64_t bytes;
+} stats, lastStats;
+
+static sensor_t *sensors;
+static sensor_t monitor;
+static uint32_t started;
+static uint32_t upCount;
+static uint32_t *latencies; // connect to ready, microseconds
+static uint64_t latencyLen;
+static uint64_t latencyCap;
+static uint8_t *payload;
+static volatile int stop;
+static os_timer_t rampTimer;
+static os_timer_t reportTimer;
+static os_timer_t stormTimer;
+static uint64_t rampStart;
+
+static void record_latency(uint32_t us) {
+    if (latencyLen == latencyCap) {
+        latencyCap = latencyCap ? latencyCap * 2 : 1024;
+        latencies = realloc(latencies, latencyCap * sizeof(*latencies));
+    }
+    latencies[latencyLen++] = us;
+}
+
+static uint32_t pub_interval_ms(void) {
+    return (uint32_t)(1000.0 / opt.rate);
+}
+
+static void sensor_publish(void *arg) {
+    sensor_t *s = arg;
+    if (!s->session.validConnection) {
+        return;
+    }
+    if (mqttSendTopic(&s->session, (uint8_t *)s->topic, strlen(s->topic), payload, opt.payloadLen, MQTT_MSG_TYPE_PUBLISH) == 0) {
+        stats.published++;
+        stats.bytes += opt.payloadLen;
+    }
+}
+
+static void sensor_first_publish(void *arg) {
+    sensor_t *s = arg;
+    sensor_publish(s);
+    os_timer_setfn(&s->pubTimer, sensor_publish, s);
+    os_timer_arm(&s->pubTimer, pub_interval_ms(), 1);
+}
+
+static void sensor_connect(void *arg) {
+    sensor_t *s = arg;
+    s->connectStart = host_time_us();
+    tcpConnect(&s->session);
+}
+
+static void sensor_tcp_up(void *arg) {
+    sensor_t *s = arg;
+    stats.connects++;
+    mqttSend(&s->session, NULL, 0, MQTT_MSG_TYPE_CONNECT);
+}
+
+// connected, and subscribed if it had to
+static void sensor_ready(sensor_t *s) {
+    record_latency((uint32_t)(host_time_us() - s->connectStart));
+    s->up = 1;
+    upCount++;
+    if (opt.rate > 0) {
+        // random phase, otherwise a storm turns into synchronised bursts forever
+        os_timer_setfn(&s->pubTimer, sensor_first_publish, s);
+        os_timer_arm(&s->pubTimer, os_random() % pub_interval_ms() + 1, 0);
+    }
+}
+
+static void sensor_connack(void *arg) {
+    sensor_t *s = arg;
+    if (s->session.connackCode != 0) {
+        stats.refused++;
+        espconn_disconnect(s->session.activeConnection);
+        return;
+    }
+    stats.accepted++;
+    if (s == &monitor) {
+        char filter[64];
+        snprintf(filter, sizeof(filter), "%s/#", opt.prefix);
+        mqttSendTopic(&s->session, (uint8_t *)filter, strlen(filter), NULL, 0, MQTT_MSG_TYPE_SUBSCRIBE);
+        return;
+    }
+    if (s->session.sessionPresent) {
+        stats.resumed++;
+    }
+    if (opt.lifecycle) {
+        mqttPublish(&s->session, (uint8_t *)s->statusTopic, strlen(s->statusTopic), (uint8_t *)"online", 6, MQTT_PUBLISH_RETAIN);
+        if (!s->session.sessionPresent) {
+            stats.subscribes++;
+            s->subscribing = 1;
+            mqttSendTopic(&s->session, (uint8_t *)s->cmdTopic, strlen(s->cmdTopic), NULL, 0, MQTT_MSG_TYPE_SUBSCRIBE);
+            return;
+        }
+    }
+    sensor_ready(s);
+}
+
+static void sensor_suback(void *arg) {
+    sensor_t *s = arg;
+    if (s->subscribing) {
+        s->subscribing = 0;
+        sensor_ready(s);
+    }
+}
+
+static void sensor_lost(void *arg) {
+    sensor_t *s = arg;
+    if (s->up) {
+        s->up = 0;
+        upCount--;
+    }
+    s->subscribing = 0;
+    stats.failures++;
+    os_timer_disarm(&s->pubTimer);
+    os_timer_setfn(&s->reconnectTimer, sensor_connect, s);
+    os_timer_arm(&s->reconnectTimer, opt.backoffMs + (opt.backoffMs ? os_random() % opt.backoffMs : 0), 0);
+}
+
+static void monitor_message(void *session, uint8_t *topic, uint32_t topic_len, uint8_t *data, uint32_t data_len) {
+    stats.delivered++;
+}
+
+static void sensor_setup(sensor_t *s, uint32_t index) {
+    s->index = index;
+    if (s == &monitor) {
+        snprintf(s->clientId, sizeof(s->clientId), "%s-monitor", opt.prefix);
+        s->session.message_cb = monitor_message;
+    } else {
+        snprintf(s->clientId, sizeof(s->clientId), "%s-%06u", opt.prefix, index);
+        snprintf(s->topic, sizeof(s->topic), "%s/%06u/temp", opt.prefix, index);
+        snprintf(s->statusTopic, sizeof(s->statusTopic), "%s/%06u/status", opt.prefix, index);
+        snprintf(s->cmdTopic, sizeof(s->cmdTopic), "%s/%06u/cmd", opt.prefix, index);
+        s->session.persistent = opt.persistent;
+        if (opt.lifecycle) {
+            s->session.will_topic = (uint8_t *)s->statusTopic;
+            s->session.will_topic_len = strlen(s->statusTopic);
+            s->session.will_message = (uint8_t *)"offline";
+            s->session.will_message_len = 7;
+            s->session.will_retain = 1;
+        }
+    }
+    os_memcpy(s->session.ip, opt.ip, 4);
+    s->session.port = opt.port;
+    s->session.client_id = (uint8_t *)s->clientId;
+    s->session.client_id_len = strlen(s->clientId);
+    s->session.topic_name = (uint8_t *)s->topic;
+    s->session.topic_name_len = strlen(s->topic);
+    s->session.username = (uint8_t *)opt.user;
+    s->session.username_len = strlen(opt.user);
+    s->session.password = (uint8_t *)opt.password;
+    s->session.password_len = strlen(opt.password);
+    s->session.keepalive = opt.keepalive;
+    s->session.connected_cb = sensor_tcp_up;
+    s->session.connack_cb = sensor_connack;
+    s->session.disconnect_cb = sensor_lost;
+    s->session.suback_cb = sensor_suback;
+}
+
+static void ramp_tick(void *arg) {
+    uint64_t due = opt.ramp ? (host_time_us() - rampStart) * opt.ramp / 1000000 + 1 : opt.count;
+    while (started < due && started < opt.count) {
+        sensor_connect(&sensors[started++]);
+    }
+    if (started == opt.count) {
+        os_timer_disarm(&rampTimer);
+    }
+}
+
+static void storm(void *arg) {
+    printf("power cut: dropping %u connections\n", upCount);
+    for (uint32_t i = 0; i < started; i++) {
+        if (sensors[i].session.validConnection) {
+            espconn_disconnect(sensors[i].session.activeConnection);
+        }
+    }
+}
+
+static void report(void *arg) {
+    double secs = REPORT_MS / 1000.0;
+    printf("%6.1fs up %6u/%u  connects %6llu  lost %6llu  pub/s %9.1f  delivered/s %9.1f  heap %u\n",
+        host_time_us() / 1e6, upCount, opt.count,
+        (unsigned long long)stats.connects, (unsigned long long)stats.failures,
+        (stats.published - lastStats.published) / secs,
+        (stats.delivered - lastStats.delivered) / secs,
+        host_heap_used());
+    fflush(stdout);
+    lastStats = stats;
+}
+
+static int cmp_u32(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *)a;
+    uint32_t y = *(const uint32_t *)b;
+    return (x > y) - (x < y);
+}
+
+static double percentile_ms(double p) {
+    uint64_t i = (uint64_t)(p / 100.0 * (latencyLen - 1) + 0.5);
+    return latencies[i] / 1000.0;
+}
+
+static void summary(double elapsed) {
+    printf("\n%u sensors, %.1f s\n", opt.count, elapsed);
+    printf("connects   %llu sent, %llu accepted, %llu refused, %llu connections lost\n",
+        (unsigned long long)stats.connects, (unsigned long long)stats.accepted,
+        (unsigned long long)stats.refused, (unsigned long long)stats.failures);
+    if (opt.lifecycle || opt.persistent) {
+        printf("sessions   %llu resumed, %llu SUBSCRIBEs after CONNACK\n",
+            (unsigned long long)stats.resumed, (unsigned long long)stats.subscribes);
+    }
+    if (latencyLen > 0) {
+        qsort(latencies, latencyLen, sizeof(*latencies), cmp_u32);
+        printf("latency    p50 %.2f ms  p90 %.2f ms  p99 %.2f ms  max %.2f ms (TCP connect to CONNACK, or SUBACK if it subscribed)\n",
+            percentile_ms(50), percentile_ms(90), percentile_ms(99), latencies[latencyLen - 1] / 1000.0);
+    }
+    printf("publish    %llu messages, %.1f msg/s, %.1f KB/s payload\n",
+        (unsigned long long)stats.published, stats.published / elapsed, stats.bytes / elapsed / 1024);
+    if (opt.monitor) {
+        printf("delivered  %llu messages, %.1f msg/s, %.2f%% of published\n",
+            (unsigned long long)stats.delivered, stats.delivered / elapsed,
+            stats.published ? 100.0 * stats.delivered / stats.published : 0.0);
+    }
+}
+
+static void on_signal(int sig) {
+    stop = 1;
+}
+
+static void usage(void) {
+    fprintf(stderr, "usage: loadgen [-h host] [-p port] [-n count] [-r rate] [-s bytes] [-k keepalive]\n"
+        "               [-R ramp] [-B backoff_ms] [-S storm_s] [-d duration_s] [-P prefix]\n"
+        "               [-u user] [-w password] [-L] [-c] [-m] [-v]\n");
+    exit(2);
+}
+
+int main(int argc, char **argv) {
+    struct rlimit rl;
+    struct in_addr addr;
+    int c;
+
+    host_verbose = 0;
+    while ((c = getopt(argc, argv, "h:p:n:r:s:k:R:B:S:d:P:u:w:Lcmv")) != -1) {
+        switch (c) {
+            case 'h':
+                if (inet_pton(AF_INET, optarg, &addr) != 1) {
+                    usage();
+                }
+                memcpy(opt.ip, &addr.s_addr, 4);
+                break;
+            case 'p': opt.port = atoi(optarg); break;
+            case 'n': opt.count = atoi(optarg); break;
+            case 'r': opt.rate = atof(optarg); break;
+            case 's': opt.payloadLen = atoi(optarg); break;
+            case 'k': opt.keepalive = atoi(optarg); break;
+            case 'R': opt.ramp = atoi(optarg); break;
+            case 'B': opt.backoffMs = atoi(optarg); break;
+            case 'S': opt.stormS = atoi(optarg); break;
+            case 'd': opt.durationS = atoi(optarg); break;
+            case 'P': opt.prefix = optarg; break;
+            case 'u': opt.user = optarg; break;
+            case 'w': opt.password = optarg; break;
+            case 'L': opt.lifecycle = 1; break;
+            case 'c': opt.persistent = 1; break;
+            case 'm': opt.monitor = 1; break;
+            case 'v': host_verbose = 1; break;
+            default: usage();
+        }
+    }
+    // mqtt.c encodes the PUBLISH in scratch, with the topic and some overhead
+    if (opt.count == 0 || opt.payloadLen + 64 > MEMPOOL_SCRATCH_LEN || (opt.rate > 0 && opt.rate > 1000)) {
+        usage();
+    }
+
+    // one socket per sensor
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < opt.count + 64) {
+        rl.rlim_cur = (rl.rlim_max < opt.count + 64) ? rl.rlim_max : opt.count + 64;
+        setrlimit(RLIMIT_NOFILE, &rl);
+        if (rl.rlim_cur < opt.count + 64) {
+            fprintf(stderr, "warning: only %llu file descriptors available\n", (unsigned long long)rl.rlim_cur);
+        }
+    }
+    signal(SIGINT, on_signal);
+    signal(SIGPIPE, SIG_IGN);
+    srandom(getpid());
+    twheel_init();
+
+    payload = malloc(opt.payloadLen + 1);
+    for (uint32_t i = 0; i < opt.payloadLen; i++) {
+        payload[i] = "23.45"[i % 5];
+    }
+    sensors = calloc(opt.count, sizeof(*sensors));
+    for (uint32_t i = 0; i < opt.count; i++) {
+        sensor_setup(&sensors[i], i);
+    }
+    if (opt.monitor) {
+        sensor_setup(&monitor, 0);
+        sensor_connect(&monitor);
+    }
+
+    rampStart = host_time_us();
+    os_timer_setfn(&rampTimer, ramp_tick, NULL);
+    os_timer_arm(&rampTimer, RAMP_TICK_MS, 1);
+    os_timer_setfn(&reportTimer, report, NULL);
+    os_timer_arm(&reportTimer, REPORT_MS, 1);
+    if (opt.stormS > 0) {
+        os_timer_setfn(&stormTimer, storm, NULL);
+        os_timer_arm(&stormTimer, opt.stormS * 1000, 1);
+    }
+
+    uint64_t start = host_time_us();
+    host_loop_run(start + (uint64_t)opt.durationS * 1000000, &stop);
+    summary((host_time_us() - start) / 1e6);
+    return 0;
+}
@@ -0,0 +1,162 @@
+// Runs main.c's publish cycle for 30 days of readings, as fast as it goes,
+// and checks that memory stays flat: nothing on the heap once the first
+// cycle is over, no pool blocks left out, no scratch leaks and no guard
+// bytes overwritten. Each cycle formats a reading in scratch and publishes
+// it, pings, and every so often reconnects and probes another broker with a
+// session from a pool, then resets scratch the way blink_timerfunc does.
+// Linked with --wrap=espconn_send, so nothing goes on the network.
+//
+// usage: memsoak [options]
+//   -d days      how long to simulate (30)
+//   -i seconds   interval between readings (20)
+//   -r cycles    reconnect and probe every this many cycles (180)
+//   -x cycle     overrun a reading into its guard bytes on this cycle, to see it caught
+//   -v           print the firmware's debug output
+//
+// Prints one line per simulated day and exits 1 if memory did not stay flat.
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "osapi.h"
+#include "mqtt.h"
+#include "mempool.h"
+#include "twheel.h"
+#include "host.h"
+
+static uint64_t sentBytes;
+static uint32_t sentPackets;
+
+sint8 __wrap_espconn_send(struct espconn *espconn, uint8 *psent, uint16 length) {
+    sentBytes += length;
+    sentPackets++;
+    return ESPCONN_OK;
+}
+
+MEMPOOL(probePool, sizeof(mqtt_session_t), 1);
+
+static mqtt_session_t session;
+
+// what pubuint() and pubfloat() do, with the overrun if asked for
+static void publish_reading(uint32_t cycle, uint32_t overrunAt) {
+    char *dataStr = scratch_alloc(20);
+    if (dataStr == NULL) {
+        return;
+    }
+    os_sprintf(dataStr, "%d.%02d", 20 + cycle % 10, cycle % 100);
+    if (cycle == overrunAt) {
+        memset(dataStr, '9', 20 + MEMPOOL_GUARD_LEN / 2);
+    }
+    mqttSend(&session, (uint8_t *)dataStr, os_strlen(dataStr), MQTT_MSG_TYPE_PUBLISH);
+}
+
+// what brokers.c does for a probe, without the network
+static void probe(void) {
+    mqtt_session_t *p = mempool_alloc(&probePool);
+    if (p == NULL) {
+        return;
+    }
+    *p = session;
+    p->client_id = (uint8_t *)"herps-probe-00000000";
+    p->client_id_len = strlen((char *)p->client_id);
+    mqttSend(p, NULL, 0, MQTT_MSG_TYPE_CONNECT);
+    mqttSend(p, NULL, 0, MQTT_MSG_TYPE_DISCONNECT);
+    twheel_disarm(&p->keepAliveTimer);
+    mempool_free(&probePool, p);
+}
+
+static void usage(void) {
+    fprintf(stderr, "usage: memsoak [-d days] [-i interval_s] [-r cycles] [-x cycle] [-v]\n");
+    exit(2);
+}
+
+int main(int argc, char **argv) {
+    uint32_t days = 30, interval = 20, reconnectEvery = 180, overrunAt = 0;
+    uint32_t cycles, perDay, cycle, baseline = 0;
+    const scratch_stats_t *st;
+    char report[192];
+    int c, failed = 0;
+
+    host_verbose = 0;
+    while ((c = getopt(argc, argv, "d:i:r:x:v")) != -1) {
+        switch (c) {
+            case 'd': days = atoi(optarg); break;
+            case 'i': interval = atoi(optarg); break;
+            case 'r': reconnectEvery = atoi(optarg); break;
+            case 'x': overrunAt = atoi(optarg); break;
+            case 'v': host_verbose = 1; break;
+            default: usage();
+        }
+    }
+    if (days == 0 || interval == 0 || reconnectEvery == 0) {
+        usage();
+    }
+    perDay = 86400 / interval;
+    cycles = days * perDay;
+
+    twheel_init();
+    mempool_init(&probePool);
+    // as init_mqtt() sets it up, but without the precompiled packets so every packet goes through scratch
+    session.client_id = (uint8_t *)"herps-00000000";
+    session.client_id_len = strlen((char *)session.client_id);
+    session.username = (uint8_t *)"sensor";
+    session.username_len = 6;
+    session.password = (uint8_t *)"hunter2";
+    session.password_len = 7;
+    session.topic_name = (uint8_t *)"herps/00000000/temp";
+    session.topic_name_len = strlen((char *)session.topic_name);
+    session.will_topic = (uint8_t *)"herps/00000000/status";
+    session.will_topic_len = strlen((char *)session.will_topic);
+    session.will_message = (uint8_t *)"offline";
+    session.will_message_len = 7;
+    session.will_retain = 1;
+    session.keepalive = 50;
+    session.activeConnection = &session.conn;
+    session.validConnection = 1;
+
+    for (cycle = 1; cycle <= cycles; cycle++) {
+        if (cycle % reconnectEvery == 1) {
+            mqttSend(&session, NULL, 0, MQTT_MSG_TYPE_CONNECT);
+            mqttSend(&session, NULL, 0, MQTT_MSG_TYPE_SUBSCRIBE);
+            probe();
+        }
+        publish_reading(cycle, overrunAt);
+        mqttSend(&session, NULL, 0, MQTT_MSG_TYPE_PINGREQ);
+        scratch_reset();
+        if (cycle == 1) {
+            baseline = host_heap_used();
+        }
+        if (cycle % perDay == 0) {
+            mempool_report(report, sizeof(report));
+            printf("day %3d  heap_used=%u  %s\n", cycle / perDay, host_heap_used(), report);
+            fflush(stdout);
+        }
+    }
+    twheel_disarm(&session.keepAliveTimer);
+
+    st = scratch_stats();
+    printf("%u cycles, %u packets, %llu bytes sent, scratch peak %d of %d bytes\n", cycles, sentPackets,
+           (unsigned long long)sentBytes, st->peak, MEMPOOL_SCRATCH_LEN);
+    if (host_heap_used() != baseline) {
+        printf("FAIL: heap went from %u to %u bytes\n", baseline, host_heap_used());
+        failed = 1;
+    }
+    if (probePool.stats.inUse != 0 || probePool.stats.failures != 0) {
+        printf("FAIL: %d probe blocks out, %u refused\n", probePool.stats.inUse, probePool.stats.failures);
+        failed = 1;
+    }
+    if (st->leaks != 0 || st->failures != 0) {
+        printf("FAIL: %u scratch leaks, %u refused\n", st->leaks, st->failures);
+        failed = 1;
+    }
+    if (st->corruptions != 0 || probePool.stats.corruptions != 0) {
+        printf("FAIL: %u guard corruptions\n", st->corruptions + probePool.stats.corruptions);
+        failed = 1;
+    }
+    if (!failed) {
+        printf("PASS: memory flat over %u days\n", days);
+    }
+    return failed;
+}
@@ -0,0 +1,232 @@
+// Checks ntc.c against the thermistor equation in floating point, with the
+// table mkntc.py makes from user_config.def.h:
+//
+//   - every count converts to within NTC_TABLE_ERROR_CENTI of the beta
+//     equation, and to the clamp outside the range
+//   - conversions never fall as the counts rise
+//   - an open probe, reading 0, and a shorted one, reading full scale, are
+//     faults, as is every count that converts to a clamp, and nothing else
+//   - ntc_format() writes what printf("%.2f") does for every temperature,
+//     and for the rest of int32_t's range, which rollup.c's values can reach
+//   - oversampling a noisy input through host_adc gains at least one bit
+//     over a single conversion
+//
+// and times the table against the equation with log(), on this machine.
+//
+// usage: ntccheck [options]
+//   -s lsb       noise on the simulated input, in 10-bit counts (0.5)
+//   -n count     readings for the oversampling check (20000)
+//
+// Exits 1 if a check fails.
+
+#include <getopt.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "osapi.h"
+#include "ntc.h"
+#include "ntc_table.h"
+#include "host.h"
+
+#define COUNTS (1 << NTC_COUNT_BITS)
+#define ADC_FULL (1 << NTC_ADC_BITS)
+
+static double inputLsb; // what the simulated input is at, in 10-bit counts
+static double noiseLsb = 0.5;
+static volatile int32_t sink;
+
+// the beta equation, as mkntc.py tabulates it
+static double reference_c(uint32_t counts) {
+    double mv = counts * (double)NTC_ADC_MV / COUNTS, r;
+    if (mv <= 0 || mv >= NTC_SUPPLY_MV) {
+        return (mv <= 0) ? -HUGE_VAL : HUGE_VAL;
+    }
+    r = NTC_SERIES * (NTC_SUPPLY_MV - mv) / mv;
+    return 1.0 / (1.0 / 298.15 + log(r / NTC_R25) / NTC_BETA) - 273.15;
+}
+
+static double gaussian(void) {
+    double u = (rand() + 1.0) / (RAND_MAX + 2.0), v = (rand() + 1.0) / (RAND_MAX + 2.0);
+    return sqrt(-2.0 * log(u)) * cos(2 * M_PI * v);
+}
+
+// one conversion of the simulated input, rounded and clipped as the ADC would
+static uint16_t noisy_adc(void) {
+    long v = lround(inputLsb + noiseLsb * gaussian());
+    return (v < 0) ? 0 : (v > ADC_FULL) ? ADC_FULL : v;
+}
+
+static int check_table(void) {
+    uint32_t counts, worstAt = 0, falls = 0, clampErrors = 0;
+    double worst = 0;
+    int32_t prev = INT32_MIN;
+    for (counts = 0; counts < COUNTS; counts++) {
+        int32_t centi = ntc_counts_to_centi(counts);
+        double ref = reference_c(counts) * 100;
+        if (centi < prev) {
+            falls++;
+        }
+        prev = centi;
+        if (ref < NTC_MIN_CENTI) {
+            clampErrors += (centi != NTC_MIN_CENTI);
+        } else if (ref > NTC_MAX_CENTI) {
+            clampErrors += (centi != NTC_MAX_CENTI);
+        } else if (fabs(centi - ref) > worst) {
+            worst = fabs(centi - ref);
+            worstAt = counts;
+        }
+    }
+    printf("table: %d entries every %d counts, worst error %.2f centi-degrees at %u counts (%.2f C)\n", NTC_TABLE_LEN,
+           1 << NTC_TABLE_SHIFT, worst, worstAt, reference_c(worstAt));
+    if (worst > NTC_TABLE_ERROR_CENTI || falls || clampErrors) {
+        printf("FAIL: error above %d, %u falls, %u wrong clamps\n", NTC_TABLE_ERROR_CENTI, falls, clampErrors);
+        return 1;
+    }
+    return 0;
+}
+
+static int check_fault(void) {
+    uint32_t counts, missed = 0, false_faults = 0, faults = 0;
+    int32_t centi;
+    for (counts = 0; counts < COUNTS; counts++) {
+        int32_t c = ntc_counts_to_centi(counts);
+        uint8_t clamped = (c <= NTC_MIN_CENTI || c >= NTC_MAX_CENTI);
+        uint8_t nearEnd = (counts <= (NTC_FAULT_COUNTS << NTC_OVERSAMPLE_BITS) ||
+                           counts >= COUNTS - 1 - (NTC_FAULT_COUNTS << NTC_OVERSAMPLE_BITS));
+        uint8_t fault = ntc_fault(counts);
+        faults += fault;
+        missed += (clamped || nearEnd) && !fault;
+        false_faults += !(clamped || nearEnd) && fault;
+    }
+    // host_adc is NULL, so every conversion reads 0: an unplugged probe
+    if (!ntc_read(&centi) || centi != NTC_MIN_CENTI) {
+        printf("fault: an open probe read %d without a fault\n", centi);
+        missed++;
+    }
+    printf("fault: %u of %u counts are an open or shorted probe or out of range\n", faults, COUNTS);
+    if (missed || false_faults) {
+        printf("FAIL: %u faults missed, %u readings taken for faults\n", missed, false_faults);
+        return 1;
+    }
+    return 0;
+}
+
+static uint32_t check_one(int32_t centi) {
+    char got[NTC_FORMAT_LEN], want[32];
+    int64_t mag = llabs((int64_t)centi);
+    uint32_t len = ntc_format(centi, got);
+    snprintf(want, sizeof(want), "%s%lld.%02lld", (centi < 0) ? "-" : "", (long long)(mag / 100), (long long)(mag % 100));
+    if (strcmp(got, want) != 0 || len != strlen(want)) {
+        printf("ntc_format(%d) wrote \"%s\", expected \"%s\"\n", centi, got, want);
+        return 1;
+    }
+    return 0;
+}
+
+static int check_format(void) {
+    static const int32_t ends[] = { INT32_MIN, INT32_MIN + 1, -1000000000, -100000, 100000, 999999999, INT32_MAX };
+    uint32_t bad = 0, i;
+    int32_t centi;
+    for (centi = -9999; centi <= 99999 && bad < 5; centi++) {
+        bad += check_one(centi);
+    }
+    for (i = 0; i < sizeof(ends) / sizeof(ends[0]); i++) {
+        bad += check_one(ends[i]);
+    }
+    printf("format: -99.99 to 999.99 and the ends of int32_t, %u wrong\n", bad);
+    if (bad) {
+        printf("FAIL: ntc_format() is wrong\n");
+        return 1;
+    }
+    return 0;
+}
+
+static int check_oversampling(uint32_t readings) {
+    double singleSq = 0, decimatedSq = 0, degreesSq = 0, gain;
+    uint32_t i;
+    host_adc = noisy_adc;
+    srand(1);
+    for (i = 0; i < readings; i++) {
+        // across the middle of the range, where a probe spends its life
+        double truth = ADC_FULL * (0.2 + 0.6 * rand() / (double)RAND_MAX);
+        uint32_t counts;
+        inputLsb = truth;
+        singleSq += pow(noisy_adc() - truth, 2);
+        counts = ntc_sample();
+        decimatedSq += pow(counts / (double)(1 << NTC_OVERSAMPLE_BITS) - truth, 2);
+        degreesSq += pow(ntc_counts_to_centi(counts) / 100.0 - reference_c(truth * (1 << NTC_OVERSAMPLE_BITS)), 2);
+    }
+    host_adc = NULL;
+    gain = log2(sqrt(singleSq / decimatedSq));
+    printf("oversampling: %d conversions with %.2f counts of noise, rms error %.3f counts against %.3f for one, "
+           "%.2f bits gained, %.3f C rms\n", NTC_SAMPLES, noiseLsb, sqrt(decimatedSq / readings),
+           sqrt(singleSq / readings), gain, sqrt(degreesSq / readings));
+    if (gain < 1.0) {
+        printf("FAIL: oversampling gained less than a bit\n");
+        return 1;
+    }
+    return 0;
+}
+
+static double elapsed_ns(const struct timespec *start) {
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return (end.tv_sec - start->tv_sec) * 1e9 + (end.tv_nsec - start->tv_nsec);
+}
+
+static void time_conversions(void) {
+    struct timespec start;
+    double tableNs, floatNs;
+    uint32_t pass, counts;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (pass = 0; pass < 100; pass++) {
+        for (counts = 1; counts < COUNTS; counts++) {
+            sink += ntc_counts_to_centi(counts);
+        }
+    }
+    tableNs = elapsed_ns(&start) / (100.0 * (COUNTS - 1));
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (pass = 0; pass < 100; pass++) {
+        for (counts = 1; counts < COUNTS; counts++) {
+            sink += (int32_t)(reference_c(counts) * 100);
+        }
+    }
+    floatNs = elapsed_ns(&start) / (100.0 * (COUNTS - 1));
+    printf("time: table %.1f ns, equation %.1f ns a conversion here; bench.c has the cycles on the device\n", tableNs,
+           floatNs);
+}
+
+static void usage(void) {
+    fprintf(stderr, "usage: ntccheck [-s noise_lsb] [-n readings]\n");
+    exit(2);
+}
+
+int main(int argc, char **argv) {
+    uint32_t readings = 20000;
+    int c, failed = 0;
+
+    host_verbose = 0;
+    while ((c = getopt(argc, argv, "s:n:")) != -1) {
+        switch (c) {
+            case 's': noiseLsb = atof(optarg); break;
+            case 'n': readings = atoi(optarg); break;
+            default: usage();
+        }
+    }
+    if (readings == 0 || noiseLsb < 0) {
+        usage();
+    }
+
+    failed |= check_table();
+    failed |= check_fault();
+    failed |= check_format();
+    failed |= check_oversampling(readings);
+    time_conversions();
+    if (!failed) {
+        printf("PASS\n");
+    }
+    return failed;
+}
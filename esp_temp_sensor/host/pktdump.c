@@ -0,0 +1,83 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+/**
+ * @file
+ * @brief Prints the packets mqtt.c encodes for a configuration, for mkpackets.py --check
+ *
+ * usage: pktdump <client id> <username> <password> <topic> <keepalive> [<persistent> <will topic> <will message>]
+ *
+ * Prints "connect", "subscribe" and "publish" lines with the packet in hex,
+ * SUBSCRIBE with packet identifier 0 and PUBLISH without payload, the way
+ * packets.h holds them. Linked with --wrap=espconn_send, so nothing goes on
+ * the network.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "host.h"
+#include "mqtt.h"
+
+static uint8_t captured[MQTT_RX_BUF_LEN];
+static uint16_t capturedLen;
+
+sint8 __wrap_espconn_send(struct espconn *espconn, uint8 *psent, uint16 length) {
+    if(length > sizeof(captured)) {
+        length = sizeof(captured);
+    }
+    memcpy(captured, psent, length);
+    capturedLen = length;
+    return ESPCONN_OK;
+}
+
+static void dump(const char *name, mqtt_session_t *session, mqtt_message_type msgType) {
+    capturedLen = 0;
+    mqttSend(session, NULL, 0, msgType);
+    if(msgType == MQTT_MSG_TYPE_SUBSCRIBE && capturedLen > 4) {
+        captured[2] = captured[3] = 0; // packet identifier
+    }
+    printf("%s ", name);
+    for(uint16_t i = 0; i < capturedLen; i++) {
+        printf("%02x", captured[i]);
+    }
+    printf("\n");
+}
+
+int main(int argc, char **argv) {
+    static mqtt_session_t session;
+
+    if(argc != 6 && argc != 9) {
+        fprintf(stderr, "usage: %s <client id> <username> <password> <topic> <keepalive> [<persistent> <will topic> <will message>]\n", argv[0]);
+        return 2;
+    }
+    session.client_id = (uint8_t *)argv[1];
+    session.client_id_len = strlen(argv[1]);
+    session.username = (uint8_t *)argv[2];
+    session.username_len = strlen(argv[2]);
+    session.password = (uint8_t *)argv[3];
+    session.password_len = strlen(argv[3]);
+    session.topic_name = (uint8_t *)argv[4];
+    session.topic_name_len = strlen(argv[4]);
+    session.keepalive = atoi(argv[5]);
+    if(argc == 9) {
+        // the will is retained, as main.c sets it up
+        session.persistent = atoi(argv[6]);
+        session.will_topic = (uint8_t *)argv[7];
+        session.will_topic_len = strlen(argv[7]);
+        session.will_message = (uint8_t *)argv[8];
+        session.will_message_len = strlen(argv[8]);
+        session.will_retain = 1;
+    }
+    session.activeConnection = &session.conn;
+    session.validConnection = 1;
+    host_verbose = 0;
+    twheel_init();
+
+    dump("connect", &session, MQTT_MSG_TYPE_CONNECT);
+    dump("subscribe", &session, MQTT_MSG_TYPE_SUBSCRIBE);
+    dump("publish", &session, MQTT_MSG_TYPE_PUBLISH);
+    return 0;
+}
@@ -0,0 +1,291 @@
+// Checks pwm_out.c by calling its FRC1 handler, which hw_timer_set_func()
+// hands the SDK stand-in, on a simulated clock:
+//
+//   - with every channel at half duty, each is on for exactly half of
+//     every period and the on-edges fall on different ticks
+//   - the jitter statistics are the extremes of the intervals the handler
+//     actually ran at, including a minimum above 0 when every tick is late
+//   - a linear ramp takes the periods it was asked to, an exponential one
+//     settles, and both only move towards the target
+//   - pwm_out_proportional() is off at the setpoint, full a band below it
+//     and in between on the way
+//   - heat driven from the thermistor as main.c's heat_timerfunc() does,
+//     at full power from a cold probe, is off by the end of the period
+//     once the probe goes open, and stays off, and so with one shorted
+//
+// and times the handler on this machine.
+//
+// usage: pwmcheck [options]
+//   -j us        most the simulated interrupt comes early or late (20)
+//   -n count     ticks for the jitter check (100000)
+//   -s seed      for the jitter (1)
+//
+// Exits 1 if a check fails.
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "osapi.h"
+#include "gpio.h"
+#include "pwm_out.h"
+#include "ntc.h"
+#include "host.h"
+
+static const uint8_t pins[] = { 4, 5, 12 };
+#define CHANNELS (sizeof(pins) / sizeof(pins[0]))
+#define SETPOINT_CENTI 2800 // user_config.def.h's heat_setpoint_c
+#define BAND_CENTI 200
+
+static uint16_t adcCounts; // what the simulated probe reads
+static uint16_t probe_adc(void) {
+    return adcCounts;
+}
+
+// the interrupt after late_us more or less than the period
+static void tick(int32_t late_us) {
+    os_delay_us(host_hw_timer_us + late_us);
+    host_hw_timer_fn();
+}
+
+static void run_periods(uint32_t periods) {
+    uint32_t i;
+    for (i = 0; i < periods * PWM_OUT_STEPS; i++) {
+        tick(0);
+    }
+}
+
+static int check_phases(void) {
+    uint32_t on[CHANNELS] = { 0 }, edge[CHANNELS], i, c;
+    uint32_t before, now;
+    int wrong = 0;
+    for (c = 0; c < CHANNELS; c++) {
+        pwm_out_set(c, PWM_OUT_STEPS / 2, PWM_RAMP_STEP, 0);
+    }
+    run_periods(2); // the new duty is taken up at the end of a period
+    before = GPIO_REG_READ(GPIO_OUT_ADDRESS);
+    for (i = 0; i < PWM_OUT_STEPS; i++) {
+        tick(0);
+        now = GPIO_REG_READ(GPIO_OUT_ADDRESS);
+        for (c = 0; c < CHANNELS; c++) {
+            uint32_t mask = 1 << pins[c];
+            on[c] += (now & mask) ? 1 : 0;
+            if ((now & mask) && !(before & mask)) {
+                edge[c] = i;
+            }
+        }
+        before = now;
+    }
+    for (c = 0; c < CHANNELS; c++) {
+        if (on[c] != PWM_OUT_STEPS / 2) {
+            printf("phases: channel %u on for %u ticks of %u\n", c, on[c], PWM_OUT_STEPS);
+            wrong++;
+        }
+        if (c > 0 && edge[c] == edge[c - 1]) {
+            printf("phases: channels %u and %u switch on in the same tick\n", c - 1, c);
+            wrong++;
+        }
+    }
+    return wrong;
+}
+
+static int check_jitter(uint32_t n, int32_t spread) {
+    pwm_out_stats_t st;
+    int32_t lo, hi, late, sign;
+    uint32_t i;
+    int wrong = 0;
+    // early and late both, then only ever late
+    for (sign = -1; sign <= 1; sign += 2) {
+        pwm_out_init(pins, CHANNELS);
+        lo = spread;
+        hi = -spread;
+        tick(0);
+        for (i = 0; i < n; i++) {
+            late = (sign < 0) ? rand() % (2 * spread + 1) - spread : 1 + rand() % spread;
+            if (late < lo) {
+                lo = late;
+            }
+            if (late > hi) {
+                hi = late;
+            }
+            tick(late);
+        }
+        pwm_out_get_stats(&st);
+        if (st.min_jitter_us != lo || st.max_jitter_us != hi || st.ticks != n + 1) {
+            printf("jitter: %d..%dus over %u ticks, want %d..%dus over %u\n", st.min_jitter_us, st.max_jitter_us,
+                   st.ticks, lo, hi, n + 1);
+            wrong++;
+        }
+    }
+    return wrong;
+}
+
+static int check_ramps(void) {
+    uint32_t periods = 0, rampMs = 1000, want = rampMs * 1000 / (PWM_OUT_STEPS * PWM_OUT_TICK_US);
+    uint16_t last = 0;
+    int wrong = 0;
+    pwm_out_init(pins, CHANNELS);
+    pwm_out_set(0, PWM_OUT_STEPS, PWM_RAMP_LINEAR, rampMs);
+    while (pwm_out_get_duty(0) != PWM_OUT_STEPS && periods <= 2 * want) {
+        run_periods(1);
+        periods++;
+        if (pwm_out_get_duty(0) < last) {
+            printf("linear: fell from %u to %u\n", last, pwm_out_get_duty(0));
+            wrong++;
+        }
+        last = pwm_out_get_duty(0);
+    }
+    if (periods != want) {
+        printf("linear: reached the target after %u periods, want %u\n", periods, want);
+        wrong++;
+    }
+    pwm_out_set(0, 0, PWM_RAMP_EXP, 0);
+    for (periods = 0; pwm_out_get_duty(0) != 0 && periods < 200; periods++) {
+        run_periods(1);
+        if (pwm_out_get_duty(0) > last) {
+            printf("exponential: rose from %u to %u\n", last, pwm_out_get_duty(0));
+            wrong++;
+        }
+        last = pwm_out_get_duty(0);
+    }
+    if (pwm_out_get_duty(0) != 0) {
+        printf("exponential: at %u after %u periods\n", pwm_out_get_duty(0), periods);
+        wrong++;
+    }
+    if (!pwm_out_static()) {
+        printf("static: not settled with the outputs off\n");
+        wrong++;
+    }
+    return wrong;
+}
+
+static int check_proportional(void) {
+    static const struct {
+        int32_t measured;
+        uint16_t want;
+    } cases[] = { { 2800, 0 }, { 3000, 0 }, { 2600, PWM_OUT_STEPS }, { 2000, PWM_OUT_STEPS }, { 2700, PWM_OUT_STEPS / 2 },
+                  { 2750, PWM_OUT_STEPS / 4 } };
+    uint32_t i;
+    int wrong = 0;
+    pwm_out_init(pins, CHANNELS);
+    for (i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+        pwm_out_proportional(1, 2800, cases[i].measured, 200);
+        if (pwm_out_get_target(1) != cases[i].want) {
+            printf("proportional: %d against 2800 gave %u, want %u\n", cases[i].measured, pwm_out_get_target(1),
+                   cases[i].want);
+            wrong++;
+        }
+    }
+    pwm_out_proportional(1, 2800, 2000, 0);
+    if (pwm_out_get_target(1) != 0) {
+        printf("proportional: no band gave %u, want 0\n", pwm_out_get_target(1));
+        wrong++;
+    }
+    return wrong;
+}
+
+// main.c's heat_timerfunc(), on channel 1
+static void heat(void) {
+    int32_t centi;
+    uint8_t fault = ntc_read(&centi);
+    pwm_out_proportional(1, SETPOINT_CENTI, fault ? PWM_OUT_NO_MEASUREMENT : centi, BAND_CENTI);
+}
+
+static int check_probe(void) {
+    static const struct {
+        const char *what;
+        uint16_t counts;
+    } faults[] = { { "open", 0 }, { "open, with a little noise", 2 }, { "shorted", 1024 } };
+    uint32_t i, p;
+    int wrong = 0;
+    host_adc = probe_adc;
+    for (i = 0; i < sizeof(faults) / sizeof(faults[0]); i++) {
+        pwm_out_init(pins, CHANNELS);
+        // a cold enclosure, a few degrees on the template's divider
+        adcCounts = 300;
+        heat();
+        run_periods(40);
+        if (pwm_out_get_duty(1) != PWM_OUT_STEPS) {
+            printf("probe: a cold enclosure heats at %u of %u\n", pwm_out_get_duty(1), PWM_OUT_STEPS);
+            wrong++;
+        }
+        adcCounts = faults[i].counts;
+        heat();
+        run_periods(1);
+        for (p = 0; p < 100 && pwm_out_get_duty(1) == 0; p++) {
+            heat();
+            run_periods(1);
+        }
+        if (p != 100) {
+            printf("probe: %s, heat at %u of %u after %u periods\n", faults[i].what, pwm_out_get_duty(1), PWM_OUT_STEPS,
+                   p);
+            wrong++;
+        }
+    }
+    host_adc = NULL;
+    return wrong;
+}
+
+static double elapsed_ns(const struct timespec *start) {
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return (end.tv_sec - start->tv_sec) * 1e9 + (end.tv_nsec - start->tv_nsec);
+}
+
+int main(int argc, char **argv) {
+    uint32_t n = 100000, seed = 1, i, c;
+    int32_t spread = 20;
+    struct timespec start;
+    int opt, wrong = 0;
+    while ((opt = getopt(argc, argv, "j:n:s:")) != -1) {
+        switch (opt) {
+        case 'j':
+            spread = atoi(optarg);
+            break;
+        case 'n':
+            n = atoi(optarg);
+            break;
+        case 's':
+            seed = atoi(optarg);
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-j us] [-n count] [-s seed]\n", argv[0]);
+            return 2;
+        }
+    }
+    if (spread < 1) {
+        spread = 1;
+    }
+    srand(seed);
+    host_verbose = 0;
+    host_virtual_time = 1;
+    pwm_out_init(pins, CHANNELS);
+    if (host_hw_timer_fn == NULL || host_hw_timer_us != PWM_OUT_TICK_US) {
+        printf("FAIL: the hardware timer was not armed at %dus\n", PWM_OUT_TICK_US);
+        return 1;
+    }
+    wrong += check_phases();
+    wrong += check_jitter(n, spread);
+    wrong += check_ramps();
+    wrong += check_proportional();
+    wrong += check_probe();
+
+    pwm_out_init(pins, CHANNELS);
+    for (c = 0; c < CHANNELS; c++) {
+        pwm_out_set(c, PWM_OUT_STEPS / 3, PWM_RAMP_LINEAR, 1000);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < n; i++) {
+        host_hw_timer_fn();
+    }
+    printf("%u channels: %.1f ns a tick on this machine, %u ticks a second on the device\n", (uint32_t)CHANNELS,
+           elapsed_ns(&start) / (n ? n : 1), 1000000 / PWM_OUT_TICK_US);
+    if (wrong > 0) {
+        printf("FAIL: %d checks failed\n", wrong);
+        return 1;
+    }
+    printf("PASS\n");
+    return 0;
+}
@@ -0,0 +1,589 @@
+// Feeds a capture of MQTT traffic back through mqtt.c's receive path, to
+// reproduce what a sensor saw and to time the parser on real traffic.
+//
+// The capture is a pcap file, from the firmware's own ring (see capture.h)
+// or from tcpdump on the broker's side, or a serial log holding a
+// capture_dump_uart() dump, whose last complete "CAP begin" .. "CAP end"
+// block is used. Raw IPv4, Ethernet (with or without a VLAN tag) and Linux
+// cooked captures are read, with microsecond or nanosecond timestamps in
+// either byte order. Segments from the broker's port are received, segments
+// to it were sent; anything else is skipped. Retransmitted bytes are
+// dropped by sequence number, and a SYN or another client port starts a new
+// connection with an empty receive buffer.
+//
+// Replaying, the clock is virtual and moves to each segment's timestamp
+// before it is handed to data_recv_callback(), so the session's timers fire
+// as they did on the device. Each packet the session took apart, and each
+// packet the capture shows the sensor sending, is printed as it goes, and
+// the summary compares the packets in the capture with those the session
+// sent itself. espconn_send() is wrapped, so nothing goes on the network.
+//
+// usage: replay [options] <capture>
+//   -p port      the broker's port (1883)
+//   -w file      also write the capture out as a pcap file, for a serial log
+//   -n count     time count passes of the received bytes through the parser
+//                instead, and print the throughput
+//   -v           print the firmware's debug output
+//
+// Exits 1 if the capture cannot be read.
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "osapi.h"
+#include "mqtt.h"
+#include "twheel.h"
+#include "host.h"
+
+#define MAX_SEGMENTS 65536
+#define STREAM_BUF_LEN 4096 // reassembly of each stream, to count its packets
+#define SHOW_PAYLOAD 48
+
+typedef struct {
+    uint64_t us; // since the first segment
+    const uint8_t *data;
+    uint32_t len;
+    uint16_t clientPort;
+    uint8_t rx;
+    uint8_t syn;
+    uint8_t fin;
+    uint8_t cut; // the capture kept less than was on the wire
+} segment_t;
+
+static const char *typeNames[16] = {
+    "reserved", "CONNECT", "CONNACK", "PUBLISH", "PUBACK", "PUBREC", "PUBREL", "PUBCOMP",
+    "SUBSCRIBE", "SUBACK", "UNSUBSCRIBE", "UNSUBACK", "PINGREQ", "PINGRESP", "DISCONNECT", "reserved",
+};
+
+static segment_t segments[MAX_SEGMENTS];
+static uint32_t segmentCount, skipped, retransmits, gaps, truncated;
+static mqtt_session_t session;
+static uint64_t now; // timestamp of the segment being replayed
+static uint8_t quiet; // the benchmark, no printing from the callbacks
+static uint32_t streamPackets[2][16]; // in the capture, sent and received
+static uint32_t sessionPackets[16]; // sent by the session on replay
+static uint32_t handled; // packets that reached one of the session's callbacks
+
+sint8 __wrap_espconn_send(struct espconn *espconn, uint8 *psent, uint16 length) {
+    if (length > 0) {
+        sessionPackets[psent[0] >> 4]++;
+        if (!quiet) {
+            printf("%10.3f  session sends %s, %d bytes\n", now / 1e6, typeNames[psent[0] >> 4], length);
+        }
+    }
+    return ESPCONN_OK;
+}
+
+static void show_payload(const uint8_t *p, uint32_t len) {
+    uint32_t i;
+    for (i = 0; i < len && i < SHOW_PAYLOAD; i++) {
+        putchar((p[i] >= 0x20 && p[i] < 0x7F) ? p[i] : '.');
+    }
+    if (len > SHOW_PAYLOAD) {
+        printf("...");
+    }
+}
+
+static void on_connack(void *arg) {
+    handled++;
+    if (!quiet) {
+        printf("%10.3f  rx CONNACK code=%d session_present=%d\n", now / 1e6, session.connackCode,
+               session.sessionPresent);
+    }
+}
+
+static void on_suback(void *arg) {
+    handled++;
+    if (!quiet) {
+        printf("%10.3f  rx SUBACK\n", now / 1e6);
+    }
+}
+
+static void on_message(void *arg, uint8_t *topic, uint32_t topic_len, uint8_t *payload, uint32_t payload_len) {
+    handled++;
+    if (!quiet) {
+        printf("%10.3f  rx PUBLISH %.*s, %u bytes: ", now / 1e6, (int)topic_len, topic, payload_len);
+        show_payload(payload, payload_len);
+        putchar('\n');
+    }
+}
+
+static uint16_t get16(const uint8_t *p) {
+    return (p[0] << 8) | p[1];
+}
+
+static uint32_t get32(const uint8_t *p) {
+    return ((uint32_t)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+static uint32_t get32_order(const uint8_t *p, int swapped) {
+    return swapped ? get32(p) : ((uint32_t)p[3] << 24) | (p[2] << 16) | (p[1] << 8) | p[0];
+}
+
+// the IPv4 packet in a frame, by link type
+static const uint8_t *frame_ip(uint32_t linktype, const uint8_t *p, uint32_t *len) {
+    uint32_t skip;
+    uint16_t proto;
+    switch (linktype) {
+        case 101: // LINKTYPE_RAW
+        case 228: // LINKTYPE_IPV4
+            return p;
+        case 1: // LINKTYPE_ETHERNET
+            if (*len < 14) {
+                return NULL;
+            }
+            skip = 14;
+            proto = get16(p + 12);
+            if (proto == 0x8100 && *len >= 18) {
+                skip = 18;
+                proto = get16(p + 16);
+            }
+            break;
+        case 113: // LINKTYPE_LINUX_SLL
+            if (*len < 16) {
+                return NULL;
+            }
+            skip = 16;
+            proto = get16(p + 14);
+            break;
+        case 276: // LINKTYPE_LINUX_SLL2
+            if (*len < 20) {
+                return NULL;
+            }
+            skip = 20;
+            proto = get16(p);
+            break;
+        default:
+            return NULL;
+    }
+    if (proto != 0x0800) {
+        return NULL;
+    }
+    *len -= skip;
+    return p + skip;
+}
+
+typedef struct {
+    uint32_t next[2]; // sequence number expected next, each way
+    uint8_t started[2];
+    uint16_t clientPort;
+} stream_t;
+
+// one TCP segment to or from the broker, with bytes already seen dropped
+static void add_segment(stream_t *st, uint64_t us, const uint8_t *ip, uint32_t len, uint16_t brokerPort) {
+    uint32_t ihl, doff, ipLen, seq, dataLen;
+    uint16_t src, dst;
+    const uint8_t *tcp;
+    segment_t *s;
+    uint8_t rx, flags;
+    if (len < 20 || (ip[0] >> 4) != 4 || ip[9] != 6) {
+        skipped++;
+        return;
+    }
+    ihl = (ip[0] & 0x0F) * 4;
+    ipLen = get16(ip + 2);
+    if (len < ihl + 20) {
+        skipped++;
+        return;
+    }
+    tcp = ip + ihl;
+    src = get16(tcp);
+    dst = get16(tcp + 2);
+    seq = get32(tcp + 4);
+    flags = tcp[13];
+    doff = (tcp[12] >> 4) * 4;
+    if (src == brokerPort) {
+        rx = 1;
+    } else if (dst == brokerPort) {
+        rx = 0;
+    } else {
+        skipped++;
+        return;
+    }
+    if (len < ihl + doff || ipLen < ihl + doff) {
+        skipped++;
+        return;
+    }
+    dataLen = ipLen - ihl - doff;
+    if (segmentCount == MAX_SEGMENTS) {
+        skipped++;
+        return;
+    }
+    s = &segments[segmentCount];
+    memset(s, 0, sizeof(*s));
+    s->us = us;
+    s->rx = rx;
+    s->clientPort = rx ? dst : src;
+    s->data = tcp + doff;
+    s->len = dataLen;
+    if (len - ihl - doff < dataLen) {
+        s->len = len - ihl - doff;
+        s->cut = 1;
+        truncated++;
+    }
+    s->fin = (flags & 0x05) != 0; // FIN or RST
+    if ((flags & 0x12) == 0x02 || s->clientPort != st->clientPort) {
+        // a SYN without an ACK, or a capture that starts partway through
+        memset(st, 0, sizeof(*st));
+        st->clientPort = s->clientPort;
+        s->syn = 1;
+    }
+    if (flags & 0x02) {
+        seq++; // the SYN takes a sequence number
+    }
+    if (!st->started[rx]) {
+        st->started[rx] = 1;
+        st->next[rx] = seq;
+    }
+    if ((int32_t)(seq + s->len - st->next[rx]) <= 0 && s->len > 0) {
+        retransmits++;
+        s->len = 0;
+    } else if ((int32_t)(seq - st->next[rx]) < 0) {
+        // partly sent before, keep only the new bytes
+        uint32_t seen = st->next[rx] - seq;
+        s->data += seen;
+        s->len -= seen;
+        retransmits++;
+    } else if (seq != st->next[rx]) {
+        gaps++;
+    }
+    if (s->len > 0 || s->syn || s->fin) {
+        st->next[rx] = seq + dataLen; // what was on the wire, however much the capture kept
+        segmentCount++;
+    }
+}
+
+static int read_pcap(const uint8_t *buf, uint32_t len, uint16_t brokerPort) {
+    uint32_t magic, linktype, at, incl, nsDiv;
+    uint64_t first = 0, us;
+    stream_t st;
+    int swapped;
+    if (len < 24) {
+        return -1;
+    }
+    magic = get32(buf);
+    if (magic == 0xA1B2C3D4 || magic == 0xA1B23C4D) {
+        swapped = 1;
+    } else if (magic == 0xD4C3B2A1 || magic == 0x4D3CB2A1) {
+        swapped = 0;
+    } else {
+        return -1;
+    }
+    nsDiv = (magic == 0xA1B23C4D || magic == 0x4D3CB2A1) ? 1000 : 1;
+    linktype = get32_order(buf + 20, swapped) & 0x0FFFFFFF;
+    memset(&st, 0, sizeof(st));
+    for (at = 24; at + 16 <= len; at += 16 + incl) {
+        const uint8_t *ip;
+        uint32_t ipLen;
+        us = get32_order(buf + at, swapped) * 1000000ULL + get32_order(buf + at + 4, swapped) / nsDiv;
+        incl = get32_order(buf + at + 8, swapped);
+        if (at + 16 + incl > len) {
+            break; // cut off in the middle
+        }
+        if (at == 24) {
+            first = us;
+        }
+        ipLen = incl;
+        ip = frame_ip(linktype, buf + at + 16, &ipLen);
+        if (ip == NULL) {
+            skipped++;
+            continue;
+        }
+        add_segment(&st, us - first, ip, ipLen, brokerPort);
+    }
+    return 0;
+}
+
+static int hex_nibble(int c) {
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    }
+    if (c >= 'a' && c <= 'f') {
+        return c - 'a' + 10;
+    }
+    if (c >= 'A' && c <= 'F') {
+        return c - 'A' + 10;
+    }
+    return -1;
+}
+
+static const uint8_t *find_cap(const uint8_t *p, const uint8_t *end) {
+    for (; p + 4 <= end; p++) {
+        if (memcmp(p, "CAP ", 4) == 0) {
+            return p;
+        }
+    }
+    return NULL;
+}
+
+// the last complete dump in a serial log, as the pcap file it encodes
+static uint8_t *read_serial_log(const uint8_t *text, uint32_t textLen, uint32_t *outLen) {
+    uint8_t *out = malloc(textLen / 2 + 1), *best = NULL;
+    uint32_t used = 0, bestLen = 0, at = 0;
+    int inDump = 0;
+    while (at < textLen) {
+        uint32_t end = at;
+        const uint8_t *cap;
+        while (end < textLen && text[end] != '\n') {
+            end++;
+        }
+        cap = find_cap(text + at, text + end);
+        if (cap != NULL) {
+            const uint8_t *p = cap + 4;
+            uint32_t left = text + end - p;
+            if (left >= 5 && memcmp(p, "begin", 5) == 0) {
+                inDump = 1;
+                used = 0;
+            } else if (left >= 3 && memcmp(p, "end", 3) == 0) {
+                if (inDump) {
+                    free(best);
+                    best = malloc(used + 1);
+                    memcpy(best, out, used);
+                    bestLen = used;
+                }
+                inDump = 0;
+            } else if (inDump) {
+                while (p + 1 < text + end && hex_nibble(p[0]) >= 0 && hex_nibble(p[1]) >= 0) {
+                    out[used++] = (hex_nibble(p[0]) << 4) | hex_nibble(p[1]);
+                    p += 2;
+                }
+            }
+        }
+        at = end + 1;
+    }
+    free(out);
+    *outLen = bestLen;
+    return best;
+}
+
+static uint8_t *read_file(const char *path, uint32_t *len) {
+    FILE *f = fopen(path, "rb");
+    uint8_t *buf;
+    long size;
+    if (f == NULL) {
+        return NULL;
+    }
+    fseek(f, 0, SEEK_END);
+    size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    buf = malloc(size + 1);
+    if (fread(buf, 1, size, f) != (size_t)size) {
+        free(buf);
+        buf = NULL;
+    }
+    fclose(f);
+    *len = size;
+    return buf;
+}
+
+typedef struct {
+    uint8_t buf[STREAM_BUF_LEN];
+    uint32_t used;
+} reassembly_t;
+
+// splits one direction of the capture into packets, counting them and
+// printing the sent ones; the received ones are printed by the callbacks
+static void stream_packets(reassembly_t *r, const segment_t *s, uint32_t *counts, int print) {
+    uint32_t offset = 0;
+    if (r->used + s->len > STREAM_BUF_LEN) {
+        r->used = 0;
+        return;
+    }
+    memcpy(r->buf + r->used, s->data, s->len);
+    r->used += s->len;
+    while (r->used - offset >= 2) {
+        uint32_t remaining;
+        int8_t lenBytes = decodeLength(r->buf + offset + 1, r->used - offset - 1, &remaining);
+        if (lenBytes < 0) {
+            r->used = 0;
+            return;
+        }
+        if (lenBytes == 0 || r->used - offset < 1 + lenBytes + remaining) {
+            break;
+        }
+        if (counts != NULL) {
+            counts[r->buf[offset] >> 4]++;
+        }
+        if (print) {
+            printf("%10.3f  tx %s, %u bytes\n", s->us / 1e6, typeNames[r->buf[offset] >> 4], 1 + lenBytes + remaining);
+        }
+        offset += 1 + lenBytes + remaining;
+    }
+    memmove(r->buf, r->buf + offset, r->used - offset);
+    r->used -= offset;
+}
+
+// what the capture holds each way, before anything is replayed
+static void count_packets(void) {
+    static reassembly_t streams[2];
+    uint32_t i;
+    for (i = 0; i < segmentCount; i++) {
+        const segment_t *s = &segments[i];
+        if (s->syn) {
+            streams[0].used = streams[1].used = 0;
+        }
+        stream_packets(&streams[s->rx], s, streamPackets[s->rx], 0);
+        if (s->cut) {
+            streams[s->rx].used = 0;
+        }
+    }
+}
+
+static void replay(void) {
+    static reassembly_t sent;
+    uint32_t i;
+    for (i = 0; i < segmentCount; i++) {
+        const segment_t *s = &segments[i];
+        host_loop_run(s->us, NULL);
+        now = s->us;
+        if (s->syn) {
+            printf("%10.3f  connection from port %d\n", s->us / 1e6, s->clientPort);
+            session.rxLen = 0;
+            sent.used = 0;
+        }
+        if (s->cut) {
+            printf("%10.3f  %s segment cut short in the capture, receive buffer dropped\n", s->us / 1e6,
+                   s->rx ? "rx" : "tx");
+        }
+        if (s->len > 0) {
+            if (s->rx) {
+                data_recv_callback(&session.conn, (char *)s->data, s->len);
+            } else {
+                stream_packets(&sent, s, NULL, 1);
+            }
+        }
+        if (s->cut) {
+            if (s->rx) {
+                session.rxLen = 0;
+            } else {
+                sent.used = 0;
+            }
+        }
+        if (s->fin) {
+            printf("%10.3f  connection closed\n", s->us / 1e6);
+        }
+    }
+}
+
+static void benchmark(uint32_t passes) {
+    struct timespec start, end;
+    uint64_t bytes = 0, packets = 0;
+    uint32_t pass, i;
+    double secs;
+    quiet = 1;
+    for (i = 0; i < segmentCount; i++) {
+        if (segments[i].rx) {
+            bytes += segments[i].len;
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (pass = 0; pass < passes; pass++) {
+        for (i = 0; i < segmentCount; i++) {
+            const segment_t *s = &segments[i];
+            if (s->syn || s->cut) {
+                session.rxLen = 0;
+            }
+            if (s->rx && s->len > 0) {
+                data_recv_callback(&session.conn, (char *)s->data, s->len);
+            }
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    for (i = 0; i < 16; i++) {
+        packets += streamPackets[1][i];
+    }
+    bytes *= passes;
+    packets *= passes;
+    printf("%u passes, %llu bytes, %llu packets in %.3f s\n", passes, (unsigned long long)bytes,
+           (unsigned long long)packets, secs);
+    printf("%.1f MB/s, %.0f packets/s, %.0f ns/packet\n", bytes / secs / 1e6, packets / secs,
+           packets ? secs * 1e9 / packets : 0.0);
+}
+
+static void usage(void) {
+    fprintf(stderr, "usage: replay [-p port] [-w file] [-n count] [-v] <capture>\n");
+    exit(2);
+}
+
+int main(int argc, char **argv) {
+    uint32_t port = 1883, passes = 0, len, pcapLen, i, rx = 0, tx = 0;
+    const char *out = NULL;
+    uint8_t *file, *pcap;
+    int c;
+
+    host_verbose = 0;
+    while ((c = getopt(argc, argv, "p:w:n:v")) != -1) {
+        switch (c) {
+            case 'p': port = atoi(optarg); break;
+            case 'w': out = optarg; break;
+            case 'n': passes = atoi(optarg); break;
+            case 'v': host_verbose = 1; break;
+            default: usage();
+        }
+    }
+    if (optind + 1 != argc || port == 0 || port > 0xFFFF) {
+        usage();
+    }
+    file = read_file(argv[optind], &len);
+    if (file == NULL) {
+        perror(argv[optind]);
+        return 1;
+    }
+    pcap = file;
+    pcapLen = len;
+    if (read_pcap(pcap, pcapLen, port) < 0) {
+        pcap = read_serial_log(file, len, &pcapLen);
+        if (pcap == NULL || read_pcap(pcap, pcapLen, port) < 0) {
+            fprintf(stderr, "%s: neither a pcap file nor a serial log with a complete CAP dump\n", argv[optind]);
+            return 1;
+        }
+    }
+    if (out != NULL) {
+        FILE *f = fopen(out, "wb");
+        if (f == NULL || fwrite(pcap, 1, pcapLen, f) != pcapLen || fclose(f) != 0) {
+            perror(out);
+            return 1;
+        }
+    }
+    for (i = 0; i < segmentCount; i++) {
+        if (segments[i].rx) {
+            rx += segments[i].len;
+        } else {
+            tx += segments[i].len;
+        }
+    }
+    printf("%u segments to or from port %u: %u bytes received, %u sent; %u skipped, %u retransmitted, "
+           "%u gaps, %u cut short\n", segmentCount, port, rx, tx, skipped, retransmits, gaps, truncated);
+    count_packets();
+
+    host_virtual_time = 1;
+    twheel_init();
+    // as init_mqtt() sets it up, as far as receiving goes
+    session.connack_cb = on_connack;
+    session.suback_cb = on_suback;
+    session.message_cb = on_message;
+    session.activeConnection = &session.conn;
+    session.conn.reverse = &session;
+    session.validConnection = 1;
+
+    if (passes > 0) {
+        benchmark(passes);
+        return 0;
+    }
+    replay();
+    twheel_disarm(&session.keepAliveTimer);
+    twheel_disarm(&session.replyTimer);
+
+    printf("\n%-12s %8s %8s %8s\n", "packet", "received", "sent", "replayed");
+    for (i = 1; i < 15; i++) {
+        if (streamPackets[1][i] || streamPackets[0][i] || sessionPackets[i]) {
+            printf("%-12s %8u %8u %8u\n", typeNames[i], streamPackets[1][i], streamPackets[0][i], sessionPackets[i]);
+        }
+    }
+    printf("%u packets reached the session's callbacks; replayed is what it sent back itself\n", handled);
+    return 0;
+}
@@ -0,0 +1,263 @@
+// Checks rollup.c against the readings kept whole. Days of readings at
+// irregular intervals, as the sampler takes them, with pauses where the
+// session drops and the odd gap of hours, go through rollup_add_at() and
+// rollup_pause_at(). Every window it publishes is summed again from the
+// readings it covers:
+//
+//   - count, minimum, maximum, time held and the value-times-time sum all
+//     match exactly, and so the average does
+//   - windows start on their period in Unix time, come in order, and none
+//     with readings or held time in them is left out
+//
+// and times rollup_add_at() on this machine.
+//
+// usage: rollupcheck [options]
+//   -d days      how long the readings run for (3)
+//   -s seed      for the readings (1)
+//   -v           print every window as it is published
+//
+// Exits 1 if a check fails.
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "osapi.h"
+#include "rollup.h"
+#include "host.h"
+
+#define UNIX_BASE_MS 1700000000000ULL // a Tuesday in November 2023, on none of the boundaries
+#define MAX_WINDOWS 65536
+
+typedef struct {
+    uint64_t fromMs; // taken
+    uint64_t untilMs; // held until: the next reading, a pause or the restart after a gap
+    int32_t value;
+} reading_t;
+
+typedef struct {
+    uint8_t level;
+    rollup_window_t w;
+} published_t;
+
+static reading_t *readings;
+static uint32_t readingCount;
+static published_t *published;
+static uint32_t publishedCount;
+static uint32_t periodsMs[ROLLUP_LEVELS];
+static int verbose;
+static volatile int32_t sink;
+
+static void publish(void *arg, uint8_t level, const rollup_window_t *w) {
+    if (verbose) {
+        char buf[ROLLUP_FORMAT_LEN];
+        rollup_format(w, buf);
+        printf("%-3s %s\n", rollup_name(level), buf);
+    }
+    if (publishedCount < MAX_WINDOWS) {
+        published[publishedCount].level = level;
+        published[publishedCount].w = *w;
+    }
+    publishedCount++;
+}
+
+// readings every 5..60 s, as the sampler might take them, that drift and jump
+static void run_readings(uint32_t days) {
+    uint64_t t = UNIX_BASE_MS + rand() % 60000, end = UNIX_BASE_MS + days * 86400000ULL, minuteEnd;
+    int32_t value = 2100;
+    reading_t *last = NULL;
+    while (t < end) {
+        uint32_t r = rand() % 1000;
+        if (last != NULL) {
+            last->untilMs = t;
+            // rollup.c starts again after a gap longer than the hour, ending the hold with the minute
+            minuteEnd = (last->fromMs / periodsMs[0] + 1) * periodsMs[0];
+            if (t >= minuteEnd + periodsMs[ROLLUP_LEVELS - 1]) {
+                last->untilMs = minuteEnd;
+            }
+        }
+        value += rand() % 41 - 20;
+        if (r < 5) {
+            value = -value; // the odd reading below zero
+        }
+        rollup_add_at(value, t);
+        readings[readingCount] = (reading_t){ t, t, value };
+        last = &readings[readingCount++];
+        if (r < 10) {
+            // the session drops: a pause, then nothing for a while
+            t += 1 + rand() % 30000;
+            rollup_pause_at(t);
+            last->untilMs = t;
+            last = NULL;
+            t += (r < 3) ? 3600000ULL + rand() % 7200000 : 1 + rand() % 600000;
+        } else if (r < 12) {
+            // readings stop without a pause, such as the clock stepping on
+            t += 3600000ULL + rand() % 7200000;
+        } else {
+            t += 5000 + rand() % 55000;
+        }
+    }
+    // far enough on that everything is closed
+    t = end + 2 * 3600000ULL;
+    if (last != NULL) {
+        minuteEnd = (last->fromMs / periodsMs[0] + 1) * periodsMs[0];
+        last->untilMs = minuteEnd;
+    }
+    rollup_advance(t);
+}
+
+// the window summed afresh from the readings
+static void reference(uint8_t level, uint64_t startMs, rollup_window_t *w) {
+    uint64_t endMs = startMs + periodsMs[level], from, until;
+    uint32_t i;
+    memset(w, 0, sizeof(*w));
+    w->startS = startMs / 1000;
+    w->min = 0x7FFFFFFF;
+    w->max = -0x7FFFFFFF - 1;
+    for (i = 0; i < readingCount; i++) {
+        const reading_t *rd = &readings[i];
+        uint8_t counts = 0;
+        if (rd->fromMs >= startMs && rd->fromMs < endMs) {
+            w->count++;
+            counts = 1;
+        }
+        from = (rd->fromMs > startMs) ? rd->fromMs : startMs;
+        until = (rd->untilMs < endMs) ? rd->untilMs : endMs;
+        if (until > from) {
+            w->heldMs += until - from;
+            w->sum += (int64_t)rd->value * (int64_t)(until - from);
+            counts = 1;
+        }
+        if (counts) {
+            if (rd->value < w->min) {
+                w->min = rd->value;
+            }
+            if (rd->value > w->max) {
+                w->max = rd->value;
+            }
+        }
+    }
+}
+
+static int same(const rollup_window_t *a, const rollup_window_t *b) {
+    return a->startS == b->startS && a->count == b->count && a->min == b->min && a->max == b->max &&
+           a->heldMs == b->heldMs && a->sum == b->sum;
+}
+
+static int check_windows(uint32_t days) {
+    uint32_t i, wrong = 0, misaligned = 0, unordered = 0, missing = 0, windows[ROLLUP_LEVELS] = { 0 };
+    uint64_t lastStartMs[ROLLUP_LEVELS] = { 0 }, startMs, endMs = UNIX_BASE_MS + (days + 1) * 86400000ULL;
+    uint8_t level;
+    rollup_window_t ref;
+    if (publishedCount > MAX_WINDOWS) {
+        printf("FAIL: %u windows, more than the %d kept\n", publishedCount, MAX_WINDOWS);
+        return 1;
+    }
+    for (i = 0; i < publishedCount; i++) {
+        const published_t *p = &published[i];
+        startMs = p->w.startS * 1000ULL;
+        windows[p->level]++;
+        if (startMs % periodsMs[p->level] != 0) {
+            misaligned++;
+        }
+        if (startMs < lastStartMs[p->level] + (lastStartMs[p->level] ? periodsMs[p->level] : 0)) {
+            unordered++;
+        }
+        lastStartMs[p->level] = startMs;
+        reference(p->level, startMs, &ref);
+        if (!same(&p->w, &ref) || rollup_average(&p->w) != rollup_average(&ref)) {
+            if (wrong++ < 5) {
+                printf("wrong %s window at %u: count %u/%u min %d/%d max %d/%d held %u/%u sum %lld/%lld\n",
+                       rollup_name(p->level), p->w.startS, p->w.count, ref.count, p->w.min, ref.min, p->w.max, ref.max,
+                       p->w.heldMs, ref.heldMs, (long long)p->w.sum, (long long)ref.sum);
+            }
+        }
+    }
+    // every window with something in it was published
+    for (level = 0; level < ROLLUP_LEVELS; level++) {
+        uint32_t expected = 0;
+        for (startMs = UNIX_BASE_MS - UNIX_BASE_MS % periodsMs[level]; startMs < endMs; startMs += periodsMs[level]) {
+            reference(level, startMs, &ref);
+            if (ref.count > 0 || ref.heldMs > 0) {
+                expected++;
+            }
+        }
+        if (expected != windows[level]) {
+            missing += (expected > windows[level]) ? expected - windows[level] : windows[level] - expected;
+        }
+        printf("%-3s %u windows\n", rollup_name(level), windows[level]);
+    }
+    printf("%u readings, %u windows: %u wrong, %u misaligned, %u out of order, %u missing or extra\n", readingCount,
+           publishedCount, wrong, misaligned, unordered, missing);
+    if (wrong > 0 || misaligned > 0 || unordered > 0 || missing > 0) {
+        printf("FAIL: windows do not match the readings\n");
+        return 1;
+    }
+    return 0;
+}
+
+static double elapsed_ns(const struct timespec *start) {
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return (end.tv_sec - start->tv_sec) * 1e9 + (end.tv_nsec - start->tv_nsec);
+}
+
+// a reading a second for a week, through every resolution
+static void time_readings(void) {
+    struct timespec start;
+    uint64_t t = UNIX_BASE_MS + 30 * 86400000ULL;
+    uint32_t i, n = 7 * 86400;
+    verbose = 0;
+    publishedCount = MAX_WINDOWS + 1; // not kept
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < n; i++) {
+        rollup_add_at(2100 + (int32_t)(i % 97), t + i * 1000ULL);
+    }
+    printf("time: %.1f ns a reading here, %u bytes of windows for %d resolutions\n", elapsed_ns(&start) / n,
+           (uint32_t)(ROLLUP_LEVELS * sizeof(rollup_window_t)), ROLLUP_LEVELS);
+}
+
+int main(int argc, char **argv) {
+    uint32_t days = 3, seed = 1;
+    uint8_t level;
+    int opt, failed;
+    while ((opt = getopt(argc, argv, "d:s:v")) != -1) {
+        switch (opt) {
+        case 'd':
+            days = atoi(optarg);
+            break;
+        case 's':
+            seed = atoi(optarg);
+            break;
+        case 'v':
+            verbose = 1;
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-d days] [-s seed] [-v]\n", argv[0]);
+            return 2;
+        }
+    }
+    if (days < 1 || days > 30) {
+        fprintf(stderr, "days must be 1..30\n");
+        return 2;
+    }
+    srand(seed);
+    for (level = 0; level < ROLLUP_LEVELS; level++) {
+        periodsMs[level] = rollup_period_s(level) * 1000;
+    }
+    readings = calloc(days * 86400 / 5 * 2, sizeof(*readings));
+    published = calloc(MAX_WINDOWS, sizeof(*published));
+    if (readings == NULL || published == NULL) {
+        return 2;
+    }
+    rollup_start(publish, NULL);
+    run_readings(days);
+    failed = check_windows(days);
+    time_readings();
+    if (!failed) {
+        printf("PASS\n");
+    }
+    return failed;
+}
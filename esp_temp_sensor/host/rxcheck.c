@@ -0,0 +1,218 @@
+// Checks mqtt.c's receive path by handing data_recv_callback() streams
+// built here, cut into segments of 1, 7, 100, 536 and 1460 bytes and whole:
+//
+//   - a PUBLISH larger than MQTT_RX_BUF_LEN, its payload made of packets
+//     of its own, is skipped to its end: none of them is taken for a
+//     packet, and the PUBLISH and PINGRESP after it are handed over
+//   - a segment larger than the room left in the buffer, holding many
+//     small packets, has every one of them handed over
+//   - a remaining length that cannot be decoded closes the connection
+//   - a CONNACK shorter or longer than its two bytes closes the connection
+//     without being taken for one, and a whole one is
+//
+// usage: rxcheck [options]
+//   -v           print the firmware's debug output
+//
+// Exits 1 if a check fails.
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "osapi.h"
+#include "mqtt.h"
+#include "host.h"
+
+#define STREAM_LEN 8192
+#define OVERSIZE (MQTT_RX_BUF_LEN * 2 + 300)
+#define SMALL_PACKETS 40
+
+static mqtt_session_t session;
+static uint8_t stream[STREAM_LEN];
+static uint32_t streamLen;
+static uint32_t messages, fakes, connacks, lost;
+static uint8_t connackCode, sessionPresent;
+static char lastTopic[16];
+
+static void on_message(void *arg, uint8_t *topic, uint32_t topic_len, uint8_t *payload, uint32_t payload_len) {
+    messages++;
+    if (topic_len == 4 && memcmp(topic, "fake", 4) == 0) {
+        fakes++;
+    }
+    topic_len = (topic_len < sizeof(lastTopic) - 1) ? topic_len : sizeof(lastTopic) - 1;
+    memcpy(lastTopic, topic, topic_len);
+    lastTopic[topic_len] = '\0';
+}
+
+static void on_connack(void *arg) {
+    connacks++;
+    connackCode = session.connackCode;
+    sessionPresent = session.sessionPresent;
+}
+
+static void on_lost(void *arg) {
+    lost++;
+}
+
+static void reset(void) {
+    memset(&session, 0, sizeof(session));
+    session.activeConnection = &session.conn;
+    session.conn.reverse = &session;
+    session.validConnection = 1;
+    session.message_cb = on_message;
+    session.connack_cb = on_connack;
+    session.disconnect_cb = on_lost;
+    messages = fakes = connacks = lost = 0;
+    lastTopic[0] = '\0';
+    streamLen = 0;
+}
+
+static void put(const uint8_t *data, uint32_t len) {
+    memcpy(stream + streamLen, data, len);
+    streamLen += len;
+}
+
+// a QoS 0 PUBLISH, with payloadLen bytes of payload, fill repeated through it
+static void put_publish(const char *topic, uint32_t payloadLen, const uint8_t *fill, uint32_t fillLen) {
+    uint8_t head[8];
+    uint32_t topicLen = strlen(topic), rest = 2 + topicLen + payloadLen, i;
+    head[0] = MQTT_MSG_TYPE_PUBLISH << 4;
+    i = 1 + encodeLength(rest, head + 1);
+    head[i++] = topicLen >> 8;
+    head[i++] = topicLen & 0xFF;
+    put(head, i);
+    put((const uint8_t *)topic, topicLen);
+    for (i = 0; i < payloadLen; i++) {
+        stream[streamLen++] = fill[i % fillLen];
+    }
+}
+
+static void feed(uint32_t segment) {
+    uint32_t at, n;
+    for (at = 0; at < streamLen; at += n) {
+        n = (streamLen - at < segment) ? streamLen - at : segment;
+        data_recv_callback(&session.conn, (char *)stream + at, n);
+    }
+}
+
+static const uint32_t segments[] = { 1, 7, 100, 536, 1460, STREAM_LEN };
+#define SEGMENT_SIZES (sizeof(segments) / sizeof(segments[0]))
+
+static int check_oversize(void) {
+    // what the oversized payload is made of: a CONNACK and a PUBLISH on "fake"
+    static const uint8_t fake[] = { 0x20, 0x02, 0x00, 0x00, 0x30, 0x08, 0x00, 0x04, 'f', 'a', 'k', 'e', 'x', 'y' };
+    static const uint8_t pingresp[] = { MQTT_MSG_TYPE_PINGRESP << 4, 0x00 };
+    uint32_t i;
+    int wrong = 0;
+    for (i = 0; i < SEGMENT_SIZES; i++) {
+        reset();
+        put_publish("big", OVERSIZE, fake, sizeof(fake));
+        put_publish("real", 5, (const uint8_t *)"after", 5);
+        put(pingresp, sizeof(pingresp));
+        feed(segments[i]);
+        if (messages != 1 || strcmp(lastTopic, "real") != 0 || fakes || connacks || lost || session.rxLen ||
+            session.rxSkip) {
+            printf("oversize: in %u byte segments, %u messages (%u fake, last on \"%s\"), %u CONNACKs, %u closes, "
+                   "%u bytes left, %u to skip\n", segments[i], messages, fakes, lastTopic, connacks, lost,
+                   session.rxLen, session.rxSkip);
+            wrong++;
+        }
+    }
+    return wrong;
+}
+
+static int check_packed(void) {
+    uint32_t i, p;
+    int wrong = 0;
+    for (i = 0; i < SEGMENT_SIZES; i++) {
+        reset();
+        for (p = 0; p < SMALL_PACKETS; p++) {
+            put_publish("many", 90, (const uint8_t *)"0123456789", 10);
+        }
+        feed(segments[i]);
+        if (messages != SMALL_PACKETS || lost || session.rxLen) {
+            printf("packed: %u bytes in %u byte segments, %u of %u messages, %u closes, %u bytes left\n", streamLen,
+                   segments[i], messages, SMALL_PACKETS, lost, session.rxLen);
+            wrong++;
+        }
+    }
+    return wrong;
+}
+
+static int check_malformed(void) {
+    static const uint8_t bad[] = { 0x30, 0xFF, 0xFF, 0xFF, 0xFF, 0x01 };
+    reset();
+    put(bad, sizeof(bad));
+    put_publish("real", 5, (const uint8_t *)"after", 5);
+    feed(STREAM_LEN);
+    if (lost != 1 || session.validConnection || messages) {
+        printf("malformed: %u closes, %u messages after it\n", lost, messages);
+        return 1;
+    }
+    return 0;
+}
+
+static int check_connack(void) {
+    static const struct {
+        const char *what;
+        uint8_t bytes[6];
+        uint8_t len;
+        uint8_t good;
+    } cases[] = {
+        { "empty", { 0x20, 0x00 }, 2, 0 },
+        { "short", { 0x20, 0x01, 0x01 }, 3, 0 },
+        { "long", { 0x20, 0x03, 0x01, 0x00, 0x00 }, 5, 0 },
+        { "accepted", { 0x20, 0x02, 0x01, 0x00 }, 4, 1 },
+        { "refused", { 0x20, 0x02, 0x00, 0x05 }, 4, 1 },
+    };
+    uint32_t i;
+    int wrong = 0;
+    for (i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+        reset();
+        // what the last connection left behind
+        session.connackCode = 0x7F;
+        session.sessionPresent = 1;
+        connackCode = sessionPresent = 0;
+        put(cases[i].bytes, cases[i].len);
+        feed(STREAM_LEN);
+        if (cases[i].good && (connacks != 1 || lost || connackCode != cases[i].bytes[3] ||
+                              sessionPresent != (cases[i].bytes[3] == 0 ? (cases[i].bytes[2] & 1) : 0))) {
+            printf("connack: %s gave %u CONNACKs, code %u, session present %u, %u closes\n", cases[i].what, connacks,
+                   connackCode, sessionPresent, lost);
+            wrong++;
+        }
+        if (!cases[i].good && (connacks || lost != 1)) {
+            printf("connack: %s gave %u CONNACKs and %u closes, want none and one\n", cases[i].what, connacks, lost);
+            wrong++;
+        }
+    }
+    return wrong;
+}
+
+int main(int argc, char **argv) {
+    int opt, wrong = 0;
+    host_verbose = 0;
+    while ((opt = getopt(argc, argv, "v")) != -1) {
+        switch (opt) {
+        case 'v':
+            host_verbose = 1;
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-v]\n", argv[0]);
+            return 2;
+        }
+    }
+    wrong += check_oversize();
+    wrong += check_packed();
+    wrong += check_malformed();
+    wrong += check_connack();
+    printf("%u segment sizes, a %u byte payload against a %u byte buffer, %u packets in one stream\n",
+           (uint32_t)SEGMENT_SIZES, OVERSIZE, MQTT_RX_BUF_LEN, SMALL_PACKETS);
+    if (wrong > 0) {
+        printf("FAIL: %d checks failed\n", wrong);
+        return 1;
+    }
+    printf("PASS\n");
+    return 0;
+}
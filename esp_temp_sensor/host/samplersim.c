@@ -0,0 +1,207 @@
+// Runs sampler.c on a virtual clock against an enclosure's temperature:
+// steady, a heater kicking on and off, a door left open and a slow drift,
+// with noise on every reading. Against the same temperature it runs the
+// old fixed 20 s cycle that publishes every reading, and prints what each
+// cost in publishes and how far the last published reading strayed from
+// the real temperature, checked every second.
+//
+//   0 h    steady at 21 C
+//   2 h    heater on for 30 min, heading for 35 C, then cooling back
+//   6 h    door open for 5 min, heading for 12 C, then recovering
+//   9 h    drifting up 0.5 C an hour
+//
+// usage: samplersim [options]
+//   -H hours     how long to simulate (12)
+//   -s centi     noise on each reading, in centi-degrees (2)
+//   -v           print every change of period as it is reported
+//
+// Exits 1 if any hour published more than the budget allows.
+
+#include <getopt.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "osapi.h"
+#include "twheel.h"
+#include "sampler.h"
+#include "host.h"
+
+#define FIXED_MS 20000 // blink_timer's period
+#define HOUR_US 3600000000ULL
+#define MAX_HOURS 168
+
+typedef struct {
+    const char *name;
+    uint32_t published[MAX_HOURS];
+    int32_t last; // the last published reading
+    double worst; // centi-degrees
+    double sumSq;
+    uint32_t checks;
+} tracker_t;
+
+static double noiseCenti = 2;
+static int verbose;
+static tracker_t adaptive = { "adaptive" }, fixed = { "fixed 20 s" };
+static uint64_t periodUs[16]; // time spent at each period, by level
+static uint32_t lastPeriodMs;
+static uint64_t lastChangeUs;
+
+static double gaussian(void) {
+    double u = (rand() + 1.0) / (RAND_MAX + 2.0), v = (rand() + 1.0) / (RAND_MAX + 2.0);
+    return sqrt(-2.0 * log(u)) * cos(2 * M_PI * v);
+}
+
+// the enclosure's temperature in degrees at t seconds
+static double truth(double t) {
+    double h = t / 3600, c = 21;
+    if (h >= 2 && h < 2.5) {
+        c += 14 * (1 - exp(-(t - 2 * 3600) / 600));
+    } else if (h >= 2.5) {
+        c += 14 * (1 - exp(-1800.0 / 600)) * exp(-(t - 2.5 * 3600) / 1200);
+    }
+    if (h >= 6 && h < 6 + 5 / 60.0) {
+        c -= 9 * (1 - exp(-(t - 6 * 3600) / 120));
+    } else if (h >= 6 + 5 / 60.0) {
+        c -= 9 * (1 - exp(-300.0 / 120)) * exp(-(t - (6 * 3600 + 300)) / 900);
+    }
+    if (h >= 9) {
+        c += 0.5 * (h - 9);
+    }
+    return c;
+}
+
+static int32_t reading(void) {
+    return (int32_t)lround(truth(host_time_us() / 1e6) * 100 + noiseCenti * gaussian());
+}
+
+static void publish(tracker_t *tr, int32_t centi) {
+    uint32_t hour = host_time_us() / HOUR_US;
+    if (hour < MAX_HOURS) {
+        tr->published[hour]++;
+    }
+    tr->last = centi;
+}
+
+static void on_publish(void *arg, int32_t centi) {
+    publish(&adaptive, centi);
+}
+
+// adds the time since the last change to the period it was at
+static void account_period(void) {
+    uint32_t level = 0;
+    while ((SAMPLER_MIN_MS << level) < lastPeriodMs && level < 15) {
+        level++;
+    }
+    periodUs[level] += host_time_us() - lastChangeUs;
+    lastChangeUs = host_time_us();
+    lastPeriodMs = sampler_stats()->periodMs;
+}
+
+static void on_report(void *arg) {
+    const sampler_stats_t *st = sampler_stats();
+    uint32_t hour = host_time_us() / HOUR_US;
+    account_period();
+    if (hour < MAX_HOURS) {
+        adaptive.published[hour]++;
+    }
+    if (verbose) {
+        char report[160];
+        sampler_report(report, sizeof(report));
+        printf("%8.1f s  %.2f C  %s\n", host_time_us() / 1e6, st->last / 100.0, report);
+    }
+}
+
+static void fixed_tick(void *arg) {
+    publish(&fixed, reading());
+}
+
+static void track(tracker_t *tr, double centi) {
+    double error = fabs(tr->last - centi);
+    if (error > tr->worst) {
+        tr->worst = error;
+    }
+    tr->sumSq += error * error;
+    tr->checks++;
+}
+
+static uint32_t summary(const tracker_t *tr, uint32_t hours) {
+    uint32_t i, total = 0, most = 0;
+    for (i = 0; i < hours; i++) {
+        total += tr->published[i];
+        if (tr->published[i] > most) {
+            most = tr->published[i];
+        }
+    }
+    printf("%-11s %9u %9.1f %9u %10.2f %10.2f\n", tr->name, total, total / (double)hours, most, tr->worst / 100,
+           sqrt(tr->sumSq / tr->checks) / 100);
+    return most;
+}
+
+static void usage(void) {
+    fprintf(stderr, "usage: samplersim [-H hours] [-s noise_centi] [-v]\n");
+    exit(2);
+}
+
+int main(int argc, char **argv) {
+    uint32_t hours = 12, i, most;
+    twheel_timer_t fixedTimer;
+    const sampler_stats_t *st;
+    uint64_t endUs, t;
+    int c;
+
+    host_verbose = 0;
+    while ((c = getopt(argc, argv, "H:s:v")) != -1) {
+        switch (c) {
+            case 'H': hours = atoi(optarg); break;
+            case 's': noiseCenti = atof(optarg); break;
+            case 'v': verbose = 1; break;
+            default: usage();
+        }
+    }
+    if (hours == 0 || hours > MAX_HOURS || noiseCenti < 0) {
+        usage();
+    }
+    host_virtual_time = 1;
+    srand(1);
+    twheel_init();
+
+    twheel_setfn(&fixedTimer, fixed_tick, NULL);
+    twheel_arm(&fixedTimer, FIXED_MS, 1);
+    fixed_tick(NULL);
+    sampler_start(reading, on_publish, on_report, NULL);
+    lastPeriodMs = sampler_stats()->periodMs;
+
+    endUs = hours * HOUR_US;
+    for (t = 1000000; t <= endUs; t += 1000000) {
+        host_loop_run(t, NULL);
+        track(&adaptive, truth(t / 1e6) * 100);
+        track(&fixed, truth(t / 1e6) * 100);
+    }
+    sampler_stop();
+    twheel_disarm(&fixedTimer);
+    account_period();
+
+    st = sampler_stats();
+    printf("%u h, %u samples, %u changes of period, %u readings left out over budget\n\n", hours, st->samples,
+           st->changes, st->suppressed);
+    printf("%-11s %9s %9s %9s %10s %10s\n", "", "publishes", "an hour", "most/hour", "worst C", "rms C");
+    most = summary(&adaptive, hours);
+    summary(&fixed, hours);
+    printf("\ntime at each period:");
+    for (i = 0; i < 16; i++) {
+        if (periodUs[i] > 0) {
+            uint32_t ms = SAMPLER_MIN_MS << i;
+            printf(" %u ms %.1f%%", (ms > SAMPLER_MAX_MS) ? SAMPLER_MAX_MS : ms, 100.0 * periodUs[i] / endUs);
+        }
+    }
+    printf("\n");
+    if (most > SAMPLER_BUDGET_PER_HOUR + SAMPLER_BURST) {
+        printf("FAIL: %u publishes in one hour, the budget is %d plus a burst of %d\n", most, SAMPLER_BUDGET_PER_HOUR,
+               SAMPLER_BURST);
+        return 1;
+    }
+    printf("PASS\n");
+    return 0;
+}
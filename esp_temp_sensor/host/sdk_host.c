@@ -0,0 +1,980 @@
+// Linux implementation of the parts of the ESP8266 NonOS SDK the firmware
+// uses: os_timer on a binary heap, espconn TCP on nonblocking sockets and
+// epoll, a counted heap, flash in memory and stubs for wifi and GPIO.
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "ets_sys.h"
+#include "osapi.h"
+#include "mem.h"
+#include "gpio.h"
+#include "uart.h"
+#include "user_interface.h"
+#include "espconn.h"
+#include "host.h"
+
+#define MAX_EVENTS 256
+
+int host_verbose = 1;
+uint32_t host_chip_id = 0x00c0ffee;
+uint32_t host_time_base;
+uint32_t host_rst_reason = REASON_DEFAULT_RST;
+uint8_t host_virtual_time;
+uint8_t host_wifi_status = STATION_GOT_IP;
+uint16_t (*host_adc)(void);
+const char *host_rtc_file;
+host_net_stats_t host_tcp_stats;
+host_net_stats_t host_udp_stats;
+volatile uint32 host_gpio_regs[8];
+
+static int epfd = -1;
+static uint64_t startNs;
+static uint64_t virtualUs;
+
+/******************************************************************************
+ * clock
+ */
+
+static uint64_t mono_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+uint64_t host_time_us(void) {
+    if (host_virtual_time) {
+        return virtualUs;
+    }
+    if (startNs == 0) {
+        startNs = mono_ns();
+    }
+    return (mono_ns() - startNs) / 1000;
+}
+
+uint32 system_get_time(void) {
+    return (uint32)host_time_us() + host_time_base;
+}
+
+// The RTC keeps running through deep sleep, so it follows the wall clock
+// rather than the process
+uint32 system_get_rtc_time(void) {
+    struct timespec ts;
+    if (host_virtual_time) {
+        return (uint32)(virtualUs / (HOST_RTC_CALI >> 12));
+    }
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint32)(((uint64_t)ts.tv_sec * 1000000ull + ts.tv_nsec / 1000) / (HOST_RTC_CALI >> 12));
+}
+
+uint32 system_rtc_clock_cali_proc(void) {
+    return HOST_RTC_CALI;
+}
+
+void os_delay_us(uint32 us) {
+    struct timespec ts = { us / 1000000, (us % 1000000) * 1000 };
+    if (host_virtual_time) {
+        virtualUs += us;
+        return;
+    }
+    nanosleep(&ts, NULL);
+}
+
+/******************************************************************************
+ * timers, a binary min-heap on the deadline; host_slot is index + 1, so a
+ * zeroed os_timer_t is disarmed
+ */
+
+static os_timer_t **heap;
+static int heapLen;
+static int heapCap;
+
+static void heap_set(int i, os_timer_t *t) {
+    heap[i] = t;
+    t->host_slot = i + 1;
+}
+
+static void heap_up(int i) {
+    while (i > 0) {
+        int parent = (i - 1) / 2;
+        if (heap[parent]->host_deadline <= heap[i]->host_deadline) {
+            break;
+        }
+        os_timer_t *t = heap[parent];
+        heap_set(parent, heap[i]);
+        heap_set(i, t);
+        i = parent;
+    }
+}
+
+static void heap_down(int i) {
+    for (;;) {
+        int least = i;
+        int l = 2 * i + 1;
+        int r = l + 1;
+        if (l < heapLen && heap[l]->host_deadline < heap[least]->host_deadline) {
+            least = l;
+        }
+        if (r < heapLen && heap[r]->host_deadline < heap[least]->host_deadline) {
+            least = r;
+        }
+        if (least == i) {
+            break;
+        }
+        os_timer_t *t = heap[least];
+        heap_set(least, heap[i]);
+        heap_set(i, t);
+        i = least;
+    }
+}
+
+static void heap_remove(os_timer_t *t) {
+    int i = t->host_slot - 1;
+    t->host_slot = 0;
+    heapLen--;
+    if (i == heapLen) {
+        return;
+    }
+    heap_set(i, heap[heapLen]);
+    heap_up(i);
+    heap_down(heap[i]->host_slot - 1);
+}
+
+static void heap_insert(os_timer_t *t) {
+    if (heapLen == heapCap) {
+        heapCap = heapCap ? heapCap * 2 : 64;
+        heap = realloc(heap, heapCap * sizeof(*heap));
+    }
+    heap_set(heapLen, t);
+    heapLen++;
+    heap_up(heapLen - 1);
+}
+
+void os_timer_setfn(os_timer_t *ptimer, os_timer_func_t *pfunction, void *parg) {
+    ptimer->timer_func = pfunction;
+    ptimer->timer_arg = parg;
+}
+
+void os_timer_disarm(os_timer_t *ptimer) {
+    if (ptimer->host_slot != 0) {
+        heap_remove(ptimer);
+    }
+}
+
+void os_timer_arm_us(os_timer_t *ptimer, uint32 usec, bool repeat_flag) {
+    os_timer_disarm(ptimer);
+    ptimer->timer_period = repeat_flag ? usec : 0;
+    ptimer->host_deadline = host_time_us() + usec;
+    heap_insert(ptimer);
+}
+
+void os_timer_arm(os_timer_t *ptimer, uint32 msec, bool repeat_flag) {
+    os_timer_arm_us(ptimer, msec * 1000, repeat_flag);
+}
+
+static void run_timers(void) {
+    uint64_t now = host_time_us();
+    while (heapLen > 0 && heap[0]->host_deadline <= now) {
+        os_timer_t *t = heap[0];
+        heap_remove(t);
+        if (t->timer_period != 0) {
+            t->host_deadline += t->timer_period;
+            heap_insert(t);
+        }
+        t->timer_func(t->timer_arg);
+    }
+}
+
+/******************************************************************************
+ * heap, counted so tools can report what the firmware code would use
+ */
+
+static uint32_t heapUsed;
+static uint32_t heapPeak;
+
+void *os_malloc(size_t size) {
+    size_t *p = malloc(size + sizeof(size_t));
+    if (p == NULL) {
+        return NULL;
+    }
+    *p = size;
+    heapUsed += size;
+    if (heapUsed > heapPeak) {
+        heapPeak = heapUsed;
+    }
+    return p + 1;
+}
+
+void *os_zalloc(size_t size) {
+    void *p = os_malloc(size);
+    if (p != NULL) {
+        memset(p, 0, size);
+    }
+    return p;
+}
+
+void os_free(void *ptr) {
+    if (ptr == NULL) {
+        return;
+    }
+    size_t *p = (size_t *)ptr - 1;
+    heapUsed -= *p;
+    free(p);
+}
+
+uint32_t host_heap_used(void) {
+    return heapUsed;
+}
+
+uint32_t host_heap_peak(void) {
+    return heapPeak;
+}
+
+uint32 system_get_free_heap_size(void) {
+    return (heapUsed < HOST_HEAP_SIZE) ? HOST_HEAP_SIZE - heapUsed : 0;
+}
+
+/******************************************************************************
+ * system, wifi and GPIO stubs
+ */
+
+static uint8 osPrint = 1;
+static uint8 cpuFreq = SYS_CPU_80MHZ;
+
+int os_printf(const char *fmt, ...) {
+    va_list ap;
+    int n;
+    if (!host_verbose || !osPrint) {
+        return 0;
+    }
+    va_start(ap, fmt);
+    n = vprintf(fmt, ap);
+    va_end(ap);
+    return n;
+}
+
+unsigned long os_random(void) {
+    return (unsigned long)random();
+}
+
+void system_set_os_print(uint8 onoff) {
+    osPrint = onoff;
+}
+
+uint32 system_get_chip_id(void) {
+    return host_chip_id;
+}
+
+uint8 system_get_cpu_freq(void) {
+    return cpuFreq;
+}
+
+bool system_update_cpu_freq(uint8 freq) {
+    if (freq != SYS_CPU_80MHZ && freq != SYS_CPU_160MHZ) {
+        return false;
+    }
+    cpuFreq = freq;
+    return true;
+}
+
+void system_soft_wdt_feed(void) {
+}
+
+uint16 system_adc_read(void) {
+    return (host_adc != NULL) ? host_adc() : 0;
+}
+
+struct rst_info *system_get_rst_info(void) {
+    static struct rst_info info;
+    info.reason = host_rst_reason;
+    return &info;
+}
+
+/******************************************************************************
+ * RTC memory: 192 blocks of 4 bytes, the first 64 reserved for the SDK. Kept
+ * in host_rtc_file when set, so it survives into the next run like it
+ * survives deep sleep.
+ */
+
+static uint32 rtcMem[192];
+static uint8 rtcLoaded;
+
+static void rtc_load(void) {
+    FILE *f;
+    if (rtcLoaded) {
+        return;
+    }
+    rtcLoaded = 1;
+    if (host_rtc_file != NULL && (f = fopen(host_rtc_file, "rb")) != NULL) {
+        if (fread(rtcMem, sizeof(rtcMem), 1, f) != 1) {
+            memset(rtcMem, 0, sizeof(rtcMem));
+        }
+        fclose(f);
+    }
+}
+
+bool system_rtc_mem_read(uint8 src_addr, void *des_addr, uint16 load_size) {
+    if (src_addr < 64 || src_addr * 4 + load_size > sizeof(rtcMem)) {
+        return false;
+    }
+    rtc_load();
+    memcpy(des_addr, (uint8 *)rtcMem + src_addr * 4, load_size);
+    return true;
+}
+
+bool system_rtc_mem_write(uint8 des_addr, const void *src_addr, uint16 save_size) {
+    FILE *f;
+    if (des_addr < 64 || des_addr * 4 + save_size > sizeof(rtcMem)) {
+        return false;
+    }
+    rtc_load();
+    memcpy((uint8 *)rtcMem + des_addr * 4, src_addr, save_size);
+    if (host_rtc_file != NULL && (f = fopen(host_rtc_file, "wb")) != NULL) {
+        fwrite(rtcMem, sizeof(rtcMem), 1, f);
+        fclose(f);
+    }
+    return true;
+}
+
+void system_restart(void) {
+    os_printf("system_restart\n");
+    exit(0);
+}
+
+bool wifi_get_ip_info(uint8 if_index, struct ip_info *info) {
+    memset(info, 0, sizeof(*info));
+    if (host_wifi_status != STATION_GOT_IP) {
+        return true;
+    }
+    info->ip.addr = htonl(0x7f000001);
+    info->netmask.addr = htonl(0xff000000);
+    return true;
+}
+
+uint8 wifi_station_get_connect_status(void) {
+    return host_wifi_status;
+}
+
+bool wifi_set_opmode(uint8 opmode) {
+    return true;
+}
+
+bool wifi_set_opmode_current(uint8 opmode) {
+    return true;
+}
+
+bool wifi_station_set_config_current(struct station_config *config) {
+    return true;
+}
+
+void wifi_status_led_install(uint8 gpio_id, uint32 gpio_name, uint8 gpio_func) {
+}
+
+sint8 wifi_station_get_rssi(void) {
+    return -60;
+}
+
+// Nothing sleeps on the host, the type is only remembered
+static enum sleep_type sleepType;
+
+bool wifi_set_sleep_type(enum sleep_type type) {
+    sleepType = type;
+    return true;
+}
+
+enum sleep_type wifi_get_sleep_type(void) {
+    return sleepType;
+}
+
+void uart_div_modify(uint8 uart_no, uint32 DivLatchValue) {
+}
+
+void host_gpio_write(uint32 reg, uint32 val) {
+    switch (reg) {
+        case GPIO_OUT_W1TS_ADDRESS:
+            host_gpio_regs[GPIO_OUT_ADDRESS / 4] |= val;
+            break;
+        case GPIO_OUT_W1TC_ADDRESS:
+            host_gpio_regs[GPIO_OUT_ADDRESS / 4] &= ~val;
+            break;
+        default:
+            host_gpio_regs[reg / 4] = val;
+            break;
+    }
+}
+
+void gpio_output_set(uint32 set_mask, uint32 clear_mask, uint32 enable_mask, uint32 disable_mask) {
+    host_gpio_regs[GPIO_OUT_ADDRESS / 4] = (host_gpio_regs[GPIO_OUT_ADDRESS / 4] | set_mask) & ~clear_mask;
+    host_gpio_regs[GPIO_ENABLE_ADDRESS / 4] = (host_gpio_regs[GPIO_ENABLE_ADDRESS / 4] | enable_mask) & ~disable_mask;
+}
+
+void gpio_init(void) {
+}
+
+// hw_timer.c in the SDK driver_lib ships without a header, these match the
+// prototypes pwm_out.c declares. The FRC1 interrupt is not run on the host:
+// at 5 kHz it would swamp every tool, so PWM outputs stay where they are
+// unless a tool calls host_hw_timer_fn itself.
+typedef enum {
+    FRC1_SOURCE = 0,
+    NMI_SOURCE = 1,
+} FRC1_TIMER_SOURCE_TYPE;
+
+void (*host_hw_timer_fn)(void);
+uint32_t host_hw_timer_us;
+
+void hw_timer_init(FRC1_TIMER_SOURCE_TYPE source_type, u8 req) {
+}
+
+void hw_timer_set_func(void (*user_hw_timer_cb_set)(void)) {
+    host_hw_timer_fn = user_hw_timer_cb_set;
+}
+
+void hw_timer_arm(u32 val) {
+    host_hw_timer_us = val;
+}
+
+/******************************************************************************
+ * flash, in memory and erased at start. Writes clear bits like NOR flash
+ * does, so a write to a sector that was not erased shows up as corruption.
+ */
+
+static uint8 flash[HOST_FLASH_SIZE];
+static uint8 flashErased;
+static uint8 upgradeFlag = UPGRADE_FLAG_IDLE;
+
+static void flash_init(void) {
+    if (!flashErased) {
+        memset(flash, 0xFF, sizeof(flash));
+        flashErased = 1;
+    }
+}
+
+SpiFlashOpResult spi_flash_erase_sector(uint16 sec) {
+    flash_init();
+    if ((uint32)(sec + 1) * SPI_FLASH_SEC_SIZE > sizeof(flash)) {
+        return SPI_FLASH_RESULT_ERR;
+    }
+    memset(flash + sec * SPI_FLASH_SEC_SIZE, 0xFF, SPI_FLASH_SEC_SIZE);
+    return SPI_FLASH_RESULT_OK;
+}
+
+SpiFlashOpResult spi_flash_write(uint32 des_addr, uint32 *src_addr, uint32 size) {
+    const uint8 *src = (const uint8 *)src_addr;
+    uint32 i;
+    flash_init();
+    if ((des_addr & 3) != 0 || des_addr + size > sizeof(flash)) {
+        return SPI_FLASH_RESULT_ERR;
+    }
+    for (i = 0; i < size; i++) {
+        flash[des_addr + i] &= src[i];
+    }
+    return SPI_FLASH_RESULT_OK;
+}
+
+SpiFlashOpResult spi_flash_read(uint32 src_addr, uint32 *des_addr, uint32 size) {
+    flash_init();
+    if ((src_addr & 3) != 0 || src_addr + size > sizeof(flash)) {
+        return SPI_FLASH_RESULT_ERR;
+    }
+    memcpy(des_addr, flash + src_addr, size);
+    return SPI_FLASH_RESULT_OK;
+}
+
+// one copy at start_sec, without the SDK's backup sector and flag sector
+bool system_param_save_with_protect(uint16 start_sec, void *param, uint16 len) {
+    if (len > SPI_FLASH_SEC_SIZE || spi_flash_erase_sector(start_sec) != SPI_FLASH_RESULT_OK) {
+        return false;
+    }
+    return spi_flash_write(start_sec * SPI_FLASH_SEC_SIZE, param, (len + 3) & ~3) == SPI_FLASH_RESULT_OK;
+}
+
+bool system_param_load(uint16 start_sec, uint16 offset, void *param, uint16 len) {
+    flash_init();
+    if ((uint32)start_sec * SPI_FLASH_SEC_SIZE + offset + len > sizeof(flash)) {
+        return false;
+    }
+    memcpy(param, flash + start_sec * SPI_FLASH_SEC_SIZE + offset, len);
+    return true;
+}
+
+bool system_partition_table_regist(const partition_item_t *partition_table, uint32 partition_num, uint32 map) {
+    return true;
+}
+
+// always running from bank 1
+uint8 system_upgrade_userbin_check(void) {
+    return UPGRADE_FW_BIN1;
+}
+
+uint8 system_upgrade_flag_check(void) {
+    return upgradeFlag;
+}
+
+void system_upgrade_flag_set(uint8 flag) {
+    upgradeFlag = flag;
+}
+
+void system_upgrade_reboot(void) {
+    os_printf("system_upgrade_reboot\n");
+    exit(0);
+}
+
+/******************************************************************************
+ * espconn, TCP client and UDP. Like the SDK, callbacks never run from
+ * inside the call that caused them: sent and disconnect callbacks are
+ * deferred to the event loop.
+ */
+
+typedef struct host_conn {
+    struct espconn *conn;
+    int fd;
+    uint8_t connecting;
+    uint8_t udp; // made by espconn_create(), datagrams go to proto.udp's remote address
+    uint8_t sentPending; // everything queued has left, call sent_callback
+    uint8_t closePending; // espconn_disconnect() was called, call disconnect_callback
+    uint8_t *out; // bytes the socket would not take yet
+    uint32_t outLen;
+    uint32_t outCap;
+    struct host_conn *nextPending;
+    uint8_t onPending;
+} host_conn_t;
+
+static host_conn_t *pendingHead;
+static uint32 nextPort = 49152;
+
+static void ensure_epoll(void) {
+    if (epfd < 0) {
+        epfd = epoll_create1(0);
+    }
+}
+
+static void defer(host_conn_t *hc) {
+    if (!hc->onPending) {
+        hc->onPending = 1;
+        hc->nextPending = pendingHead;
+        pendingHead = hc;
+    }
+}
+
+static void watch(host_conn_t *hc, uint32_t events) {
+    struct epoll_event ev;
+    ev.events = events;
+    ev.data.ptr = hc;
+    epoll_ctl(epfd, EPOLL_CTL_MOD, hc->fd, &ev);
+}
+
+// Closes the socket and detaches it from the espconn. The host_conn itself
+// is freed from run_pending(), as events for it may still be in the batch
+// being dispatched.
+static void close_conn(host_conn_t *hc) {
+    if (hc->fd >= 0) {
+        epoll_ctl(epfd, EPOLL_CTL_DEL, hc->fd, NULL);
+        close(hc->fd);
+        hc->fd = -1;
+    }
+    if (hc->conn != NULL && hc->conn->host == hc) {
+        hc->conn->host = NULL;
+        hc->conn->state = ESPCONN_CLOSE;
+    }
+    free(hc->out);
+    hc->out = NULL;
+    hc->outLen = hc->outCap = 0;
+    defer(hc);
+}
+
+static void fail_conn(host_conn_t *hc, sint8 err) {
+    struct espconn *conn = hc->conn;
+    hc->closePending = 0;
+    hc->sentPending = 0;
+    close_conn(hc);
+    if (conn->proto.tcp->reconnect_callback != NULL) {
+        conn->proto.tcp->reconnect_callback(conn, err);
+    }
+}
+
+static sint8 errno_to_espconn(int err) {
+    switch (err) {
+        case ECONNREFUSED:
+        case ECONNRESET:
+            return ESPCONN_RST;
+        case ETIMEDOUT:
+            return ESPCONN_TIMEOUT;
+        case EHOSTUNREACH:
+        case ENETUNREACH:
+            return ESPCONN_RTE;
+        default:
+            return ESPCONN_CONN;
+    }
+}
+
+sint8 espconn_connect(struct espconn *espconn) {
+    struct sockaddr_in addr;
+    struct epoll_event ev;
+    host_conn_t *hc;
+    int one = 1;
+
+    ensure_epoll();
+    if (espconn->host != NULL) {
+        // a deferred disconnect for the old socket must not reach the new one
+        host_conn_t *old = espconn->host;
+        old->closePending = 0;
+        old->sentPending = 0;
+        close_conn(old);
+    }
+    hc = calloc(1, sizeof(*hc));
+    hc->conn = espconn;
+    hc->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (hc->fd < 0) {
+        free(hc);
+        return ESPCONN_MEM;
+    }
+    setsockopt(hc->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(espconn->proto.tcp->remote_port);
+    memcpy(&addr.sin_addr.s_addr, espconn->proto.tcp->remote_ip, 4);
+    if (connect(hc->fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 && errno != EINPROGRESS) {
+        int err = errno;
+        close(hc->fd);
+        free(hc);
+        return errno_to_espconn(err);
+    }
+    hc->connecting = 1;
+    host_tcp_stats.connects++;
+    espconn->host = hc;
+    espconn->state = ESPCONN_WAIT;
+    ev.events = EPOLLOUT;
+    ev.data.ptr = hc;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, hc->fd, &ev);
+    return ESPCONN_OK;
+}
+
+sint8 espconn_disconnect(struct espconn *espconn) {
+    host_conn_t *hc = espconn->host;
+    if (hc == NULL) {
+        return ESPCONN_ARG;
+    }
+    hc->closePending = 1;
+    defer(hc);
+    close_conn(hc);
+    return ESPCONN_OK;
+}
+
+sint8 espconn_delete(struct espconn *espconn) {
+    if (espconn->host != NULL) {
+        host_conn_t *hc = espconn->host;
+        hc->closePending = 0;
+        hc->sentPending = 0;
+        close_conn(hc);
+    }
+    return ESPCONN_OK;
+}
+
+sint8 espconn_create(struct espconn *espconn) {
+    struct sockaddr_in addr;
+    struct epoll_event ev;
+    host_conn_t *hc;
+
+    ensure_epoll();
+    if (espconn->type != ESPCONN_UDP || espconn->host != NULL) {
+        return ESPCONN_ARG;
+    }
+    hc = calloc(1, sizeof(*hc));
+    hc->conn = espconn;
+    hc->udp = 1;
+    hc->fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (hc->fd < 0) {
+        free(hc);
+        return ESPCONN_MEM;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(espconn->proto.udp->local_port);
+    if (bind(hc->fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        close(hc->fd);
+        free(hc);
+        return ESPCONN_ISCONN;
+    }
+    espconn->host = hc;
+    ev.events = EPOLLIN;
+    ev.data.ptr = hc;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, hc->fd, &ev);
+    return ESPCONN_OK;
+}
+
+static sint8 send_udp(host_conn_t *hc, uint8 *psent, uint16 length) {
+    struct sockaddr_in addr;
+    esp_udp *udp = hc->conn->proto.udp;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(udp->remote_port);
+    memcpy(&addr.sin_addr.s_addr, udp->remote_ip, 4);
+    // like lwIP, a datagram that cannot go out now is dropped
+    sendto(hc->fd, psent, length, 0, (struct sockaddr *)&addr, sizeof(addr));
+    host_udp_stats.txPackets++;
+    host_udp_stats.txBytes += length;
+    hc->sentPending = 1;
+    defer(hc);
+    return ESPCONN_OK;
+}
+
+sint8 espconn_send(struct espconn *espconn, uint8 *psent, uint16 length) {
+    host_conn_t *hc = espconn->host;
+    ssize_t n = 0;
+    if (hc == NULL || hc->connecting) {
+        return ESPCONN_ARG;
+    }
+    if (hc->udp) {
+        return send_udp(hc, psent, length);
+    }
+    host_tcp_stats.txPackets++;
+    host_tcp_stats.txBytes += length;
+    if (hc->outLen == 0) {
+        n = send(hc->fd, psent, length, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                return ESPCONN_CONN;
+            }
+            n = 0;
+        }
+    }
+    if ((uint16)n < length) {
+        uint32_t rest = length - n;
+        if (hc->outLen + rest > hc->outCap) {
+            hc->outCap = (hc->outLen + rest) * 2;
+            hc->out = realloc(hc->out, hc->outCap);
+        }
+        memcpy(hc->out + hc->outLen, psent + n, rest);
+        hc->outLen += rest;
+        watch(hc, EPOLLIN | EPOLLOUT);
+        return ESPCONN_OK;
+    }
+    hc->sentPending = 1;
+    defer(hc);
+    return ESPCONN_OK;
+}
+
+uint32 espconn_port(void) {
+    if (nextPort == 65535) {
+        nextPort = 49152;
+    }
+    return nextPort++;
+}
+
+sint8 espconn_set_opt(struct espconn *espconn, uint8 opt) {
+    return ESPCONN_OK;
+}
+
+sint8 espconn_regist_connectcb(struct espconn *espconn, espconn_connect_callback connect_cb) {
+    espconn->proto.tcp->connect_callback = connect_cb;
+    return ESPCONN_OK;
+}
+
+sint8 espconn_regist_reconcb(struct espconn *espconn, espconn_reconnect_callback recon_cb) {
+    espconn->proto.tcp->reconnect_callback = recon_cb;
+    return ESPCONN_OK;
+}
+
+sint8 espconn_regist_disconcb(struct espconn *espconn, espconn_connect_callback discon_cb) {
+    espconn->proto.tcp->disconnect_callback = discon_cb;
+    return ESPCONN_OK;
+}
+
+sint8 espconn_regist_recvcb(struct espconn *espconn, espconn_recv_callback recv_cb) {
+    espconn->recv_callback = recv_cb;
+    return ESPCONN_OK;
+}
+
+sint8 espconn_regist_sentcb(struct espconn *espconn, espconn_sent_callback sent_cb) {
+    espconn->sent_callback = sent_cb;
+    return ESPCONN_OK;
+}
+
+static void handle_connect(host_conn_t *hc) {
+    int err = 0;
+    socklen_t len = sizeof(err);
+    getsockopt(hc->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+    if (err != 0) {
+        fail_conn(hc, errno_to_espconn(err));
+        return;
+    }
+    hc->connecting = 0;
+    hc->conn->state = ESPCONN_CONNECT;
+    watch(hc, EPOLLIN);
+    if (hc->conn->proto.tcp->connect_callback != NULL) {
+        hc->conn->proto.tcp->connect_callback(hc->conn);
+    }
+}
+
+static void handle_writable(host_conn_t *hc) {
+    ssize_t n = send(hc->fd, hc->out, hc->outLen, MSG_NOSIGNAL);
+    if (n < 0) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            fail_conn(hc, errno_to_espconn(errno));
+        }
+        return;
+    }
+    memmove(hc->out, hc->out + n, hc->outLen - n);
+    hc->outLen -= n;
+    if (hc->outLen == 0) {
+        watch(hc, EPOLLIN);
+        hc->sentPending = 1;
+        defer(hc);
+    }
+}
+
+static void handle_datagram(host_conn_t *hc) {
+    char buf[HOST_RECV_LEN];
+    struct sockaddr_in from;
+    socklen_t fromLen = sizeof(from);
+    ssize_t n = recvfrom(hc->fd, buf, sizeof(buf), 0, (struct sockaddr *)&from, &fromLen);
+    if (n < 0) {
+        return;
+    }
+    // the SDK reports the sender through remote_ip and remote_port
+    memcpy(hc->conn->proto.udp->remote_ip, &from.sin_addr.s_addr, 4);
+    hc->conn->proto.udp->remote_port = ntohs(from.sin_port);
+    host_udp_stats.rxPackets++;
+    host_udp_stats.rxBytes += n;
+    if (hc->conn->recv_callback != NULL) {
+        hc->conn->recv_callback(hc->conn, buf, (unsigned short)n);
+    }
+}
+
+static void handle_readable(host_conn_t *hc) {
+    char buf[HOST_RECV_LEN];
+    struct espconn *conn = hc->conn;
+    ssize_t n;
+    if (hc->udp) {
+        handle_datagram(hc);
+        return;
+    }
+    n = recv(hc->fd, buf, sizeof(buf), 0);
+    if (n < 0) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            fail_conn(hc, errno_to_espconn(errno));
+        }
+        return;
+    }
+    if (n == 0) {
+        // orderly close by the broker
+        hc->sentPending = 0;
+        close_conn(hc);
+        if (conn->proto.tcp->disconnect_callback != NULL) {
+            conn->proto.tcp->disconnect_callback(conn);
+        }
+        return;
+    }
+    host_tcp_stats.rxPackets++;
+    host_tcp_stats.rxBytes += n;
+    if (conn->recv_callback != NULL) {
+        conn->recv_callback(conn, buf, (unsigned short)n);
+    }
+}
+
+static void run_pending(void) {
+    while (pendingHead != NULL) {
+        host_conn_t *hc = pendingHead;
+        struct espconn *conn = hc->conn;
+        pendingHead = hc->nextPending;
+        hc->onPending = 0;
+        if (hc->closePending) {
+            if (conn->proto.tcp->disconnect_callback != NULL) {
+                conn->proto.tcp->disconnect_callback(conn);
+            }
+        } else if (hc->sentPending && hc->fd >= 0) {
+            hc->sentPending = 0;
+            if (conn->sent_callback != NULL) {
+                conn->sent_callback(conn);
+            }
+        }
+        if (hc->fd < 0) {
+            free(hc);
+        }
+    }
+}
+
+/******************************************************************************
+ * event loop
+ */
+
+// Nothing waits on a virtual clock: it jumps to the next timer, or by
+// max_wait_ms if none is due sooner. Sockets are only polled.
+static void virtual_advance(int max_wait_ms) {
+    uint64_t next = virtualUs + (uint64_t)max_wait_ms * 1000;
+    if (pendingHead != NULL) {
+        return;
+    }
+    if (heapLen > 0 && heap[0]->host_deadline < next) {
+        next = heap[0]->host_deadline;
+    }
+    if (next > virtualUs) {
+        virtualUs = next;
+    }
+}
+
+void host_loop_once(int max_wait_ms) {
+    struct epoll_event events[MAX_EVENTS];
+    int timeout = max_wait_ms;
+    int n;
+
+    run_timers();
+    run_pending();
+    if (host_virtual_time) {
+        virtual_advance(max_wait_ms);
+        if (epfd < 0) {
+            return; // no sockets, the usual case with a simulated network
+        }
+        timeout = 0;
+    }
+    ensure_epoll();
+    if (heapLen > 0 && timeout > 0) {
+        uint64_t now = host_time_us();
+        uint64_t due = heap[0]->host_deadline;
+        int untilDue = (due <= now) ? 0 : (int)((due - now + 999) / 1000);
+        if (untilDue < timeout) {
+            timeout = untilDue;
+        }
+    }
+    n = epoll_wait(epfd, events, MAX_EVENTS, timeout);
+    for (int i = 0; i < n; i++) {
+        host_conn_t *hc = events[i].data.ptr;
+        if (hc->fd < 0) {
+            continue; // closed by an earlier event in this batch
+        }
+        if (hc->connecting) {
+            handle_connect(hc);
+            continue;
+        }
+        if (events[i].events & EPOLLOUT) {
+            handle_writable(hc);
+            if (hc->fd < 0) {
+                continue;
+            }
+        }
+        if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+            handle_readable(hc);
+        }
+    }
+    run_pending();
+}
+
+void host_loop_run(uint64_t deadline_us, volatile int *stop) {
+    while (host_time_us() < deadline_us && (stop == NULL || !*stop)) {
+        uint64_t left = (deadline_us - host_time_us() + 999) / 1000;
+        // real time is waited out in short steps so *stop is seen promptly;
+        // virtual time has nothing to wait for
+        uint64_t most = host_virtual_time ? 0x7FFFFFFF : 100;
+        host_loop_once(left > most ? (int)most : (int)left);
+    }
+}
@@ -0,0 +1,1287 @@
+// Runs the whole firmware, from user_init() on, against a simulated access
+// point, TCP, MQTT broker and SNTP server on a virtual clock, so weeks of
+// timers, reconnects and readings pass in seconds. Faults are injected on a
+// script, and at the end invariants on memory, readings, reconnects and
+// timing are checked and written out as a JSON report, for comparing builds.
+//
+// Everything above espconn is the firmware as built for the device, with
+// user_config.h made from user_config.def.h in soak/. espconn_connect,
+// _disconnect, _delete, _create and _send are wrapped, and behind them:
+//
+//   - a segment takes SIM_LATENCY_MS one way; a lost one is sent again after
+//     SIM_RTO_MS, doubling, and after SIM_RETRIES the connection is aborted
+//   - the broker answers CONNECT, SUBSCRIBE, UNSUBSCRIBE and PINGREQ, keeps
+//     persistent sessions, takes over a client ID that connects again, and
+//     drops a client it has not heard from in 1.5 keepalives, publishing
+//     its will
+//   - the SNTP server answers on TIMEBASE_NTP_PORT with the virtual clock
+//
+// outq_reading() is wrapped too, to time each reading main.c makes,
+// twheel_arm() and twheel_set_grid() to know when each one should come, and
+// mqttSend() to see which of them had no session when they left the lane.
+//
+// The script has one fault per line: when it starts, the fault, how long it
+// lasts and, for two of them, a value. Times are a number with d, h, m or s,
+// which can be strung together as in 1d6h. "repeat 7d" on a line of its own
+// runs the script again every 7 days; # starts a comment.
+//
+//   ap_loss            the access point is gone: no IP, every segment lost
+//   broker_restart     the broker closes every connection, forgets its
+//                      sessions and refuses connections until it is back
+//   drop P             each segment is lost with probability P
+//   slow_ack MS        ACKs and everything from the broker take MS longer
+//
+// Without -f, defaultScript below is used.
+//
+// usage: soak [options]
+//   -d days      virtual time to run (14)
+//   -f file      fault script
+//   -o file      write the JSON report here instead of stdout
+//   -b label     build label for the report, such as git describe
+//   -s seed      random seed for segment drops (1)
+//   -g seconds   how long after a fault ends the firmware has to be back (120)
+//   -c count     most connection attempts allowed in any minute (8)
+//   -H bytes     heap growth allowed over the run (0)
+//   -v           print the firmware's debug output
+//
+// A line per simulated day goes to stderr. Exits 1 if an invariant failed.
+//
+// Invariants:
+//   heap_flat               heap in use at the end is within -H of what it
+//                           was when the session first came up
+//   memory_clean            no scratch leaks or refusals, no guard bytes
+//                           overwritten, from mempool_report()
+//   no_loss_outside_faults  every reading made outside a fault and its -g
+//                           grace period reached the broker
+//   recovery                the session was back within -g of every fault
+//   no_reconnect_storm      at most -c connection attempts in any minute
+//   clock_synced            timebase.c agrees with the SNTP server to 100 ms
+//   reading_period          readings are READING_MS apart, give or take the
+//                           DTIM grid power.c aligns long timers to
+//   reading_schedule        each reading comes on the very tick it is due,
+//                           READING_MS times the readings since the timer was
+//                           armed, or with the DTIM grid on, the tick of the
+//                           grid point nearest that
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "osapi.h"
+#include "user_interface.h"
+#include "espconn.h"
+#include "user_config.h"
+#include "main.h"
+#include "mqtt.h"
+#include "mempool.h"
+#include "timebase.h"
+#include "twheel.h"
+#include "power.h"
+#include "host.h"
+
+#define SIM_LATENCY_MS 5
+#define SIM_RTO_MS 1000
+#define SIM_RETRIES 6 // 127 s of retransmissions before a connection is aborted
+#define SIM_MQTT_PORT 1883
+#define SIM_UNIX_BASE_S 1700000000ULL // the SNTP server's time at virtual 0
+#define SIM_CLOCK_LIMIT_US 100000
+#define NTP_UNIX_OFFSET_S 2208988800ULL
+#define NTP_PACKET_LEN 48
+#define READING_MS 20000 // blink_timer in main.c
+#define MAX_FAULTS 512
+#define MAX_CONNS 8
+#define MAX_SESSIONS 8
+#define STORM_RING 4096
+// main.c's backoff waits at least 0.5, 1, 2, 4, 8 and 16 s, so it gets six
+// attempts into the minute after a loss and fewer into any other; two more
+// for brokers.c's probes
+#define STORM_LIMIT 8
+#define TICK_US (TWHEEL_TICK_MS * 1000ULL)
+#define HOUR_US 3600000000ULL
+#define DAY_US (24 * HOUR_US)
+
+void ICACHE_FLASH_ATTR user_pre_init(void);
+void __real_twheel_arm(twheel_timer_t *t, uint32_t ms, uint8_t repeat);
+void __real_twheel_set_grid(uint32_t gridUs, uint64_t phaseUs);
+uint8_t __real_mqttSend(mqtt_session_t *session, uint8_t *data, uint32_t len, mqtt_message_type msgType);
+sint8 __real_outq_reading(const uint8_t *data, uint32_t len);
+
+static const char defaultScript[] =
+    "repeat 7d\n"
+    "6h     ap_loss         90s\n"
+    "1d     broker_restart  45s\n"
+    "2d     drop            2h    0.05\n"
+    "3d     slow_ack        2h    1500\n"
+    "4d     ap_loss         20m\n"
+    "5d     broker_restart  10m\n"
+    "6d     drop            30m   0.3\n";
+
+/******************************************************************************
+ * faults
+ */
+
+typedef enum {
+    FAULT_AP_LOSS,
+    FAULT_BROKER_RESTART,
+    FAULT_DROP,
+    FAULT_SLOW_ACK,
+    FAULT_KINDS
+} fault_kind_t;
+
+static const char *faultNames[FAULT_KINDS] = { "ap_loss", "broker_restart", "drop", "slow_ack" };
+
+typedef struct {
+    fault_kind_t kind;
+    uint64_t startUs;
+    uint64_t endUs;
+    double value; // drop probability, or extra ACK delay in ms
+    uint8_t state; // 0 to come, 1 active, 2 over
+    uint8_t recovered; // the session was up again after it ended
+    uint64_t recoveryUs; // from the end of the fault until the session was up
+    uint32_t sessionsLost;
+    uint32_t missed; // readings main.c made with no session
+    uint32_t lost; // readings sent that never reached the broker
+} fault_t;
+
+static fault_t faults[MAX_FAULTS];
+static uint32_t faultCount;
+
+/******************************************************************************
+ * simulated connections, one per espconn
+ */
+
+typedef struct {
+    struct espconn *conn;
+    uint8_t udp;
+    uint8_t connecting; // espconn_connect() called, no answer yet
+    uint8_t deviceOpen; // the firmware's side is open
+    uint8_t brokerOpen; // the broker's side is open
+    uint8_t connected; // the broker accepted CONNECT
+    uint8_t disconnected; // DISCONNECT came, so no will
+    uint8_t hasWill;
+    uint8_t doomed; // a segment could not be delivered, the abort is on its way
+    uint32_t devGen; // bumped whenever the firmware's side closes, so stale events are dropped
+    uint32_t brokerGen; // the same for the broker's side
+    uint64_t toBrokerUs; // last arrival each way, TCP keeps them in order
+    uint64_t toDeviceUs;
+    uint64_t lastHeardUs;
+    uint16_t keepalive;
+    char clientId[64];
+    uint8_t rx[MQTT_RX_BUF_LEN];
+    uint32_t rxLen;
+} simconn_t;
+
+static simconn_t conns[MAX_CONNS];
+static char sessions[MAX_SESSIONS][64]; // client IDs the broker keeps a session for
+static uint8_t sessionCount;
+
+typedef enum {
+    EV_CONNECTED,
+    EV_REFUSED,
+    EV_ABORT,
+    EV_CLOSED,
+    EV_TO_BROKER,
+    EV_FIN_TO_BROKER,
+    EV_TO_DEVICE,
+    EV_SENT,
+    EV_KEEPALIVE,
+    EV_DATAGRAM
+} ev_kind_t;
+
+// pending deliveries, sorted by time and run from one os_timer; malloc()
+// rather than os_malloc() so they stay out of the firmware's heap count
+typedef struct event {
+    struct event *next;
+    uint64_t at;
+    ev_kind_t kind;
+    simconn_t *sc;
+    uint32_t gen;
+    sint8 err;
+    uint16_t readings; // readings in a segment to the broker
+    uint16_t readingsOutside; // of those, made outside any fault
+    uint16_t len;
+    uint8_t data[];
+} event_t;
+
+static event_t *events;
+static os_timer_t simTimer;
+
+/******************************************************************************
+ * what was seen
+ */
+
+static struct {
+    uint32_t connectAttempts;
+    uint32_t refused;
+    uint32_t aborts;
+    uint32_t connacks;
+    uint32_t resumed;
+    uint32_t takeovers;
+    uint32_t wills;
+    uint32_t pings;
+    uint32_t publishes;
+    uint32_t segments;
+    uint32_t segmentsLost;
+    uint32_t sntpReplies;
+    uint32_t sessionsUp;
+    uint32_t sessionsLost;
+    uint32_t readingsDue;
+    uint32_t readingsSent;
+    uint32_t readingsDelivered;
+    uint32_t readingsMissed;
+    uint32_t readingsLost;
+    uint32_t missedOutside;
+    uint32_t lostOutside;
+    uint32_t stormMax;
+    uint32_t periodErrUs; // furthest an interval between readings was from READING_MS
+    uint32_t scheduleErrUs; // furthest a reading was from the tick it should have come on
+    uint32_t heapBaseline;
+    uint32_t heapMax;
+    uint8_t heapBaselineSet;
+} st;
+
+static struct {
+    uint32_t days;
+    uint64_t graceUs;
+    uint32_t stormLimit;
+    uint32_t heapSlack;
+    uint32_t seed;
+    const char *label;
+    const char *scriptName;
+} opt = { 14, 120000000ULL, STORM_LIMIT, 0, 1, "", "default" };
+
+static mqtt_session_t *fwSession; // main.c's, as seen going through mqttSend()
+static uint8_t sessionUp;
+static uint8_t upSinceDue; // the blink timer was armed again since the last reading
+static uint64_t lastDueUs;
+static uint64_t readingArmUs; // when the reading timer was last armed
+static uint32_t readingsSinceArm;
+static uint64_t readingNextUs; // the tick the next reading should come on
+static uint32_t gridUs; // what power.c last gave twheel_set_grid()
+static uint64_t gridPhaseUs;
+static uint64_t stormRing[STORM_RING];
+static uint32_t stormHead, stormTail;
+static uint64_t rngState;
+static volatile int stop;
+
+static double rnd(void) {
+    // xorshift64*, so drops are the same for a seed on every libc
+    rngState ^= rngState >> 12;
+    rngState ^= rngState << 25;
+    rngState ^= rngState >> 27;
+    return (double)((rngState * 2685821657736338717ULL) >> 11) / (double)(1ULL << 53);
+}
+
+static double fault_value(fault_kind_t kind, uint64_t t) {
+    double v = 0;
+    uint32_t i;
+    for (i = 0; i < faultCount; i++) {
+        if (faults[i].kind == kind && faults[i].startUs <= t && t < faults[i].endUs && faults[i].value > v) {
+            v = faults[i].value;
+        }
+    }
+    return v;
+}
+
+// the fault whose window, grace period included, t falls in
+static fault_t *fault_window(uint64_t t) {
+    fault_t *found = NULL;
+    uint32_t i;
+    for (i = 0; i < faultCount; i++) {
+        if (faults[i].startUs <= t && t < faults[i].endUs + opt.graceUs) {
+            found = &faults[i];
+        }
+    }
+    return found;
+}
+
+/******************************************************************************
+ * events
+ */
+
+static void sim_arm(void) {
+    uint64_t now = host_time_us();
+    if (events == NULL) {
+        os_timer_disarm(&simTimer);
+        return;
+    }
+    uint64_t wait = (events->at > now) ? events->at - now : 0;
+    os_timer_arm_us(&simTimer, wait > 0xFFFFFFFF ? 0xFFFFFFFF : (uint32)wait, 0);
+}
+
+static event_t *schedule(uint64_t at, ev_kind_t kind, simconn_t *sc, uint32_t gen, const uint8_t *data, uint16_t len) {
+    event_t *e = calloc(1, sizeof(*e) + len);
+    event_t **pp = &events;
+    e->at = at;
+    e->kind = kind;
+    e->sc = sc;
+    e->gen = gen;
+    e->len = len;
+    if (len > 0) {
+        memcpy(e->data, data, len);
+    }
+    while (*pp != NULL && (*pp)->at <= at) {
+        pp = &(*pp)->next;
+    }
+    e->next = *pp;
+    *pp = e;
+    if (events == e) {
+        sim_arm();
+    }
+    return e;
+}
+
+// when a segment sent at t arrives, 0 if the connection gives up on it first
+static uint64_t deliver(uint64_t *last, uint64_t t, uint8_t toDevice, uint64_t *abortAt) {
+    uint64_t rto = SIM_RTO_MS * 1000ULL;
+    uint8_t i;
+    st.segments++;
+    for (i = 0; i <= SIM_RETRIES; i++) {
+        double p = fault_value(FAULT_DROP, t);
+        if (fault_value(FAULT_AP_LOSS, t) == 0 && (p == 0 || rnd() >= p)) {
+            uint64_t at = t + SIM_LATENCY_MS * 1000ULL;
+            if (toDevice) {
+                at += (uint64_t)(fault_value(FAULT_SLOW_ACK, t) * 1000);
+            }
+            if (at < *last) {
+                at = *last;
+            }
+            *last = at;
+            return at;
+        }
+        st.segmentsLost++;
+        t += rto;
+        rto *= 2;
+    }
+    *abortAt = t;
+    return 0;
+}
+
+static void session_up(void) {
+    uint64_t now = host_time_us();
+    uint32_t i;
+    if (sessionUp) {
+        return;
+    }
+    sessionUp = 1;
+    st.sessionsUp++;
+    if (!st.heapBaselineSet) {
+        st.heapBaseline = host_heap_used();
+        st.heapBaselineSet = 1;
+    }
+    for (i = 0; i < faultCount; i++) {
+        if (faults[i].state == 2 && !faults[i].recovered) {
+            faults[i].recovered = 1;
+            faults[i].recoveryUs = now - faults[i].endUs;
+        }
+    }
+}
+
+static void session_down(void) {
+    fault_t *f;
+    if (!sessionUp) {
+        return;
+    }
+    sessionUp = 0;
+    st.sessionsLost++;
+    if ((f = fault_window(host_time_us())) != NULL) {
+        f->sessionsLost++;
+    }
+}
+
+static void readings_lost(uint16_t readings, uint16_t outside) {
+    fault_t *f = fault_window(host_time_us());
+    st.readingsLost += readings;
+    st.lostOutside += outside;
+    if (f != NULL) {
+        f->lost += readings - outside;
+    }
+}
+
+/******************************************************************************
+ * the broker
+ */
+
+static int session_find(const char *id) {
+    int i;
+    for (i = 0; i < sessionCount; i++) {
+        if (strcmp(sessions[i], id) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static void to_device(simconn_t *sc, const uint8_t *data, uint16_t len);
+
+// closes the broker's side, with a FIN to the firmware if fin is set
+static void broker_close(simconn_t *sc, uint8_t will, uint8_t fin) {
+    uint64_t at, abortAt;
+    if (!sc->brokerOpen) {
+        return;
+    }
+    sc->brokerOpen = 0;
+    sc->brokerGen++;
+    if (sc->connected && will && sc->hasWill) {
+        st.wills++;
+    }
+    sc->connected = 0;
+    if (fin && (at = deliver(&sc->toDeviceUs, host_time_us(), 1, &abortAt)) != 0) {
+        schedule(at, EV_CLOSED, sc, sc->devGen, NULL, 0);
+    }
+}
+
+static uint32_t get_string(const uint8_t *p, uint32_t avail, char *out, uint32_t outLen) {
+    uint32_t len;
+    if (avail < 2) {
+        return 0;
+    }
+    len = (p[0] << 8) | p[1];
+    if (len + 2 > avail) {
+        return 0;
+    }
+    if (out != NULL) {
+        uint32_t n = (len < outLen - 1) ? len : outLen - 1;
+        memcpy(out, p + 2, n);
+        out[n] = 0;
+    }
+    return len + 2;
+}
+
+static void broker_connect(simconn_t *sc, const uint8_t *body, uint32_t len) {
+    uint8_t connack[4] = { 0x20, 0x02, 0x00, 0x00 };
+    uint32_t at, n;
+    uint8_t flags;
+    int i;
+    at = get_string(body, len, NULL, 0); // protocol name
+    if (at == 0 || at + 4 > len) {
+        broker_close(sc, 1, 1);
+        return;
+    }
+    flags = body[at + 1];
+    sc->keepalive = (body[at + 2] << 8) | body[at + 3];
+    at += 4;
+    if ((n = get_string(body + at, len - at, sc->clientId, sizeof(sc->clientId))) == 0) {
+        broker_close(sc, 1, 1);
+        return;
+    }
+    sc->hasWill = (flags & MQTT_CONNECT_WILL) != 0;
+    for (i = 0; i < MAX_CONNS; i++) {
+        simconn_t *other = &conns[i];
+        if (other != sc && other->connected && strcmp(other->clientId, sc->clientId) == 0) {
+            st.takeovers++;
+            broker_close(other, 1, 1);
+        }
+    }
+    i = session_find(sc->clientId);
+    if (flags & MQTT_CONNECT_CLEAN_SESSION) {
+        if (i >= 0) {
+            memmove(sessions[i], sessions[i + 1], (sessionCount - i - 1) * sizeof(sessions[0]));
+            sessionCount--;
+        }
+    } else if (i >= 0) {
+        connack[2] = 1; // session present
+        st.resumed++;
+    } else if (sessionCount < MAX_SESSIONS) {
+        strcpy(sessions[sessionCount++], sc->clientId);
+    }
+    sc->connected = 1;
+    sc->disconnected = 0;
+    st.connacks++;
+    if (sc->keepalive != 0) {
+        schedule(host_time_us() + sc->keepalive * 1500000ULL, EV_KEEPALIVE, sc, sc->brokerGen, NULL, 0);
+    }
+    to_device(sc, connack, sizeof(connack));
+}
+
+static void broker_packet(simconn_t *sc, const uint8_t *pkt, uint32_t headerLen, uint32_t bodyLen) {
+    const uint8_t *body = pkt + headerLen;
+    uint8_t reply[4];
+    switch (pkt[0] >> 4) {
+        case MQTT_MSG_TYPE_CONNECT:
+            broker_connect(sc, body, bodyLen);
+            return;
+        case MQTT_MSG_TYPE_PUBLISH:
+            st.publishes++;
+            return;
+        case MQTT_MSG_TYPE_SUBSCRIBE:
+        case MQTT_MSG_TYPE_UNSUBSCRIBE:
+            if (bodyLen < 2) {
+                return;
+            }
+            // one topic a packet, the way mqtt.c sends them
+            reply[0] = ((pkt[0] >> 4) == MQTT_MSG_TYPE_SUBSCRIBE) ? 0x90 : 0xB0;
+            reply[1] = ((pkt[0] >> 4) == MQTT_MSG_TYPE_SUBSCRIBE) ? 3 : 2;
+            reply[2] = body[0];
+            reply[3] = body[1];
+            to_device(sc, reply, reply[1] + 2);
+            if (reply[1] == 3) {
+                reply[0] = 0; // granted QoS 0
+                to_device(sc, reply, 1);
+            }
+            return;
+        case MQTT_MSG_TYPE_PINGREQ:
+            st.pings++;
+            reply[0] = 0xD0;
+            reply[1] = 0;
+            to_device(sc, reply, 2);
+            return;
+        case MQTT_MSG_TYPE_DISCONNECT:
+            sc->disconnected = 1;
+            broker_close(sc, 0, 1);
+            return;
+        default:
+            return;
+    }
+}
+
+static void broker_input(simconn_t *sc, const uint8_t *data, uint16_t len) {
+    uint32_t rest;
+    int8_t n;
+    if (sc->rxLen + len > sizeof(sc->rx)) {
+        broker_close(sc, 1, 1);
+        return;
+    }
+    memcpy(sc->rx + sc->rxLen, data, len);
+    sc->rxLen += len;
+    while (sc->brokerOpen && sc->rxLen >= 2) {
+        n = decodeLength(sc->rx + 1, sc->rxLen - 1, &rest);
+        if (n < 0) {
+            broker_close(sc, 1, 1);
+            return;
+        }
+        if (n == 0 || 1 + n + rest > sc->rxLen) {
+            return;
+        }
+        broker_packet(sc, sc->rx, 1 + n, rest);
+        memmove(sc->rx, sc->rx + 1 + n + rest, sc->rxLen - 1 - n - rest);
+        sc->rxLen -= 1 + n + rest;
+    }
+}
+
+static void to_device(simconn_t *sc, const uint8_t *data, uint16_t len) {
+    uint64_t at, abortAt;
+    if ((at = deliver(&sc->toDeviceUs, host_time_us(), 1, &abortAt)) != 0) {
+        schedule(at, EV_TO_DEVICE, sc, sc->devGen, data, len);
+        return;
+    }
+    // the broker gives up on the connection; the firmware hears when it next sends
+    broker_close(sc, 1, 0);
+}
+
+static void put_be32(uint8_t *p, uint32_t v) {
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+static void put_ntp(uint8_t *p, uint64_t unixUs) {
+    put_be32(p, (uint32_t)(unixUs / 1000000 + NTP_UNIX_OFFSET_S));
+    put_be32(p + 4, (uint32_t)(((unixUs % 1000000) << 32) / 1000000));
+}
+
+static void sntp_reply(simconn_t *sc, const uint8_t *req, uint16_t len) {
+    uint8_t reply[NTP_PACKET_LEN];
+    uint64_t now = host_time_us();
+    uint64_t at = now + 2 * SIM_LATENCY_MS * 1000ULL;
+    double p = fault_value(FAULT_DROP, now);
+    if (len < NTP_PACKET_LEN || fault_value(FAULT_AP_LOSS, now) != 0 || (p != 0 && rnd() < p)) {
+        return;
+    }
+    memset(reply, 0, sizeof(reply));
+    reply[0] = 0x24; // no leap warning, version 4, server
+    reply[1] = 1; // stratum 1
+    memcpy(reply + 24, req + 40, 8); // their transmit time is our originate time
+    put_ntp(reply + 32, SIM_UNIX_BASE_S * 1000000ULL + now + SIM_LATENCY_MS * 1000ULL);
+    put_ntp(reply + 40, SIM_UNIX_BASE_S * 1000000ULL + now + SIM_LATENCY_MS * 1000ULL);
+    st.sntpReplies++;
+    schedule(at, EV_DATAGRAM, sc, sc->devGen, reply, sizeof(reply));
+}
+
+static void sim_event(event_t *e) {
+    simconn_t *sc = e->sc;
+    struct espconn *conn = sc->conn;
+    switch (e->kind) {
+        case EV_CONNECTED:
+            if (e->gen != sc->devGen || !sc->connecting) {
+                return;
+            }
+            sc->connecting = 0;
+            if (fault_value(FAULT_BROKER_RESTART, host_time_us()) != 0) {
+                st.refused++;
+                conn->state = ESPCONN_CLOSE;
+                conn->proto.tcp->reconnect_callback(conn, ESPCONN_RST);
+                return;
+            }
+            sc->deviceOpen = 1;
+            sc->brokerOpen = 1;
+            sc->lastHeardUs = host_time_us();
+            conn->state = ESPCONN_CONNECT;
+            conn->proto.tcp->connect_callback(conn);
+            return;
+        case EV_REFUSED:
+            if (e->gen != sc->devGen || !sc->connecting) {
+                return;
+            }
+            sc->connecting = 0;
+            st.refused++;
+            conn->state = ESPCONN_CLOSE;
+            conn->proto.tcp->reconnect_callback(conn, e->err);
+            return;
+        case EV_ABORT:
+            if (e->gen != sc->devGen || !sc->deviceOpen) {
+                return;
+            }
+            sc->deviceOpen = 0;
+            sc->devGen++;
+            st.aborts++;
+            session_down();
+            conn->state = ESPCONN_CLOSE;
+            conn->proto.tcp->reconnect_callback(conn, e->err);
+            return;
+        case EV_CLOSED:
+            // a FIN from the broker, or the firmware's own espconn_disconnect()
+            if (e->gen != sc->devGen) {
+                return;
+            }
+            sc->deviceOpen = 0;
+            sc->devGen++;
+            session_down();
+            conn->state = ESPCONN_CLOSE;
+            conn->proto.tcp->disconnect_callback(conn);
+            return;
+        case EV_TO_BROKER:
+            if (e->gen != sc->brokerGen || !sc->brokerOpen) {
+                readings_lost(e->readings, e->readingsOutside);
+                if (sc->deviceOpen && !sc->doomed) {
+                    // nobody there any more, the broker's host answers with a reset
+                    sc->doomed = 1;
+                    schedule(host_time_us() + SIM_LATENCY_MS * 1000ULL, EV_ABORT, sc, sc->devGen, NULL, 0)->err = ESPCONN_RST;
+                }
+                return;
+            }
+            st.readingsDelivered += e->readings;
+            sc->lastHeardUs = host_time_us();
+            broker_input(sc, e->data, e->len);
+            return;
+        case EV_FIN_TO_BROKER:
+            if (e->gen == sc->brokerGen) {
+                broker_close(sc, !sc->disconnected, 0);
+            }
+            return;
+        case EV_TO_DEVICE:
+            if (e->gen != sc->devGen || !sc->deviceOpen) {
+                return;
+            }
+            if (e->len == 4 && e->data[0] == 0x20 && e->data[3] == 0) {
+                session_up();
+            }
+            conn->recv_callback(conn, (char *)e->data, e->len);
+            return;
+        case EV_SENT:
+            if (e->gen == sc->devGen && sc->deviceOpen && conn->sent_callback != NULL) {
+                conn->sent_callback(conn);
+            }
+            return;
+        case EV_KEEPALIVE: {
+            uint64_t limit = sc->keepalive * 1500000ULL;
+            if (e->gen != sc->brokerGen || !sc->connected) {
+                return;
+            }
+            if (host_time_us() - sc->lastHeardUs >= limit) {
+                broker_close(sc, 1, 1);
+            } else {
+                schedule(sc->lastHeardUs + limit, EV_KEEPALIVE, sc, sc->brokerGen, NULL, 0);
+            }
+            return;
+        }
+        case EV_DATAGRAM:
+            if (sc->deviceOpen && conn->recv_callback != NULL) {
+                conn->recv_callback(conn, (char *)e->data, e->len);
+            }
+            return;
+    }
+}
+
+static void sim_run(void *arg) {
+    uint64_t now = host_time_us();
+    while (events != NULL && events->at <= now) {
+        event_t *e = events;
+        events = e->next;
+        sim_event(e);
+        free(e);
+    }
+    sim_arm();
+}
+
+/******************************************************************************
+ * espconn, as the firmware sees it
+ */
+
+static simconn_t *sim_conn(struct espconn *conn) {
+    uint8_t i;
+    if (conn->host != NULL) {
+        return conn->host;
+    }
+    for (i = 0; i < MAX_CONNS; i++) {
+        if (conns[i].conn == NULL) {
+            conns[i].conn = conn;
+            conn->host = &conns[i];
+            return &conns[i];
+        }
+    }
+    return NULL;
+}
+
+// 1 if the packet is a reading on the session topic
+static uint8_t is_reading(const uint8_t *data, uint16_t len) {
+    uint32_t rest, topicLen;
+    int8_t n;
+    if (len < 2 || (data[0] >> 4) != MQTT_MSG_TYPE_PUBLISH) {
+        return 0;
+    }
+    n = decodeLength(data + 1, len - 1, &rest);
+    if (n <= 0 || 1 + n + 2 > len) {
+        return 0;
+    }
+    topicLen = (data[1 + n] << 8) | data[2 + n];
+    return topicLen == sizeof(mqtt_topic) - 1 && 3 + n + topicLen <= len &&
+           memcmp(data + 3 + n, mqtt_topic, topicLen) == 0;
+}
+
+sint8 __wrap_espconn_connect(struct espconn *conn) {
+    simconn_t *sc = sim_conn(conn);
+    uint64_t now = host_time_us();
+    uint64_t syn, synAck, abortAt;
+    if (sc == NULL) {
+        return ESPCONN_MEM;
+    }
+    // like a closed socket, an old connection on this espconn goes quietly
+    broker_close(sc, !sc->disconnected, 0);
+    sc->devGen++;
+    sc->deviceOpen = 0;
+    sc->connecting = 1;
+    sc->doomed = 0;
+    sc->rxLen = 0;
+    sc->toBrokerUs = sc->toDeviceUs = 0;
+    conn->state = ESPCONN_WAIT;
+
+    st.connectAttempts++;
+    stormRing[stormHead++ % STORM_RING] = now;
+    while (stormRing[stormTail % STORM_RING] + 60000000ULL <= now) {
+        stormTail++;
+    }
+    if (stormHead - stormTail > st.stormMax) {
+        st.stormMax = stormHead - stormTail;
+    }
+
+    if (conn->proto.tcp->remote_port != SIM_MQTT_PORT) {
+        schedule(now + 2 * SIM_LATENCY_MS * 1000ULL, EV_REFUSED, sc, sc->devGen, NULL, 0)->err = ESPCONN_RST;
+    } else if ((syn = deliver(&sc->toBrokerUs, now, 0, &abortAt)) == 0 ||
+               (synAck = deliver(&sc->toDeviceUs, syn, 1, &abortAt)) == 0) {
+        schedule(abortAt, EV_REFUSED, sc, sc->devGen, NULL, 0)->err = ESPCONN_TIMEOUT;
+    } else {
+        schedule(synAck, EV_CONNECTED, sc, sc->devGen, NULL, 0);
+    }
+    return ESPCONN_OK;
+}
+
+sint8 __wrap_espconn_disconnect(struct espconn *conn) {
+    simconn_t *sc = conn->host;
+    uint64_t at, abortAt;
+    if (sc == NULL || (!sc->deviceOpen && !sc->connecting)) {
+        return ESPCONN_ARG;
+    }
+    sc->deviceOpen = 0;
+    sc->connecting = 0;
+    sc->devGen++;
+    session_down();
+    // the callback is deferred, as the SDK does
+    schedule(host_time_us(), EV_CLOSED, sc, sc->devGen, NULL, 0);
+    if (sc->brokerOpen && (at = deliver(&sc->toBrokerUs, host_time_us(), 0, &abortAt)) != 0) {
+        schedule(at, EV_FIN_TO_BROKER, sc, sc->brokerGen, NULL, 0);
+    }
+    return ESPCONN_OK;
+}
+
+sint8 __wrap_espconn_delete(struct espconn *conn) {
+    simconn_t *sc = conn->host;
+    if (sc == NULL) {
+        return ESPCONN_ARG;
+    }
+    if (sc->deviceOpen || sc->connecting) {
+        session_down();
+    }
+    sc->deviceOpen = 0;
+    sc->connecting = 0;
+    sc->devGen++;
+    broker_close(sc, !sc->disconnected, 0);
+    return ESPCONN_OK;
+}
+
+sint8 __wrap_espconn_create(struct espconn *conn) {
+    simconn_t *sc;
+    if (conn->type != ESPCONN_UDP || (sc = sim_conn(conn)) == NULL) {
+        return ESPCONN_ARG;
+    }
+    sc->udp = 1;
+    sc->deviceOpen = 1;
+    return ESPCONN_OK;
+}
+
+sint8 __wrap_espconn_send(struct espconn *conn, uint8 *psent, uint16 length) {
+    simconn_t *sc = conn->host;
+    uint64_t now = host_time_us(), at, abortAt;
+    uint16_t readings, outside;
+    event_t *e;
+    if (sc == NULL || !sc->deviceOpen) {
+        return ESPCONN_ARG;
+    }
+    if (sc->udp) {
+        if (conn->proto.udp->remote_port == TIMEBASE_NTP_PORT) {
+            sntp_reply(sc, psent, length);
+        }
+        return ESPCONN_OK;
+    }
+    readings = is_reading(psent, length);
+    outside = (readings && fault_window(now) == NULL) ? 1 : 0;
+    st.readingsSent += readings;
+    if (sc->doomed) {
+        readings_lost(readings, outside);
+        return ESPCONN_OK;
+    }
+    if ((at = deliver(&sc->toBrokerUs, now, 0, &abortAt)) == 0) {
+        sc->doomed = 1;
+        readings_lost(readings, outside);
+        schedule(abortAt, EV_ABORT, sc, sc->devGen, NULL, 0)->err = ESPCONN_TIMEOUT;
+        return ESPCONN_OK;
+    }
+    e = schedule(at, EV_TO_BROKER, sc, sc->brokerGen, psent, length);
+    e->readings = readings;
+    e->readingsOutside = outside;
+    // the SDK calls back once the data is acknowledged
+    schedule(at + SIM_LATENCY_MS * 1000ULL + (uint64_t)(fault_value(FAULT_SLOW_ACK, at) * 1000), EV_SENT, sc,
+             sc->devGen, NULL, 0);
+    return ESPCONN_OK;
+}
+
+// where twheel.c should run the reading due at dueUs: the tick it is in, or
+// with the grid on, the tick the nearest grid point is in
+static uint64_t reading_tick(uint64_t dueUs) {
+    dueUs = (dueUs + TICK_US - 1) / TICK_US * TICK_US;
+    if (gridUs != 0 && READING_MS * 1000ULL >= gridUs) {
+        int64_t off = (int64_t)(dueUs - gridPhaseUs) + gridUs / 2;
+        int64_t steps = off / gridUs - (off < 0 && off % gridUs != 0);
+        dueUs = (gridPhaseUs + steps * gridUs + TICK_US - 1) / TICK_US * TICK_US;
+    }
+    return dueUs;
+}
+
+// each reading main.c makes, as it goes into the telemetry lane
+sint8 __wrap_outq_reading(const uint8_t *data, uint32_t len) {
+    uint64_t now = host_time_us();
+    int64_t err;
+    if (lastDueUs != 0 && !upSinceDue) {
+        err = (int64_t)(now - lastDueUs) - READING_MS * 1000LL;
+        if (err < 0) {
+            err = -err;
+        }
+        if ((uint64_t)err > st.periodErrUs) {
+            st.periodErrUs = (uint32_t)err;
+        }
+    }
+    if (readingArmUs != 0) {
+        err = (int64_t)(now - readingNextUs);
+        if (err < 0) {
+            err = -err;
+        }
+        if ((uint64_t)err > st.scheduleErrUs) {
+            st.scheduleErrUs = (uint32_t)err;
+        }
+        // twheel.c placed the next one before running this one, on the grid as it is now
+        readingNextUs = reading_tick(readingArmUs + (uint64_t)(++readingsSinceArm + 1) * READING_MS * 1000);
+    }
+    lastDueUs = now;
+    upSinceDue = 0;
+    st.readingsDue++;
+    return __real_outq_reading(data, len);
+}
+
+// main.c arms the reading timer again on every connection
+void __wrap_twheel_arm(twheel_timer_t *t, uint32_t ms, uint8_t repeat) {
+    if (ms == READING_MS && repeat) {
+        readingArmUs = host_time_us();
+        readingsSinceArm = 0;
+        readingNextUs = reading_tick(readingArmUs + READING_MS * 1000ULL);
+        upSinceDue = 1;
+    }
+    __real_twheel_arm(t, ms, repeat);
+}
+
+void __wrap_twheel_set_grid(uint32_t us, uint64_t phaseUs) {
+    gridUs = us;
+    gridPhaseUs = phaseUs;
+    __real_twheel_set_grid(us, phaseUs);
+}
+
+// readings leave the lane through here, whether there is a session to send them on or not
+uint8_t __wrap_mqttSend(mqtt_session_t *session, uint8_t *data, uint32_t len, mqtt_message_type msgType) {
+    fault_t *f;
+    fwSession = session;
+    if (msgType == MQTT_MSG_TYPE_PUBLISH && !session->validConnection) {
+        st.readingsMissed++;
+        if ((f = fault_window(host_time_us())) != NULL) {
+            f->missed++;
+        } else {
+            st.missedOutside++;
+        }
+    }
+    return __real_mqttSend(session, data, len, msgType);
+}
+
+/******************************************************************************
+ * the script
+ */
+
+// "1d6h", "90s", "2m"; a bare number is seconds
+static int parse_time(const char *s, uint64_t *us) {
+    uint64_t total = 0;
+    char *end;
+    if (*s == 0) {
+        return -1;
+    }
+    while (*s) {
+        double v = strtod(s, &end);
+        uint64_t unit = 1000000ULL;
+        if (end == s || v < 0) {
+            return -1;
+        }
+        switch (*end) {
+            case 'd': unit = DAY_US; end++; break;
+            case 'h': unit = HOUR_US; end++; break;
+            case 'm': unit = 60000000ULL; end++; break;
+            case 's': end++; break;
+            case 0: break;
+            default: return -1;
+        }
+        total += (uint64_t)(v * unit);
+        s = end;
+    }
+    *us = total;
+    return 0;
+}
+
+static int load_script(const char *text, uint64_t runUs) {
+    fault_t parsed[MAX_FAULTS];
+    uint32_t count = 0, i, lineNo = 0;
+    uint64_t repeatUs = 0, base;
+    char line[256];
+    const char *p = text;
+    while (*p) {
+        const char *nl = strchr(p, '\n');
+        size_t n = nl ? (size_t)(nl - p) : strlen(p);
+        char at[32], kind[32], dur[32], *hash;
+        double value = 0;
+        int fields;
+        if (n >= sizeof(line)) {
+            n = sizeof(line) - 1;
+        }
+        memcpy(line, p, n);
+        line[n] = 0;
+        p += nl ? n + 1 : n;
+        lineNo++;
+        if ((hash = strchr(line, '#')) != NULL) {
+            *hash = 0;
+        }
+        fields = sscanf(line, "%31s %31s %31s %lf", at, kind, dur, &value);
+        if (fields <= 0) {
+            continue;
+        }
+        if (strcmp(at, "repeat") == 0) {
+            if (fields != 2 || parse_time(kind, &repeatUs) != 0 || repeatUs == 0) {
+                fprintf(stderr, "line %u: repeat needs a period\n", lineNo);
+                return -1;
+            }
+            continue;
+        }
+        if (fields < 3 || count == MAX_FAULTS) {
+            fprintf(stderr, "line %u: expected <at> <fault> <for> [value]\n", lineNo);
+            return -1;
+        }
+        for (i = 0; i < FAULT_KINDS && strcmp(kind, faultNames[i]) != 0; i++) {
+        }
+        if (i == FAULT_KINDS || parse_time(at, &parsed[count].startUs) != 0 ||
+            parse_time(dur, &parsed[count].endUs) != 0) {
+            fprintf(stderr, "line %u: bad fault or time\n", lineNo);
+            return -1;
+        }
+        if ((i == FAULT_DROP || i == FAULT_SLOW_ACK) && fields != 4) {
+            fprintf(stderr, "line %u: %s needs a value\n", lineNo, faultNames[i]);
+            return -1;
+        }
+        parsed[count].kind = i;
+        parsed[count].value = (i == FAULT_DROP || i == FAULT_SLOW_ACK) ? value : 1;
+        parsed[count].endUs += parsed[count].startUs;
+        count++;
+    }
+    for (base = 0; base < runUs; base += repeatUs) {
+        for (i = 0; i < count && faultCount < MAX_FAULTS; i++) {
+            if (base + parsed[i].startUs < runUs) {
+                faults[faultCount] = parsed[i];
+                faults[faultCount].startUs += base;
+                faults[faultCount].endUs += base;
+                faultCount++;
+            }
+        }
+        if (repeatUs == 0) {
+            break;
+        }
+    }
+    return 0;
+}
+
+static char *read_file(const char *name) {
+    FILE *f = fopen(name, "rb");
+    char *text;
+    long len;
+    if (f == NULL) {
+        return NULL;
+    }
+    fseek(f, 0, SEEK_END);
+    len = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    text = calloc(1, len + 1);
+    if (fread(text, 1, len, f) != (size_t)len) {
+        free(text);
+        text = NULL;
+    }
+    fclose(f);
+    return text;
+}
+
+// faults that start or end by now take effect
+static void faults_apply(uint64_t now) {
+    uint32_t i;
+    for (i = 0; i < faultCount; i++) {
+        fault_t *f = &faults[i];
+        if (f->state == 0 && f->startUs <= now) {
+            f->state = 1;
+            if (f->kind == FAULT_BROKER_RESTART) {
+                uint8_t c;
+                for (c = 0; c < MAX_CONNS; c++) {
+                    broker_close(&conns[c], 0, 1);
+                }
+                sessionCount = 0;
+            }
+        }
+        if (f->state == 1 && f->endUs <= now) {
+            f->state = 2;
+            if (sessionUp) {
+                f->recovered = 1;
+            }
+        }
+    }
+    host_wifi_status = (fault_value(FAULT_AP_LOSS, now) != 0) ? STATION_CONNECTING : STATION_GOT_IP;
+}
+
+static uint64_t faults_next(uint64_t now) {
+    uint64_t next = UINT64_MAX;
+    uint32_t i;
+    for (i = 0; i < faultCount; i++) {
+        if (faults[i].startUs > now && faults[i].startUs < next) {
+            next = faults[i].startUs;
+        }
+        if (faults[i].endUs > now && faults[i].endUs < next) {
+            next = faults[i].endUs;
+        }
+    }
+    return next;
+}
+
+/******************************************************************************
+ * the report
+ */
+
+typedef struct {
+    const char *name;
+    uint8_t ok;
+    double value;
+    double limit;
+} check_t;
+
+static void report(FILE *out, double wallS, const check_t *checks, uint32_t checkCount, uint8_t pass) {
+    const scratch_stats_t *ss = scratch_stats();
+    const timebase_stats_t *ts = timebase_stats();
+    uint32_t i;
+    fprintf(out, "{\n  \"tool\": \"soak\",\n  \"build\": \"%s\",\n", opt.label);
+    fprintf(out, "  \"config\": {\"days\": %u, \"script\": \"%s\", \"faults\": %u, \"seed\": %u, \"grace_s\": %.0f, "
+                 "\"reading_ms\": %d, \"keepalive_s\": %d, \"persistent\": %d},\n",
+            opt.days, opt.scriptName, faultCount, opt.seed, opt.graceUs / 1e6, READING_MS, mqtt_keepalive,
+            mqtt_persistent);
+    fprintf(out, "  \"virtual_s\": %.0f,\n  \"wall_s\": %.3f,\n", host_time_us() / 1e6, wallS);
+    fprintf(out, "  \"heap\": {\"baseline\": %u, \"final\": %u, \"max\": %u, \"peak\": %u, \"low_free\": %u, "
+                 "\"scratch_peak\": %u, \"scratch_leaks\": %u, \"scratch_failures\": %u},\n",
+            st.heapBaseline, host_heap_used(), st.heapMax, host_heap_peak(), ss->heapLow, ss->peak, ss->leaks,
+            ss->failures);
+    fprintf(out, "  \"readings\": {\"due\": %u, \"sent\": %u, \"delivered\": %u, \"missed\": %u, \"lost\": %u, "
+                 "\"missed_outside_faults\": %u, \"lost_outside_faults\": %u, \"period_error_ms\": %.3f, "
+                 "\"schedule_error_ms\": %.3f},\n",
+            st.readingsDue, st.readingsSent, st.readingsDelivered, st.readingsMissed, st.readingsLost,
+            st.missedOutside, st.lostOutside, st.periodErrUs / 1000.0, st.scheduleErrUs / 1000.0);
+    fprintf(out, "  \"sessions\": {\"up\": %u, \"lost\": %u, \"connect_attempts\": %u, \"refused\": %u, "
+                 "\"aborts\": %u, \"connacks\": %u, \"resumed\": %u, \"takeovers\": %u, \"wills\": %u, "
+                 "\"max_attempts_per_min\": %u},\n",
+            st.sessionsUp, st.sessionsLost, st.connectAttempts, st.refused, st.aborts, st.connacks, st.resumed,
+            st.takeovers, st.wills, st.stormMax);
+    fprintf(out, "  \"network\": {\"segments\": %u, \"segments_lost\": %u, \"pings\": %u, \"publishes\": %u, "
+                 "\"sntp_replies\": %u, \"tx_queue_peak\": %u, \"tx_refused\": %u},\n",
+            st.segments, st.segmentsLost, st.pings, st.publishes, st.sntpReplies,
+            fwSession ? fwSession->txStats.queuedPeak : 0, fwSession ? fwSession->txStats.refused : 0);
+    fprintf(out, "  \"timebase\": {\"valid\": %u, \"syncs\": %u, \"failures\": %u, \"drift_ppb\": %d},\n",
+            timebase_valid(), ts->syncs, ts->failures, ts->driftPpb);
+    fprintf(out, "  \"faults\": [");
+    for (i = 0; i < faultCount; i++) {
+        const fault_t *f = &faults[i];
+        fprintf(out, "%s\n    {\"kind\": \"%s\", \"at_s\": %.0f, \"for_s\": %.0f, \"value\": %g, \"recovered\": %s, "
+                     "\"recovery_s\": %.3f, \"sessions_lost\": %u, \"missed\": %u, \"lost\": %u}",
+                i ? "," : "", faultNames[f->kind], f->startUs / 1e6, (f->endUs - f->startUs) / 1e6, f->value,
+                f->recovered ? "true" : "false", f->recoveryUs / 1e6, f->sessionsLost, f->missed, f->lost);
+    }
+    fprintf(out, "\n  ],\n  \"invariants\": [");
+    for (i = 0; i < checkCount; i++) {
+        fprintf(out, "%s\n    {\"name\": \"%s\", \"ok\": %s, \"value\": %g, \"limit\": %g}", i ? "," : "",
+                checks[i].name, checks[i].ok ? "true" : "false", checks[i].value, checks[i].limit);
+    }
+    fprintf(out, "\n  ],\n  \"pass\": %s\n}\n", pass ? "true" : "false");
+}
+
+static void usage(void) {
+    fprintf(stderr, "usage: soak [-d days] [-f script] [-o report.json] [-b label] [-s seed] [-g grace_s] "
+                    "[-c attempts_per_min] [-H heap_bytes] [-v]\n");
+    exit(2);
+}
+
+int main(int argc, char **argv) {
+    const char *reportName = NULL;
+    char *text = (char *)defaultScript;
+    char memory[192], *corrupt;
+    check_t checks[8];
+    uint64_t runUs, nextHour = HOUR_US, worstRecovery = 0;
+    uint32_t i, unrecovered = 0, corruptions = 0;
+    int64_t clockErr = 0;
+    struct timespec t0, t1;
+    uint8_t pass = 1;
+    FILE *out = stdout;
+    int c;
+
+    host_verbose = 0;
+    while ((c = getopt(argc, argv, "d:f:o:b:s:g:c:H:v")) != -1) {
+        switch (c) {
+            case 'd': opt.days = atoi(optarg); break;
+            case 'f':
+                opt.scriptName = optarg;
+                if ((text = read_file(optarg)) == NULL) {
+                    perror(optarg);
+                    return 2;
+                }
+                break;
+            case 'o': reportName = optarg; break;
+            case 'b': opt.label = optarg; break;
+            case 's': opt.seed = atoi(optarg); break;
+            case 'g': opt.graceUs = (uint64_t)atoi(optarg) * 1000000; break;
+            case 'c': opt.stormLimit = atoi(optarg); break;
+            case 'H': opt.heapSlack = atoi(optarg); break;
+            case 'v': host_verbose = 1; break;
+            default: usage();
+        }
+    }
+    if (opt.days == 0) {
+        usage();
+    }
+    runUs = opt.days * DAY_US;
+    if (load_script(text, runUs) != 0) {
+        return 2;
+    }
+    rngState = 0x9E3779B97F4A7C15ULL ^ opt.seed;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+
+    host_virtual_time = 1;
+    os_timer_setfn(&simTimer, sim_run, NULL);
+    user_pre_init();
+    user_init();
+    while (host_time_us() < runUs && !stop) {
+        uint64_t next = faults_next(host_time_us());
+        if (next > nextHour) {
+            next = nextHour;
+        }
+        if (next > runUs) {
+            next = runUs;
+        }
+        host_loop_run(next, &stop);
+        faults_apply(host_time_us());
+        if (host_time_us() >= nextHour) {
+            if (host_heap_used() > st.heapMax) {
+                st.heapMax = host_heap_used();
+            }
+            if (nextHour % DAY_US == 0) {
+                fprintf(stderr, "day %3u  sessions %u  attempts %u  readings %u/%u delivered  heap %u\n",
+                        (uint32_t)(nextHour / DAY_US), st.sessionsUp, st.connectAttempts, st.readingsDelivered,
+                        st.readingsDue, host_heap_used());
+            }
+            nextHour += HOUR_US;
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+
+    for (i = 0; i < faultCount; i++) {
+        if (faults[i].state == 2 && !faults[i].recovered) {
+            unrecovered++;
+        } else if (faults[i].recoveryUs > worstRecovery) {
+            worstRecovery = faults[i].recoveryUs;
+        }
+    }
+    mempool_report(memory, sizeof(memory));
+    if ((corrupt = strstr(memory, "corrupt=")) != NULL) {
+        corruptions = atoi(corrupt + 8);
+    }
+    if (timebase_valid()) {
+        clockErr = (int64_t)(timebase_now_us() - (SIM_UNIX_BASE_S * 1000000ULL + host_time_us()));
+        if (clockErr < 0) {
+            clockErr = -clockErr;
+        }
+    }
+    checks[0] = (check_t){ "heap_flat", host_heap_used() <= st.heapBaseline + opt.heapSlack,
+                           (double)host_heap_used() - st.heapBaseline, opt.heapSlack };
+    checks[1] = (check_t){ "memory_clean", scratch_stats()->leaks == 0 && scratch_stats()->failures == 0 && corruptions == 0,
+                           scratch_stats()->leaks + scratch_stats()->failures + corruptions, 0 };
+    checks[2] = (check_t){ "no_loss_outside_faults", st.missedOutside + st.lostOutside == 0,
+                           st.missedOutside + st.lostOutside, 0 };
+    checks[3] = (check_t){ "recovery", unrecovered == 0 && worstRecovery <= opt.graceUs,
+                           unrecovered ? -1 : worstRecovery / 1e6, opt.graceUs / 1e6 };
+    checks[4] = (check_t){ "no_reconnect_storm", st.stormMax <= opt.stormLimit, st.stormMax, opt.stormLimit };
+    checks[5] = (check_t){ "clock_synced", timebase_valid() && clockErr <= SIM_CLOCK_LIMIT_US,
+                           timebase_valid() ? clockErr / 1000.0 : -1, SIM_CLOCK_LIMIT_US / 1000.0 };
+    checks[6] = (check_t){ "reading_period", st.periodErrUs <= POWER_DTIM_US, st.periodErrUs / 1000.0,
+                           POWER_DTIM_US / 1000.0 };
+    checks[7] = (check_t){ "reading_schedule", st.scheduleErrUs == 0, st.scheduleErrUs / 1000.0, 0 };
+    for (i = 0; i < sizeof(checks) / sizeof(checks[0]); i++) {
+        pass &= checks[i].ok;
+        if (!checks[i].ok) {
+            fprintf(stderr, "FAIL: %s is %g, limit %g\n", checks[i].name, checks[i].value, checks[i].limit);
+        }
+    }
+    if (reportName != NULL && (out = fopen(reportName, "w")) == NULL) {
+        perror(reportName);
+        return 2;
+    }
+    report(out, (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9, checks, sizeof(checks) / sizeof(checks[0]),
+           pass);
+    if (out != stdout) {
+        fclose(out);
+    }
+    fprintf(stderr, "%s\n", pass ? "PASS" : "FAIL");
+    return pass ? 0 : 1;
+}
@@ -0,0 +1,151 @@
+// Runs the firmware's timebase.c against an SNTP server, normally the
+// stand-in sntpd.py, and reports how closely it tracks it. With sntpd.py at
+// no offset its clock is this machine's, so the error column is how far the
+// firmware's idea of the time is off.
+//
+// usage: timesync [options]
+//   -h host      server IPv4 address (127.0.0.1)
+//   -p port      server port (12300, sntpd.py's default)
+//   -n count     syncs to run (5)
+//   -i seconds   time between syncs (10); drift needs 60 or more
+//   -W           start system_get_time() 5 s before its 32-bit wrap
+//   -r file      keep RTC memory in this file between runs
+//   -s           timebase_save() at the end, as before deep sleep
+//   -w           start as if woken from deep sleep, restoring from -r
+//   -v           print the firmware's debug output
+//
+// Deep sleep round trip: timesync -r rtc.bin -s, wait, then
+// timesync -r rtc.bin -w; the first line shows the restored time's error.
+
+#include <getopt.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <arpa/inet.h>
+
+#include "osapi.h"
+#include "user_interface.h"
+#include "timebase.h"
+#include "twheel.h"
+#include "host.h"
+
+#define CHECK_MS 100
+
+static struct {
+    uint8_t ip[4];
+    uint16_t port;
+    uint32_t count;
+    uint32_t intervalS;
+    uint8_t save;
+} opt = { { 127, 0, 0, 1 }, 12300, 5, 10, 0 };
+
+static volatile int stop;
+static uint32_t done;
+static uint64_t lastLocal;
+static uint32_t backwards;
+static os_timer_t syncTimer;
+static os_timer_t checkTimer;
+
+static int64_t wall_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static int64_t error_us(void) {
+    return (int64_t)timebase_now_us() - wall_us();
+}
+
+static void start_sync(void *arg) {
+    timebase_sync(opt.ip, opt.port);
+}
+
+static void on_sync(uint8_t ok) {
+    const timebase_stats_t *st = timebase_stats();
+    done++;
+    if (ok) {
+        printf("sync %u ok   rtt %6u us  step %+8d us  drift %+8d ppb  error %+8lld us\n",
+               done, st->lastRttUs, st->lastStepUs, st->driftPpb, (long long)error_us());
+    } else {
+        printf("sync %u failed\n", done);
+    }
+    fflush(stdout);
+    if (done >= opt.count) {
+        stop = 1;
+        return;
+    }
+    os_timer_arm(&syncTimer, opt.intervalS * 1000, 0);
+}
+
+// the 64-bit clock must never step back, in particular across the wrap
+static void check_clock(void *arg) {
+    uint64_t now = timebase_local_us();
+    if (now < lastLocal) {
+        backwards++;
+    }
+    lastLocal = now;
+}
+
+static void on_signal(int sig) {
+    stop = 1;
+}
+
+static void usage(void) {
+    fprintf(stderr, "usage: timesync [-h host] [-p port] [-n count] [-i interval_s] [-W] [-r rtc_file] [-s] [-w] [-v]\n");
+    exit(2);
+}
+
+int main(int argc, char **argv) {
+    struct in_addr addr;
+    int c;
+
+    host_verbose = 0;
+    while ((c = getopt(argc, argv, "h:p:n:i:Wr:swv")) != -1) {
+        switch (c) {
+            case 'h':
+                if (inet_pton(AF_INET, optarg, &addr) != 1) {
+                    usage();
+                }
+                memcpy(opt.ip, &addr.s_addr, 4);
+                break;
+            case 'p': opt.port = atoi(optarg); break;
+            case 'n': opt.count = atoi(optarg); break;
+            case 'i': opt.intervalS = atoi(optarg); break;
+            case 'W': host_time_base = 0xFFFFFFFF - 5000000; break;
+            case 'r': host_rtc_file = optarg; break;
+            case 's': opt.save = 1; break;
+            case 'w': host_rst_reason = REASON_DEEP_SLEEP_AWAKE; break;
+            case 'v': host_verbose = 1; break;
+            default: usage();
+        }
+    }
+    if (opt.count == 0) {
+        usage();
+    }
+    signal(SIGINT, on_signal);
+
+    twheel_init();
+    timebase_init();
+    if (timebase_valid()) {
+        printf("restored     drift %+8d ppb  error %+8lld us\n", timebase_stats()->driftPpb, (long long)error_us());
+    }
+    timebase_set_sync_cb(on_sync);
+    os_timer_setfn(&syncTimer, (os_timer_func_t *)start_sync, NULL);
+    os_timer_setfn(&checkTimer, (os_timer_func_t *)check_clock, NULL);
+    os_timer_arm(&checkTimer, CHECK_MS, 1);
+    start_sync(NULL);
+
+    while (!stop) {
+        host_loop_once(100);
+    }
+    check_clock(NULL);
+    printf("%u syncs, %u failed, 64-bit clock %s, local clock %llu us\n", timebase_stats()->syncs,
+           timebase_stats()->failures, backwards ? "WENT BACKWARDS" : "monotonic", (unsigned long long)lastLocal);
+    if (opt.save) {
+        timebase_save();
+        printf("saved to RTC memory\n");
+    }
+    return backwards ? 1 : 0;
+}
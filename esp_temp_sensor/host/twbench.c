@@ -0,0 +1,180 @@
+// Timer wheel benchmark: N timers through twheel.c against the same timers
+// as separate os_timer_t. The host's os_timer is a binary heap, so it is a
+// kinder baseline than the SDK, which keeps armed timers in a sorted list.
+//
+// usage: twbench [options]
+//   -n count     timers (10000)
+//   -c ops       disarm/arm pairs on random timers for the churn test (1000000)
+//   -s seconds   deadlines for the expiry test spread over this long (5)
+//
+// Reports ns per arm, disarm and rearm, then runs every timer to expiry
+// in real time and reports how many times the CPU was woken for them and
+// how late they ran.
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "osapi.h"
+#include "timebase.h"
+#include "twheel.h"
+#include "host.h"
+
+typedef struct {
+    twheel_timer_t wheel;
+    os_timer_t os;
+    uint64_t due; // host_time_us() the timer should run at
+} bench_timer_t;
+
+static struct {
+    uint32_t count;
+    uint32_t churn;
+    uint32_t spreadS;
+} opt = { 10000, 1000000, 5 };
+
+static bench_timer_t *timers;
+static uint32_t *delays;
+static uint32_t fired;
+static uint32_t osWakes;
+static uint64_t lastOsFire;
+static uint64_t lateSum;
+static uint64_t lateMax;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void record(bench_timer_t *b) {
+    uint64_t now = host_time_us();
+    uint64_t late = (now > b->due) ? now - b->due : 0;
+    fired++;
+    lateSum += late;
+    if (late > lateMax) {
+        lateMax = late;
+    }
+}
+
+static void on_wheel(void *arg) {
+    record(arg);
+}
+
+// os_timers due in the same millisecond run from one pass of the host loop;
+// count those as one wake
+static void on_os(void *arg) {
+    uint64_t now = host_time_us() / 1000;
+    if (now != lastOsFire) {
+        osWakes++;
+        lastOsFire = now;
+    }
+    record(arg);
+}
+
+static void report(const char *what, const char *impl, uint64_t ns, uint32_t ops) {
+    printf("  %-8s %-9s %8.1f ns/op\n", what, impl, (double)ns / ops);
+}
+
+static void bench_ops(void) {
+    uint64_t t0;
+    uint32_t i, j;
+
+    printf("%u timers, delays up to %u s:\n", opt.count, 600);
+    t0 = now_ns();
+    for (i = 0; i < opt.count; i++) {
+        twheel_arm(&timers[i].wheel, delays[i], 0);
+    }
+    report("arm", "twheel", now_ns() - t0, opt.count);
+    t0 = now_ns();
+    for (i = 0; i < opt.count; i++) {
+        os_timer_arm(&timers[i].os, delays[i], 0);
+    }
+    report("arm", "os_timer", now_ns() - t0, opt.count);
+
+    // the ping pattern: disarm a timer and arm it again
+    t0 = now_ns();
+    for (i = 0, j = 0; i < opt.churn; i++, j = (j + 7919) % opt.count) {
+        twheel_disarm(&timers[j].wheel);
+        twheel_arm(&timers[j].wheel, delays[(j + i) % opt.count], 0);
+    }
+    report("rearm", "twheel", now_ns() - t0, opt.churn);
+    t0 = now_ns();
+    for (i = 0, j = 0; i < opt.churn; i++, j = (j + 7919) % opt.count) {
+        os_timer_disarm(&timers[j].os);
+        os_timer_arm(&timers[j].os, delays[(j + i) % opt.count], 0);
+    }
+    report("rearm", "os_timer", now_ns() - t0, opt.churn);
+
+    t0 = now_ns();
+    for (i = 0; i < opt.count; i++) {
+        twheel_disarm(&timers[i].wheel);
+    }
+    report("disarm", "twheel", now_ns() - t0, opt.count);
+    t0 = now_ns();
+    for (i = 0; i < opt.count; i++) {
+        os_timer_disarm(&timers[i].os);
+    }
+    report("disarm", "os_timer", now_ns() - t0, opt.count);
+}
+
+static void bench_expiry(uint8_t wheel) {
+    uint32_t wakes0 = twheel_stats()->wakes;
+    uint64_t start = host_time_us();
+    uint32_t i, ms;
+
+    fired = 0;
+    osWakes = 0;
+    lastOsFire = 0;
+    lateSum = lateMax = 0;
+    for (i = 0; i < opt.count; i++) {
+        ms = 1 + random() % (opt.spreadS * 1000);
+        timers[i].due = start + (uint64_t)ms * 1000;
+        if (wheel) {
+            twheel_arm(&timers[i].wheel, ms, 0);
+        } else {
+            os_timer_arm(&timers[i].os, ms, 0);
+        }
+    }
+    while (fired < opt.count) {
+        host_loop_once(1000);
+    }
+    printf("  %-9s %6u expiries, %6u wakes, late %6.0f us mean %6llu us max\n", wheel ? "twheel" : "os_timer",
+           fired, wheel ? twheel_stats()->wakes - wakes0 : osWakes, (double)lateSum / fired,
+           (unsigned long long)lateMax);
+}
+
+int main(int argc, char **argv) {
+    int c;
+
+    host_verbose = 0;
+    while ((c = getopt(argc, argv, "n:c:s:")) != -1) {
+        switch (c) {
+            case 'n': opt.count = atoi(optarg); break;
+            case 'c': opt.churn = atoi(optarg); break;
+            case 's': opt.spreadS = atoi(optarg); break;
+            default:
+                fprintf(stderr, "usage: twbench [-n count] [-c churn_ops] [-s spread_s]\n");
+                return 2;
+        }
+    }
+    if (opt.count == 0 || opt.spreadS == 0) {
+        return 2;
+    }
+    srandom(1);
+    twheel_init();
+    timers = calloc(opt.count, sizeof(*timers));
+    delays = calloc(opt.count, sizeof(*delays));
+    for (uint32_t i = 0; i < opt.count; i++) {
+        twheel_setfn(&timers[i].wheel, on_wheel, &timers[i]);
+        os_timer_setfn(&timers[i].os, (os_timer_func_t *)on_os, &timers[i]);
+        delays[i] = 10 + random() % 600000;
+    }
+    bench_ops();
+    printf("\nall %u timers run to expiry within %u s:\n", opt.count, opt.spreadS);
+    bench_expiry(1);
+    bench_expiry(0);
+    printf("  twheel totals: %u wakes, %u expired, %u moved down a level\n", twheel_stats()->wakes,
+           twheel_stats()->expired, twheel_stats()->cascaded);
+    return 0;
+}
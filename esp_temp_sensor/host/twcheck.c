@@ -0,0 +1,254 @@
+// Checks twheel.c on a simulated clock, against when each timer was due:
+//
+//   - a one-shot timer whose deadline is the first tick of a slot on a
+//     higher level, which moves down on that very tick, runs on it and not
+//     a tick later, for each level and a few ticks either side
+//   - a repeating timer on such a period runs exactly a period apart,
+//     however many times it goes round
+//   - thousands of one-shot timers, armed together with deadlines up to
+//     the -d days, each run on the tick it was due
+//   - with a grid of one DTIM interval, 307.2 ms, a timer shorter than
+//     that is left alone, and a one-shot and every run of a repeating
+//     timer land in the tick of the grid point nearest their deadline,
+//     so a 20 s period does not drift however many times it goes round
+//
+// Deadlines are whole ticks from a tick boundary, so every timer has to
+// run exactly on time.
+//
+// usage: twcheck [options]
+//   -n count     timers for the spread check (10000)
+//   -d days      longest deadline in the spread check (3)
+//   -r runs      runs of each repeating timer (100)
+//   -s seed      for the deadlines (1)
+//
+// Exits 1 if a check fails.
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "osapi.h"
+#include "twheel.h"
+#include "host.h"
+
+#define TICK_US (TWHEEL_TICK_MS * 1000ULL)
+#define GRID_US 307200 // POWER_DTIM_US
+#define GRID_PERIOD_MS 20000 // main.c's readings
+
+typedef struct {
+    twheel_timer_t t;
+    uint64_t dueUs; // when it should run next
+    uint64_t periodUs; // 0 for one-shot
+    uint32_t runs;
+    uint64_t worstUs; // furthest a run was from dueUs
+    uint32_t wrong; // runs not on time
+    uint64_t ranUs; // when it last ran
+} check_timer_t;
+
+static void on_timer(void *arg) {
+    check_timer_t *c = arg;
+    uint64_t now = host_time_us();
+    uint64_t off = (now > c->dueUs) ? now - c->dueUs : c->dueUs - now;
+    if (off > c->worstUs) {
+        c->worstUs = off;
+    }
+    if (off != 0) {
+        c->wrong++;
+    }
+    c->runs++;
+    c->ranUs = now;
+    c->dueUs += c->periodUs;
+}
+
+static void arm(check_timer_t *c, uint32_t ms, uint8_t repeat) {
+    c->dueUs = host_time_us() + ms * 1000ULL;
+    c->periodUs = repeat ? ms * 1000ULL : 0;
+    c->runs = c->wrong = 0;
+    c->worstUs = 0;
+    twheel_setfn(&c->t, on_timer, c);
+    twheel_arm(&c->t, ms, repeat);
+}
+
+// runs the wheel until the timer has run this many times, or an hour past when it should have
+static void run_until(check_timer_t *c, uint32_t runs) {
+    uint64_t limit = c->dueUs + (uint64_t)(runs - 1) * c->periodUs + 3600000000ULL;
+    while (c->runs < runs && host_time_us() < limit) {
+        host_loop_once(1000);
+    }
+}
+
+// the ticks to the nth tick from now on which a slot of the given size starts
+static uint32_t to_boundary(uint32_t slotTicks, uint32_t nth) {
+    uint64_t tick = host_time_us() / TICK_US;
+    return (uint32_t)((tick / slotTicks + nth) * slotTicks - tick);
+}
+
+static int check_boundaries(void) {
+    static const int32_t around[] = { -1, 0, 1 };
+    uint32_t level, slotTicks, ms, i, nth;
+    check_timer_t c;
+    int wrong = 0;
+    for (level = 1; level < TWHEEL_LEVELS; level++) {
+        slotTicks = 1UL << (TWHEEL_L0_BITS + (level - 1) * TWHEEL_LN_BITS);
+        for (nth = 1; nth <= 3; nth++) {
+            for (i = 0; i < sizeof(around) / sizeof(around[0]); i++) {
+                ms = (to_boundary(slotTicks, nth) + around[i]) * TWHEEL_TICK_MS;
+                arm(&c, ms, 0);
+                run_until(&c, 1);
+                if (c.runs != 1 || c.wrong != 0) {
+                    printf("boundary: %u ms onto a level %u slot %+d ticks ran %u times, %llu us off\n", ms, level,
+                           around[i], c.runs, (unsigned long long)c.worstUs);
+                    wrong++;
+                }
+            }
+        }
+    }
+    return wrong;
+}
+
+static int check_repeats(uint32_t runs) {
+    uint32_t level, slotTicks, ms;
+    check_timer_t c;
+    int wrong = 0;
+    for (level = 1; level < TWHEEL_LEVELS - 1; level++) {
+        slotTicks = 1UL << (TWHEEL_L0_BITS + (level - 1) * TWHEEL_LN_BITS);
+        // starting on a slot boundary, so every run lands on one too
+        host_loop_run(host_time_us() + to_boundary(slotTicks, 1) * TICK_US, NULL);
+        ms = slotTicks * TWHEEL_TICK_MS;
+        arm(&c, ms, 1);
+        run_until(&c, runs);
+        twheel_disarm(&c.t);
+        if (c.runs != runs || c.wrong != 0) {
+            printf("repeat: every %u ms ran %u of %u times, %u off time, worst by %llu us\n", ms, c.runs, runs,
+                   c.wrong, (unsigned long long)c.worstUs);
+            wrong++;
+        }
+    }
+    return wrong;
+}
+
+// where a deadline lands with the grid: the tick the nearest grid point is in
+static uint64_t on_grid(uint64_t dueUs, uint64_t phaseUs) {
+    uint64_t point = phaseUs + (dueUs - phaseUs + GRID_US / 2) / GRID_US * GRID_US;
+    return (point + TICK_US - 1) / TICK_US * TICK_US;
+}
+
+static int check_grid(uint32_t runs) {
+    check_timer_t c;
+    uint64_t phaseUs, startUs, nowUs, worstOff = 0;
+    uint32_t i;
+    int wrong = 0;
+    host_loop_run((host_time_us() / TICK_US + 1) * TICK_US, NULL);
+    phaseUs = host_time_us() + 12345; // not on a tick
+    twheel_set_grid(GRID_US, phaseUs);
+
+    arm(&c, 200, 0);
+    run_until(&c, 1);
+    if (c.runs != 1 || c.wrong != 0) {
+        printf("grid: a 200 ms timer was moved by %llu us\n", (unsigned long long)c.worstUs);
+        wrong++;
+    }
+    for (i = 0; i < 3; i++) {
+        uint32_t ms = (i == 0) ? 5000 : (i == 1) ? 5160 : 310;
+        nowUs = host_time_us();
+        arm(&c, ms, 0);
+        c.dueUs = on_grid(nowUs + ms * 1000ULL, phaseUs);
+        run_until(&c, 1);
+        if (c.runs != 1 || c.wrong != 0) {
+            printf("grid: a %u ms one-shot ran %llu us off the nearest grid point\n", ms,
+                   (unsigned long long)c.worstUs);
+            wrong++;
+        }
+    }
+
+    // the timer checks each run against dueUs, so move that along the grid from run to run
+    startUs = host_time_us();
+    arm(&c, GRID_PERIOD_MS, 1);
+    c.periodUs = 0;
+    for (i = 1; i <= runs; i++) {
+        uint64_t ideal = startUs + (uint64_t)i * GRID_PERIOD_MS * 1000;
+        uint64_t off;
+        c.dueUs = on_grid(ideal, phaseUs);
+        run_until(&c, i);
+        off = (c.ranUs > ideal) ? c.ranUs - ideal : ideal - c.ranUs;
+        if (off > worstOff) {
+            worstOff = off;
+        }
+    }
+    twheel_disarm(&c.t);
+    twheel_set_grid(0, 0);
+    printf("grid: %u runs every %u ms, %.3f ms apart on average, at most %.1f ms from their deadlines\n", c.runs,
+           GRID_PERIOD_MS, (c.ranUs - startUs) / 1000.0 / (runs ? runs : 1), worstOff / 1000.0);
+    if (c.runs != runs || c.wrong != 0 || worstOff > GRID_US / 2 + TICK_US) {
+        printf("grid: %u of %u runs off the nearest grid point, worst by %llu us\n", c.wrong, c.runs,
+               (unsigned long long)c.worstUs);
+        wrong++;
+    }
+    return wrong;
+}
+
+static int check_spread(uint32_t n, uint32_t days) {
+    check_timer_t *timers = calloc(n, sizeof(*timers));
+    uint64_t worst = 0, lastDue = 0;
+    uint32_t i, maxTicks = days * 24 * 3600 * (1000 / TWHEEL_TICK_MS), late = 0, missing = 0;
+    for (i = 0; i < n; i++) {
+        arm(&timers[i], (1 + (uint32_t)(random() % maxTicks)) * TWHEEL_TICK_MS, 0);
+        if (timers[i].dueUs > lastDue) {
+            lastDue = timers[i].dueUs;
+        }
+    }
+    host_loop_run(lastDue + 1, NULL);
+    for (i = 0; i < n; i++) {
+        late += timers[i].wrong;
+        missing += (timers[i].runs != 1);
+        if (timers[i].worstUs > worst) {
+            worst = timers[i].worstUs;
+        }
+    }
+    free(timers);
+    printf("%u timers over %u days: %u off time, %u not run once, worst by %llu us, %u moved down a level\n", n, days,
+           late, missing, (unsigned long long)worst, twheel_stats()->cascaded);
+    return (late != 0 || missing != 0) ? 1 : 0;
+}
+
+int main(int argc, char **argv) {
+    uint32_t n = 10000, days = 3, runs = 100, seed = 1;
+    int opt, wrong = 0;
+    while ((opt = getopt(argc, argv, "n:d:r:s:")) != -1) {
+        switch (opt) {
+        case 'n':
+            n = atoi(optarg);
+            break;
+        case 'd':
+            days = atoi(optarg);
+            break;
+        case 'r':
+            runs = atoi(optarg);
+            break;
+        case 's':
+            seed = atoi(optarg);
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-n count] [-d days] [-r runs] [-s seed]\n", argv[0]);
+            return 2;
+        }
+    }
+    if (days < 1 || days > 7 || runs < 1) {
+        fprintf(stderr, "days must be 1 to 7, the wheel reaches 7.7, and runs at least 1\n");
+        return 2;
+    }
+    srandom(seed);
+    host_verbose = 0;
+    host_virtual_time = 1;
+    twheel_init();
+    wrong += check_boundaries();
+    wrong += check_repeats(runs);
+    wrong += check_spread(n, days);
+    wrong += check_grid(runs);
+    if (wrong > 0) {
+        printf("FAIL: %d checks failed\n", wrong);
+        return 1;
+    }
+    printf("PASS\n");
+    return 0;
+}
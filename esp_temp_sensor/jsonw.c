@@ -0,0 +1,244 @@
+#include "ets_sys.h"
+#include "osapi.h"
+#include "os_type.h"
+#include "mempool.h"
+#include "jsonw.h"
+
+typedef struct {
+    const char *text;
+    uint8_t len;
+} jsonw_key_text_t;
+
+// quoted and with the colon, so a key is one copy
+#define KEY(name) { "\"" name "\":", sizeof(name) + 2 }
+
+static const jsonw_key_text_t keys[] = {
+    [JSONW_TEMP] = KEY("temp"),
+    [JSONW_HUMIDITY] = KEY("humidity"),
+    [JSONW_RSSI] = KEY("rssi"),
+    [JSONW_HEAP] = KEY("heap"),
+    [JSONW_SEQ] = KEY("seq"),
+    [JSONW_TS] = KEY("ts"),
+    [JSONW_LED] = KEY("led"),
+    [JSONW_UPTIME] = KEY("uptime"),
+    [JSONW_UNIQUE_ID] = KEY("uniq_id"),
+    [JSONW_STATE_TOPIC] = KEY("stat_t"),
+    [JSONW_AVAILABILITY_TOPIC] = KEY("avty_t"),
+    [JSONW_PAYLOAD_AVAILABLE] = KEY("pl_avail"),
+    [JSONW_PAYLOAD_NOT_AVAILABLE] = KEY("pl_not_avail"),
+    [JSONW_DEVICE] = KEY("dev"),
+    [JSONW_IDENTIFIERS] = KEY("ids"),
+    [JSONW_NAME] = KEY("name"),
+    [JSONW_SW_VERSION] = KEY("sw"),
+};
+MEMPOOL_ASSERT(jsonw_every_key_has_text, sizeof(keys) / sizeof(keys[0]) == JSONW_KEY_COUNT);
+MEMPOOL_ASSERT(jsonw_depth_fits_first, JSONW_DEPTH <= 8);
+
+static const char pairs[201] =
+    "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+    "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+    "8081828384858687888990919293949596979899";
+
+// the digits of value, right-aligned to end, so two come from each division
+static char * ICACHE_FLASH_ATTR put_digits(char *end, uint32_t value) {
+    while (value >= 100) {
+        uint32_t pair = (value % 100) * 2;
+        value /= 100;
+        *--end = pairs[pair + 1];
+        *--end = pairs[pair];
+    }
+    if (value >= 10) {
+        *--end = pairs[value * 2 + 1];
+        *--end = pairs[value * 2];
+    } else {
+        *--end = '0' + value;
+    }
+    return end;
+}
+
+uint8_t ICACHE_FLASH_ATTR jsonw_format_int(char *buf, int32_t value) {
+    char digits[10];
+    char *start;
+    uint8_t len = 0, n;
+    if (value < 0) {
+        buf[len++] = '-';
+    }
+    start = put_digits(digits + sizeof(digits), (value < 0) ? -(uint32_t)value : (uint32_t)value);
+    n = digits + sizeof(digits) - start;
+    os_memcpy(buf + len, start, n);
+    return len + n;
+}
+
+static uint8_t ICACHE_FLASH_ATTR room(jsonw_t *w, uint16_t need) {
+    if (!w->overflow && w->cap - w->len < need) {
+        w->overflow = 1;
+    }
+    return !w->overflow;
+}
+
+// the comma before every field but the first, if there is room for it and
+// len bytes of field after it
+static uint8_t ICACHE_FLASH_ATTR next_field(jsonw_t *w, uint16_t len) {
+    uint8_t bit, comma;
+    if (w->depth == 0) {
+        w->overflow = 1;
+        return 0;
+    }
+    bit = 1 << (w->depth - 1);
+    comma = (w->first & bit) ? 0 : 1;
+    if (!room(w, comma + len)) {
+        return 0;
+    }
+    if (comma) {
+        w->buf[w->len++] = ',';
+    }
+    w->first &= ~bit;
+    return 1;
+}
+
+static uint8_t ICACHE_FLASH_ATTR put_key(jsonw_t *w, jsonw_key_t key, uint16_t valueLen) {
+    if (!next_field(w, keys[key].len + valueLen)) {
+        return 0;
+    }
+    os_memcpy(w->buf + w->len, keys[key].text, keys[key].len);
+    w->len += keys[key].len;
+    return 1;
+}
+
+void ICACHE_FLASH_ATTR jsonw_init(jsonw_t *w, char *buf, uint16_t cap) {
+    w->buf = buf;
+    w->len = 0;
+    w->cap = cap;
+    w->depth = 0;
+    w->first = 0;
+    w->overflow = 0;
+    if (room(w, 1)) {
+        w->buf[w->len++] = '{';
+        w->first = 1;
+        w->depth = 1;
+    }
+}
+
+void ICACHE_FLASH_ATTR jsonw_int(jsonw_t *w, jsonw_key_t key, int32_t value) {
+    char digits[11];
+    uint8_t n = jsonw_format_int(digits, value);
+    if (put_key(w, key, n)) {
+        os_memcpy(w->buf + w->len, digits, n);
+        w->len += n;
+    }
+}
+
+void ICACHE_FLASH_ATTR jsonw_uint(jsonw_t *w, jsonw_key_t key, uint32_t value) {
+    char digits[10];
+    char *start = put_digits(digits + sizeof(digits), value);
+    uint8_t n = digits + sizeof(digits) - start;
+    if (put_key(w, key, n)) {
+        os_memcpy(w->buf + w->len, start, n);
+        w->len += n;
+    }
+}
+
+void ICACHE_FLASH_ATTR jsonw_fixed(jsonw_t *w, jsonw_key_t key, int32_t value, uint8_t decimals) {
+    char digits[12];
+    char *end = digits + sizeof(digits), *start;
+    uint32_t abs = (value < 0) ? -(uint32_t)value : (uint32_t)value;
+    uint8_t neg = (value < 0), n;
+    if (decimals > 9) {
+        decimals = 9;
+    }
+    // at least one digit before the point: 5 with 2 decimals is 0.05
+    start = put_digits(end, abs);
+    while (end - start < decimals + 1) {
+        *--start = '0';
+    }
+    n = end - start;
+    if (put_key(w, key, neg + n + (decimals > 0))) {
+        if (neg) {
+            w->buf[w->len++] = '-';
+        }
+        os_memcpy(w->buf + w->len, start, n - decimals);
+        w->len += n - decimals;
+        if (decimals > 0) {
+            w->buf[w->len++] = '.';
+            os_memcpy(w->buf + w->len, end - decimals, decimals);
+            w->len += decimals;
+        }
+    }
+}
+
+void ICACHE_FLASH_ATTR jsonw_bool(jsonw_t *w, jsonw_key_t key, uint8_t value) {
+    if (put_key(w, key, value ? 4 : 5)) {
+        os_memcpy(w->buf + w->len, value ? "true" : "false", value ? 4 : 5);
+        w->len += value ? 4 : 5;
+    }
+}
+
+void ICACHE_FLASH_ATTR jsonw_str(jsonw_t *w, jsonw_key_t key, const char *s, uint16_t len) {
+    static const char hex[] = "0123456789abcdef";
+    uint16_t i, need = 2;
+    for (i = 0; i < len; i++) {
+        uint8_t c = s[i];
+        need += (c == '"' || c == '\\') ? 2 : (c < 0x20) ? 6 : 1;
+    }
+    if (!put_key(w, key, need)) {
+        return;
+    }
+    w->buf[w->len++] = '"';
+    for (i = 0; i < len; i++) {
+        uint8_t c = s[i];
+        if (c == '"' || c == '\\') {
+            w->buf[w->len++] = '\\';
+            w->buf[w->len++] = c;
+        } else if (c < 0x20) {
+            os_memcpy(w->buf + w->len, "\\u00", 4);
+            w->buf[w->len + 4] = hex[c >> 4];
+            w->buf[w->len + 5] = hex[c & 0xF];
+            w->len += 6;
+        } else {
+            w->buf[w->len++] = c;
+        }
+    }
+    w->buf[w->len++] = '"';
+}
+
+void ICACHE_FLASH_ATTR jsonw_fields(jsonw_t *w, const char *fields, uint16_t len) {
+    const uint32_t *word = (const uint32_t *)fields;
+    uint32_t v;
+    uint16_t i;
+    if (len == 0 || !next_field(w, len)) {
+        return;
+    }
+    for (i = 0; i < len; i += 4) {
+        v = *word++;
+        os_memcpy(w->buf + w->len + i, &v, (len - i < 4) ? len - i : 4);
+    }
+    w->len += len;
+}
+
+void ICACHE_FLASH_ATTR jsonw_object(jsonw_t *w, jsonw_key_t key) {
+    if (w->depth >= JSONW_DEPTH) {
+        w->overflow = 1;
+        return;
+    }
+    if (put_key(w, key, 1)) {
+        w->buf[w->len++] = '{';
+        w->first |= 1 << w->depth;
+        w->depth++;
+    }
+}
+
+void ICACHE_FLASH_ATTR jsonw_close(jsonw_t *w) {
+    if (w->depth == 0 || !room(w, 1)) {
+        w->overflow = 1;
+        return;
+    }
+    w->buf[w->len++] = '}';
+    w->depth--;
+}
+
+uint16_t ICACHE_FLASH_ATTR jsonw_finish(jsonw_t *w) {
+    while (w->depth > 0 && !w->overflow) {
+        jsonw_close(w);
+    }
+    return w->overflow ? 0 : w->len;
+}
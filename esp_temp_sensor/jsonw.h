@@ -0,0 +1,129 @@
+/**
+ * @file
+ * @brief A forward-only JSON writer for payloads of several fields.
+ *
+ * It writes one object front to back into a buffer the caller owns, such as
+ * the payload of mqttPublishBegin(), so no tree is built and nothing comes
+ * from the heap: the state is a jsonw_t on the stack. Keys come from a fixed
+ * table, already quoted and with their colon, so a field costs a copy of the
+ * key and its value. Integers are formatted two digits at a time, and values
+ * in hundredths are written as fixed point without floats.
+ *
+ * Running out of room is sticky: the rest of the writes do nothing and
+ * jsonw_finish() returns 0, so a cut-off object is never sent.
+ */
+#ifndef JSONW_H
+#define JSONW_H
+
+#include "os_type.h"
+
+#define JSONW_DEPTH 8 /**< Deepest nesting of objects */
+
+/**
+ * @enum jsonw_key_t
+ * The keys a payload can have; jsonw.c holds their text.
+ */
+typedef enum {
+    JSONW_TEMP, /**< "temp" */
+    JSONW_HUMIDITY, /**< "humidity" */
+    JSONW_RSSI, /**< "rssi" */
+    JSONW_HEAP, /**< "heap" */
+    JSONW_SEQ, /**< "seq" */
+    JSONW_TS, /**< "ts", Unix seconds */
+    JSONW_LED, /**< "led" */
+    JSONW_UPTIME, /**< "uptime" */
+    JSONW_UNIQUE_ID, /**< "uniq_id", and the rest Home Assistant's abbreviations for discovery */
+    JSONW_STATE_TOPIC, /**< "stat_t" */
+    JSONW_AVAILABILITY_TOPIC, /**< "avty_t" */
+    JSONW_PAYLOAD_AVAILABLE, /**< "pl_avail" */
+    JSONW_PAYLOAD_NOT_AVAILABLE, /**< "pl_not_avail" */
+    JSONW_DEVICE, /**< "dev" */
+    JSONW_IDENTIFIERS, /**< "ids" */
+    JSONW_NAME, /**< "name" */
+    JSONW_SW_VERSION, /**< "sw" */
+    JSONW_KEY_COUNT
+} jsonw_key_t;
+
+/**
+ * @struct jsonw_t
+ * A payload being written.
+ */
+typedef struct {
+    char *buf;
+    uint16_t len; /**< Bytes written so far */
+    uint16_t cap; /**< Size of buf */
+    uint8_t depth; /**< Objects open, the outermost included */
+    uint8_t first; /**< One bit per depth: nothing written in that object yet */
+    uint8_t overflow; /**< Ran out of room */
+} jsonw_t;
+
+/**
+ * Opens the outermost object.
+ * @param w the writer
+ * @param buf where to write
+ * @param cap its size
+ */
+void ICACHE_FLASH_ATTR jsonw_init(jsonw_t *w, char *buf, uint16_t cap);
+
+/**
+ * Writes a signed integer field.
+ */
+void ICACHE_FLASH_ATTR jsonw_int(jsonw_t *w, jsonw_key_t key, int32_t value);
+
+/**
+ * Writes an unsigned integer field.
+ */
+void ICACHE_FLASH_ATTR jsonw_uint(jsonw_t *w, jsonw_key_t key, uint32_t value);
+
+/**
+ * Writes a fixed-point field: 2105 with 2 decimals is 21.05.
+ * @param decimals digits after the point, up to 9
+ */
+void ICACHE_FLASH_ATTR jsonw_fixed(jsonw_t *w, jsonw_key_t key, int32_t value, uint8_t decimals);
+
+/**
+ * Writes true or false.
+ */
+void ICACHE_FLASH_ATTR jsonw_bool(jsonw_t *w, jsonw_key_t key, uint8_t value);
+
+/**
+ * Writes a string field, escaped.
+ * @param s the string, which need not end in a 0
+ * @param len its length
+ */
+void ICACHE_FLASH_ATTR jsonw_str(jsonw_t *w, jsonw_key_t key, const char *s, uint16_t len);
+
+/**
+ * Copies in fields already written out as "key":value pairs, such as a
+ * template kept in flash with ICACHE_RODATA_ATTR. Flash can only be read a
+ * word at a time, so fields must be word aligned; they are read in words.
+ * @param fields the pairs, separated by commas, without a comma at either end
+ * @param len their length
+ */
+void ICACHE_FLASH_ATTR jsonw_fields(jsonw_t *w, const char *fields, uint16_t len);
+
+/**
+ * Opens an object as a field; fields written next go in it until jsonw_close().
+ */
+void ICACHE_FLASH_ATTR jsonw_object(jsonw_t *w, jsonw_key_t key);
+
+/**
+ * Closes the innermost open object.
+ */
+void ICACHE_FLASH_ATTR jsonw_close(jsonw_t *w);
+
+/**
+ * Closes every object still open.
+ * @param w the writer
+ * @return the length of the payload, not 0 terminated, or 0 if it did not fit
+ */
+uint16_t ICACHE_FLASH_ATTR jsonw_finish(jsonw_t *w);
+
+/**
+ * Formats an integer, two digits at a time, without a 0 after it.
+ * @param buf at least 11 bytes
+ * @return the length written
+ */
+uint8_t ICACHE_FLASH_ATTR jsonw_format_int(char *buf, int32_t value);
+
+#endif
@@ -10,165 +10,650 @@
 #include "wifi.h"
 #include "espconn.h"
 #include "mqtt.h"
+#include "packets.h"
 #include "main.h"
+#include "pwm_out.h"
+#include "ota.h"
+#include "fwupdate.h"
+#include "profile.h"
+#include "timebase.h"
+#include "twheel.h"
+#include "power.h"
+#include "brokers.h"
+#include "mempool.h"
+#include "bench.h"
+#include "capture.h"
+#include "ntc.h"
+#include "sampler.h"
+#include "outq.h"
+#include "rollup.h"
+#include "jsonw.h"
+#include "discovery.h"
+#ifdef MQTT_USE_SN
+#include "mqttsn.h"
+#endif
 
 void ICACHE_FLASH_ATTR user_pre_init(void);
 struct espconn esp_conn;
 static const int blink_pin = 2;
-static volatile os_timer_t blink_timer;
+#ifdef NTC_SENSOR
+static const uint8_t pwm_pins[] = { 2, heat_pin }; // channel 0 is the blink pin, 1 the heat emitter
+#define HEAT_PWM_CHANNEL 1
+#define HEAT_PERIOD_MS 5000
+static twheel_timer_t heatTimer;
+#else
+static const uint8_t pwm_pins[] = { 2 }; // channel 0 is the blink pin
+#endif
+#define BLINK_PWM_CHANNEL 0
+#define BLINK_RAMP_MS 2000
+static twheel_timer_t blink_timer;
+#define POWER_REPORT_MS 600000
+static twheel_timer_t powerTimer;
 
-os_timer_t wifi_timer;
-os_timer_t tcpTimer;
-os_timer_t pingTimer;
-os_timer_t pubTimer;
+twheel_timer_t wifi_timer;
+twheel_timer_t tcpTimer;
+twheel_timer_t pubTimer;
 
 static const char ioTopic[4] = { 0x74, 0x65, 0x73, 0x74 }; // test
 static const uint8_t ioTopic_len = 4;
-static const char mqtt_ip[4] = {10, 0, 81, 146};
-
-void ICACHE_FLASH_ATTR ping(void *arg) {
-#ifdef DEBUG
-    os_printf("Entered ping!\n");
+static const uint8_t brokerIps[][4] = broker_ips;
+#define BROKER_RECONNECT_MS 1000 // first wait after the session is lost, doubled on each failure after
+#define BROKER_RECONNECT_MAX_MS 60000
+static uint32_t reconnectMs = BROKER_RECONNECT_MS;
+static const uint8_t sntp_ip[4] = sntp_server_ip;
+static char otaTopic[32]; // herps/<chip id>/ota
+static char powerTopic[32]; // herps/<chip id>/power
+static char brokersTopic[32]; // herps/<chip id>/brokers
+static char memoryTopic[32]; // herps/<chip id>/memory
+static char captureTopic[32]; // herps/<chip id>/capture
+static char pcapTopic[40]; // herps/<chip id>/capture/pcap
+static char samplerTopic[32]; // herps/<chip id>/sampler
+static char alarmTopic[32]; // herps/<chip id>/alarm
+static char outqTopic[32]; // herps/<chip id>/outq
+static char rollupTopics[ROLLUP_LEVELS][32]; // herps/<chip id>/rollup/1m, 15m and 1h
+static char stateTopic[32]; // herps/<chip id>/state
+static uint32_t stateSeq; // counts state publishes, so a subscriber can tell one was missed
+#define STATE_JSON_LEN 128 // room for every field of the state payload
+static char discoveryTopic[32]; // herps/<chip id>/discovery
+static discovery_config_t discoveryConfig; // Home Assistant's view of the channels on stateTopic
+#ifdef NTC_SENSOR
+static int32_t lastCenti; // the last reading the sampler took
+#endif
+static twheel_timer_t captureTimer;
+static capture_cursor_t captureCursor;
+#define CAPTURE_PUBLISH_MS 100 // between chunks of a dump, so readings still get through
+static char statusTopic[64]; // mqtt_status_topic, or herps/<chip id>/status
+static char clientId[24]; // herps-<chip id>, when a persistent session needs one
+static uint8_t sessionUp; // the broker has accepted us, so the radio may sleep
+#ifdef MQTT_USE_TLS
+static char tlsTopic[32]; // herps/<chip id>/tls
+#endif
+LOCAL mqtt_session_t globalSession;
+static uint8_t txQueue[MQTT_TX_QUEUE_LEN]; // packets waiting their turn with the SDK
+LOCAL mqtt_session_t *pGlobalSession = &globalSession;
+#ifdef MQTT_USE_SN
+// readings go over MQTT-SN; globalSession still carries userData for pubuint
+LOCAL mqttsn_session_t snSession;
+static char snClientId[16]; // herps-<chip id>
+#define SN_RECONNECT_MS 30000
 #endif
-    mqtt_session_t *pSession = (mqtt_session_t *)arg;
-    mqttSend(pSession, NULL, 0, MQTT_MSG_TYPE_PINGREQ);
-    os_timer_disarm(&pingTimer);
-    os_timer_setfn(&pingTimer, (os_timer_func_t *)ping, arg);
-    os_timer_arm(&pingTimer, 5000, 0);
-}
 
-void ICACHE_FLASH_ATTR con(void *arg) {
+void PLACE(blink_timerfunc) blink_timerfunc(void *arg);
+
+void PLACE(con) con(void *arg) {
 #ifdef DEBUG
     os_printf("Entered con!\n");
 #endif
     mqtt_session_t *pSession = (mqtt_session_t *)arg;
+    brokers_connecting();
     mqttSend(pSession, NULL, 0, MQTT_MSG_TYPE_CONNECT);
-
-    os_timer_disarm(&pingTimer);
-    os_timer_setfn(&pingTimer, (os_timer_func_t *)ping, arg);
-    os_timer_arm(&pingTimer, 5000, 0);
 }
 
-void ICACHE_FLASH_ATTR sub(void *arg) {
+void PLACE(sub) sub(void *arg) {
 #ifdef DEBUG
     os_printf("Entered sub!\n");
 #endif
     mqtt_session_t *pSession = (mqtt_session_t *)arg;
     mqttSend(pSession, NULL, 0, MQTT_MSG_TYPE_SUBSCRIBE);
+    mqttSendTopic(pSession, (uint8_t *)otaTopic, os_strlen(otaTopic), NULL, 0, MQTT_MSG_TYPE_SUBSCRIBE);
+    mqttSendTopic(pSession, (uint8_t *)captureTopic, os_strlen(captureTopic), NULL, 0, MQTT_MSG_TYPE_SUBSCRIBE);
+}
+
+// round trips and failovers, to see how the brokers are doing from the sensors' side
+void PLACE(brokers_publish) brokers_publish(mqtt_session_t *pSession) {
+  char stats[160];
+  uint32_t len = brokers_report(stats, sizeof(stats));
+  mqttPublish(pSession, (uint8_t *)brokersTopic, os_strlen(brokersTopic), (uint8_t *)stats, len, MQTT_PUBLISH_RETAIN);
+}
+
+#define TX_FIELDS_LEN 44 // ";tx_peak=" and ";tx_refused=" with 11 characters each, and the terminator
+
+// pool, scratch and send queue high-water marks and the lowest free heap, to catch leaks in the field
+void PLACE(memory_publish) memory_publish(mqtt_session_t *pSession) {
+  char stats[256];
+  uint32_t len = mempool_report(stats, sizeof(stats));
+  if (len + TX_FIELDS_LEN <= sizeof(stats)) {
+    len += os_sprintf(stats + len, ";tx_peak=%d;tx_refused=%d", pSession->txStats.queuedPeak, pSession->txStats.refused);
+  }
+  mqttPublish(pSession, (uint8_t *)memoryTopic, os_strlen(memoryTopic), (uint8_t *)stats, len, MQTT_PUBLISH_RETAIN);
+}
+
+// alarms raised and how long the broker took to have them, readings batched
+void PLACE(outq_publish) outq_publish(mqtt_session_t *pSession) {
+  char stats[160];
+  uint32_t len = outq_report(stats, sizeof(stats));
+  mqttPublish(pSession, (uint8_t *)outqTopic, os_strlen(outqTopic), (uint8_t *)stats, len, MQTT_PUBLISH_RETAIN);
+}
+
+#ifndef MQTT_USE_SN
+// the device's state as one JSON object, written straight into the packet
+void PLACE(state_publish) state_publish(mqtt_session_t *pSession) {
+  mqtt_publish_buf_t pub;
+  jsonw_t w;
+  uint64_t now = timebase_now_us();
+  char *buf = (char *)mqttPublishBegin(pSession, &pub, (uint8_t *)stateTopic, os_strlen(stateTopic), STATE_JSON_LEN);
+  if (buf == NULL) {
+    return;
+  }
+  jsonw_init(&w, buf, STATE_JSON_LEN);
+#ifdef NTC_SENSOR
+  jsonw_fixed(&w, JSONW_TEMP, lastCenti, 2);
+#endif
+  jsonw_bool(&w, JSONW_LED, pwm_out_get_target(BLINK_PWM_CHANNEL) > 0);
+  jsonw_int(&w, JSONW_RSSI, wifi_station_get_rssi());
+  jsonw_uint(&w, JSONW_HEAP, system_get_free_heap_size());
+  jsonw_uint(&w, JSONW_SEQ, ++stateSeq);
+  jsonw_uint(&w, JSONW_UPTIME, (uint32_t)(timebase_local_us() / 1000000));
+  if (now != 0) {
+    jsonw_uint(&w, JSONW_TS, (uint32_t)(now / 1000000));
+  }
+  // retained, so the latest state is there for whoever subscribes
+  mqttPublishEnd(pSession, &pub, jsonw_finish(&w), MQTT_PUBLISH_RETAIN);
+}
+
+// discovery configs sent and the ones the cache saved sending again
+void PLACE(discovery_publish) discovery_publish(mqtt_session_t *pSession) {
+  char stats[160];
+  uint32_t len = discovery_report(stats, sizeof(stats));
+  mqttPublish(pSession, (uint8_t *)discoveryTopic, os_strlen(discoveryTopic), (uint8_t *)stats, len, MQTT_PUBLISH_RETAIN);
+}
+#endif
+
+// radio on time per power mode, to compare what each costs
+void PLACE(power_report) power_report(void *arg) {
+  const power_stats_t *st = power_stats();
+  char stats[96];
+  os_sprintf(stats, "mode=%d;awake_ms=%d;modem_ms=%d;light_ms=%d;radio_ms=%d;packets=%d;switches=%d", st->mode,
+             st->modeMs[POWER_AWAKE], st->modeMs[POWER_MODEM], st->modeMs[POWER_LIGHT], st->radioMs, st->packets,
+             st->switches);
+#ifdef MQTT_USE_SN
+  mqttsn_publish(&snSession, mqttsn_power_topic_id, (uint8_t *)stats, os_strlen(stats), MQTTSN_QOS_M1);
+#else
+  mqtt_session_t *pSession = (mqtt_session_t *)arg;
+  mqttPublish(pSession, (uint8_t *)powerTopic, os_strlen(powerTopic), (uint8_t *)stats, os_strlen(stats), MQTT_PUBLISH_RETAIN);
+  brokers_publish(pSession);
+  memory_publish(pSession);
+  outq_publish(pSession);
+  state_publish(pSession);
+  discovery_publish(pSession);
+#endif
+}
+
+#ifndef MQTT_USE_SN
+// a closed window of readings, on its resolution's topic; not retained, so
+// a subscriber storing them gets each window once
+void PLACE(rollup_publish) rollup_publish(void *arg, uint8_t level, const rollup_window_t *w) {
+  mqtt_session_t *pSession = (mqtt_session_t *)arg;
+  char rollup[ROLLUP_FORMAT_LEN];
+  uint32_t len = rollup_format(w, rollup);
+  mqttPublish(pSession, (uint8_t *)rollupTopics[level], os_strlen(rollupTopics[level]), (uint8_t *)rollup, len, 0);
+}
+#endif
+
+// a reading on the session topic, over whichever transport was built in; over
+// TCP it waits in the telemetry lane for others to share the radio wake
+static void PLACE(publish_reading) publish_reading(mqtt_session_t *pSession, char *dataStr, int32_t dataLen) {
+#ifdef MQTT_USE_SN
+  mqttsn_publish(&snSession, mqttsn_topic_id, (uint8_t *)dataStr, dataLen, (mqttsn_qos < 0) ? MQTTSN_QOS_M1 : MQTTSN_QOS_0);
+#else
+  outq_reading((uint8_t *)dataStr, dataLen);
+#endif
+}
+
+#ifdef NTC_SENSOR
+// a temperature reading from the sampler, formatted without floats
+void PLACE(pubtemp) pubtemp(void *arg, int32_t centi) {
+    mqtt_session_t *pSession = (mqtt_session_t *)arg;
+    char dataStr[NTC_FORMAT_LEN];
+    int32_t dataLen = ntc_format(centi, dataStr);
+#ifdef DEBUG
+    os_printf("Temperature: %s\n", dataStr);
+#endif
+    publish_reading(pSession, dataStr, dataLen);
+}
+
+// the sampler changed its period, retained so the tradeoff can be followed per device
+void PLACE(sampler_publish) sampler_publish(void *arg) {
+  mqtt_session_t *pSession = (mqtt_session_t *)arg;
+  char stats[160];
+  uint32_t len = sampler_report(stats, sizeof(stats));
+  mqttPublish(pSession, (uint8_t *)samplerTopic, os_strlen(samplerTopic), (uint8_t *)stats, len, MQTT_PUBLISH_RETAIN);
+}
+
+#ifndef MQTT_USE_SN
+#define ALARM_CLEAR 0
+#define ALARM_HIGH 1
+#define ALARM_LOW 2
+#define ALARM_PROBE 3 // open or shorted, so there is no temperature to hold
+static uint8_t alarmState;
+
+// holds a reading against the limits in user_config.h; a change of state
+// goes out in the alarm lane, retained, so the latest state is there for
+// whoever subscribes
+static void PLACE(check_alarm) check_alarm(int32_t centi, uint8_t fault) {
+  static const char *const names[] = { "clear", "high", "low", "probe" };
+  uint8_t state = alarmState;
+  char alarm[OUTQ_ALARM_LEN];
+  uint32_t len;
+  if (fault) {
+    state = ALARM_PROBE;
+  } else if (centi >= alarm_high_c * 100) {
+    state = ALARM_HIGH;
+  } else if (centi <= alarm_low_c * 100) {
+    state = ALARM_LOW;
+  } else if (state == ALARM_PROBE ||
+             (centi < alarm_high_c * 100 - alarm_hysteresis_centi && centi > alarm_low_c * 100 + alarm_hysteresis_centi)) {
+    state = ALARM_CLEAR;
+  }
+  if (state != alarmState) {
+    alarmState = state;
+    len = os_sprintf(alarm, "state=%s;temp=", names[state]);
+    len += ntc_format(centi, alarm + len);
+    os_printf("Alarm: %s\n", alarm);
+    outq_alarm((uint8_t *)alarmTopic, os_strlen(alarmTopic), (uint8_t *)alarm, len);
+  }
+}
+#endif
+
+// every reading the sampler takes is checked for alarms, published or not
+int32_t PLACE(read_temp) read_temp(void) {
+  int32_t centi;
+#ifndef MQTT_USE_SN
+  // the gateway has no topic ID for alarms
+  uint8_t fault = ntc_read(&centi);
+  check_alarm(centi, fault);
+  if (!fault) {
+    // a clamp from a probe that is not there would pull the windows down
+    rollup_add(centi);
+  }
+#else
+  centi = ntc_read_centi();
+#endif
+  lastCenti = centi;
+  return centi;
+}
+
+// holds the enclosure at heat_setpoint_c through the heat channel's duty;
+// runs from boot whether or not a broker is there. An open probe reads as
+// cold as it can, which would heat at full power for good, so a fault
+// turns the heat off and raises the alarm until the probe reads again
+void PLACE(heat_timerfunc) heat_timerfunc(void *arg) {
+  int32_t centi;
+  uint8_t fault = ntc_read(&centi);
+  pwm_out_proportional(HEAT_PWM_CHANNEL, heat_setpoint_c * 100, fault ? PWM_OUT_NO_MEASUREMENT : centi,
+                       heat_band_centi);
+#ifndef MQTT_USE_SN
+  if (fault) {
+    check_alarm(centi, 1);
+  }
+#endif
+}
+#endif
+
+void PLACE(connack) connack(void *arg) {
+  mqtt_session_t *pSession = (mqtt_session_t *)arg;
+  brokers_connack();
+  if (pSession->connackCode == 0) {
+    reconnectMs = BROKER_RECONNECT_MS;
+    if (!sessionUp) {
+      sessionUp = 1;
+      power_release();
+    }
+    // alarms from while we were away go before anything else
+    outq_connected();
+    // the broker took us, so this image is good
+    ota_confirm();
+    timebase_sync(sntp_ip, TIMEBASE_NTP_PORT);
+    // retained, so late subscribers see it; our will replaces it if we vanish
+    mqttPublish(pSession, (uint8_t *)statusTopic, os_strlen(statusTopic), (uint8_t *)mqtt_status_online,
+                sizeof(mqtt_status_online) - 1, MQTT_PUBLISH_RETAIN);
+    if (!pSession->sessionPresent) {
+      // the broker kept our subscriptions otherwise
+      sub(pGlobalSession);
+      fwupdate_connected();
+#ifndef MQTT_USE_SN
+      discovery_subscribe();
+#endif
+    }
+#ifndef MQTT_USE_SN
+    // configs the broker does not have yet, then the state they point at
+    discovery_connected();
+    state_publish(pSession);
+#endif
+    brokers_publish(pSession);
+#ifdef MQTT_USE_TLS
+    // what the handshakes cost, so the fleet's duty cycle can be checked
+    char stats[80];
+    os_sprintf(stats, "handshakes=%d;last_ms=%d;max_ms=%d;heap=%d", pSession->tlsStats.handshakes,
+               pSession->tlsStats.lastMs, pSession->tlsStats.maxMs, pSession->tlsStats.heapPeak);
+    mqttPublish(pSession, (uint8_t *)tlsTopic, os_strlen(tlsTopic), (uint8_t *)stats, os_strlen(stats), MQTT_PUBLISH_RETAIN);
+#endif
+    // armed with the radio asleep, so they line up with the DTIM beacons
+    twheel_setfn(&blink_timer, (twheel_fn)blink_timerfunc, pSession);
+    twheel_arm(&blink_timer, 20000, 1);
+    twheel_setfn(&powerTimer, (twheel_fn)power_report, pSession);
+    twheel_arm(&powerTimer, POWER_REPORT_MS, 1);
+#ifdef NTC_SENSOR
+    sampler_start(read_temp, pubtemp, sampler_publish, pSession);
+#endif
+  }
+}
+
+void PLACE(lost_connection) lost_connection(void *arg) {
+  twheel_disarm(&pubTimer);
+  twheel_disarm(&powerTimer);
+  twheel_disarm(&captureTimer);
+  capture_pcap_end(&captureCursor);
+  sampler_stop();
+  outq_lost();
+#if defined(NTC_SENSOR) && !defined(MQTT_USE_SN)
+  // no readings until the broker has us again, so the last one stops counting
+  rollup_pause();
+#endif
+  if (sessionUp) {
+    sessionUp = 0;
+    power_hold(); // awake until the broker has us again
+  }
+}
+
+#ifdef MQTT_USE_SN
+void PLACE(sn_connack) sn_connack(void *arg, uint8_t returnCode) {
+  if (returnCode != 0) {
+    os_printf("MQTT-SN: gateway refused CONNECT, code %d\n", returnCode);
+    twheel_arm(&tcpTimer, SN_RECONNECT_MS, 0);
+    return;
+  }
+  if (!sessionUp) {
+    sessionUp = 1;
+    power_release();
+  }
+  ota_confirm();
+  timebase_sync(sntp_ip, TIMEBASE_NTP_PORT);
+  twheel_setfn(&blink_timer, (twheel_fn)blink_timerfunc, pGlobalSession);
+  twheel_arm(&blink_timer, 20000, 1);
+  twheel_setfn(&powerTimer, (twheel_fn)power_report, pGlobalSession);
+  twheel_arm(&powerTimer, POWER_REPORT_MS, 1);
+#ifdef NTC_SENSOR
+  // the gateway has no topic ID for the sampler's reports
+  sampler_start(ntc_read_centi, pubtemp, NULL, pGlobalSession);
+#endif
+  if (mqttsn_qos < 0) {
+    // QoS -1 readings need no connection, so the gateway only hears from us to keep it
+    mqttsn_sleep(&snSession, mqtt_keepalive);
+  }
+}
+
+void PLACE(sn_lost) sn_lost(void *arg) {
+  lost_connection(arg);
+  twheel_arm(&tcpTimer, SN_RECONNECT_MS, 0);
+}
+#endif
+
+// the session failed or is moving, connect again to whichever broker is now chosen
+void PLACE(tcp_lost) tcp_lost(void *arg) {
+  lost_connection(arg);
+  brokers_lost();
+  // somewhere in the upper half of the wait, so sensors that lost the same
+  // broker at once do not all come back in the same instant
+  twheel_arm(&tcpTimer, reconnectMs / 2 + os_random() % (reconnectMs / 2 + 1), 0);
+  if (reconnectMs < BROKER_RECONNECT_MAX_MS) {
+    reconnectMs = (reconnectMs * 2 < BROKER_RECONNECT_MAX_MS) ? reconnectMs * 2 : BROKER_RECONNECT_MAX_MS;
+  }
+}
 
+// the capture ring as a pcap file, a chunk at a time on the pcap topic; an empty message ends it
+void PLACE(capture_publish) capture_publish(void *arg) {
+  mqtt_session_t *pSession = (mqtt_session_t *)arg;
+  uint8_t chunk[CAPTURE_CHUNK_LEN];
+  uint32_t len = capture_pcap_next(&captureCursor, chunk, sizeof(chunk));
+  mqttPublish(pSession, (uint8_t *)pcapTopic, os_strlen(pcapTopic), chunk, len, 0);
+  if (len == 0) {
+    twheel_disarm(&captureTimer);
+    capture_pcap_end(&captureCursor);
+  }
+}
+
+// "uart" prints the ring, "mqtt" publishes it, "clear" empties it
+static void PLACE(capture_command) capture_command(uint8_t *payload, uint32_t payload_len) {
+  if (payload_len == 4 && os_memcmp(payload, "uart", 4) == 0) {
+    capture_dump_uart();
+  } else if (payload_len == 4 && os_memcmp(payload, "mqtt", 4) == 0) {
+    capture_pcap_begin(&captureCursor);
+    twheel_setfn(&captureTimer, (twheel_fn)capture_publish, pGlobalSession);
+    twheel_arm(&captureTimer, CAPTURE_PUBLISH_MS, 1);
+  } else if (payload_len == 5 && os_memcmp(payload, "clear", 5) == 0) {
+    capture_clear();
+  }
 }
 
-void ICACHE_FLASH_ATTR discon(void *arg) {
+void PLACE(message_received) message_received(void *arg, uint8_t *topic, uint32_t topic_len, uint8_t *payload, uint32_t payload_len) {
+  if (fwupdate_message(topic, topic_len, payload, payload_len)) {
+    return;
+  }
+#ifndef MQTT_USE_SN
+  if (discovery_message(topic, topic_len, payload, payload_len)) {
+    return;
+  }
+#endif
+  if (topic_len == os_strlen(otaTopic) && os_memcmp(topic, otaTopic, topic_len) == 0) {
+    ota_handle(payload, payload_len);
+  } else if (topic_len == os_strlen(captureTopic) && os_memcmp(topic, captureTopic, topic_len) == 0) {
+    capture_command(payload, payload_len);
+  }
+}
+
+void PLACE(discon) discon(void *arg) {
 #ifdef DEBUG
     os_printf("Entered discon!\n");
 #endif
     mqtt_session_t *pSession = (mqtt_session_t *)arg;
+    // a clean DISCONNECT does not set off the will, so say it ourselves
+    mqttPublish(pSession, (uint8_t *)statusTopic, os_strlen(statusTopic), (uint8_t *)mqtt_status_offline,
+                sizeof(mqtt_status_offline) - 1, MQTT_PUBLISH_RETAIN);
     mqttSend(pSession, NULL, 0, MQTT_MSG_TYPE_DISCONNECT);
-    os_timer_disarm(&pingTimer);
-    os_timer_disarm(&pubTimer);
+    twheel_disarm(&pubTimer);
 }
 
-void ICACHE_FLASH_ATTR pubuint(void *arg) {
+void PLACE(pubuint) pubuint(void *arg) {
 #ifdef DEBUG
     os_printf("Entered pubuint!\n");
 #endif
     mqtt_session_t *pSession = (mqtt_session_t *)arg;
     uint8_t *data = (uint8_t *)(pSession->userData);
-    char *dataStr = os_zalloc(20 * sizeof(char));
+    // freed with the rest of the cycle's scratch by blink_timerfunc
+    char *dataStr = scratch_alloc(20 * sizeof(char));
+    if (dataStr == NULL) {
+        return;
+    }
     intToStr(*data, dataStr, 4);
     int32_t dataLen = os_strlen(dataStr);
-    mqttSend(pSession, (uint8_t *)dataStr, dataLen, MQTT_MSG_TYPE_PUBLISH);
-    os_timer_disarm(&pingTimer);
-    os_timer_setfn(&pingTimer, (os_timer_func_t *)ping, arg);
-    os_timer_arm(&pingTimer, 5000, 0);
+    publish_reading(pSession, dataStr, dataLen);
 }
 
-void ICACHE_FLASH_ATTR pubfloat(void *arg) {
+void PLACE(pubfloat) pubfloat(void *arg) {
 #ifdef DEBUG
     os_printf("Entered pubfloat!\n");
 #endif
     mqtt_session_t *pSession = (mqtt_session_t *)arg;
     float *data = (float *)(pSession->userData);
-    char *dataStr = os_zalloc(20 * sizeof(char));
+    // freed with the rest of the cycle's scratch by blink_timerfunc
+    char *dataStr = scratch_alloc(20 * sizeof(char));
+    if (dataStr == NULL) {
+        return;
+    }
     ftoa(*data, dataStr, 2);
     int32_t dataLen = os_strlen(dataStr);
 #ifdef DEBUG
     os_printf("Encoded string: %s\tString length: %d\n", dataStr, dataLen);
 #endif
-    mqttSend(pSession, (uint8_t *)dataStr, dataLen, MQTT_MSG_TYPE_PUBLISH);
-    os_timer_disarm(&pingTimer);
-    os_timer_setfn(&pingTimer, (os_timer_func_t *)ping, arg);
-    os_timer_arm(&pingTimer, 5000, 0);
+    publish_reading(pSession, dataStr, dataLen);
 }
 
-blink_timerfunc(void *arg, int val)
+void PLACE(blink_timerfunc) blink_timerfunc(void *arg)
 {
   wifi_get_ip_info(0, &info);
   blink_packet Data;
   blink_packet *pData = &Data;
   mqtt_session_t *pSession = (mqtt_session_t *)arg;
-  //pData->state += (uint8_t)0;
+#ifdef DEBUG
+  pwm_out_stats_t pwmStats;
+  pwm_out_get_stats(&pwmStats);
+  os_printf("PWM jitter: %d..%dus over %d ticks\n", pwmStats.min_jitter_us, pwmStats.max_jitter_us, pwmStats.ticks);
+#endif
 
   //Do blinky stuff
-  if (GPIO_REG_READ(GPIO_OUT_ADDRESS) & (1 << blink_pin))
+  if (pwm_out_get_target(BLINK_PWM_CHANNEL) > 0)
   {
-    // set gpio low
-    gpio_output_set(0, (1 << blink_pin), 0, 0);
+    // ramp the output down
+    pwm_out_set(BLINK_PWM_CHANNEL, 0, PWM_RAMP_LINEAR, BLINK_RAMP_MS);
     pData->state = (uint8_t)0;
     #ifdef DEBUG
       os_printf("LED state - %d - %s IP: %d.%d.%d.%d\n", pData->state, "LOW", IP2STR(&info.ip.addr));
     #endif
     pSession->userData = (void *)&pData->state;
+#ifndef NTC_SENSOR
+    // with a thermistor the sampler publishes the readings, the LED only blinks
     pubuint(pSession);
+#endif
     pData->state = 0;
+    scratch_reset();
     return;
   }
   else
   {
-    // set gpio high
-    gpio_output_set((1 << blink_pin), 0, 0, 0);
+    // ramp the output up
+    pwm_out_set(BLINK_PWM_CHANNEL, PWM_OUT_STEPS, PWM_RAMP_LINEAR, BLINK_RAMP_MS);
     #ifdef DEBUG
       os_printf("LED state - %d - %s IP: %d.%d.%d.%d\n", pData->state, "HIGH", IP2STR(&info.ip.addr));
     #endif
     pData->state = (uint8_t)1;
     pSession->userData = (void *)&pData->state;
+#ifndef NTC_SENSOR
+    // with a thermistor the sampler publishes the readings, the LED only blinks
     pubuint(pSession);
+#endif
     pData->state = 0;
+    scratch_reset();
     return;
   }
 }
 
-void ICACHE_FLASH_ATTR
-init_mqtt(void) {
+void PLACE(init_mqtt) init_mqtt(void) {
+  uint8_t level;
   os_printf("Entering MQTT Init");
-  LOCAL mqtt_session_t globalSession;
-  LOCAL mqtt_session_t *pGlobalSession = &globalSession;
   pGlobalSession->port = 1883; // mqtt port
-  os_memcpy(pGlobalSession->ip, mqtt_ip, 4);
-  /*pGlobalSession->topic_name_len = ioTopic_len;
-  pGlobalSession->topic_name = os_zalloc(sizeof(uint8_t) * pGlobalSession->topic_name_len);*/
-  pGlobalSession->topic_name_len = 4;
-  pGlobalSession->topic_name = "test";
-  os_memcpy(pGlobalSession->topic_name, /*ioTopic*/"test", pGlobalSession->topic_name_len);
+#ifdef MQTT_USE_TLS
+  pGlobalSession->port = MQTT_TLS_PORT;
+  pGlobalSession->secure = 1;
+  os_sprintf(tlsTopic, "herps/%08x/tls", system_get_chip_id());
+#endif
+  brokers_init(pGlobalSession, brokerIps, sizeof(brokerIps) / sizeof(brokerIps[0]));
+  // the same defines mkpackets.py built packets.h from
+  pGlobalSession->client_id = mqtt_client_id;
+  pGlobalSession->client_id_len = sizeof(mqtt_client_id) - 1;
+  if (mqtt_persistent && pGlobalSession->client_id_len == 0) {
+    // the broker finds a persistent session by client ID, so it has to stay the same
+    os_sprintf(clientId, "herps-%08x", system_get_chip_id());
+    pGlobalSession->client_id = clientId;
+    pGlobalSession->client_id_len = os_strlen(clientId);
+  }
+  pGlobalSession->persistent = mqtt_persistent;
+  pGlobalSession->username = mqtt_username;
+  pGlobalSession->username_len = sizeof(mqtt_username) - 1;
+  pGlobalSession->password = mqtt_password;
+  pGlobalSession->password_len = sizeof(mqtt_password) - 1;
+  pGlobalSession->topic_name = mqtt_topic;
+  pGlobalSession->topic_name_len = sizeof(mqtt_topic) - 1;
+  pGlobalSession->keepalive = mqtt_keepalive;
+  pGlobalSession->precompiled = &mqttPrecompiled;
+  mqttSetSendQueue(pGlobalSession, txQueue, sizeof(txQueue));
+  os_sprintf(otaTopic, "herps/%08x/ota", system_get_chip_id());
+  os_sprintf(powerTopic, "herps/%08x/power", system_get_chip_id());
+  os_sprintf(brokersTopic, "herps/%08x/brokers", system_get_chip_id());
+  os_sprintf(memoryTopic, "herps/%08x/memory", system_get_chip_id());
+  os_sprintf(captureTopic, "herps/%08x/capture", system_get_chip_id());
+  os_sprintf(pcapTopic, "herps/%08x/capture/pcap", system_get_chip_id());
+  os_sprintf(samplerTopic, "herps/%08x/sampler", system_get_chip_id());
+  os_sprintf(alarmTopic, "herps/%08x/alarm", system_get_chip_id());
+  os_sprintf(outqTopic, "herps/%08x/outq", system_get_chip_id());
+  os_sprintf(stateTopic, "herps/%08x/state", system_get_chip_id());
+  os_sprintf(discoveryTopic, "herps/%08x/discovery", system_get_chip_id());
+  for (level = 0; level < ROLLUP_LEVELS; level++) {
+    os_sprintf(rollupTopics[level], "herps/%08x/rollup/%s", system_get_chip_id(), rollup_name(level));
+  }
+  if (sizeof(mqtt_status_topic) > 1) {
+    os_strcpy(statusTopic, mqtt_status_topic);
+  } else {
+    os_sprintf(statusTopic, "herps/%08x/status", system_get_chip_id());
+  }
+  pGlobalSession->will_topic = (uint8_t *)statusTopic;
+  pGlobalSession->will_topic_len = os_strlen(statusTopic);
+  pGlobalSession->will_message = (uint8_t *)mqtt_status_offline;
+  pGlobalSession->will_message_len = sizeof(mqtt_status_offline) - 1;
+  pGlobalSession->will_retain = 1;
+  pGlobalSession->connected_cb = con;
+  pGlobalSession->connack_cb = connack;
+  pGlobalSession->disconnect_cb = tcp_lost;
+  pGlobalSession->message_cb = message_received;
+#ifdef MQTT_USE_SN
+  // firmware updates need the TCP transport, so there is no fwupdate_init()
+  os_sprintf(snClientId, "herps-%08x", system_get_chip_id());
+  os_memcpy(snSession.ip, brokerIps[0], 4); // the gateway
+  snSession.port = MQTTSN_PORT;
+  snSession.client_id = (const uint8_t *)snClientId;
+  snSession.client_id_len = os_strlen(snClientId);
+  snSession.duration = mqtt_keepalive;
+  snSession.connack_cb = sn_connack;
+  snSession.disconnect_cb = sn_lost;
+  twheel_setfn(&tcpTimer, (twheel_fn)mqttsn_connect, &snSession);
+#else
+  fwupdate_init(pGlobalSession);
+  outq_init(pGlobalSession);
+#ifdef NTC_SENSOR
+  // the thermistor's readings are what is rolled up, the LED state is not worth it
+  rollup_start(rollup_publish, pGlobalSession);
+#endif
+  discoveryConfig.prefix = ha_discovery_prefix;
+  discoveryConfig.version = ha_discovery_version;
+  discoveryConfig.stateTopic = stateTopic;
+  discoveryConfig.statusTopic = statusTopic;
+  discoveryConfig.online = mqtt_status_online;
+  discoveryConfig.offline = mqtt_status_offline;
+#ifdef NTC_SENSOR
+  discoveryConfig.thermistor = 1;
+#endif
+  discovery_init(pGlobalSession, &discoveryConfig);
   os_printf("MQTT Memory Opts Set");
 
   os_printf("Arm the TCP timer\n");
-  os_timer_setfn(&tcpTimer, (os_timer_func_t *)tcpConnect, pGlobalSession);
-  os_timer_arm(&tcpTimer, 12000, 0);
-  os_printf("Arm Ping timer\n");
-  os_timer_setfn(&pingTimer, (os_timer_func_t *)con, pGlobalSession);
-  os_timer_arm(&pingTimer, 16000, 0);
-
-  // setup blink timer (500ms, repeating)
-  os_printf("Arm Blink Timer\n");
-  os_timer_setfn(&blink_timer, (os_timer_func_t *)blink_timerfunc, pGlobalSession);
-  os_timer_arm(&blink_timer, 20000, 1);
+  twheel_setfn(&tcpTimer, (twheel_fn)tcpConnect, pGlobalSession);
+#endif
+  twheel_arm(&tcpTimer, 12000, 0);
 }
 
-void ICACHE_FLASH_ATTR
-wifi_timer_cb(void *arg) {
+void PLACE(wifi_timer_cb) wifi_timer_cb(void *arg) {
 
-  os_timer_disarm(&wifi_timer);
+  twheel_disarm(&wifi_timer);
 
   uint8 status;
   struct ip_info ipconfig;
@@ -180,15 +665,26 @@ wifi_timer_cb(void *arg) {
     init_mqtt();
     return;
   } else {
-    os_timer_arm(&wifi_timer, 2000, 1);
+    twheel_arm(&wifi_timer, 2000, 1);
   }
 }
 
-void ICACHE_FLASH_ATTR 
-user_init()
+void ICACHE_FLASH_ATTR user_init()
 {
   uart_div_modify(0, UART_CLK_FREQ / 115200);
   system_set_os_print(TRUE);
+  ota_boot_check();
+  twheel_init();
+  timebase_init();
+#ifdef BENCH
+  // the bench image runs its suite and nothing else, see bench.h
+  bench_init();
+  return;
+#endif
+  power_init();
+#ifdef PROFILE
+  profile_init();
+#endif
   wifi_status_led_install(WIFI_LED_IO_NUM, WIFI_LED_IO_MUX, FUNC_GPIO0);
 
   wifi_init();
@@ -198,8 +694,15 @@ user_init()
   
   // configure UART TXD to be GPIO1, set as output
   PIN_FUNC_SELECT(PERIPHS_IO_MUX_GPIO2_U, FUNC_GPIO2); 
+  pwm_out_init(pwm_pins, sizeof(pwm_pins) / sizeof(pwm_pins[0]));
+  // light-sleep stops the PWM interrupt, so only while the outputs are settled
+  power_set_light_check(pwm_out_static);
+#ifdef NTC_SENSOR
+  twheel_setfn(&heatTimer, heat_timerfunc, NULL);
+  twheel_arm(&heatTimer, HEAT_PERIOD_MS, 1);
+#endif
 
-  os_timer_disarm(&wifi_timer); 
-  os_timer_setfn(&wifi_timer, wifi_timer_cb, NULL); /* Set callback for timer */
-  os_timer_arm(&wifi_timer, 2000 , 1);
+  twheel_disarm(&wifi_timer); 
+  twheel_setfn(&wifi_timer, wifi_timer_cb, NULL); /* Set callback for timer */
+  twheel_arm(&wifi_timer, 2000 , 1);
 }
\ No newline at end of file
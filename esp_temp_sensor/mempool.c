@@ -0,0 +1,201 @@
+#include "ets_sys.h"
+#include "osapi.h"
+#include "os_type.h"
+#include "user_interface.h"
+#include "mempool.h"
+
+#define SCRATCH_HEADER 4 // the length of each allocation, so release can walk them
+
+MEMPOOL_ASSERT(scratch_words, MEMPOOL_SCRATCH_LEN % 4 == 0);
+MEMPOOL_ASSERT(scratch_length_fits, MEMPOOL_SCRATCH_LEN <= 0xFFFF);
+
+static mempool_t *pools[MEMPOOL_MAX_POOLS];
+static uint8_t poolCount;
+
+static struct {
+    uint32_t mem[MEMPOOL_SCRATCH_LEN / 4];
+    uint32_t top; // bytes handed out, with headers and guards
+    uint32_t marks; // scratch_mark() calls not yet released
+    scratch_stats_t stats;
+} scratch;
+
+static void ICACHE_FLASH_ATTR guard_set(uint8_t *p) {
+#if MEMPOOL_GUARD_LEN > 0
+    os_memset(p, MEMPOOL_GUARD_BYTE, MEMPOOL_GUARD_LEN);
+#endif
+}
+
+static uint8_t ICACHE_FLASH_ATTR guard_ok(const uint8_t *p) {
+#if MEMPOOL_GUARD_LEN > 0
+    uint8_t i;
+    for (i = 0; i < MEMPOOL_GUARD_LEN; i++) {
+        if (p[i] != MEMPOOL_GUARD_BYTE) {
+            return 0;
+        }
+    }
+#endif
+    return 1;
+}
+
+static void ICACHE_FLASH_ATTR heap_sample(void) {
+    uint32_t free = system_get_free_heap_size();
+    if (scratch.stats.heapLow == 0 || free < scratch.stats.heapLow) {
+        scratch.stats.heapLow = free;
+    }
+}
+
+void ICACHE_FLASH_ATTR mempool_init(mempool_t *pool) {
+    uint8_t i;
+    pool->used = 0;
+    os_memset(&pool->stats, 0, sizeof(pool->stats));
+    for (i = 0; i < poolCount; i++) {
+        if (pools[i] == pool) {
+            return;
+        }
+    }
+    if (poolCount < MEMPOOL_MAX_POOLS) {
+        pools[poolCount++] = pool;
+    }
+}
+
+void * ICACHE_FLASH_ATTR mempool_alloc(mempool_t *pool) {
+    uint32_t stride = MEMPOOL_STRIDE(pool->blockLen);
+    uint8_t *block;
+    uint16_t i;
+    for (i = 0; i < pool->count; i++) {
+        if (!(pool->used & (1UL << i))) {
+            break;
+        }
+    }
+    if (i == pool->count) {
+        pool->stats.failures++;
+        return NULL;
+    }
+    pool->used |= 1UL << i;
+    block = pool->storage + i * stride;
+    guard_set(block);
+    os_memset(block + MEMPOOL_GUARD_LEN, 0, stride - 2 * MEMPOOL_GUARD_LEN);
+    guard_set(block + stride - MEMPOOL_GUARD_LEN);
+    pool->stats.allocs++;
+    if (++pool->stats.inUse > pool->stats.peak) {
+        pool->stats.peak = pool->stats.inUse;
+    }
+    return block + MEMPOOL_GUARD_LEN;
+}
+
+void ICACHE_FLASH_ATTR mempool_free(mempool_t *pool, void *ptr) {
+    uint32_t stride = MEMPOOL_STRIDE(pool->blockLen);
+    uint8_t *block = (uint8_t *)ptr - MEMPOOL_GUARD_LEN;
+    uint32_t offset, i;
+    if (ptr == NULL) {
+        return;
+    }
+    offset = block - pool->storage;
+    i = offset / stride;
+    if (block < pool->storage || offset % stride != 0 || i >= pool->count || !(pool->used & (1UL << i))) {
+        os_printf("mempool %s: free of %p that is not out\n", pool->name, ptr);
+        pool->stats.badFrees++;
+        return;
+    }
+    if (!guard_ok(block) || !guard_ok(block + stride - MEMPOOL_GUARD_LEN)) {
+        os_printf("mempool %s: block %d overran its guard\n", pool->name, i);
+        pool->stats.corruptions++;
+    }
+    pool->used &= ~(1UL << i);
+    pool->stats.inUse--;
+}
+
+void * ICACHE_FLASH_ATTR scratch_alloc(uint32_t len) {
+    uint8_t *base = (uint8_t *)scratch.mem;
+    uint32_t rounded = (len + 3) & ~3UL;
+    uint32_t need = SCRATCH_HEADER + rounded + 2 * MEMPOOL_GUARD_LEN;
+    uint8_t *p;
+    if (len > MEMPOOL_SCRATCH_LEN || need > MEMPOOL_SCRATCH_LEN - scratch.top) {
+        scratch.stats.failures++;
+        return NULL;
+    }
+    p = base + scratch.top;
+    *(uint32_t *)p = rounded;
+    guard_set(p + SCRATCH_HEADER);
+    os_memset(p + SCRATCH_HEADER + MEMPOOL_GUARD_LEN, 0, rounded);
+    guard_set(p + SCRATCH_HEADER + MEMPOOL_GUARD_LEN + rounded);
+    scratch.top += need;
+    scratch.stats.used = scratch.top;
+    if (scratch.top > scratch.stats.peak) {
+        scratch.stats.peak = scratch.top;
+    }
+    return p + SCRATCH_HEADER + MEMPOOL_GUARD_LEN;
+}
+
+uint32_t ICACHE_FLASH_ATTR scratch_mark(void) {
+    scratch.marks++;
+    return scratch.top;
+}
+
+static void ICACHE_FLASH_ATTR scratch_unwind(uint32_t mark) {
+    uint8_t *base = (uint8_t *)scratch.mem;
+    uint32_t at = mark;
+    while (at < scratch.top) {
+        uint32_t rounded = *(uint32_t *)(base + at);
+        uint8_t *guard = base + at + SCRATCH_HEADER;
+        if (!guard_ok(guard) || !guard_ok(guard + MEMPOOL_GUARD_LEN + rounded)) {
+            os_printf("scratch: allocation at %d overran its guard\n", at);
+            scratch.stats.corruptions++;
+        }
+        at += SCRATCH_HEADER + rounded + 2 * MEMPOOL_GUARD_LEN;
+    }
+    scratch.top = mark;
+    scratch.stats.used = mark;
+}
+
+void ICACHE_FLASH_ATTR scratch_release(uint32_t mark) {
+    if (scratch.marks > 0) {
+        scratch.marks--;
+    }
+    if (mark <= scratch.top) {
+        scratch_unwind(mark);
+    }
+}
+
+void ICACHE_FLASH_ATTR scratch_reset(void) {
+    if (scratch.marks != 0) {
+        os_printf("scratch: %d marks not released this cycle\n", scratch.marks);
+        scratch.stats.leaks++;
+        scratch.marks = 0;
+    }
+    scratch_unwind(0);
+    scratch.stats.resets++;
+    heap_sample();
+}
+
+const scratch_stats_t * ICACHE_FLASH_ATTR scratch_stats(void) {
+    heap_sample();
+    return &scratch.stats;
+}
+
+// %d of a uint32_t is at most 11 characters, with a sign
+#define CORRUPT_FIELD_LEN 21 // ";corrupt=" and its count, and the terminator
+#define POOL_FIELDS_LEN 56 // a pool's fields at their longest, without its name
+
+uint32_t ICACHE_FLASH_ATTR mempool_report(char *buf, uint32_t len) {
+    uint32_t used, corruptions = scratch.stats.corruptions;
+    uint8_t i;
+    if (len < 128) {
+        return 0;
+    }
+    heap_sample();
+    used = os_sprintf(buf, "heap_low=%d;scratch_peak=%d;scratch_fail=%d;scratch_leaks=%d", scratch.stats.heapLow,
+                      scratch.stats.peak, scratch.stats.failures, scratch.stats.leaks);
+    for (i = 0; i < poolCount; i++) {
+        const mempool_t *p = pools[i];
+        corruptions += p->stats.corruptions + p->stats.badFrees;
+        // the pool's fields at their longest, and room left for the corrupt count
+        if (used + POOL_FIELDS_LEN + os_strlen(p->name) * 3 + CORRUPT_FIELD_LEN > len) {
+            continue;
+        }
+        used += os_sprintf(buf + used, ";%s_in_use=%d;%s_peak=%d;%s_fail=%d", p->name, p->stats.inUse, p->name,
+                           p->stats.peak, p->name, p->stats.failures);
+    }
+    used += os_sprintf(buf + used, ";corrupt=%d", corruptions);
+    return used;
+}
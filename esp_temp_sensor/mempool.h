@@ -0,0 +1,144 @@
+/**
+ * @file
+ * @brief Fixed-size block pools and a scratch arena, in place of the heap.
+ *
+ * The firmware runs for months, and the SDK heap fragments and leaks are
+ * only found when it runs out. So memory the firmware needs comes from
+ * static storage instead:
+ *
+ * - A pool hands out blocks of one size, for objects that outlive the call
+ *   that made them, such as the broker probe session. MEMPOOL() sizes the
+ *   storage at compile time; allocation and freeing are O(blocks).
+ * - The scratch arena hands out memory that only lives until the caller is
+ *   done: packets being encoded, a reading being formatted. A caller takes
+ *   a mark, allocates, and releases back to the mark; main.c also resets
+ *   the whole arena after each publish cycle, so anything left behind is
+ *   counted as a leak rather than kept.
+ *
+ * With MEMPOOL_GUARD_LEN bytes of guard pattern either side of every block
+ * and scratch allocation, overruns are caught when the memory is given back.
+ * Leaks are counted from blocks still out and marks not released. The free
+ * heap is sampled each cycle, and its low-water mark is kept with the rest.
+ */
+#ifndef MEMPOOL_H
+#define MEMPOOL_H
+
+#include "os_type.h"
+
+#ifndef MEMPOOL_GUARD_LEN
+#define MEMPOOL_GUARD_LEN 4 /**< Guard bytes before and after each block; the Makefile sets 0 with MEMPOOL_GUARD=0 */
+#endif
+#define MEMPOOL_GUARD_BYTE 0xA5 /**< What the guard bytes hold */
+#define MEMPOOL_MAX_BLOCKS 32 /**< Most blocks one pool can have, one bit each */
+#define MEMPOOL_MAX_POOLS 4 /**< Most pools mempool_report() lists */
+#define MEMPOOL_SCRATCH_LEN 1024 /**< Bytes in the scratch arena, including per-allocation overhead */
+
+/** Fails the build with a negative array size when cond is false. */
+#define MEMPOOL_ASSERT(name, cond) typedef char mempool_assert_##name[(cond) ? 1 : -1]
+
+/** Bytes of storage one block takes, guards included, kept word aligned. */
+#define MEMPOOL_STRIDE(len) ((((len) + 3) & ~3) + 2 * MEMPOOL_GUARD_LEN)
+
+/**
+ * Defines pool var with count blocks of len bytes, in static storage.
+ * Call mempool_init() on it before use.
+ */
+#define MEMPOOL(var, len, count) \
+    MEMPOOL_ASSERT(var##_count, (count) > 0 && (count) <= MEMPOOL_MAX_BLOCKS); \
+    static uint32_t var##_storage[MEMPOOL_STRIDE(len) * (count) / 4]; \
+    static mempool_t var = { #var, (len), (count), (uint8_t *)var##_storage }
+
+/**
+ * @struct mempool_stats_t
+ * What a pool has been through.
+ */
+typedef struct {
+    uint16_t inUse; /**< Blocks out now */
+    uint16_t peak; /**< Most blocks out at once */
+    uint32_t allocs;
+    uint32_t failures; /**< Allocations refused because every block was out */
+    uint32_t corruptions; /**< Blocks freed with their guard bytes overwritten */
+    uint32_t badFrees; /**< Pointers freed that were not out of this pool */
+} mempool_stats_t;
+
+/**
+ * @struct mempool_t
+ * A pool, made with MEMPOOL().
+ */
+typedef struct {
+    const char *name;
+    uint16_t blockLen; /**< Bytes the caller gets */
+    uint16_t count;
+    uint8_t *storage;
+    uint32_t used; /**< One bit per block out */
+    mempool_stats_t stats;
+} mempool_t;
+
+/**
+ * @struct scratch_stats_t
+ * What the scratch arena and the heap have been through.
+ */
+typedef struct {
+    uint16_t used; /**< Bytes in use now */
+    uint16_t peak; /**< Most bytes in use at once */
+    uint32_t failures; /**< Allocations refused for lack of room */
+    uint32_t corruptions; /**< Allocations released with their guard bytes overwritten */
+    uint32_t leaks; /**< Resets that found memory not released to its mark */
+    uint32_t resets;
+    uint32_t heapLow; /**< Lowest free heap seen, bytes */
+} scratch_stats_t;
+
+/**
+ * Empties a pool and lists it in mempool_report().
+ */
+void ICACHE_FLASH_ATTR mempool_init(mempool_t *pool);
+
+/**
+ * @return a zeroed block, or NULL if every block is out
+ */
+void * ICACHE_FLASH_ATTR mempool_alloc(mempool_t *pool);
+
+/**
+ * Gives a block back, checking its guard bytes.
+ * @param pool the pool it came from
+ * @param block the block, NULL is ignored
+ */
+void ICACHE_FLASH_ATTR mempool_free(mempool_t *pool, void *block);
+
+/**
+ * @return zeroed memory from the scratch arena, word aligned, or NULL if it is full
+ */
+void * ICACHE_FLASH_ATTR scratch_alloc(uint32_t len);
+
+/**
+ * @return where the arena is now, for scratch_release()
+ */
+uint32_t ICACHE_FLASH_ATTR scratch_mark(void);
+
+/**
+ * Frees everything allocated since the mark, checking the guard bytes.
+ */
+void ICACHE_FLASH_ATTR scratch_release(uint32_t mark);
+
+/**
+ * Empties the arena at the end of a publish cycle, counting a leak if it
+ * was not already empty, and samples the free heap.
+ */
+void ICACHE_FLASH_ATTR scratch_reset(void);
+
+/**
+ * @return the arena and heap counters, with the heap sampled now
+ */
+const scratch_stats_t * ICACHE_FLASH_ATTR scratch_stats(void);
+
+/**
+ * Formats the counters as heap_low=..;scratch_peak=..;scratch_fail=..;scratch_leaks=..
+ * then in_use, peak and failures for each pool by name, and the total of
+ * guard-byte corruptions. Pools that do not fit in len are left out.
+ * @param buf where to write
+ * @param len its size, at least 128
+ * @return the length written, 0 if len is too small
+ */
+uint32_t ICACHE_FLASH_ATTR mempool_report(char *buf, uint32_t len);
+
+#endif
@@ -0,0 +1,214 @@
+#!/usr/bin/env python3
+##
+# @file
+# @brief Makes a compressed delta between two firmware images
+#
+# The device rebuilds the new image from the one in its running bank, see
+# delta.h for the format. Both images must be linked for their banks: old is
+# the image the device runs now, new is the build for the other bank.
+#
+# The output starts with a 20 byte header that otapush.py turns into the 'P'
+# message: "HDLT", old size, old CRC32, new size, new CRC32 (big endian),
+# followed by the delta stream itself. The delta is decoded again before it
+# is written, so a bad file is never produced.
+#
+# usage: mkdelta.py <old.bin> <new.bin> <out.delta>
+
+import struct
+import sys
+import zlib
+
+MAGIC = b"HDLT"
+HEADER_LEN = 20  # magic plus four 32 bit fields
+WINDOW = 1024  # must match DELTA_WINDOW in delta.h
+MIN_MATCH = 3
+MAX_MATCH = 66
+BLOCK = 8  # bytes hashed to find match candidates in the old image
+MIN_SCORE = 8  # shortest approximate match worth a new record
+
+
+def varint(n):
+    out = bytearray()
+    while True:
+        byte = n & 0x7F
+        n >>= 7
+        if n:
+            out.append(byte | 0x80)
+        else:
+            out.append(byte)
+            return bytes(out)
+
+
+def zigzag(n):
+    return (n << 1) if n >= 0 else ((-n << 1) - 1)
+
+
+def extend(old, new, o, n):
+    """bsdiff style approximate match: grow while matches outweigh mismatches"""
+    score = best_score = best_len = 0
+    limit = min(len(old) - o, len(new) - n)
+    k = 0
+    while k < limit:
+        score += 1 if old[o + k] == new[n + k] else -1
+        k += 1
+        if score > best_score:
+            best_score, best_len = score, k
+        elif score < best_score - 2 * BLOCK:
+            break
+    return best_len, best_score
+
+
+def find_matches(old, new):
+    """Returns (new offset, old offset, length) for each approximate match"""
+    index = {}
+    for o in range(len(old) - BLOCK + 1):
+        candidates = index.setdefault(old[o:o + BLOCK], [])
+        if len(candidates) < 4:
+            candidates.append(o)
+    matches = []
+    n = 0
+    shift = 0  # old - new offset of the previous match, code tends to move in blocks
+    while n < len(new):
+        candidates = index.get(new[n:n + BLOCK], [])
+        if 0 <= n + shift < len(old):
+            candidates = [n + shift] + candidates
+        best = (0, 0, 0)
+        for o in candidates:
+            length, score = extend(old, new, o, n)
+            if score > best[2]:
+                best = (o, length, score)
+        if best[2] >= MIN_SCORE:
+            matches.append((n, best[0], best[1]))
+            shift = best[0] - n
+            n += best[1]
+        else:
+            n += 1
+    return matches
+
+
+def make_patch(old, new):
+    out = bytearray()
+    records = [(0, 0, 0)] + find_matches(old, new)
+    old_pos = 0
+    for i, (n, o, length) in enumerate(records):
+        end = records[i + 1][0] if i + 1 < len(records) else len(new)
+        next_old = records[i + 1][1] if i + 1 < len(records) else o + length
+        diff = bytes((new[n + k] - old[o + k]) & 0xFF for k in range(length))
+        extra = new[n + length:end]
+        if length == 0 and not extra and next_old == old_pos:
+            continue
+        out += varint(length) + varint(len(extra)) + varint(zigzag(next_old - (o + length)))
+        out += diff + extra
+        old_pos = next_old
+    return bytes(out)
+
+
+def compress(data):
+    """Greedy LZSS with hash chains, the outer layer in delta.h"""
+    out = bytearray()
+    chains = {}
+    i = 0
+    while i < len(data):
+        flag_pos = len(out)
+        out.append(0)
+        flags = 0
+        for bit in range(8):
+            if i >= len(data):
+                break
+            best_len, best_dist = 0, 0
+            key = data[i:i + MIN_MATCH]
+            for j in reversed(chains.get(key, [])[-16:]):
+                if i - j > WINDOW:
+                    break
+                length = 0
+                while length < MAX_MATCH and i + length < len(data) and data[j + length] == data[i + length]:
+                    length += 1
+                if length > best_len:
+                    best_len, best_dist = length, i - j
+                    if length == MAX_MATCH:
+                        break
+            if best_len >= MIN_MATCH:
+                code = ((best_dist - 1) << 6) | (best_len - MIN_MATCH)
+                out += bytes([code >> 8, code & 0xFF])
+                step = best_len
+            else:
+                flags |= 1 << bit
+                out.append(data[i])
+                step = 1
+            for k in range(i, i + step):
+                chains.setdefault(data[k:k + MIN_MATCH], []).append(k)
+            i += step
+        out[flag_pos] = flags
+    return bytes(out)
+
+
+def decompress(data):
+    out = bytearray()
+    i = 0
+    while i < len(data):
+        flags = data[i]
+        i += 1
+        for bit in range(8):
+            if i >= len(data):
+                break
+            if flags & (1 << bit):
+                out.append(data[i])
+                i += 1
+            else:
+                code = (data[i] << 8) | data[i + 1]
+                i += 2
+                start = len(out) - ((code >> 6) + 1)
+                for k in range((code & 0x3F) + MIN_MATCH):
+                    out.append(out[start + k])
+    return bytes(out)
+
+
+def apply_patch(old, patch):
+    out = bytearray()
+    i = old_pos = 0
+
+    def read_varint():
+        nonlocal i
+        value = shift = 0
+        while True:
+            byte = patch[i]
+            i += 1
+            value |= (byte & 0x7F) << shift
+            shift += 7
+            if not byte & 0x80:
+                return value
+
+    while i < len(patch):
+        diff_len, extra_len, seek = read_varint(), read_varint(), read_varint()
+        seek = (seek >> 1) ^ -(seek & 1)
+        for k in range(diff_len):
+            out.append((old[old_pos + k] + patch[i + k]) & 0xFF)
+        i += diff_len
+        old_pos += diff_len
+        out += patch[i:i + extra_len]
+        i += extra_len
+        old_pos += seek
+    return bytes(out)
+
+
+def make_delta(old, new):
+    """Returns the delta file contents, header included"""
+    stream = compress(make_patch(old, new))
+    if apply_patch(old, decompress(stream)) != new:
+        raise ValueError("delta does not rebuild the new image")
+    return MAGIC + struct.pack(">IIII", len(old), zlib.crc32(old), len(new), zlib.crc32(new)) + stream
+
+
+if __name__ == "__main__":
+    if len(sys.argv) != 4:
+        sys.exit("usage: mkdelta.py <old.bin> <new.bin> <out.delta>")
+
+    old = open(sys.argv[1], "rb").read()
+    new = open(sys.argv[2], "rb").read()
+    try:
+        delta = make_delta(old, new)
+    except ValueError as e:
+        sys.exit("{0}, not written".format(e))
+    open(sys.argv[3], "wb").write(delta)
+    print("{0}: {1} bytes, {2:.1f}x smaller than the {3} byte image".format(
+        sys.argv[3], len(delta), len(new) / len(delta), len(new)))
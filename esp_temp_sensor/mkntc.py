@@ -0,0 +1,153 @@
+#!/usr/bin/env python3
+##
+# @file
+# @brief Tabulates an NTC thermistor's temperature against ADC counts
+#
+# ntc.c turns a decimated ADC reading into centi-degrees by linear
+# interpolation in this table, with integer math only, so nothing on the
+# device needs log() or floats. The table has an entry every 2**shift
+# counts across the NTC_COUNT_BITS range of the decimated reading, each the
+# temperature at those counts in centi-degrees, from the beta form of the
+# Steinhart-Hart equation:
+#
+#   1/T = 1/T25 + ln(R/R25)/beta
+#
+# The thermistor goes from the supply to the ADC pin, with the series
+# resistor from there to ground, so the counts rise with the temperature.
+# The configuration comes from these defines in user_config.h:
+#   ntc_r25        ohms at 25 C
+#   ntc_beta       kelvin, B25/85 from the datasheet
+#   ntc_series     ohms, the resistor to ground
+#   ntc_supply_mv  what the divider is fed
+#   ntc_adc_mv     input at full scale: 1000 on a bare module, about 3200
+#                  behind the 220k/100k divider of NodeMCU-style boards
+#   ntc_min_c, ntc_max_c  the range readings are clamped to
+#
+# The table must rise all the way; the worst interpolation error inside the
+# clamped range is printed, and one above --max-error fails the build.
+# host/ntccheck checks ntc.c against the same equation in floating point.
+#
+# usage: mkntc.py user_config.h [--shift N] [--max-error CENTI] [-o ntc_table.h]
+
+import argparse
+import ast
+import math
+import re
+import sys
+
+DEFINE = re.compile(r"^\s*#define\s+(ntc_\w+)\s+(.+?)\s*(?://.*)?$")
+NUMBERS = ["ntc_r25", "ntc_beta", "ntc_series", "ntc_supply_mv", "ntc_adc_mv", "ntc_min_c", "ntc_max_c"]
+COUNT_BITS = 12  # 10-bit ADC oversampled 16 times, NTC_OVERSAMPLE_BITS in ntc.h
+T25 = 298.15
+
+
+def read_config(path):
+    values = {}
+    for line in open(path):
+        m = DEFINE.match(line)
+        if m:
+            values[m.group(1)] = m.group(2)
+    config = {}
+    for name in NUMBERS:
+        if name not in values:
+            sys.exit("{0}: no #define {1}, see user_config.def.h".format(path, name))
+        value = ast.literal_eval(values[name])
+        if not isinstance(value, (int, float)):
+            sys.exit("{0}: {1} must be a number".format(path, name))
+        config[name] = value
+    if config["ntc_min_c"] >= config["ntc_max_c"]:
+        sys.exit("{0}: ntc_min_c must be below ntc_max_c".format(path))
+    return config
+
+
+def temperature(config, counts):
+    """Degrees C at a decimated reading, as the float reference; None past either end of the divider"""
+    volts = counts * config["ntc_adc_mv"] / float(1 << COUNT_BITS)
+    if volts <= 0 or volts >= config["ntc_supply_mv"]:
+        return None
+    r = config["ntc_series"] * (config["ntc_supply_mv"] - volts) / volts
+    return 1.0 / (1.0 / T25 + math.log(r / config["ntc_r25"]) / config["ntc_beta"]) - 273.15
+
+
+def table(config, shift):
+    """The entries, in centi-degrees; ends the divider cannot reach are carried on from their neighbours"""
+    step = 1 << shift
+    temps = [temperature(config, i * step) for i in range((1 << COUNT_BITS) // step + 1)]
+    known = [i for i, t in enumerate(temps) if t is not None]
+    if len(known) < 2:
+        sys.exit("the divider gives no usable readings, check ntc_adc_mv against ntc_supply_mv")
+    entries = [None if t is None else int(round(t * 100)) for t in temps]
+    # an end the divider never reaches only has to keep the table rising
+    for i in range(known[0] - 1, -1, -1):
+        entries[i] = entries[i + 1] - (entries[known[0] + 1] - entries[known[0]])
+    for i in range(known[-1] + 1, len(entries)):
+        entries[i] = entries[i - 1] + (entries[known[-1]] - entries[known[-1] - 1])
+    return entries
+
+
+def interpolate(entries, shift, counts, low, high):
+    """What ntc_counts_to_centi() returns, in the same integer steps"""
+    i, frac = counts >> shift, counts & ((1 << shift) - 1)
+    value = entries[i] + (((entries[i + 1] - entries[i]) * frac) >> shift)
+    return min(max(value, low), high)
+
+
+def worst_error(config, entries, shift):
+    """(centi-degrees, counts) of the largest difference from the float reference inside the clamped range"""
+    low, high = config["ntc_min_c"] * 100, config["ntc_max_c"] * 100
+    worst = (0.0, 0)
+    for counts in range(1 << COUNT_BITS):
+        t = temperature(config, counts)
+        if t is None or t * 100 < low or t * 100 > high:
+            continue
+        error = abs(interpolate(entries, shift, counts, low, high) - t * 100)
+        if error > worst[0]:
+            worst = (error, counts)
+    return worst
+
+
+def main():
+    parser = argparse.ArgumentParser(description="tabulate the NTC thermistor set in user_config.h")
+    parser.add_argument("config")
+    parser.add_argument("--shift", type=int, default=4, help="log2 of the counts between entries")
+    parser.add_argument("--max-error", type=float, default=10.0, help="centi-degrees the table may be off by")
+    parser.add_argument("-o", "--output")
+    args = parser.parse_args()
+
+    config = read_config(args.config)
+    entries = table(config, args.shift)
+    for i in range(1, len(entries)):
+        if entries[i] <= entries[i - 1]:
+            sys.exit("the table does not rise at entry {0}, {1} after {2}".format(i, entries[i], entries[i - 1]))
+    error, at = worst_error(config, entries, args.shift)
+    if error > args.max_error:
+        sys.exit("interpolation is {0:.1f} centi-degrees off at {1} counts, above {2}; use a smaller --shift".format(
+            error, at, args.max_error))
+
+    out = open(args.output, "w") if args.output else sys.stdout
+    out.write("// Generated by mkntc.py from {0}, do not edit.\n".format(args.config))
+    out.write("#ifndef NTC_TABLE_H\n#define NTC_TABLE_H\n\n#include \"c_types.h\"\n\n")
+    out.write("// R25 {0} ohms, beta {1} K, {2} ohms to ground, {3} mV supply, {4} mV full scale\n".format(
+        config["ntc_r25"], config["ntc_beta"], config["ntc_series"], config["ntc_supply_mv"], config["ntc_adc_mv"]))
+    out.write("#define NTC_R25 {0}\n#define NTC_BETA {1}\n#define NTC_SERIES {2}\n".format(
+        config["ntc_r25"], config["ntc_beta"], config["ntc_series"]))
+    out.write("#define NTC_SUPPLY_MV {0}\n#define NTC_ADC_MV {1}\n".format(config["ntc_supply_mv"], config["ntc_adc_mv"]))
+    out.write("#define NTC_COUNT_BITS {0}\n#define NTC_TABLE_SHIFT {1}\n#define NTC_TABLE_LEN {2}\n".format(
+        COUNT_BITS, args.shift, len(entries)))
+    out.write("#define NTC_MIN_CENTI {0}\n#define NTC_MAX_CENTI {1}\n".format(
+        int(config["ntc_min_c"] * 100), int(config["ntc_max_c"] * 100)))
+    out.write("#define NTC_TABLE_ERROR_CENTI {0} // worst interpolation error, at {1} counts\n\n".format(
+        int(math.ceil(error)), at))
+    out.write("// centi-degrees every {0} counts, words so flash is read whole\n".format(1 << args.shift))
+    out.write("static const int32_t ntcTable[NTC_TABLE_LEN] ICACHE_RODATA_ATTR STORE_ATTR = {\n")
+    for i in range(0, len(entries), 8):
+        out.write("    " + ", ".join(str(e) for e in entries[i:i + 8]) + ",\n")
+    out.write("};\n\n#endif\n")
+    if args.output:
+        out.close()
+        print("{0}: {1} entries, worst error {2:.2f} centi-degrees at {3} counts".format(
+            args.output, len(entries), error, at))
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,173 @@
+#!/usr/bin/env python3
+
+# This Source Code Form is subject to the terms of the Mozilla Public
+# License, v. 2.0. If a copy of the MPL was not distributed with this
+# file, You can obtain one at http://mozilla.org/MPL/2.0/.
+##
+# @file
+# @brief Serializes the MQTT packets that only depend on user_config.h
+#
+# CONNECT, SUBSCRIBE to the session topic and the PUBLISH header for it are
+# the same on every connection, so packets.h holds them ready to send as
+# arrays in flash, built with strtoarr.py's c_array(). mqttSendFlags() copies
+# them out instead of encoding them again; see mqtt_precompiled_t.
+#
+# The configuration comes from these defines in user_config.h:
+#   mqtt_client_id, mqtt_username, mqtt_password, mqtt_topic  string literals
+#   mqtt_status_topic, mqtt_status_online, mqtt_status_offline string literals
+#   mqtt_keepalive                                            seconds
+#   mqtt_persistent                                           0 or 1
+#
+# An empty client ID with mqtt_persistent, or an empty status topic, is
+# filled in from the chip ID at runtime, and then CONNECT is left out.
+#
+# With --check, the host build of mqtt.c (host/pktdump) encodes the same
+# configuration and any byte that differs fails the build.
+#
+# usage: mkpackets.py user_config.h [--check host/pktdump] [-o packets.h]
+
+import argparse
+import ast
+import re
+import subprocess
+import sys
+
+from strtoarr import c_array
+
+DEFINE = re.compile(r"^\s*#define\s+(mqtt_\w+)\s+(.+?)\s*(?://.*)?$")
+STRINGS = ["mqtt_client_id", "mqtt_username", "mqtt_password", "mqtt_topic",
+           "mqtt_status_topic", "mqtt_status_online", "mqtt_status_offline"]
+NUMBERS = ["mqtt_keepalive", "mqtt_persistent"]
+# CONNECT flags, as in mqttConnectFlags()
+FLAG_USERNAME, FLAG_PASSWORD, FLAG_WILL_RETAIN, FLAG_WILL, FLAG_CLEAN = 0x80, 0x40, 0x20, 0x04, 0x02
+
+
+def read_config(path):
+    values = {}
+    for line in open(path):
+        m = DEFINE.match(line)
+        if m:
+            values[m.group(1)] = m.group(2)
+    config = {}
+    for name in STRINGS + NUMBERS:
+        if name not in values:
+            sys.exit("{0}: no #define {1}, see user_config.def.h".format(path, name))
+        value = ast.literal_eval(values[name])
+        if name in STRINGS and not isinstance(value, str):
+            sys.exit("{0}: {1} must be a string literal".format(path, name))
+        config[name] = value
+    return config
+
+
+def encode_length(n):
+    """Remaining length, MQTT spec section 2.2.3"""
+    out = bytearray()
+    while True:
+        byte, n = n % 128, n // 128
+        out.append(byte | (0x80 if n else 0))
+        if not n:
+            return bytes(out)
+
+
+def utf8(s):
+    data = s.encode()
+    return bytes([len(data) >> 8, len(data) & 0xFF]) + data
+
+
+def connect_packet(config):
+    """CONNECT with the status topic as a retained will, or b"" if it needs the chip ID"""
+    if not config["mqtt_status_topic"] or (config["mqtt_persistent"] and not config["mqtt_client_id"]):
+        return b""
+    flags = FLAG_WILL | FLAG_WILL_RETAIN
+    payload = utf8(config["mqtt_client_id"]) + utf8(config["mqtt_status_topic"]) + utf8(config["mqtt_status_offline"])
+    if config["mqtt_username"]:
+        flags |= FLAG_USERNAME
+        payload += utf8(config["mqtt_username"])
+        if config["mqtt_password"]:
+            flags |= FLAG_PASSWORD
+            payload += utf8(config["mqtt_password"])
+    if not config["mqtt_persistent"]:
+        flags |= FLAG_CLEAN
+    body = utf8("MQTT") + bytes([0x04, flags, config["mqtt_keepalive"] >> 8, config["mqtt_keepalive"] & 0xFF]) + payload
+    return bytes([0x10]) + encode_length(len(body)) + body
+
+
+def packets(config):
+    """Returns (connect, subscribe, publish header); the SUBSCRIBE packet
+    identifier is 0 and the PUBLISH remaining length is for no payload"""
+    connect = connect_packet(config)
+
+    body = bytes([0, 0]) + utf8(config["mqtt_topic"]) + bytes([0])
+    subscribe = bytes([0x82]) + encode_length(len(body)) + body
+
+    body = utf8(config["mqtt_topic"])
+    # mqttSendFlags() adds the payload length to one remaining length byte
+    publish = bytes([0x30]) + encode_length(len(body)) + body if len(body) < 128 else b""
+    return connect, subscribe, publish
+
+
+def check(tool, config, built):
+    args = [tool] + [config[name] for name in STRINGS[:4]] + [str(config["mqtt_keepalive"]),
+            str(config["mqtt_persistent"]), config["mqtt_status_topic"], config["mqtt_status_offline"]]
+    output = subprocess.run(args, stdout=subprocess.PIPE, check=True, universal_newlines=True).stdout
+    runtime = {}
+    for line in output.splitlines():
+        fields = line.split()
+        if len(fields) == 2:
+            runtime[fields[0]] = bytes.fromhex(fields[1])
+    failures = 0
+    for name, data in zip(("connect", "subscribe", "publish"), built):
+        expected = runtime.get(name)
+        if not data:
+            continue
+        if expected != data:
+            print("{0}: generated {1}, mqtt.c sends {2}".format(
+                name, data.hex(), expected.hex() if expected else "nothing"), file=sys.stderr)
+            failures += 1
+    if failures:
+        sys.exit("generated packets differ from the runtime encoder")
+
+
+def flash_array(name, data):
+    """Flash is read a word at a time, so the array is padded to whole words"""
+    padded = data + bytes(-len(data) % 4)
+    return c_array(name, padded, "uint8_t", " ICACHE_RODATA_ATTR STORE_ATTR")
+
+
+def main():
+    parser = argparse.ArgumentParser(description="serialize the MQTT packets fixed by user_config.h")
+    parser.add_argument("config")
+    parser.add_argument("--check", help="host/pktdump, to compare with what mqtt.c encodes")
+    parser.add_argument("-o", "--output")
+    args = parser.parse_args()
+
+    config = read_config(args.config)
+    connect, subscribe, publish = packets(config)
+    if args.check:
+        check(args.check, config, (connect, subscribe, publish))
+
+    out = open(args.output, "w") if args.output else sys.stdout
+    out.write("// Generated by mkpackets.py from {0}, do not edit.\n".format(args.config))
+    out.write("#ifndef PACKETS_H\n#define PACKETS_H\n\n#include \"c_types.h\"\n#include \"mqtt.h\"\n\n")
+    if connect:
+        out.write("// CONNECT, client id \"{0}\", keepalive {1} s, will on \"{2}\"\n".format(
+            config["mqtt_client_id"], config["mqtt_keepalive"], config["mqtt_status_topic"]))
+        out.write(flash_array("mqttConnectPacket", connect) + "\n")
+    out.write("// SUBSCRIBE to \"{0}\", packet identifier filled in when sent\n".format(config["mqtt_topic"]))
+    out.write(flash_array("mqttSubscribePacket", subscribe) + "\n")
+    if publish:
+        out.write("// PUBLISH header for \"{0}\", remaining length without the payload\n".format(config["mqtt_topic"]))
+        out.write(flash_array("mqttPublishHeader", publish) + "\n")
+    out.write("\nstatic const mqtt_precompiled_t mqttPrecompiled = {\n")
+    out.write("    {0}, {1},\n".format("mqttConnectPacket" if connect else "NULL", len(connect)))
+    out.write("    mqttSubscribePacket, {0},\n".format(len(subscribe)))
+    out.write("    {0}, {1}\n".format("mqttPublishHeader" if publish else "NULL", len(publish)))
+    out.write("};\n\n#endif\n")
+    if args.output:
+        out.close()
+        print("{0}: CONNECT {1}, SUBSCRIBE {2}, PUBLISH header {3} bytes".format(
+            args.output, len(connect), len(subscribe), len(publish)))
+
+
+if __name__ == "__main__":
+    main()
@@ -13,6 +13,9 @@
 #include "os_type.h"
 #include "mqtt.h"
 #include "main.h"
+#include "power.h"
+#include "mempool.h"
+#include "capture.h"
 
 /* Functions we will need to implement:
  * Send -- will handle all sending of all packets
@@ -23,11 +26,111 @@
  * security or QoS in this basic implementation.
  */
 
-static os_timer_t MQTT_KeepAliveTimer;
-static os_timer_t waitForWifiTimer;
+// packets too long for a precompiled template are encoded in scratch, so it
+// must take one of those with room left for the reading it carries
+MEMPOOL_ASSERT(mqtt_packet_fits_scratch, 2 * (MQTT_PRECOMPILED_BUF_LEN + MQTT_FIXED_HEADER_MAX) + 32 <= MEMPOOL_SCRATCH_LEN);
 
+static uint8_t PLACE(mqttSendFlags) mqttSendFlags(mqtt_session_t *session, const uint8_t *topic, uint32_t topic_len, uint8_t *data, uint32_t len, mqtt_message_type msgType, uint8_t flags, uint16_t packetId);
+static void PLACE(mqttDropConnection) mqttDropConnection(mqtt_session_t *session);
+
+#ifdef MQTT_USE_TLS
+static void PLACE(tlsSampleHeap) tlsSampleHeap(void *arg) {
+    mqtt_session_t *session = arg;
+    uint32_t heap = system_get_free_heap_size();
+    if(heap < session->heapLow) {
+        session->heapLow = heap;
+    }
+}
+
+// Called once the handshake is over, whether it worked or not
+static void PLACE(tlsHandshakeDone) tlsHandshakeDone(mqtt_session_t *session, uint8_t ok) {
+    twheel_disarm(&session->heapTimer);
+    if(session->handshakeStart == 0) {
+        return;
+    }
+    tlsSampleHeap(session);
+    if(session->heapBefore - session->heapLow > session->tlsStats.heapPeak) {
+        session->tlsStats.heapPeak = session->heapBefore - session->heapLow;
+    }
+    if(ok) {
+        uint32_t ms = (system_get_time() - session->handshakeStart) / 1000;
+        session->tlsStats.handshakes++;
+        session->tlsStats.lastMs = ms;
+        if(ms > session->tlsStats.maxMs) {
+            session->tlsStats.maxMs = ms;
+        }
+        os_printf("TLS handshake took %d ms, %d bytes of heap\n", ms, session->heapBefore - session->heapLow);
+    }
+    session->handshakeStart = 0;
+}
+#endif
+
+// Hands bytes to the transport the session was opened with, which copies them
+static sint8 PLACE(mqttConnTransmit) mqttConnTransmit(mqtt_session_t *session, uint8_t *data, uint16_t len) {
+    sint8 res;
+    power_packet(0);
+    capture_record(session->activeConnection, CAPTURE_TX, data, len);
+#ifdef MQTT_USE_TLS
+    if(session->secure) {
+        res = espconn_secure_send(session->activeConnection, data, len);
+    } else
+#endif
+    res = espconn_send(session->activeConnection, data, len);
+    if(res == ESPCONN_OK) {
+        session->txBusy = 1;
+    } else {
+        session->txStats.refused++;
+        os_printf("Send of %d bytes refused: %d\n", len, res);
+    }
+    return res;
+}
+
+// Sends now if the SDK is free, otherwise queues behind what it has, in
+// order; an urgent packet goes behind the urgent ones only, ahead of the rest
+static sint8 PLACE(mqttConnSend) mqttConnSend(mqtt_session_t *session, uint8_t *data, uint16_t len, uint8_t urgent) {
+    uint8_t *slot;
+    if(session->txQueue == NULL || (!session->txBusy && session->txQueued == 0)) {
+        return mqttConnTransmit(session, data, len);
+    }
+    if(session->txQueued + 2 + len + (urgent ? 0 : MQTT_TX_URGENT_ROOM) > session->txQueueLen) {
+        session->txStats.refused++;
+        os_printf("Send queue full, dropping %d bytes\n", len);
+        return ESPCONN_MAXNUM;
+    }
+    if(urgent) {
+        slot = session->txQueue + session->txUrgent;
+        os_memmove(slot + 2 + len, slot, session->txQueued - session->txUrgent);
+        session->txUrgent += 2 + len;
+    } else {
+        slot = session->txQueue + session->txQueued;
+    }
+    slot[0] = (len >> 8) & 0xFF;
+    slot[1] = len & 0xFF;
+    os_memcpy(slot + 2, data, len);
+    session->txQueued += 2 + len;
+    if(session->txQueued > session->txStats.queuedPeak) {
+        session->txStats.queuedPeak = session->txQueued;
+    }
+    return ESPCONN_OK;
+}
+
+// Nothing queued or in flight survives the connection
+static void PLACE(mqttTxReset) mqttTxReset(mqtt_session_t *session) {
+    session->txQueued = 0;
+    session->txUrgent = 0;
+    session->txBusy = 0;
+}
+
+void PLACE(mqttSetSendQueue) mqttSetSendQueue(mqtt_session_t *session, uint8_t *buf, uint32_t len) {
+    session->txQueue = buf;
+    session->txQueueLen = len;
+    mqttTxReset(session);
+}
+
+// The string helpers only run when a reading is published, so they live in
+// flash rather than in IRAM, which is kept for code that cannot wait
 // reverses a string 'str' of length 'len'
-void reverse(char *str, int len) {
+void PLACE(reverse) reverse(char *str, int len) {
     int i=0, j=len-1, temp;
     while (i<j) {
         temp = str[i];
@@ -41,7 +144,7 @@ void reverse(char *str, int len) {
 // Converts a given integer x to string str[].  d is the number
 // of digits required in output. If d is more than the number
 // of digits in x, then 0s are added at the beginning.
-int intToStr(int x, char str[], int d) {
+int PLACE(intToStr) intToStr(int x, char str[], int d) {
     int i = 0;
     while (x) {
         str[i++] = (x%10) + '0';
@@ -59,7 +162,7 @@ int intToStr(int x, char str[], int d) {
 }
 
 // Converts a floating point number to string.
-void ftoa(float n, char *res, int afterpoint) {
+void PLACE(ftoa) ftoa(float n, char *res, int afterpoint) {
     // Extract integer part
     int ipart = (int)n;
 
@@ -82,32 +185,113 @@ void ftoa(float n, char *res, int afterpoint) {
     }
 }
 
-void ICACHE_FLASH_ATTR data_sent_callback(void *arg) {
+void PLACE(data_sent_callback) data_sent_callback(void *arg) {
+    struct espconn *pConn = arg;
+    mqtt_session_t *session = pConn->reverse;
+    uint32_t len;
 #ifdef DEBUG
     os_printf("Data sent!\n");
 #endif
-    return;
+    session->txBusy = 0;
+    if(session->txQueued == 0) {
+        return;
+    }
+    // the next one in line; the SDK has its own copy once it takes it
+    len = (session->txQueue[0] << 8) | session->txQueue[1];
+    if(mqttConnTransmit(session, session->txQueue + 2, len) != ESPCONN_OK) {
+        // the connection is going, and the rest with it
+        mqttTxReset(session);
+        return;
+    }
+    session->txQueued -= 2 + len;
+    session->txUrgent -= (session->txUrgent > 0) ? 2 + len : 0;
+    os_memmove(session->txQueue, session->txQueue + 2 + len, session->txQueued);
 }
 
-void ICACHE_FLASH_ATTR data_recv_callback(void *arg, char *pdata, unsigned short len) {
+void PLACE(data_recv_callback) data_recv_callback(void *arg, char *pdata, unsigned short len) {
     struct espconn *pConn = arg;
     mqtt_session_t *session = pConn->reverse;
-    // deal with received data
+    power_packet(1);
+    capture_record(pConn, CAPTURE_RX, (const uint8_t *)pdata, len);
+    // deal with received data; the bytes themselves are in the capture ring, see capture.h
 #ifdef DEBUG
-    os_printf("Received data of length %d -- %s \r\n", len, pdata);
-    os_printf("Hex dump: ");
-    for(int i = 0; i < len; i++) {
-        os_printf("(%d): %x ", i, pdata[i]);
-    }
-    os_printf("\n");
+    os_printf("Received data of length %d\n", len);
 #endif
+    // a segment can be bigger than the room left in rxBuf, so it goes in as much at a time as fits
+    while(len > 0) {
+        uint32_t n, offset = 0;
+        if(session->rxSkip > 0) {
+            // the rest of a packet too large to hold, which must not be taken for packets of its own
+            n = (len < session->rxSkip) ? len : session->rxSkip;
+            session->rxSkip -= n;
+            pdata += n;
+            len -= n;
+            continue;
+        }
+        n = MQTT_RX_BUF_LEN - session->rxLen;
+        if(n > len) {
+            n = len;
+        }
+        os_memcpy(session->rxBuf + session->rxLen, pdata, n);
+        session->rxLen += n;
+        pdata += n;
+        len -= n;
+
+        // hand over every complete packet, keep any partial one for the next segment
+        while(session->rxLen - offset >= 2) {
+            uint32_t remaining;
+            int8_t lenBytes = decodeLength(session->rxBuf + offset + 1, session->rxLen - offset - 1, &remaining);
+            if(lenBytes < 0) {
+                // there is no telling where the next packet starts
+                os_printf("Malformed remaining length, closing the connection\n");
+                session->rxLen = 0;
+                mqttDropConnection(session);
+                return;
+            }
+            if(lenBytes == 0) {
+                break; // need more bytes to know the length
+            }
+            uint32_t headerLen = 1 + lenBytes;
+            if(headerLen + remaining > MQTT_RX_BUF_LEN) {
+                os_printf("Packet of %d bytes too large, skipping it\n", headerLen + remaining);
+                session->rxSkip = headerLen + remaining - (session->rxLen - offset);
+                session->rxLen = offset;
+                break;
+            }
+            if(session->rxLen - offset < headerLen + remaining) {
+                break; // rest of the packet is still in flight
+            }
+            mqttHandlePacket(session, session->rxBuf + offset, headerLen + remaining, headerLen);
+            offset += headerLen + remaining;
+        }
+        if(offset > 0) {
+            os_memmove(session->rxBuf, session->rxBuf + offset, session->rxLen - offset);
+            session->rxLen -= offset;
+        }
+    }
+}
+
+void PLACE(mqttHandlePacket) mqttHandlePacket(mqtt_session_t *session, uint8_t *pdata, uint32_t len, uint32_t headerLen) {
     mqtt_message_type msgType = ((mqtt_message_type)pdata[0] >> 4) & 0x0F;
     switch(msgType) {
         case MQTT_MSG_TYPE_CONNACK:
+#ifdef DEBUG
             os_printf("CONNACK recieved...\n");
-            switch(pdata[3]) {
+#endif
+            twheel_disarm(&session->replyTimer);
+            if(len - headerLen != 2) {
+                // the flags and return code are all there is to it, MQTT spec section 3.2
+                os_printf("Malformed CONNACK of %d bytes, closing the connection\n", len);
+                mqttDropConnection(session);
+                return;
+            }
+            session->connackCode = pdata[headerLen + 1];
+            session->sessionPresent = (session->connackCode == 0) ? (pdata[headerLen] & 0x01) : 0;
+            switch(session->connackCode) {
                 case 0:
+#ifdef DEBUG
                     os_printf("Connection accepted.\n");
+#endif
                     break;
                 case 1:
                     os_printf("Connection refused -- incorrect protocol version.\n");
@@ -129,27 +313,65 @@ void ICACHE_FLASH_ATTR data_recv_callback(void *arg, char *pdata, unsigned short
                     break;
             }
             if(session->connack_cb != NULL) {
-                session->connack_cb(pdata);
+                session->connack_cb(session);
             }
             break;
-        case MQTT_MSG_TYPE_PUBLISH:
-            os_printf("Application message from server: %s\n", &pdata[3]); // probably incorrect
+        case MQTT_MSG_TYPE_PUBLISH: {
+            // variable header is a two byte topic length, the topic, then a
+            // packet identifier only if QoS is above 0
+            uint8_t qos = (pdata[0] >> 1) & 0x03;
+            uint32_t offset = headerLen;
+            if(len < offset + 2) {
+                break;
+            }
+            uint32_t topic_len = (pdata[offset] << 8) | pdata[offset + 1];
+            uint8_t *topic = pdata + offset + 2;
+            offset += 2 + topic_len + ((qos > 0) ? 2 : 0);
+            if(len < offset) {
+                os_printf("Truncated PUBLISH\n");
+                break;
+            }
+#ifdef DEBUG
+            os_printf("Application message from server: %d bytes, topic length %d\n", len - offset, topic_len);
+#endif
             if(session->publish_cb != NULL) {
                 session->publish_cb(pdata);
             }
+            if(session->message_cb != NULL) {
+                session->message_cb(session, topic, topic_len, pdata + offset, len - offset);
+            }
             break;
+        }
         case MQTT_MSG_TYPE_SUBACK:
+#ifdef DEBUG
             os_printf("Subscription acknowledged\n");
+#endif
+            if(session->suback_cb != NULL) {
+                session->suback_cb(session);
+            }
             break;
         case MQTT_MSG_TYPE_UNSUBACK:
+#ifdef DEBUG
             os_printf("Unsubscription acknowledged\n");
+#endif
+            break;
+        case MQTT_MSG_TYPE_PUBACK:
+            // the packet identifier is all there is to it
+            if(len < headerLen + 2) {
+                break;
+            }
+            if(session->puback_cb != NULL) {
+                session->puback_cb(session, (pdata[headerLen] << 8) | pdata[headerLen + 1]);
+            }
             break;
         case MQTT_MSG_TYPE_PINGRESP:
+#ifdef DEBUG
             os_printf("Pong!\n");
+#endif
+            twheel_disarm(&session->replyTimer);
             break;
         // all remaining cases listed to avoid warnings
         case MQTT_MSG_TYPE_CONNECT:
-        case MQTT_MSG_TYPE_PUBACK:
         case MQTT_MSG_TYPE_PUBREC:
         case MQTT_MSG_TYPE_PUBREL:
         case MQTT_MSG_TYPE_PUBCOMP:
@@ -167,7 +389,7 @@ void ICACHE_FLASH_ATTR data_recv_callback(void *arg, char *pdata, unsigned short
     }
 }
 
-void ICACHE_FLASH_ATTR connected_callback(void *arg) {
+void PLACE(connected_callback) connected_callback(void *arg) {
     struct espconn *pConn = arg;
     mqtt_session_t *pSession = pConn->reverse;
 #ifdef DEBUG
@@ -178,28 +400,82 @@ void ICACHE_FLASH_ATTR connected_callback(void *arg) {
     // enable keepalive
     espconn_set_opt(pConn, ESPCONN_KEEPALIVE);
     pSession->validConnection = 1;
+    pSession->rxLen = 0;
+    pSession->rxSkip = 0;
+    mqttTxReset(pSession);
+#ifdef MQTT_USE_TLS
+    if(pSession->secure) {
+        tlsHandshakeDone(pSession, 1);
+    }
+#endif
+    if(pSession->connected_cb != NULL) {
+        pSession->connected_cb(pSession);
+    }
+}
+
+// Either way the connection is gone, stop using it and tell the user
+static void PLACE(connection_lost) connection_lost(mqtt_session_t *session) {
+#ifdef MQTT_USE_TLS
+    if(session->secure) {
+        tlsHandshakeDone(session, 0);
+    }
+#endif
+    session->validConnection = 0;
+    mqttTxReset(session);
+    twheel_disarm(&session->keepAliveTimer);
+    twheel_disarm(&session->replyTimer);
+    if(session->disconnect_cb != NULL) {
+        session->disconnect_cb(session);
+    }
 }
 
-void ICACHE_FLASH_ATTR reconnected_callback(void *arg, sint8 err) {
+// Closing the connection ends in disconnected_callback(); if there was
+// nothing to close, end it here.
+static void PLACE(mqttDropConnection) mqttDropConnection(mqtt_session_t *session) {
+    sint8 res;
+#ifdef MQTT_USE_TLS
+    if(session->secure) {
+        res = espconn_secure_disconnect(session->activeConnection);
+    } else
+#endif
+    res = espconn_disconnect(session->activeConnection);
+    if(res != ESPCONN_OK) {
+        connection_lost(session);
+    }
+}
+
+// The broker did not answer in time
+static void PLACE(mqttReplyTimeout) mqttReplyTimeout(void *arg) {
+    os_printf("No reply from the broker\n");
+    mqttDropConnection(arg);
+}
+
+static void PLACE(mqttAwaitReply) mqttAwaitReply(mqtt_session_t *session, uint32_t ms) {
+    twheel_setfn(&session->replyTimer, (twheel_fn)mqttReplyTimeout, session);
+    twheel_arm(&session->replyTimer, ms, 0);
+}
+
+void PLACE(reconnected_callback) reconnected_callback(void *arg, sint8 err) {
+    struct espconn *pConn = arg;
     os_printf("Reconnected?\n");
     os_printf("Error code: %d\n", err);
+    connection_lost(pConn->reverse);
 }
 
-void ICACHE_FLASH_ATTR disconnected_callback(void *arg) {
+void PLACE(disconnected_callback) disconnected_callback(void *arg) {
+    struct espconn *pConn = arg;
     os_printf("Disconnected\n");
-    os_timer_disarm(&pubTimer);
-    os_timer_disarm(&pingTimer);
+    connection_lost(pConn->reverse);
 }
 
-uint8_t ICACHE_FLASH_ATTR tcpConnect(void *arg) {
-    os_timer_disarm(&waitForWifiTimer);
+uint8_t PLACE(tcpConnect) tcpConnect(void *arg) {
     struct ip_info ipConfig;
     mqtt_session_t *session = arg;
+    twheel_disarm(&session->waitForWifiTimer);
     wifi_get_ip_info(STATION_IF, &ipConfig);
     if (wifi_station_get_connect_status() == STATION_GOT_IP && ipConfig.ip.addr != 0) {
-        LOCAL struct espconn conn;
-        LOCAL struct _esp_tcp tcp_s;
-        conn.reverse = arg;
+        struct espconn *conn = &session->conn;
+        conn->reverse = arg;
 #ifdef DEBUG
         os_printf("Entered tcpConnect\n");
 #endif
@@ -208,236 +484,391 @@ uint8_t ICACHE_FLASH_ATTR tcpConnect(void *arg) {
 #ifdef DEBUG
         os_printf("about to set up TCP params\n");
 #endif
-        conn.proto.tcp = &tcp_s;
-        conn.type = ESPCONN_TCP;
-        conn.proto.tcp->local_port = espconn_port();
-        conn.proto.tcp->remote_port = session->port;
-        conn.state = ESPCONN_NONE;
-        os_memcpy(conn.proto.tcp->remote_ip, session->ip, 4);
+        conn->proto.tcp = &session->tcp;
+        conn->type = ESPCONN_TCP;
+        conn->proto.tcp->local_port = espconn_port();
+        conn->proto.tcp->remote_port = session->port;
+        conn->state = ESPCONN_NONE;
+        os_memcpy(conn->proto.tcp->remote_ip, session->ip, 4);
 #ifdef DEBUG
         os_printf("About to register callbacks\n");
 #endif
         // register callbacks
-        espconn_regist_connectcb(&conn, (espconn_connect_callback)connected_callback);
-        espconn_regist_reconcb(&conn, (espconn_reconnect_callback)reconnected_callback);
-        espconn_regist_disconcb(&conn, (espconn_connect_callback)disconnected_callback);
+        espconn_regist_connectcb(conn, (espconn_connect_callback)connected_callback);
+        espconn_regist_reconcb(conn, (espconn_reconnect_callback)reconnected_callback);
+        espconn_regist_disconcb(conn, (espconn_connect_callback)disconnected_callback);
 #ifdef DEBUG
         os_printf("About to connect\n");
 #endif
         //make the connection
-        if(espconn_connect(&conn) == 0) {
+        session->activeConnection = conn;
+#ifdef MQTT_USE_TLS
+        if(session->secure) {
+            LOCAL uint8_t tlsConfigured = 0;
+            sint8 res;
+            if(!tlsConfigured) {
+                // the SDK allocates its record buffers at this size for every
+                // handshake, the default is sized for neither our packets nor
+                // the broker's certificate
+                espconn_secure_set_size(ESPCONN_CLIENT, MQTT_TLS_BUF_LEN);
+#ifdef MQTT_TLS_CA_SECTOR
+                espconn_secure_ca_enable(ESPCONN_CLIENT, MQTT_TLS_CA_SECTOR);
+#endif
+                tlsConfigured = 1;
+            }
+            session->heapBefore = system_get_free_heap_size();
+            session->heapLow = session->heapBefore;
+            session->handshakeStart = system_get_time();
+            mqttAwaitReply(session, MQTT_TLS_CONNECT_TIMEOUT_MS);
+            twheel_setfn(&session->heapTimer, (twheel_fn)tlsSampleHeap, session);
+            twheel_arm(&session->heapTimer, MQTT_TLS_HEAP_SAMPLE_MS, 1);
+            res = espconn_secure_connect(conn);
+            if(res == 0) {
+                os_printf("TLS connection started\n");
+            } else {
+                os_printf("TLS connection error %d\n", res);
+                tlsHandshakeDone(session, 0);
+            }
+            return 0;
+        }
+#endif
+        mqttAwaitReply(session, MQTT_CONNECT_TIMEOUT_MS);
+        if(espconn_connect(conn) == 0) {
             os_printf("Connection successful\n");
         } else {
             os_printf("Connection error\n");
         }
-        session->activeConnection = &conn;
-        sub(arg);
 #ifdef DEBUG
         os_printf("About to return from TCP connect\n");
 #endif
         return 0;
     } else {
         // set timer to try again
-        os_timer_setfn(&waitForWifiTimer, (os_timer_func_t *)tcpConnect, session);
-        os_timer_arm(&waitForWifiTimer, 1000, 0);
+        twheel_setfn(&session->waitForWifiTimer, (twheel_fn)tcpConnect, session);
+        twheel_arm(&session->waitForWifiTimer, 1000, 0);
         return 2;
     }
     return 0;
 }
 
 
-uint8_t ICACHE_FLASH_ATTR *encodeLength(uint32_t trueLength) {
-    uint8_t *encodedByte = os_zalloc(sizeof(uint8_t) * 5); // can't be more than 5 bytes
-    uint8_t numBytes = 1;
+uint8_t PLACE(encodeLength) encodeLength(uint32_t trueLength, uint8_t *encoded) {
+    uint8_t numBytes = 0;
     do {
-        encodedByte[numBytes] = trueLength % 128;
+        encoded[numBytes] = trueLength % 128;
         trueLength /= 128;
         if(trueLength > 0) {
-            encodedByte[numBytes] |= 128;
+            encoded[numBytes] |= 128;
         }
         numBytes++;
-    } while(trueLength > 0);
-    encodedByte[0] = numBytes - 1;
-
-    return encodedByte;
+    } while(trueLength > 0 && numBytes < 4);
+    return numBytes;
+}
 
+int8_t PLACE(decodeLength) decodeLength(const uint8_t *buf, uint32_t avail, uint32_t *value) {
+    uint32_t multiplier = 1;
+    uint8_t i;
+    *value = 0;
+    for(i = 0; i < 4; i++) {
+        if(i >= avail) {
+            return 0;
+        }
+        *value += (buf[i] & 127) * multiplier;
+        if((buf[i] & 128) == 0) {
+            return i + 1;
+        }
+        multiplier *= 128;
+    }
+    return -1; // more than four bytes is not allowed, MQTT spec section 2.2.3
 }
 
-void ICACHE_FLASH_ATTR pingAlive(void *arg) {
+void PLACE(pingAlive) pingAlive(void *arg) {
     mqtt_session_t *pSession = (mqtt_session_t *)arg;
+    uint32_t keepalive = (pSession->keepalive != 0) ? pSession->keepalive : MQTT_KEEPALIVE_S;
     mqttSend(pSession, NULL, 0, MQTT_MSG_TYPE_PINGREQ);
+    // pinged at 60%, so an answer by 85% leaves time to connect elsewhere
+    mqttAwaitReply(pSession, keepalive * 250);
 }
 
-uint8_t ICACHE_FLASH_ATTR mqttSend(mqtt_session_t *session, uint8_t *data, uint32_t len, mqtt_message_type msgType) {
+uint8_t PLACE(mqttSend) mqttSend(mqtt_session_t *session, uint8_t *data, uint32_t len, mqtt_message_type msgType) {
+    return mqttSendTopic(session, session->topic_name, session->topic_name_len, data, len, msgType);
+}
+
+uint8_t PLACE(mqttSendTopic) mqttSendTopic(mqtt_session_t *session, const uint8_t *topic, uint32_t topic_len, uint8_t *data, uint32_t len, mqtt_message_type msgType) {
+    return mqttSendFlags(session, topic, topic_len, data, len, msgType, 0, 0);
+}
+
+uint8_t PLACE(mqttPublish) mqttPublish(mqtt_session_t *session, const uint8_t *topic, uint32_t topic_len, uint8_t *data, uint32_t len, uint8_t flags) {
+    return mqttSendFlags(session, topic, topic_len, data, len, MQTT_MSG_TYPE_PUBLISH, flags & MQTT_PUBLISH_RETAIN, 0);
+}
+
+uint8_t PLACE(mqttPublishQos1) mqttPublishQos1(mqtt_session_t *session, const uint8_t *topic, uint32_t topic_len, uint8_t *data, uint32_t len, uint8_t flags, uint16_t packetId) {
+    flags = (flags & (MQTT_PUBLISH_RETAIN | MQTT_PUBLISH_DUP)) | MQTT_PUBLISH_QOS1;
+    return mqttSendFlags(session, topic, topic_len, data, len, MQTT_MSG_TYPE_PUBLISH, flags, packetId);
+}
+
+uint16_t PLACE(mqttNextPacketId) mqttNextPacketId(mqtt_session_t *session) {
+    // packet ID must be non-zero, MQTT spec section 2.3.1
+    if(++session->packetId == 0) session->packetId = 1;
+    return session->packetId;
+}
+
+// flash only allows aligned 32 bit reads, so the precompiled packets are copied out a word at a time
+static void PLACE(mqttFlashCopy) mqttFlashCopy(uint8_t *dst, const uint8_t *src, uint32_t len) {
+    const uint32_t *word = (const uint32_t *)src;
+    uint32_t i, w;
+    for(i = 0; i < len; i += 4) {
+        w = *word++;
+        os_memcpy(dst + i, &w, (len - i < 4) ? len - i : 4);
+    }
+}
+
+// Sends from the build-time packets in session->precompiled, returns 0 if
+// this packet has no template and has to be encoded; *res is what the send gave
+static uint8_t PLACE(mqttSendPrecompiled) mqttSendPrecompiled(mqtt_session_t *session, const uint8_t *topic, uint8_t *data, uint32_t len, mqtt_message_type msgType, uint8_t flags, sint8 *res) {
+    const mqtt_precompiled_t *pre = session->precompiled;
+    uint8_t packet[MQTT_PRECOMPILED_BUF_LEN];
+    uint32_t length;
+    switch(msgType) {
+        case MQTT_MSG_TYPE_CONNECT:
+            if(pre->connect_len == 0 || pre->connect_len > sizeof(packet)) return 0;
+            mqttFlashCopy(packet, pre->connect, pre->connect_len);
+            length = pre->connect_len;
+            break;
+        case MQTT_MSG_TYPE_SUBSCRIBE:
+            if(topic != session->topic_name || pre->subscribe_len == 0 || pre->subscribe_len > sizeof(packet)) return 0;
+            mqttFlashCopy(packet, pre->subscribe, pre->subscribe_len);
+            mqttNextPacketId(session);
+            packet[2] = (session->packetId >> 8) & 0xFF;
+            packet[3] = session->packetId & 0xFF;
+            length = pre->subscribe_len;
+            break;
+        case MQTT_MSG_TYPE_PUBLISH:
+            // the remaining length has to stay in one byte, and the template has no packet identifier
+            if((flags & MQTT_PUBLISH_QOS1) || topic != session->topic_name || pre->publish_len == 0 || pre->publish_len + len > sizeof(packet) || pre->publish_len - 2 + len > 127) return 0;
+            mqttFlashCopy(packet, pre->publish, pre->publish_len);
+            packet[0] |= flags & MQTT_PUBLISH_RETAIN;
+            packet[1] += len;
+            os_memcpy(packet + pre->publish_len, data, len);
+            length = pre->publish_len + len;
+            break;
+        default:
+            return 0;
+    }
+#ifdef DEBUG
+    os_printf("About to send precompiled MQTT command type: %d...\n", (uint8_t)msgType);
+#endif
+    *res = mqttConnSend(session, packet, length, 0);
+    return 1;
+}
+
+// two byte length then the bytes, MQTT spec section 1.5.3
+static uint32_t PLACE(mqttPutString) mqttPutString(uint8_t *buf, uint32_t offset, const uint8_t *str, uint32_t len) {
+    buf[offset] = (len >> 8) & 0xFF;
+    buf[offset + 1] = len & 0xFF;
+    os_memcpy(buf + offset + 2, str, len);
+    return offset + 2 + len;
+}
+
+uint8_t PLACE(mqttConnectFlags) mqttConnectFlags(const mqtt_session_t *session) {
+    uint8_t flags = 0;
+    if(session->username_len > 0) {
+        flags |= MQTT_CONNECT_USERNAME;
+        // a password is only allowed with a username
+        if(session->password_len > 0) {
+            flags |= MQTT_CONNECT_PASSWORD;
+        }
+    }
+    if(session->will_topic_len > 0) {
+        flags |= MQTT_CONNECT_WILL;
+        if(session->will_retain) {
+            flags |= MQTT_CONNECT_WILL_RETAIN;
+        }
+    }
+    if(!session->persistent) {
+        flags |= MQTT_CONNECT_CLEAN_SESSION;
+    }
+    return flags;
+}
+
+// set up keepalive timer, pinging well inside the keepalive we gave the broker
+static void PLACE(mqttArmKeepAlive) mqttArmKeepAlive(mqtt_session_t *session, mqtt_message_type msgType) {
+    if(msgType != MQTT_MSG_TYPE_DISCONNECT) {
+        uint32_t keepalive = (session->keepalive != 0) ? session->keepalive : MQTT_KEEPALIVE_S;
+        twheel_setfn(&session->keepAliveTimer, (twheel_fn)pingAlive, session);
+        twheel_arm(&session->keepAliveTimer, keepalive * 600, 0);
+    }
+}
+
+// sends a packet built in scratch: packet[0] holds the first byte, and the body
+// of rest bytes starts MQTT_FIXED_HEADER_MAX on
+static sint8 PLACE(mqttSendBuilt) mqttSendBuilt(mqtt_session_t *session, uint8_t *packet, uint32_t rest, mqtt_message_type msgType) {
+    uint8_t remaining[4];
+    uint8_t remaining_len;
+    uint8_t *start;
+    sint8 res;
+    // the remaining length is the size of the packet, minus the first byte and the bytes taken by the remaining length bytes themselves
+    // they are encoded per the MQTT spec, section 2.2.3, in 1 to 4 bytes
+    remaining_len = encodeLength(rest, remaining);
+    start = packet + MQTT_FIXED_HEADER_MAX - 1 - remaining_len;
+    start[0] = packet[0];
+    os_memcpy(start + 1, remaining, remaining_len);
+#ifdef DEBUG
+    os_printf("About to send MQTT command type: %d, %d bytes...\n", (uint8_t)msgType, 1 + remaining_len + rest);
+#endif
+    // QoS 1 publishes are the alarms, which go ahead of routine telemetry
+    res = mqttConnSend(session, start, 1 + remaining_len + rest,
+                       msgType == MQTT_MSG_TYPE_PUBLISH && (packet[0] & MQTT_PUBLISH_QOS1));
+    mqttArmKeepAlive(session, msgType);
+    return res;
+}
+
+static uint8_t PLACE(mqttSendFlags) mqttSendFlags(mqtt_session_t *session, const uint8_t *topic, uint32_t topic_len, uint8_t *data, uint32_t len, mqtt_message_type msgType, uint8_t flags, uint16_t packetId) {
     if(session->validConnection == 1) {
-        os_timer_disarm(&MQTT_KeepAliveTimer); // disable timer if we are called
+        twheel_disarm(&session->keepAliveTimer); // disable timer if we are called
 #ifdef DEBUG
         os_printf("Entering mqttSend!\n");
 #endif
-        LOCAL mqtt_packet_t packet;
-        LOCAL mqtt_packet_t *pPacket = &packet;
-        uint8_t *fullPacket;
-        uint8_t *remaining_len_encoded;
+        sint8 res;
+        if(session->precompiled != NULL && mqttSendPrecompiled(session, topic, data, len, msgType, flags, &res)) {
+            mqttArmKeepAlive(session, msgType);
+            return (res == ESPCONN_OK) ? 0 : -1;
+        }
+        // the packet is built in one scratch buffer: the body from MQTT_FIXED_HEADER_MAX on, then the
+        // fixed header written just in front of it once the remaining length is known
+        uint32_t mark = scratch_mark();
+        uint8_t *packet, *body;
+        uint32_t rest;
         switch(msgType) {
             case MQTT_MSG_TYPE_CONNECT: {
-                const uint8_t varDefaults[10] = { 0x00, 0x04, 0x4D, 0x51, 0x54, 0x54, 0x04, 0xC2, 0x00, 0x32 }; // variable header is always the same for Connect
-                pPacket->fixedHeader = (uint8_t *)os_zalloc(sizeof(uint8_t) * 5); // fixed header cannot be longer than 5
-                pPacket->fixedHeader[0] = ((uint8_t)msgType << 4) & 0xF0; // make sure lower 4 are clear
-                // prepare variable header
-                pPacket->varHeader = (uint8_t *)os_zalloc(sizeof(uint8_t) * 10); // 10 bytes for connect
-                os_memcpy(pPacket->varHeader, varDefaults, 10); // copy defaults
-                pPacket->varHeader_len = 10;
-                // prepare payload
-                uint32_t offset = 0; // keep track of how many bytes we have copied
-                uint32_t maxPayloadLength = session->client_id_len + session->username_len + session->password_len + 12; // length info can only take a maximum of 12 bytes
-                pPacket->payload = (uint8_t *)os_zalloc(sizeof(uint8_t) * maxPayloadLength);
-                // copy client id to payload: 2 bytes for size, then client id.
-                // insert a 0
-                os_memset(pPacket->payload + offset, 0, 1); // MSB is always 0
-                offset += 1;
-                os_memcpy(pPacket->payload + offset, &session->client_id_len, 1); // LSB is length of string
-                offset += 1;
-                os_memcpy(pPacket->payload + offset, session->client_id, session->client_id_len); // and copy string
-                offset += session->client_id_len;
-                // copy username to payload: same as client id, 2 bytes for size, then username
-                // insert a 0
-                os_memset(pPacket->payload + offset, 0, 1);
-                offset += 1;
-                os_memcpy(pPacket->payload + offset, &session->username_len, 1);
-                offset += 1;
-                os_memcpy(pPacket->payload + offset, session->username, session->username_len);
-                offset += session->username_len;
-                // Password: same as username and client id, 2 bytes for size, then password
-                // insert a 0
-                os_memset(pPacket->payload + offset, 0, 1);
-                offset += 1;
-                os_memcpy(pPacket->payload + offset, &session->password_len, 1);
-                offset += 1;
-                os_memcpy(pPacket->payload + offset, session->password, session->password_len);
-                offset += session->password_len;
-                pPacket->payload_len = offset; // the length of the payload is the same as our offset
-#ifdef DEBUG
-                os_printf("Total offset: %d\n", offset);
-#endif
-                // the remaining length is the size of the packet, minus the first byte and the bytes taken by the remaining length bytes themselves
-                // they are encoded per the MQTT spec, section 2.2.3
-                // the first byte returned by encodeLength is the number of bytes to follow, as it can be anywhere from 1 to 4 bytes to encode the length
-                remaining_len_encoded = encodeLength((uint32_t)(pPacket->varHeader_len + pPacket->payload_len));
-                os_memcpy(pPacket->fixedHeader + 1, remaining_len_encoded + 1, remaining_len_encoded[0]);
-                pPacket->fixedHeader_len = remaining_len_encoded[0] + 1; // fixed header length is the number of bytes used to encode the remaining length, plus 1 for the fixed CONNECT byte
-                // the full length is the length of the varHeader, payload, and fixedHeader
-                pPacket->length = (pPacket->varHeader_len + pPacket->payload_len + pPacket->fixedHeader_len);
+                const uint8_t varDefaults[10] = { 0x00, 0x04, 0x4D, 0x51, 0x54, 0x54, 0x04, 0x00, 0x00, 0x32 }; // protocol name and level, flags and keepalive are filled in
+                // variable header, then the payload: client id, will topic and message, username, password,
+                // each with a two byte length, the last four only when their flag is set
+                uint32_t maxPayloadLength = session->client_id_len + session->will_topic_len + session->will_message_len + session->username_len + session->password_len + 10;
+                packet = (uint8_t *)scratch_alloc(MQTT_FIXED_HEADER_MAX + 10 + maxPayloadLength);
+                if(packet == NULL) {
+                    break;
+                }
+                body = packet + MQTT_FIXED_HEADER_MAX;
+                os_memcpy(body, varDefaults, 10); // copy defaults
+                body[7] = mqttConnectFlags(session);
+                if(session->keepalive != 0) {
+                    body[8] = (session->keepalive >> 8) & 0xFF;
+                    body[9] = session->keepalive & 0xFF;
+                }
+                rest = mqttPutString(body, 10, session->client_id, session->client_id_len);
+                if(body[7] & MQTT_CONNECT_WILL) {
+                    rest = mqttPutString(body, rest, session->will_topic, session->will_topic_len);
+                    rest = mqttPutString(body, rest, session->will_message, session->will_message_len);
+                }
+                if(body[7] & MQTT_CONNECT_USERNAME) {
+                    rest = mqttPutString(body, rest, session->username, session->username_len);
+                }
+                if(body[7] & MQTT_CONNECT_PASSWORD) {
+                    rest = mqttPutString(body, rest, session->password, session->password_len);
+                }
 #ifdef DEBUG
-                os_printf("Packet length: %d\n", pPacket->length);
+                os_printf("Total offset: %d\n", rest);
 #endif
-                // construct packet data
-                fullPacket = (uint8_t *)os_zalloc(sizeof(uint8_t) * pPacket->length);
-                os_memcpy(fullPacket, pPacket->fixedHeader, pPacket->fixedHeader_len);
-                os_memcpy(fullPacket + pPacket->fixedHeader_len, pPacket->varHeader, pPacket->varHeader_len);
-                os_memcpy(fullPacket + pPacket->fixedHeader_len + pPacket->varHeader_len, pPacket->payload, pPacket->payload_len);
+                packet[0] = ((uint8_t)msgType << 4) & 0xF0; // make sure lower 4 are clear
                 break;
             }
             case MQTT_MSG_TYPE_PUBLISH: {
-                // prepare for publish
-                pPacket->fixedHeader = (uint8_t *)os_zalloc(sizeof(uint8_t) * 5);
-                pPacket->fixedHeader[0] = (MQTT_MSG_TYPE_PUBLISH << 4) & 0xF0; // clear lower 4 bits, we don't need DUP, QOS or RETAIN
-
-                // variable header
                 // A PUBLISH Packet MUST NOT contain a Packet Identifier if its QoS value is set to 0 [MQTT-2.3.1-5].
-                pPacket->varHeader_len = session->topic_name_len + 2; // we have no packet identifier, as we are QOS 0
-                pPacket->varHeader = (uint8_t *)os_zalloc(sizeof(uint8_t) * pPacket->varHeader_len);
-                os_memset(pPacket->varHeader, 0, 1);
-                os_memcpy(pPacket->varHeader + 1, &session->topic_name_len, 1);
-                os_memcpy(pPacket->varHeader + 2, session->topic_name, session->topic_name_len);
-
-                //payload
-                pPacket->payload_len = len;
-                pPacket->payload = (uint8_t *)os_zalloc(sizeof(uint8_t) * pPacket->payload_len);
-                os_memcpy(pPacket->payload, data, pPacket->payload_len);
-                // calculate remaining length for fixed header
-                remaining_len_encoded = encodeLength((uint32_t)(pPacket->varHeader_len + pPacket->payload_len));
-                os_memcpy(pPacket->fixedHeader + 1, remaining_len_encoded + 1, remaining_len_encoded[0]);
-                pPacket->fixedHeader_len = remaining_len_encoded[0] + 1; // fixed header length is the number of bytes used to encode the remaining length, plus 1 for the fixed CONNECT byte
-                // the full length is the length of the varHeader, payload, and fixedHeader
-                pPacket->length = (pPacket->varHeader_len + pPacket->payload_len + pPacket->fixedHeader_len);
-                os_printf("Packet length: %d\n", pPacket->length);
-                // construct packet data
-                fullPacket = (uint8_t *)os_zalloc(sizeof(uint8_t) * pPacket->length);
-                os_memcpy(fullPacket, pPacket->fixedHeader, pPacket->fixedHeader_len);
-                os_memcpy(fullPacket + pPacket->fixedHeader_len, pPacket->varHeader, pPacket->varHeader_len);
-                os_memcpy(fullPacket + pPacket->fixedHeader_len + pPacket->varHeader_len, pPacket->payload, pPacket->payload_len);
+                uint32_t idLen = (flags & MQTT_PUBLISH_QOS1) ? 2 : 0;
+                rest = topic_len + 2 + idLen + len;
+                packet = (uint8_t *)scratch_alloc(MQTT_FIXED_HEADER_MAX + rest);
+                if(packet == NULL) {
+                    break;
+                }
+                body = packet + MQTT_FIXED_HEADER_MAX;
+                body[0] = (topic_len >> 8) & 0xFF;
+                body[1] = topic_len & 0xFF;
+                os_memcpy(body + 2, topic, topic_len);
+                if(idLen > 0) {
+                    body[2 + topic_len] = (packetId >> 8) & 0xFF;
+                    body[3 + topic_len] = packetId & 0xFF;
+                }
+                os_memcpy(body + 2 + topic_len + idLen, data, len);
+                packet[0] = ((MQTT_MSG_TYPE_PUBLISH << 4) & 0xF0) | (flags & (MQTT_PUBLISH_RETAIN | MQTT_PUBLISH_QOS1 | MQTT_PUBLISH_DUP));
                 break;
             }
             case MQTT_MSG_TYPE_SUBSCRIBE:
             case MQTT_MSG_TYPE_UNSUBSCRIBE:
-                // prepare for subscribe
-                pPacket->fixedHeader = (uint8_t *)os_zalloc(sizeof(uint8_t) * 5);
-                pPacket->fixedHeader[0] = ((msgType << 4) & 0xF0) | 0x02;
-
-                pPacket->varHeader_len = 2;
-                pPacket->varHeader = (uint8_t *)os_zalloc(sizeof(uint8_t) * pPacket->varHeader_len);
-                os_memset(pPacket->varHeader, 0, 2); // set packet ID to 0
-
-                uint8_t extraByte = (msgType == MQTT_MSG_TYPE_SUBSCRIBE) ? 3 : 2;
-                pPacket->payload_len = session->topic_name_len + extraByte;
-                pPacket->payload = (uint8_t *)os_zalloc(sizeof(uint8_t) * pPacket->payload_len);
-                pPacket->payload[1] = session->topic_name_len % 0xFF;
-                pPacket->payload[0] = session->topic_name_len / 0xFF;
-                os_memcpy(pPacket->payload + 2, session->topic_name, session->topic_name_len); // copy topic name
-                if(msgType == MQTT_MSG_TYPE_SUBSCRIBE) pPacket->payload[session->topic_name_len+2] = 0;
-
-                // calculate remaining length for fixed header
-                remaining_len_encoded = encodeLength((uint32_t)(pPacket->varHeader_len + pPacket->payload_len));
-                os_memcpy(pPacket->fixedHeader + 1, remaining_len_encoded + 1, remaining_len_encoded[0]);
-                pPacket->fixedHeader_len = remaining_len_encoded[0] + 1; // fixed header length is the number of bytes used to encode the remaining length, plus 1 for the fixed CONNECT byte
-                // the full length is the length of the varHeader, payload, and fixedHeader
-                pPacket->length = (pPacket->varHeader_len + pPacket->payload_len + pPacket->fixedHeader_len);
-                os_printf("Packet length: %d\n", pPacket->length);
-                // construct packet data
-                fullPacket = (uint8_t *)os_zalloc(sizeof(uint8_t) * pPacket->length);
-                os_memcpy(fullPacket, pPacket->fixedHeader, pPacket->fixedHeader_len);
-                os_memcpy(fullPacket + pPacket->fixedHeader_len, pPacket->varHeader, pPacket->varHeader_len);
-                os_memcpy(fullPacket + pPacket->fixedHeader_len + pPacket->varHeader_len, pPacket->payload, pPacket->payload_len);
-
+                // packet ID, then the topic filter, and for SUBSCRIBE the requested QoS
+                rest = 2 + 2 + topic_len + ((msgType == MQTT_MSG_TYPE_SUBSCRIBE) ? 1 : 0);
+                packet = (uint8_t *)scratch_alloc(MQTT_FIXED_HEADER_MAX + rest);
+                if(packet == NULL) {
+                    break;
+                }
+                body = packet + MQTT_FIXED_HEADER_MAX;
+                mqttNextPacketId(session);
+                body[0] = (session->packetId >> 8) & 0xFF;
+                body[1] = session->packetId & 0xFF;
+                body[2] = (topic_len >> 8) & 0xFF;
+                body[3] = topic_len & 0xFF;
+                os_memcpy(body + 4, topic, topic_len); // copy topic name, the QoS byte after it is already 0
+                packet[0] = ((msgType << 4) & 0xF0) | 0x02;
                 break;
             case MQTT_MSG_TYPE_PINGREQ:
             case MQTT_MSG_TYPE_DISCONNECT:
                 // PINGREQ has no varHeader or payload, it's just two bytes
                 // 0xC0 0x00
-                pPacket->fixedHeader = (uint8_t *)os_zalloc(sizeof(uint8_t) * 2);
-                pPacket->fixedHeader[0] = (msgType << 4) & 0xF0; // bottom nibble must be clear
-                pPacket->fixedHeader[1] = 0; // remaining length is zero
-                pPacket->fixedHeader_len = 2;
-                pPacket->length = pPacket->fixedHeader_len;
-                // In order to avoid undefined behaviour, we must allocate
-                // something to varHeader and payload, as they get passed
-                // to free() at the end of this function
-                pPacket->varHeader = (uint8_t *)os_zalloc(1);
-                pPacket->payload = (uint8_t *)os_zalloc(1);
-                // copy the fixedHeader to fullPacket, and we're done!
-                fullPacket = (uint8_t *)os_zalloc(sizeof(uint8_t) * pPacket->length);
-                os_memcpy(fullPacket, pPacket->fixedHeader, pPacket->fixedHeader_len);
+                rest = 0;
+                packet = (uint8_t *)scratch_alloc(MQTT_FIXED_HEADER_MAX);
+                if(packet == NULL) {
+                    break;
+                }
+                packet[0] = (msgType << 4) & 0xF0; // bottom nibble must be clear
                 break;
             default:
                 // something has gone wrong
                 os_printf("Attempt to send incorrect packet type: %d", (uint8_t)msgType);
+                scratch_release(mark);
                 return -1;
         }
-#ifdef DEBUG
-        os_printf("About to send MQTT command type: %d...\n", (uint8_t)msgType);
-#endif
-        espconn_send(session->activeConnection, fullPacket, pPacket->length);
-        os_free(fullPacket);
-        os_free(pPacket->fixedHeader);
-        os_free(pPacket->varHeader);
-        os_free(pPacket->payload);
-        // set up keepalive timer
-        if(msgType != MQTT_MSG_TYPE_DISCONNECT) {
-            os_timer_setfn(&MQTT_KeepAliveTimer, (os_timer_func_t *)pingAlive, session);
-            os_timer_arm(&MQTT_KeepAliveTimer, 30000, 0);
+        if(packet == NULL) {
+            os_printf("No scratch memory for MQTT packet type %d\n", (uint8_t)msgType);
+            scratch_release(mark);
+            return -1;
         }
-    } else {
-        os_printf("No wifi! Narf!\n");
+        res = mqttSendBuilt(session, packet, rest, msgType);
+        scratch_release(mark);
+        return (res == ESPCONN_OK) ? 0 : -1;
     }
-    return 0;
+    os_printf("No wifi! Narf!\n");
+    return -1;
+}
+
+uint8_t * PLACE(mqttPublishBegin) mqttPublishBegin(mqtt_session_t *session, mqtt_publish_buf_t *pub, const uint8_t *topic, uint32_t topic_len, uint32_t room) {
+    pub->packet = NULL;
+    if(session->validConnection != 1) {
+        return NULL;
+    }
+    pub->mark = scratch_mark();
+    pub->packet = (uint8_t *)scratch_alloc(MQTT_FIXED_HEADER_MAX + 2 + topic_len + room);
+    if(pub->packet == NULL) {
+        os_printf("No scratch memory for MQTT packet type %d\n", MQTT_MSG_TYPE_PUBLISH);
+        scratch_release(pub->mark);
+        return NULL;
+    }
+    pub->head = mqttPutString(pub->packet + MQTT_FIXED_HEADER_MAX, 0, topic, topic_len);
+    pub->room = room;
+    return pub->packet + MQTT_FIXED_HEADER_MAX + pub->head;
+}
+
+uint8_t PLACE(mqttPublishEnd) mqttPublishEnd(mqtt_session_t *session, mqtt_publish_buf_t *pub, uint32_t len, uint8_t flags) {
+    uint8_t sent = 0;
+    if(pub->packet == NULL) {
+        return -1;
+    }
+    // the session may have gone while the payload was written
+    if(len > 0 && len <= pub->room && session->validConnection == 1) {
+        twheel_disarm(&session->keepAliveTimer);
+        pub->packet[0] = ((MQTT_MSG_TYPE_PUBLISH << 4) & 0xF0) | (flags & MQTT_PUBLISH_RETAIN);
+        sent = (mqttSendBuilt(session, pub->packet, pub->head + len, MQTT_MSG_TYPE_PUBLISH) == ESPCONN_OK);
+    }
+    scratch_release(pub->mark);
+    pub->packet = NULL;
+    return sent ? 0 : -1;
 }
@@ -14,13 +14,39 @@
  * @brief This is the main header file for all MQTT/TCP related functions.
  */
 
+#ifndef MQTT_H
+#define MQTT_H
+
 #include "user_interface.h"
 #include "ets_sys.h"
 #include "osapi.h"
 #include "espconn.h"
 #include "os_type.h"
+#include "placement.h"
+#include "twheel.h"
 
+#ifndef BENCH // the bench image times the code, not its debug output
 #define DEBUG 1 /**< This define enables or disables serial debug output in most places */
+#endif
+#define MQTT_PUBLISH_RETAIN 0x01 /**< Flag for mqttPublish(): the broker keeps the message for later subscribers */
+#define MQTT_PUBLISH_QOS1 0x02 /**< QoS 1 in the PUBLISH fixed header, set by mqttPublishQos1() */
+#define MQTT_PUBLISH_DUP 0x08 /**< Flag for mqttPublishQos1(): a resend, which the broker may have had already */
+#define MQTT_CONNECT_USERNAME 0x80 /**< CONNECT flags, MQTT spec section 3.1.2.3 */
+#define MQTT_CONNECT_PASSWORD 0x40
+#define MQTT_CONNECT_WILL_RETAIN 0x20
+#define MQTT_CONNECT_WILL 0x04
+#define MQTT_CONNECT_CLEAN_SESSION 0x02
+#define MQTT_RX_BUF_LEN 1280 /**< Size of the receive reassembly buffer, the largest packet we can accept */
+#define MQTT_KEEPALIVE_S 50 /**< Keepalive sent in CONNECT when the session does not set one */
+#define MQTT_CONNECT_TIMEOUT_MS 5000 /**< Time for the TCP connection and CONNACK before the broker is given up on */
+#define MQTT_TLS_CONNECT_TIMEOUT_MS 15000 /**< The same with a TLS handshake in between */
+#define MQTT_TLS_PORT 8883 /**< Usual broker port for MQTT over TLS */
+#define MQTT_TLS_BUF_LEN 4096 /**< TLS record buffer; must hold the broker's certificate record, 8192 for chains with intermediates */
+#define MQTT_TLS_HEAP_SAMPLE_MS 10 /**< How often free heap is sampled during a handshake */
+#define MQTT_PRECOMPILED_BUF_LEN 192 /**< Largest packet sent from a precompiled template, longer ones are encoded at runtime */
+#define MQTT_FIXED_HEADER_MAX 5 /**< The type byte and up to four bytes of remaining length */
+#define MQTT_TX_QUEUE_LEN 2048 /**< Send queue main.c gives its session: what goes out back to back after CONNACK, the discovery configs the most of it */
+#define MQTT_TX_URGENT_ROOM 384 /**< Bytes at the end of a send queue kept for QoS 1 publishes, outq.c's OUTQ_ALARMS alarms on a 32 byte topic */
 
 /**
  * @typedef
@@ -46,21 +72,50 @@ typedef enum mqtt_message_enum {
 } mqtt_message_type;
 
 /**
- * @struct mqtt_packet_t
- * A structure which contains all the information for an MQTT packet.
+ * @struct mqtt_tls_stats_t
+ * What TLS handshakes have cost on this session, kept across reconnects.
+ */
+typedef struct {
+    uint32_t handshakes; /**< Number of completed handshakes */
+    uint32_t lastMs; /**< Duration of the last handshake in milliseconds */
+    uint32_t maxMs; /**< Longest handshake in milliseconds */
+    uint32_t heapPeak; /**< Most heap a TLS connection has taken, from just before the handshake */
+} mqtt_tls_stats_t;
+
+/**
+ * @struct mqtt_tx_stats_t
+ * How the send queue has done on this session, kept across reconnects.
+ */
+typedef struct {
+    uint32_t queuedPeak; /**< Most bytes waiting in txQueue at once */
+    uint32_t refused; /**< Packets there was no room for, or that the SDK would not take */
+} mqtt_tx_stats_t;
+
+/**
+ * @struct mqtt_precompiled_t
+ * Packets serialized at build time by mkpackets.py, see packets.h.
  *
- * This structure contains pointers to the three main parts of an MQTT packet: the fixed header, the variable header, and the payload. Not all message types contain a variable header or payload, but *all* message types have a fixed header.
+ * They hold the client ID, credentials and keepalive from user_config.h, and the SUBSCRIBE and PUBLISH templates are for the session topic_name, so the session must be set up from the same defines. The arrays are in flash, which can only be read a word at a time, so they are word aligned and padded.
  */
 typedef struct {
-    uint8_t *fixedHeader; /**< The pointer to the fixed header bytes */
-    uint32_t fixedHeader_len; /**< The length of the fixed header */
-    uint8_t *varHeader; /**< The pointer to the variable header bytes */
-    uint32_t varHeader_len; /**< The length of the variable header */
-    uint8_t *payload; /**< The pointer to the payload bytes */
-    uint32_t payload_len; /**< The length of the payload */
-    uint32_t length; /**< The full length of the packet */
-    mqtt_message_type msgType; /**< What message type this packet contains */
-} mqtt_packet_t;
+    const uint8_t *connect; /**< The whole CONNECT packet */
+    uint32_t connect_len; /**< Its length */
+    const uint8_t *subscribe; /**< SUBSCRIBE to the session topic, the packet identifier in bytes 2 and 3 is filled in when sent */
+    uint32_t subscribe_len; /**< Its length */
+    const uint8_t *publish; /**< PUBLISH fixed and variable header for the session topic, with the one remaining length byte counting no payload */
+    uint32_t publish_len; /**< Its length, 0 if the topic is too long for a one byte remaining length */
+} mqtt_precompiled_t;
+
+/**
+ * @struct mqtt_publish_buf_t
+ * A PUBLISH being written in place, from mqttPublishBegin() to mqttPublishEnd().
+ */
+typedef struct {
+    uint8_t *packet; /**< In scratch, with room for the fixed header in front; NULL if there is nothing to end */
+    uint32_t mark; /**< The scratch mark to release back to */
+    uint32_t head; /**< Bytes of variable header: the topic and its length */
+    uint32_t room; /**< Bytes of payload there is room for */
+} mqtt_publish_buf_t;
 
 /**
  * @struct mqtt_session_t
@@ -82,9 +137,45 @@ typedef struct {
     char validConnection; /**< Boolean value which indicates whether or not the TCP connection is established, set in tcpConnect() */
     struct espconn *activeConnection; /**< A pointer to the espconn structure containing details of the TCP connection */
     void *userData; /**< Used to pass data to the PUBLISH function */
+    uint16_t packetId; /**< The last packet identifier used, for SUBSCRIBE and UNSUBSCRIBE */
+    uint8_t rxBuf[MQTT_RX_BUF_LEN]; /**< Holds received bytes until a whole packet has arrived */
+    uint32_t rxLen; /**< Number of bytes waiting in rxBuf */
+    uint32_t rxSkip; /**< Bytes still to come of a packet too large for rxBuf, which are dropped */
+    uint16_t keepalive; /**< Keepalive in seconds sent in CONNECT, 0 for MQTT_KEEPALIVE_S */
+    uint8_t connackCode; /**< Return code of the last CONNACK, 0 if the broker accepted us */
+    uint8_t persistent; /**< 1 to connect without clean session, so the broker keeps our subscriptions for client_id between connections */
+    uint8_t sessionPresent; /**< The last CONNACK said the broker still had our session, so there is no need to subscribe again */
+    const uint8_t *will_topic; /**< Where the broker publishes will_message if we vanish without DISCONNECT, or NULL for no will */
+    uint32_t will_topic_len;
+    const uint8_t *will_message; /**< The last will, published at QoS 0 */
+    uint32_t will_message_len;
+    uint8_t will_retain; /**< 1 to have the broker retain the will */
+    struct espconn conn; /**< The TCP connection, owned by the session so several can be open at once */
+    esp_tcp tcp; /**< TCP parameters of conn */
+    twheel_timer_t keepAliveTimer; /**< Sends PINGREQ when nothing else has been sent for a while */
+    twheel_timer_t waitForWifiTimer; /**< Retries tcpConnect() until the station has an IP */
+    twheel_timer_t replyTimer; /**< Drops the connection when CONNACK or PINGRESP does not come in time */
+    uint8_t secure; /**< Connect with espconn_secure, only honoured when built with MQTT_USE_TLS */
+    uint32_t handshakeStart; /**< system_get_time() when the TLS connection was started */
+    uint32_t heapBefore; /**< Free heap just before the TLS connection was started */
+    uint32_t heapLow; /**< Lowest free heap seen since then */
+    twheel_timer_t heapTimer; /**< Samples free heap while the handshake runs */
+    mqtt_tls_stats_t tlsStats; /**< Handshake time and heap cost */
+    const mqtt_precompiled_t *precompiled; /**< Build-time packets for this session's configuration, or NULL to encode everything at runtime */
+    uint8_t *txQueue; /**< Packets waiting for the sent callback of the one before them, each a two byte length then the bytes; NULL to send straight away, see mqttSetSendQueue() */
+    uint32_t txQueueLen; /**< Size of txQueue */
+    uint32_t txQueued; /**< Bytes waiting in txQueue */
+    uint32_t txUrgent; /**< Of those, the bytes at the front that are QoS 1 publishes, queued ahead of the rest */
+    uint8_t txBusy; /**< The SDK has a packet whose sent callback has not come yet */
+    mqtt_tx_stats_t txStats; /**< Queue high-water mark and refusals */
     // Add pointers to user callback functions
     void (*publish_cb)(void *arg); /**< Pointer to user callback function for publish */
-    void (*connack_cb)(void *arg); /**< Pointer to user callback function for connack */
+    void (*connack_cb)(void *session); /**< Pointer to user callback function for connack, the return code is in connackCode */
+    void (*suback_cb)(void *session); /**< Pointer to user callback function for SUBACK */
+    void (*puback_cb)(void *session, uint16_t packetId); /**< Pointer to user callback function for PUBACK, with the packet identifier of the QoS 1 publish it acknowledges */
+    void (*connected_cb)(void *session); /**< Pointer to user callback function for when the TCP connection is up */
+    void (*disconnect_cb)(void *session); /**< Pointer to user callback function for when the TCP connection is lost or could not be made */
+    void (*message_cb)(void *session, uint8_t *topic, uint32_t topic_len, uint8_t *payload, uint32_t payload_len); /**< Pointer to user callback function for a decoded application message */
 } mqtt_session_t;
 
 /**
@@ -92,18 +183,18 @@ typedef struct {
  * @param arg A pointer to void, so it can be called from a timer or task
  * @return 0 on success
  */
-uint8_t ICACHE_FLASH_ATTR tcpConnect(void *arg);
-void ICACHE_FLASH_ATTR disconnected_callback(void *arg);
-void ICACHE_FLASH_ATTR reconnected_callback(void *arg, sint8 err);
+uint8_t PLACE(tcpConnect) tcpConnect(void *arg);
+void PLACE(disconnected_callback) disconnected_callback(void *arg);
+void PLACE(reconnected_callback) reconnected_callback(void *arg, sint8 err);
 
 /**
  * A callback function which is called when TCP connection is successful.
  * @param *arg A pointer to void, which needs to be cast to espconn *pConn
  * @return Void
  *
- * This function is called once the TCP connection to the server is completed. This allows us to register the callbacks for received and sent data, as well as enable TCP keepalive and set validConnection in mqtt_session_t to 1 to show the connection has been successful.
+ * This function is called once the TCP connection to the server is completed. This allows us to register the callbacks for received and sent data, as well as enable TCP keepalive and set validConnection in mqtt_session_t to 1 to show the connection has been successful. connected_cb is called last, so it can send CONNECT straight away.
  */
-void ICACHE_FLASH_ATTR connected_callback(void *arg);
+void PLACE(connected_callback) connected_callback(void *arg);
 
 /**
  * A callback function that deals with received data.
@@ -112,22 +203,77 @@ void ICACHE_FLASH_ATTR connected_callback(void *arg);
  * @param len The length of *pdata
  * @return Void
  *
- * At this point the function does little more than detect what type of MQTT message is sent, and prints out debug info to the serial port. The next few versions should improve this so the user can register their own callback functions which will be called when the particular message type is receieved.
+ * TCP gives us a byte stream, so packets can be split across or packed into segments. The received bytes are appended to rxBuf in the session and every complete packet is handed to mqttHandlePacket().
+ * A packet larger than MQTT_RX_BUF_LEN is skipped to its end; a remaining length that cannot be decoded closes the connection, as nothing after it can be read.
  */
-void ICACHE_FLASH_ATTR data_recv_callback(void *arg, char *pdata, unsigned short len);
-void ICACHE_FLASH_ATTR data_sent_callback(void *arg);
-void ICACHE_FLASH_ATTR pingAlive(void *arg);
+void PLACE(data_recv_callback) data_recv_callback(void *arg, char *pdata, unsigned short len);
 
 /**
- * A function which takes a uint32_t and returns a pointer to a properly formatted MQTT length.
+ * Acts on one complete MQTT packet from the broker.
+ * @param session a pointer to the active mqtt_session_t
+ * @param packet a pointer to the first byte of the fixed header
+ * @param len the full length of the packet
+ * @param headerLen the length of the fixed header, including the remaining length bytes
+ *
+ * CONNACK is passed to connack_cb. PUBLISH is split into topic and payload and passed to message_cb. PUBACK is passed to puback_cb.
+ */
+void PLACE(mqttHandlePacket) mqttHandlePacket(mqtt_session_t *session, uint8_t *packet, uint32_t len, uint32_t headerLen);
+
+/**
+ * A callback function for when the SDK has sent the last packet it was given.
+ * @param *arg A pointer to void, which needs to be cast to espconn *pConn
+ *
+ * The SDK takes one packet at a time: espconn_send() fails until this has been called for the one before. The next packet waiting in txQueue is handed over from here.
+ */
+void PLACE(data_sent_callback) data_sent_callback(void *arg);
+
+/**
+ * Gives the session somewhere to keep packets sent while the SDK still has
+ * the one before, so several can be sent back to back, such as after
+ * CONNACK. Without one, a packet sent before the sent callback of the last
+ * fails. Packets that do not fit fail too; either way the send returns -1.
+ * QoS 1 publishes, outq.c's alarms, go next after the packet the SDK has
+ * and any QoS 1 publishes queued before them, ahead of everything else,
+ * and only they may take the last MQTT_TX_URGENT_ROOM bytes, so a queue
+ * full of telemetry still has room for them.
+ * The queue is emptied when the connection goes.
+ * @param session a pointer to the mqtt_session_t
+ * @param buf the queue, which must outlive the session
+ * @param len its size, which must hold the longest packet and its two byte length, and MQTT_TX_URGENT_ROOM
+ */
+void PLACE(mqttSetSendQueue) mqttSetSendQueue(mqtt_session_t *session, uint8_t *buf, uint32_t len);
+
+/**
+ * Sends PINGREQ from the keepalive timer.
+ * @param arg A pointer to the mqtt_session_t
+ * The PINGRESP has to arrive within a quarter of the keepalive, so a broker that has gone away is noticed, and disconnect_cb called, before the keepalive runs out.
+ */
+void PLACE(pingAlive) pingAlive(void *arg);
+
+/**
+ * The CONNECT flags byte for the session's options.
+ * @param session a pointer to the mqtt_session_t
+ * @return username and password flags when they are set, will flags when will_topic is, and clean session unless persistent
+ */
+uint8_t PLACE(mqttConnectFlags) mqttConnectFlags(const mqtt_session_t *session);
+
+/**
+ * Encodes a remaining length the way the MQTT spec does, section 2.2.3:
+ * seven bits per byte, low bits first, the top bit set while more follow.
  * @param trueLength the length in bytes
- * @return encoded multi-byte number per MQTT standards. The first byte this pointer
- * returns is the number of bytes to follow.
+ * @param encoded where the bytes go, room for 4
+ * @return the number of bytes written, 1 to 4
+ */
+uint8_t PLACE(encodeLength) encodeLength(uint32_t trueLength, uint8_t *encoded);
 
- * The MQTT standard uses a very strange method of encoding the lengths of the various sections
- * of the packets. This makes it simpler to implement in code.
+/**
+ * The reverse of encodeLength(), for received packets.
+ * @param buf pointer to the first remaining length byte
+ * @param avail the number of bytes available at buf
+ * @param value where the decoded length is written
+ * @return the number of bytes used by the encoding, 0 if more bytes are needed, or -1 if the encoding is malformed
  */
-uint8_t ICACHE_FLASH_ATTR *encodeLength(uint32_t trueLength);
+int8_t PLACE(decodeLength) decodeLength(const uint8_t *buf, uint32_t avail, uint32_t *value);
 
 /**
  * This function handles all the sending of various MQTT messages.
@@ -135,6 +281,80 @@ uint8_t ICACHE_FLASH_ATTR *encodeLength(uint32_t trueLength);
  * @param data a pointer to the data to be published; only applied to MQTT_MSG_TYPE_PUBLISH
  * @param len the length of the above data
  * @param msgType the type of message to be sent, one of the mqtt_message_type
+ * @return -1 if the packet was not handed to the SDK or queued: no connection, no scratch, no room or the SDK refused it; 0 otherwise
+ */
+uint8_t PLACE(mqttSend) mqttSend(mqtt_session_t *session, uint8_t *data, uint32_t len, mqtt_message_type msgType);
+
+/**
+ * Like mqttSend(), but with an explicit topic rather than the session topic.
+ * @param session a pointer to the active mqtt_session_t
+ * @param topic a pointer to the topic name; only applied to PUBLISH, SUBSCRIBE and UNSUBSCRIBE
+ * @param topic_len the length of the topic name
+ * @param data a pointer to the data to be published; only applied to MQTT_MSG_TYPE_PUBLISH
+ * @param len the length of the above data
+ * @param msgType the type of message to be sent, one of the mqtt_message_type
+ * @return -1 in case of error, 0 otherwise
+ */
+uint8_t PLACE(mqttSendTopic) mqttSendTopic(mqtt_session_t *session, const uint8_t *topic, uint32_t topic_len, uint8_t *data, uint32_t len, mqtt_message_type msgType);
+
+/**
+ * Publishes to an explicit topic with PUBLISH flags.
+ * @param session a pointer to the active mqtt_session_t
+ * @param topic a pointer to the topic name
+ * @param topic_len the length of the topic name
+ * @param data a pointer to the data to be published
+ * @param len the length of the above data
+ * @param flags MQTT_PUBLISH_RETAIN or 0
+ * @return -1 in case of error, 0 otherwise
+ */
+uint8_t PLACE(mqttPublish) mqttPublish(mqtt_session_t *session, const uint8_t *topic, uint32_t topic_len, uint8_t *data, uint32_t len, uint8_t flags);
+
+/**
+ * Publishes at QoS 1: the broker answers with a PUBACK carrying packetId,
+ * which is passed to puback_cb. Until then the caller keeps the message, and
+ * sends it again with MQTT_PUBLISH_DUP and the same packetId if the PUBACK
+ * does not come, or after connecting again.
+ * @param session a pointer to the active mqtt_session_t
+ * @param topic a pointer to the topic name
+ * @param topic_len the length of the topic name
+ * @param data a pointer to the data to be published
+ * @param len the length of the above data
+ * @param flags MQTT_PUBLISH_RETAIN and MQTT_PUBLISH_DUP, or 0
+ * @param packetId from mqttNextPacketId()
  * @return -1 in case of error, 0 otherwise
  */
-uint8_t ICACHE_FLASH_ATTR mqttSend(mqtt_session_t *session, uint8_t *data, uint32_t len, mqtt_message_type msgType);
+uint8_t PLACE(mqttPublishQos1) mqttPublishQos1(mqtt_session_t *session, const uint8_t *topic, uint32_t topic_len, uint8_t *data, uint32_t len, uint8_t flags, uint16_t packetId);
+
+/**
+ * Starts a QoS 0 PUBLISH whose payload is written straight into the packet,
+ * rather than formatted somewhere else and copied in. The packet is taken
+ * from scratch, so nothing else may use scratch until mqttPublishEnd().
+ * @param session a pointer to the active mqtt_session_t
+ * @param pub keeps the packet until mqttPublishEnd()
+ * @param topic a pointer to the topic name
+ * @param topic_len the length of the topic name
+ * @param room the longest payload that will be written
+ * @return where to write the payload, NULL without a connection or scratch
+ */
+uint8_t * PLACE(mqttPublishBegin) mqttPublishBegin(mqtt_session_t *session, mqtt_publish_buf_t *pub, const uint8_t *topic, uint32_t topic_len, uint32_t room);
+
+/**
+ * Sends the PUBLISH mqttPublishBegin() started, and gives its scratch back.
+ * A len of 0 sends nothing, so a payload that did not fit is dropped rather
+ * than sent empty, which would clear a retained topic.
+ * @param session a pointer to the active mqtt_session_t
+ * @param pub from mqttPublishBegin()
+ * @param len the length of the payload written, at most the room asked for
+ * @param flags MQTT_PUBLISH_RETAIN or 0
+ * @return -1 if nothing was sent or queued, 0 otherwise
+ */
+uint8_t PLACE(mqttPublishEnd) mqttPublishEnd(mqtt_session_t *session, mqtt_publish_buf_t *pub, uint32_t len, uint8_t flags);
+
+/**
+ * The next packet identifier, for SUBSCRIBE, UNSUBSCRIBE and QoS 1 PUBLISH.
+ * @param session a pointer to the mqtt_session_t
+ * @return a non-zero identifier, MQTT spec section 2.3.1
+ */
+uint16_t PLACE(mqttNextPacketId) mqttNextPacketId(mqtt_session_t *session);
+
+#endif
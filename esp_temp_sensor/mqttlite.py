@@ -0,0 +1,106 @@
+#!/usr/bin/env python3
+##
+# @file
+# @brief Minimal MQTT 3.1.1 client for the host side tools
+#
+# Just enough of the protocol to publish firmware and read replies from a
+# broker without pulling in a client library: CONNECT, PUBLISH, SUBSCRIBE,
+# PINGREQ and DISCONNECT, QoS 0 only.
+
+import socket
+import struct
+
+
+def encode_length(n):
+    """Remaining length encoding, MQTT spec section 2.2.3"""
+    out = bytearray()
+    while True:
+        byte = n % 128
+        n //= 128
+        if n > 0:
+            byte |= 128
+        out.append(byte)
+        if n == 0:
+            return bytes(out)
+
+
+def encode_string(s):
+    if isinstance(s, str):
+        s = s.encode()
+    return struct.pack(">H", len(s)) + s
+
+
+class Client:
+    def __init__(self, host, port=1883, client_id="herps-host", username=None, password=None, keepalive=60):
+        self.sock = socket.create_connection((host, port))
+        self.rx = b""
+        self.packet_id = 0
+        flags = 0x02  # clean session
+        payload = encode_string(client_id)
+        if username is not None:
+            flags |= 0x80
+            payload += encode_string(username)
+        if password is not None:
+            flags |= 0x40
+            payload += encode_string(password)
+        var = encode_string("MQTT") + bytes([4, flags]) + struct.pack(">H", keepalive)
+        self._send(0x10, var + payload)
+        ptype, body = self.read_packet()
+        if ptype != 2 or body[1] != 0:
+            raise ConnectionError("CONNECT refused: {0}".format(body.hex()))
+
+    def _send(self, first, body):
+        self.sock.sendall(bytes([first]) + encode_length(len(body)) + body)
+
+    def publish(self, topic, payload, retain=False):
+        if isinstance(payload, str):
+            payload = payload.encode()
+        self._send(0x30 | (0x01 if retain else 0), encode_string(topic) + payload)
+
+    def subscribe(self, topic):
+        self.packet_id = (self.packet_id % 0xFFFF) + 1
+        self._send(0x82, struct.pack(">H", self.packet_id) + encode_string(topic) + b"\x00")
+
+    def ping(self):
+        self._send(0xC0, b"")
+
+    def disconnect(self):
+        self._send(0xE0, b"")
+        self.sock.close()
+
+    def read_packet(self, timeout=None):
+        """Returns (packet type, body) for the next packet, or None on timeout"""
+        self.sock.settimeout(timeout)
+        while True:
+            if len(self.rx) >= 2:
+                length, mult, i = 0, 1, 1
+                while i < len(self.rx):
+                    length += (self.rx[i] & 127) * mult
+                    mult *= 128
+                    if not self.rx[i] & 128:
+                        break
+                    i += 1
+                else:
+                    i = None
+                if i is not None and len(self.rx) >= i + 1 + length:
+                    first, body = self.rx[0], self.rx[i + 1:i + 1 + length]
+                    self.rx = self.rx[i + 1 + length:]
+                    return first >> 4, body
+            try:
+                data = self.sock.recv(4096)
+            except socket.timeout:
+                return None
+            if not data:
+                raise ConnectionError("broker closed the connection")
+            self.rx += data
+
+    def read_message(self, timeout=None):
+        """Returns (topic, payload) for the next PUBLISH, or None on timeout"""
+        while True:
+            packet = self.read_packet(timeout)
+            if packet is None:
+                return None
+            ptype, body = packet
+            if ptype == 3:
+                tlen = struct.unpack(">H", body[:2])[0]
+                return body[2:2 + tlen].decode(), body[2 + tlen:]
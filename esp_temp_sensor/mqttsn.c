@@ -0,0 +1,297 @@
+#include "ets_sys.h"
+#include "osapi.h"
+#include "os_type.h"
+#include "user_interface.h"
+#include "espconn.h"
+#include "mqttsn.h"
+#include "power.h"
+
+#define FLAG_QOS_1 0x20
+#define FLAG_CLEAN_SESSION 0x04
+#define FLAG_TOPIC_PREDEFINED 0x01
+#define PROTOCOL_ID 0x01
+#define RC_NOT_SUPPORTED 0x03
+
+static void ICACHE_FLASH_ATTR put_be16(uint8_t *p, uint16_t v) {
+    p[0] = v >> 8;
+    p[1] = v;
+}
+
+static uint16_t ICACHE_FLASH_ATTR get_be16(const uint8_t *p) {
+    return ((uint16_t)p[0] << 8) | p[1];
+}
+
+static uint16_t ICACHE_FLASH_ATTR next_msg_id(mqttsn_session_t *s) {
+    if (++s->msgId == 0) {
+        s->msgId = 1;
+    }
+    return s->msgId;
+}
+
+// keepalive while active: the gateway resets its timer on anything we send
+static void ICACHE_FLASH_ATTR arm_ping(mqttsn_session_t *s) {
+    if (s->state == MQTTSN_ACTIVE && s->duration != 0) {
+        twheel_arm(&s->pingTimer, s->duration * 750, 0);
+    }
+}
+
+// every packet is one datagram, its length in the first byte
+static void ICACHE_FLASH_ATTR sn_send(mqttsn_session_t *s, uint8_t *packet) {
+    // a received datagram overwrote the remote address with the sender's
+    os_memcpy(s->udp.remote_ip, s->ip, 4);
+    s->udp.remote_port = s->port;
+    power_packet(0);
+    espconn_send(&s->conn, packet, packet[0]);
+    s->stats.txPackets++;
+    s->stats.txBytes += packet[0];
+    arm_ping(s);
+}
+
+static void ICACHE_FLASH_ATTR send_connect(mqttsn_session_t *s) {
+    uint8_t packet[6 + MQTTSN_CLIENT_ID_LEN];
+    packet[0] = 6 + s->client_id_len;
+    packet[1] = MQTTSN_CONNECT;
+    packet[2] = FLAG_CLEAN_SESSION;
+    packet[3] = PROTOCOL_ID;
+    put_be16(packet + 4, s->duration);
+    os_memcpy(packet + 6, s->client_id, s->client_id_len);
+    sn_send(s, packet);
+}
+
+// with the client ID it also asks the gateway for messages held while asleep
+static void ICACHE_FLASH_ATTR send_ping(mqttsn_session_t *s) {
+    uint8_t packet[2 + MQTTSN_CLIENT_ID_LEN];
+    packet[0] = 2;
+    packet[1] = MQTTSN_PINGREQ;
+    if (s->state == MQTTSN_AWAKE) {
+        packet[0] += s->client_id_len;
+        os_memcpy(packet + 2, s->client_id, s->client_id_len);
+    }
+    sn_send(s, packet);
+}
+
+static void ICACHE_FLASH_ATTR send_request(mqttsn_session_t *s) {
+    s->tries++;
+    if (s->waiting == MQTTSN_CONNACK) {
+        send_connect(s);
+    } else {
+        send_ping(s);
+    }
+    twheel_arm(&s->retryTimer, MQTTSN_RETRY_MS, 0);
+}
+
+static void ICACHE_FLASH_ATTR expect(mqttsn_session_t *s, uint8_t reply) {
+    s->waiting = reply;
+    s->tries = 0;
+    send_request(s);
+}
+
+static void ICACHE_FLASH_ATTR lost(mqttsn_session_t *s) {
+    s->state = MQTTSN_DISCONNECTED;
+    s->waiting = 0;
+    twheel_disarm(&s->retryTimer);
+    twheel_disarm(&s->pingTimer);
+    if (s->disconnect_cb != NULL) {
+        s->disconnect_cb(s);
+    }
+}
+
+static void ICACHE_FLASH_ATTR retry_timeout(void *arg) {
+    mqttsn_session_t *s = arg;
+    if (s->tries < MQTTSN_RETRIES) {
+        s->stats.retries++;
+        send_request(s);
+    } else {
+        os_printf("MQTT-SN: no reply after %d tries\n", s->tries);
+        lost(s);
+    }
+}
+
+static void ICACHE_FLASH_ATTR ping_timeout(void *arg) {
+    mqttsn_session_t *s = arg;
+    if (s->state == MQTTSN_ASLEEP) {
+        mqttsn_wake(s);
+    } else if (s->state == MQTTSN_ACTIVE && s->waiting == 0) {
+        expect(s, MQTTSN_PINGRESP);
+    }
+}
+
+static void ICACHE_FLASH_ATTR handle_publish(mqttsn_session_t *s, uint8_t *p, uint8_t len) {
+    if (len < 7) {
+        return;
+    }
+    if (p[2] & FLAG_QOS_1) {
+        uint8_t ack[7] = { 7, MQTTSN_PUBACK };
+        os_memcpy(ack + 2, p + 3, 4); // topic ID and message ID
+        ack[6] = 0;
+        sn_send(s, ack);
+    }
+    if (s->message_cb != NULL) {
+        s->message_cb(s, get_be16(p + 3), p + 7, len - 7);
+    }
+}
+
+static void ICACHE_FLASH_ATTR sn_recv(void *arg, char *pdata, unsigned short len) {
+    struct espconn *conn = arg;
+    mqttsn_session_t *s = conn->reverse;
+    uint8_t *p = (uint8_t *)pdata;
+
+    power_packet(1);
+    s->stats.rxPackets++;
+    s->stats.rxBytes += len;
+    // a first byte of 1 announces a three byte length, longer than we take
+    if (len < 2 || p[0] != len) {
+        return;
+    }
+    switch (p[1]) {
+        case MQTTSN_CONNACK:
+            if (s->state != MQTTSN_CONNECTING || len < 3) {
+                break;
+            }
+            twheel_disarm(&s->retryTimer);
+            s->waiting = 0;
+            s->state = (p[2] == 0) ? MQTTSN_ACTIVE : MQTTSN_DISCONNECTED;
+            arm_ping(s);
+            if (s->connack_cb != NULL) {
+                s->connack_cb(s, p[2]);
+            }
+            break;
+        case MQTTSN_PINGRESP:
+            if (s->waiting != MQTTSN_PINGRESP) {
+                break;
+            }
+            twheel_disarm(&s->retryTimer);
+            s->waiting = 0;
+            if (s->state == MQTTSN_AWAKE) {
+                // everything held for us has arrived, back to sleep
+                s->state = MQTTSN_ASLEEP;
+                twheel_arm(&s->pingTimer, s->sleepS * 750, 0);
+            }
+            break;
+        case MQTTSN_PUBLISH:
+            handle_publish(s, p, len);
+            break;
+        case MQTTSN_PUBACK:
+            // only sent for QoS 0 and -1 when the gateway rejects the publish
+            if (len >= 7 && p[6] != 0) {
+                os_printf("MQTT-SN: publish to topic %d rejected, code %d\n", get_be16(p + 2), p[6]);
+            }
+            break;
+        case MQTTSN_SUBACK:
+            if (len >= 8 && p[7] != 0) {
+                os_printf("MQTT-SN: subscribe refused, code %d\n", p[7]);
+            }
+            break;
+        case MQTTSN_REGISTER: {
+            // topics are predefined, so names the gateway offers are refused
+            uint8_t ack[7] = { 7, MQTTSN_REGACK };
+            if (len < 6) {
+                break;
+            }
+            os_memcpy(ack + 2, p + 2, 4); // topic ID and message ID
+            ack[6] = RC_NOT_SUPPORTED;
+            sn_send(s, ack);
+            break;
+        }
+        case MQTTSN_DISCONNECT:
+            // the answer to our DISCONNECT is expected, anything else means the gateway dropped us
+            if (s->state == MQTTSN_ACTIVE || s->state == MQTTSN_CONNECTING) {
+                lost(s);
+            }
+            break;
+        default:
+            break;
+    }
+}
+
+static void ICACHE_FLASH_ATTR ensure_socket(mqttsn_session_t *s) {
+    if (s->conn.type != ESPCONN_INVALID) {
+        return;
+    }
+    s->conn.type = ESPCONN_UDP;
+    s->conn.proto.udp = &s->udp;
+    s->conn.reverse = s;
+    s->udp.local_port = espconn_port();
+    os_memcpy(s->udp.remote_ip, s->ip, 4);
+    s->udp.remote_port = s->port;
+    espconn_regist_recvcb(&s->conn, sn_recv);
+    espconn_create(&s->conn);
+    twheel_setfn(&s->retryTimer, retry_timeout, s);
+    twheel_setfn(&s->pingTimer, ping_timeout, s);
+}
+
+void ICACHE_FLASH_ATTR mqttsn_connect(mqttsn_session_t *session) {
+    ensure_socket(session);
+    twheel_disarm(&session->pingTimer);
+    session->state = MQTTSN_CONNECTING;
+    expect(session, MQTTSN_CONNACK);
+}
+
+sint8 ICACHE_FLASH_ATTR mqttsn_publish(mqttsn_session_t *session, uint16_t topicId, const uint8_t *data, uint32_t len, mqttsn_qos_t qos) {
+    uint8_t packet[MQTTSN_MAX_PACKET];
+    if (len > sizeof(packet) - 7) {
+        return -1;
+    }
+    if (qos == MQTTSN_QOS_0 && session->state != MQTTSN_ACTIVE) {
+        return -1;
+    }
+    ensure_socket(session);
+    packet[0] = 7 + len;
+    packet[1] = MQTTSN_PUBLISH;
+    packet[2] = qos | FLAG_TOPIC_PREDEFINED;
+    put_be16(packet + 3, topicId);
+    put_be16(packet + 5, 0); // only QoS 1 and 2 use message IDs
+    os_memcpy(packet + 7, data, len);
+    sn_send(session, packet);
+    return 0;
+}
+
+sint8 ICACHE_FLASH_ATTR mqttsn_subscribe(mqttsn_session_t *session, uint16_t topicId) {
+    uint8_t packet[7];
+    if (session->state != MQTTSN_ACTIVE) {
+        return -1;
+    }
+    packet[0] = sizeof(packet);
+    packet[1] = MQTTSN_SUBSCRIBE;
+    packet[2] = FLAG_TOPIC_PREDEFINED;
+    put_be16(packet + 3, next_msg_id(session));
+    put_be16(packet + 5, topicId);
+    sn_send(session, packet);
+    return 0;
+}
+
+void ICACHE_FLASH_ATTR mqttsn_sleep(mqttsn_session_t *session, uint16_t seconds) {
+    uint8_t packet[4];
+    if (session->state != MQTTSN_ACTIVE) {
+        return;
+    }
+    packet[0] = sizeof(packet);
+    packet[1] = MQTTSN_DISCONNECT;
+    put_be16(packet + 2, seconds);
+    twheel_disarm(&session->retryTimer);
+    session->waiting = 0;
+    session->sleepS = seconds;
+    session->state = MQTTSN_ASLEEP;
+    sn_send(session, packet);
+    twheel_arm(&session->pingTimer, seconds * 750, 0);
+}
+
+void ICACHE_FLASH_ATTR mqttsn_wake(mqttsn_session_t *session) {
+    if (session->state != MQTTSN_ASLEEP) {
+        return;
+    }
+    session->state = MQTTSN_AWAKE;
+    expect(session, MQTTSN_PINGRESP);
+}
+
+void ICACHE_FLASH_ATTR mqttsn_disconnect(mqttsn_session_t *session) {
+    uint8_t packet[2] = { 2, MQTTSN_DISCONNECT };
+    if (session->state == MQTTSN_DISCONNECTED) {
+        return;
+    }
+    session->state = MQTTSN_DISCONNECTED;
+    session->waiting = 0;
+    twheel_disarm(&session->retryTimer);
+    twheel_disarm(&session->pingTimer);
+    sn_send(session, packet);
+}
@@ -0,0 +1,149 @@
+/**
+ * @file
+ * @brief MQTT-SN 1.2 client over UDP, the lighter alternative to mqtt.c.
+ *
+ * MQTT over TCP costs a three-way handshake, TCP acknowledgements and
+ * keepalives on top of every reading. MQTT-SN puts each packet in a single
+ * datagram with a two byte header and names topics with two byte IDs that
+ * the gateway knows in advance, so a reading is one small frame.
+ *
+ * Only predefined topic IDs are used, there is no REGISTER. Readings go out
+ * as QoS 0 while connected, or as QoS -1, which needs no connection at all.
+ * A sleeping client tells the gateway how long it will sleep; the gateway
+ * holds messages for it, and mqttsn.c collects them with a PINGREQ before
+ * the sleep duration runs out.
+ *
+ * A gateway translates to the MQTT broker; mqttsn_gw.py stands in for one.
+ */
+#ifndef MQTTSN_H
+#define MQTTSN_H
+
+#include "os_type.h"
+#include "espconn.h"
+#include "twheel.h"
+
+#define MQTTSN_PORT 1883 /**< Usual gateway port, on UDP */
+#define MQTTSN_RETRY_MS 3000 /**< Wait for CONNACK or PINGRESP before sending again */
+#define MQTTSN_RETRIES 4 /**< Sends before the gateway is taken to be gone */
+#define MQTTSN_MAX_PACKET 128 /**< Longest packet sent or accepted, so the length always fits in one byte */
+#define MQTTSN_CLIENT_ID_LEN 23 /**< Longest client ID the protocol allows */
+
+/**
+ * @typedef
+ * MQTT-SN message types, section 5.2.2 of the specification.
+ */
+typedef enum mqttsn_message_enum {
+    MQTTSN_CONNECT = 0x04,
+    MQTTSN_CONNACK = 0x05,
+    MQTTSN_REGISTER = 0x0A,
+    MQTTSN_REGACK = 0x0B,
+    MQTTSN_PUBLISH = 0x0C,
+    MQTTSN_PUBACK = 0x0D,
+    MQTTSN_SUBSCRIBE = 0x12,
+    MQTTSN_SUBACK = 0x13,
+    MQTTSN_PINGREQ = 0x16,
+    MQTTSN_PINGRESP = 0x17,
+    MQTTSN_DISCONNECT = 0x18,
+} mqttsn_message_type;
+
+/**
+ * @typedef
+ * QoS levels a reading can be published with, as PUBLISH flag bits.
+ */
+typedef enum mqttsn_qos_enum {
+    MQTTSN_QOS_0 = 0x00, /**< Needs a connection, the gateway forwards it at QoS 0 */
+    MQTTSN_QOS_M1 = 0x60, /**< Fire and forget, no connection needed */
+} mqttsn_qos_t;
+
+/**
+ * @typedef
+ * Client states, section 6.14 of the specification.
+ */
+typedef enum mqttsn_state_enum {
+    MQTTSN_DISCONNECTED = 0,
+    MQTTSN_CONNECTING = 1, /**< CONNECT sent, waiting for CONNACK */
+    MQTTSN_ACTIVE = 2, /**< Connected, the gateway forwards messages straight away */
+    MQTTSN_ASLEEP = 3, /**< The gateway holds messages until we ask for them */
+    MQTTSN_AWAKE = 4, /**< Asleep, but collecting held messages until PINGRESP */
+} mqttsn_state_t;
+
+/**
+ * @struct mqttsn_stats_t
+ * Bytes and datagrams through the UDP socket, for comparison with TCP.
+ */
+typedef struct {
+    uint32_t txPackets;
+    uint32_t txBytes;
+    uint32_t rxPackets;
+    uint32_t rxBytes;
+    uint32_t retries; /**< CONNECT or PINGREQ sent again for lack of a reply */
+} mqttsn_stats_t;
+
+/**
+ * @struct mqttsn_session_t
+ * One client and its gateway. Fill in the address, client ID, duration and
+ * callbacks, then call mqttsn_connect().
+ */
+typedef struct {
+    uint8_t ip[4]; /**< Gateway address */
+    uint16_t port; /**< Gateway port, normally MQTTSN_PORT */
+    const uint8_t *client_id; /**< 1 to MQTTSN_CLIENT_ID_LEN bytes */
+    uint8_t client_id_len;
+    uint16_t duration; /**< Keepalive in seconds while active */
+    uint16_t sleepS; /**< Sleep duration given to the gateway while asleep */
+    uint8_t state; /**< One of mqttsn_state_t */
+    uint8_t waiting; /**< The reply we are waiting for, MQTTSN_CONNACK or MQTTSN_PINGRESP, 0 for none */
+    uint8_t tries; /**< Sends of the request we are waiting on */
+    uint16_t msgId; /**< Last message ID used */
+    struct espconn conn; /**< The UDP socket */
+    esp_udp udp;
+    twheel_timer_t retryTimer; /**< Sends CONNECT or PINGREQ again */
+    twheel_timer_t pingTimer; /**< Keepalive while active, collects held messages while asleep */
+    mqttsn_stats_t stats;
+    void (*connack_cb)(void *session, uint8_t returnCode); /**< CONNACK arrived, 0 if accepted */
+    void (*disconnect_cb)(void *session); /**< The gateway stopped answering */
+    void (*message_cb)(void *session, uint16_t topicId, uint8_t *payload, uint32_t payload_len); /**< A PUBLISH on a subscribed topic */
+} mqttsn_session_t;
+
+/**
+ * Sends CONNECT with a clean session, retrying until CONNACK arrives.
+ * @param session the session, with ip, port, client_id and duration set
+ */
+void ICACHE_FLASH_ATTR mqttsn_connect(mqttsn_session_t *session);
+
+/**
+ * Publishes to a predefined topic.
+ * @param session the session
+ * @param topicId the topic ID as configured at the gateway
+ * @param data the payload
+ * @param len its length
+ * @param qos MQTTSN_QOS_0, which needs the session active, or MQTTSN_QOS_M1 at any time
+ * @return 0 if it was sent, -1 if it was not
+ */
+sint8 ICACHE_FLASH_ATTR mqttsn_publish(mqttsn_session_t *session, uint16_t topicId, const uint8_t *data, uint32_t len, mqttsn_qos_t qos);
+
+/**
+ * Subscribes to a predefined topic at QoS 0; messages arrive at message_cb.
+ * @return 0 if SUBSCRIBE was sent
+ */
+sint8 ICACHE_FLASH_ATTR mqttsn_subscribe(mqttsn_session_t *session, uint16_t topicId);
+
+/**
+ * Goes to sleep. The gateway holds messages for up to seconds, and a
+ * PINGREQ collects them before that runs out.
+ * @param session an active session
+ * @param seconds the sleep duration
+ */
+void ICACHE_FLASH_ATTR mqttsn_sleep(mqttsn_session_t *session, uint16_t seconds);
+
+/**
+ * Collects held messages now instead of waiting for the sleep timer.
+ */
+void ICACHE_FLASH_ATTR mqttsn_wake(mqttsn_session_t *session);
+
+/**
+ * Sends DISCONNECT and stops the timers.
+ */
+void ICACHE_FLASH_ATTR mqttsn_disconnect(mqttsn_session_t *session);
+
+#endif
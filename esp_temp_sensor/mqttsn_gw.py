@@ -0,0 +1,226 @@
+#!/usr/bin/env python3
+##
+# @file
+# @brief MQTT-SN to MQTT gateway standing in for a real one, see mqttsn.h
+#
+# Enough of an MQTT-SN 1.2 gateway to try mqttsn.c against a normal broker:
+# CONNECT, PUBLISH at QoS 0 and -1, SUBSCRIBE, PINGREQ, and DISCONNECT with
+# a sleep duration, all on predefined topic IDs given with --topic. Each
+# connected client gets its own broker connection. Messages for a sleeping
+# client are held until it sends a PINGREQ with its client ID.
+#
+# usage: mqttsn_gw.py [--port 1883] [--broker 127.0.0.1] [--broker-port 1883] --topic 1=test [-v]
+
+import argparse
+import select
+import socket
+import struct
+import sys
+import time
+
+import mqttlite
+
+CONNECT, CONNACK, REGISTER, PUBLISH, PUBACK = 0x04, 0x05, 0x0A, 0x0C, 0x0D
+SUBSCRIBE, SUBACK, PINGREQ, PINGRESP, DISCONNECT = 0x12, 0x13, 0x16, 0x17, 0x18
+QOS_M1 = 0x60
+TOPIC_PREDEFINED = 0x01
+RC_ACCEPTED, RC_CONGESTION, RC_INVALID_TOPIC, RC_NOT_SUPPORTED = 0, 1, 2, 3
+GRACE = 1.5  # keepalive and sleep durations are enforced with this much slack
+
+
+def packet(msg_type, body=b""):
+    return bytes([len(body) + 2, msg_type]) + body
+
+
+class Client:
+    def __init__(self, addr, client_id, duration, mqtt):
+        self.addr = addr
+        self.client_id = client_id
+        self.duration = duration
+        self.mqtt = mqtt
+        self.asleep = False
+        self.held = []
+        self.deadline = time.time() + duration * GRACE if duration else None
+
+
+class Gateway:
+    def __init__(self, args):
+        self.args = args
+        self.topics = {}
+        for spec in args.topic:
+            tid, name = spec.split("=", 1)
+            self.topics[int(tid)] = name
+        self.ids = {name: tid for tid, name in self.topics.items()}
+        self.sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+        self.sock.bind(("0.0.0.0", args.port))
+        self.clients = {}  # by address
+        self.anonymous = None  # broker connection for QoS -1 publishes
+        self.counts = {"rx": 0, "rx_bytes": 0, "tx": 0, "tx_bytes": 0}
+
+    def log(self, fmt, *a):
+        if self.args.verbose:
+            print(fmt.format(*a))
+            sys.stdout.flush()
+
+    def send(self, addr, data):
+        self.sock.sendto(data, addr)
+        self.counts["tx"] += 1
+        self.counts["tx_bytes"] += len(data)
+
+    def broker(self, client_id):
+        return mqttlite.Client(self.args.broker, self.args.broker_port, client_id=client_id, keepalive=0)
+
+    def drop(self, client, why):
+        self.log("{0} {1}: {2}", client.addr, client.client_id, why)
+        try:
+            client.mqtt.disconnect()
+        except OSError:
+            pass
+        del self.clients[client.addr]
+
+    def forward(self, client, topic, payload):
+        tid = self.ids.get(topic)
+        if tid is None:
+            return
+        data = packet(PUBLISH, struct.pack(">BHH", TOPIC_PREDEFINED, tid, 0) + payload)
+        if client.asleep:
+            client.held.append(data)
+        else:
+            self.send(client.addr, data)
+
+    def on_connect(self, addr, body):
+        flags, protocol, duration = struct.unpack(">BBH", body[:4])
+        client_id = body[4:].decode(errors="replace")
+        old = self.clients.get(addr)
+        if old is not None:
+            self.drop(old, "reconnected")
+        try:
+            mqtt = self.broker(client_id)
+        except (OSError, ConnectionError) as e:
+            self.log("{0} {1}: broker refused, {2}", addr, client_id, e)
+            self.send(addr, packet(CONNACK, bytes([RC_CONGESTION])))
+            return
+        self.clients[addr] = Client(addr, client_id, duration, mqtt)
+        self.log("{0} {1}: connected, keepalive {2} s", addr, client_id, duration)
+        self.send(addr, packet(CONNACK, bytes([RC_ACCEPTED])))
+
+    def on_publish(self, addr, client, body):
+        flags, tid, msg_id = struct.unpack(">BHH", body[:5])
+        payload = body[5:]
+        name = self.topics.get(tid) if flags & 0x03 == TOPIC_PREDEFINED else None
+        if name is None:
+            self.send(addr, packet(PUBACK, struct.pack(">HHB", tid, msg_id, RC_INVALID_TOPIC)))
+            return
+        if flags & QOS_M1 == QOS_M1:
+            if self.anonymous is None:
+                self.anonymous = self.broker("herps-mqttsn-gw")
+            self.anonymous.publish(name, payload, retain=bool(flags & 0x10))
+        elif client is not None and not client.asleep:
+            client.mqtt.publish(name, payload, retain=bool(flags & 0x10))
+        else:
+            self.send(addr, packet(PUBACK, struct.pack(">HHB", tid, msg_id, RC_NOT_SUPPORTED)))
+            return
+        self.log("{0}: {1} <- {2!r}", addr, name, payload)
+
+    def on_subscribe(self, addr, client, body):
+        flags, msg_id, tid = struct.unpack(">BHH", body[:5])
+        name = self.topics.get(tid) if flags & 0x03 == TOPIC_PREDEFINED else None
+        rc = RC_ACCEPTED if name is not None else RC_INVALID_TOPIC
+        if name is not None:
+            client.mqtt.subscribe(name)
+        self.send(addr, packet(SUBACK, struct.pack(">BHHB", 0, tid, msg_id, rc)))
+
+    def on_ping(self, addr, client, body):
+        if body and client.asleep:
+            # awake: hand over what was held, then PINGRESP sends it back to sleep
+            self.log("{0} {1}: awake, {2} held", addr, client.client_id, len(client.held))
+            for data in client.held:
+                self.send(addr, data)
+            client.held = []
+        self.send(addr, packet(PINGRESP))
+
+    def on_disconnect(self, addr, client, body):
+        self.send(addr, packet(DISCONNECT))
+        if len(body) >= 2:
+            client.asleep = True
+            client.duration = struct.unpack(">H", body[:2])[0]
+            client.deadline = time.time() + client.duration * GRACE
+            self.log("{0} {1}: asleep for {2} s", addr, client.client_id, client.duration)
+        else:
+            self.drop(client, "disconnected")
+
+    def datagram(self, data, addr):
+        self.counts["rx"] += 1
+        self.counts["rx_bytes"] += len(data)
+        if len(data) < 2 or data[0] != len(data):
+            return  # no three byte lengths, nothing we take is that long
+        msg_type, body = data[1], data[2:]
+        client = self.clients.get(addr)
+        if msg_type == CONNECT:
+            self.on_connect(addr, body)
+            return
+        if msg_type == PUBLISH:
+            self.on_publish(addr, client, body)
+            return
+        if client is None:
+            if msg_type != DISCONNECT:
+                self.send(addr, packet(DISCONNECT))
+            return
+        if client.duration:
+            client.deadline = time.time() + client.duration * GRACE
+        if msg_type == SUBSCRIBE:
+            self.on_subscribe(addr, client, body)
+        elif msg_type == PINGREQ:
+            self.on_ping(addr, client, body)
+        elif msg_type == DISCONNECT:
+            self.on_disconnect(addr, client, body)
+
+    def broker_readable(self, client):
+        while True:
+            try:
+                pkt = client.mqtt.read_packet(0.001)
+            except (OSError, ConnectionError):
+                self.drop(client, "broker closed the connection")
+                return
+            if pkt is None:
+                return
+            ptype, body = pkt
+            if ptype == 3:
+                tlen = struct.unpack(">H", body[:2])[0]
+                self.forward(client, body[2:2 + tlen].decode(), body[2 + tlen:])
+
+    def run(self):
+        print("MQTT-SN gateway on udp/{0} for {1}:{2}, topics {3}".format(
+            self.args.port, self.args.broker, self.args.broker_port, self.topics))
+        sys.stdout.flush()
+        while True:
+            socks = {c.mqtt.sock: c for c in self.clients.values()}
+            ready, _, _ = select.select([self.sock] + list(socks), [], [], 1.0)
+            for s in ready:
+                if s is self.sock:
+                    data, addr = self.sock.recvfrom(512)
+                    self.datagram(data, addr)
+                elif socks[s].addr in self.clients:
+                    self.broker_readable(socks[s])
+            now = time.time()
+            for client in list(self.clients.values()):
+                if client.deadline is not None and now > client.deadline:
+                    self.drop(client, "lost")
+
+
+def main():
+    parser = argparse.ArgumentParser(description="MQTT-SN gateway stand-in")
+    parser.add_argument("--port", type=int, default=1883, help="UDP port to listen on")
+    parser.add_argument("--broker", default="127.0.0.1")
+    parser.add_argument("--broker-port", type=int, default=1883)
+    parser.add_argument("--topic", action="append", default=[], help="predefined topic, ID=name; repeat for more")
+    parser.add_argument("-v", "--verbose", action="store_true")
+    gw = Gateway(parser.parse_args())
+    try:
+        gw.run()
+    except KeyboardInterrupt:
+        print("{rx} datagrams in ({rx_bytes} bytes), {tx} out ({tx_bytes} bytes)".format(**gw.counts))
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,87 @@
+#include "ets_sys.h"
+#include "osapi.h"
+#include "os_type.h"
+#include "user_interface.h"
+#include "mempool.h"
+#include "ntc.h"
+#include "ntc_table.h"
+
+#define NTC_COUNTS_MAX ((1 << (NTC_ADC_BITS + NTC_OVERSAMPLE_BITS)) - 1)
+#define NTC_FAULT_MARGIN (NTC_FAULT_COUNTS << NTC_OVERSAMPLE_BITS)
+
+MEMPOOL_ASSERT(ntc_table_bits, NTC_COUNT_BITS == NTC_ADC_BITS + NTC_OVERSAMPLE_BITS);
+MEMPOOL_ASSERT(ntc_table_len, NTC_TABLE_LEN == (1 << (NTC_COUNT_BITS - NTC_TABLE_SHIFT)) + 1);
+
+uint32_t ICACHE_FLASH_ATTR ntc_sample(void) {
+    uint32_t sum = 0, i, counts;
+    for (i = 0; i < NTC_SAMPLES; i++) {
+        sum += system_adc_read();
+    }
+    counts = sum >> NTC_OVERSAMPLE_BITS;
+    // full scale reads 1024, one past the top of the table
+    return (counts > NTC_COUNTS_MAX) ? NTC_COUNTS_MAX : counts;
+}
+
+int32_t ICACHE_FLASH_ATTR ntc_counts_to_centi(uint32_t counts) {
+    uint32_t i, frac;
+    int32_t low, high, centi;
+    if (counts > NTC_COUNTS_MAX) {
+        counts = NTC_COUNTS_MAX;
+    }
+    i = counts >> NTC_TABLE_SHIFT;
+    frac = counts & ((1 << NTC_TABLE_SHIFT) - 1);
+    low = ntcTable[i];
+    high = ntcTable[i + 1];
+    // the table rises, so the step is never negative and the shift rounds down like mkntc.py's
+    centi = low + (int32_t)(((uint32_t)(high - low) * frac) >> NTC_TABLE_SHIFT);
+    if (centi < NTC_MIN_CENTI) {
+        return NTC_MIN_CENTI;
+    }
+    if (centi > NTC_MAX_CENTI) {
+        return NTC_MAX_CENTI;
+    }
+    return centi;
+}
+
+uint8_t ICACHE_FLASH_ATTR ntc_fault(uint32_t counts) {
+    int32_t centi;
+    if (counts <= NTC_FAULT_MARGIN || counts >= NTC_COUNTS_MAX - NTC_FAULT_MARGIN) {
+        return 1;
+    }
+    centi = ntc_counts_to_centi(counts);
+    return (centi <= NTC_MIN_CENTI || centi >= NTC_MAX_CENTI) ? 1 : 0;
+}
+
+uint8_t ICACHE_FLASH_ATTR ntc_read(int32_t *centi) {
+    uint32_t counts = ntc_sample();
+    *centi = ntc_counts_to_centi(counts);
+    return ntc_fault(counts);
+}
+
+int32_t ICACHE_FLASH_ATTR ntc_read_centi(void) {
+    return ntc_counts_to_centi(ntc_sample());
+}
+
+uint32_t ICACHE_FLASH_ATTR ntc_format(int32_t centi, char *buf) {
+    char digits[10];
+    uint32_t value, len = 0, n = 0;
+    if (centi < 0) {
+        buf[len++] = '-';
+        value = -(uint32_t)centi;
+    } else {
+        value = centi;
+    }
+    // at least "0.00": the hundredths, the tenths and the units, then the rest
+    do {
+        digits[n++] = '0' + value % 10;
+        value /= 10;
+    } while (value > 0 || n < 3);
+    while (n > 0) {
+        buf[len++] = digits[--n];
+        if (n == 2) {
+            buf[len++] = '.';
+        }
+    }
+    buf[len] = 0;
+    return len;
+}
@@ -0,0 +1,79 @@
+/**
+ * @file
+ * @brief Temperature from an NTC thermistor on the ADC, in integer math.
+ *
+ * The ESP8266 has one 10-bit ADC, on TOUT. A reading takes NTC_SAMPLES
+ * conversions back to back, adds them up and shifts the sum right by
+ * NTC_OVERSAMPLE_BITS: the noise on the input dithers the conversions, so
+ * the decimated result has NTC_OVERSAMPLE_BITS more bits of resolution than
+ * one conversion. The esp_init_data byte 107 has to be left at its default,
+ * so the ADC reads TOUT and not the supply.
+ *
+ * Counts become centi-degrees by linear interpolation in ntc_table.h, which
+ * mkntc.py generates from the thermistor and divider in user_config.h. No
+ * log() or float is needed on the device; the table's worst error against
+ * the Steinhart-Hart beta equation is NTC_TABLE_ERROR_CENTI, and
+ * host/ntccheck checks this code against the equation in floating point.
+ *
+ * Built in with make NTC=1, which makes the published reading the
+ * temperature.
+ */
+#ifndef NTC_H
+#define NTC_H
+
+#include "os_type.h"
+
+#define NTC_ADC_BITS 10 /**< system_adc_read() gives 0 to 1024 */
+#define NTC_OVERSAMPLE_BITS 2 /**< Resolution gained by oversampling; each bit costs four times the conversions */
+#define NTC_SAMPLES (1 << (2 * NTC_OVERSAMPLE_BITS)) /**< Conversions per reading */
+#define NTC_FORMAT_LEN 13 /**< Room ntc_format() needs, up to "-21474836.48" and the terminator */
+#define NTC_FAULT_COUNTS 4 /**< 10-bit counts from either end of the ADC's range that mean the probe is open or shorted */
+
+/**
+ * Takes NTC_SAMPLES conversions and decimates them.
+ * @return counts, NTC_ADC_BITS + NTC_OVERSAMPLE_BITS wide
+ */
+uint32_t ICACHE_FLASH_ATTR ntc_sample(void);
+
+/**
+ * Converts decimated counts to a temperature, clamped to the range set in
+ * user_config.h.
+ * @param counts as from ntc_sample()
+ * @return hundredths of a degree Celsius
+ */
+int32_t ICACHE_FLASH_ATTR ntc_counts_to_centi(uint32_t counts);
+
+/**
+ * Whether counts come from a probe that is open or shorted. The thermistor
+ * is between the supply and TOUT, so an open or unplugged probe reads near
+ * 0 and a shorted one near full scale, and both convert to a clamp; so
+ * does anything else outside the probe's range.
+ * @param counts as from ntc_sample()
+ * @return 1 if the counts are no temperature, 0 if they are
+ */
+uint8_t ICACHE_FLASH_ATTR ntc_fault(uint32_t counts);
+
+/**
+ * Takes a reading and checks the probe.
+ * @param centi the temperature now, in hundredths of a degree Celsius; the
+ *        clamp it hit on a fault
+ * @return 1 if the probe is open or shorted, as ntc_fault(), 0 if not
+ */
+uint8_t ICACHE_FLASH_ATTR ntc_read(int32_t *centi);
+
+/**
+ * @return the temperature now, in hundredths of a degree Celsius, without
+ *         checking the probe
+ */
+int32_t ICACHE_FLASH_ATTR ntc_read_centi(void);
+
+/**
+ * Writes a temperature as degrees with two decimals, such as "-3.05", or
+ * anything else kept in hundredths, such as rollup.c's sums and averages.
+ * @param centi hundredths of a degree, any int32_t
+ * @param buf at least NTC_FORMAT_LEN bytes
+ * @return the length written, without the terminator
+ */
+uint32_t ICACHE_FLASH_ATTR ntc_format(int32_t centi, char *buf);
+
+#endif
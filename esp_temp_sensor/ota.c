@@ -0,0 +1,311 @@
+#include "ets_sys.h"
+#include "osapi.h"
+#include "os_type.h"
+#include "user_interface.h"
+#include "flashmap.h"
+#include "crc32.h"
+#include "delta.h"
+#include "ota.h"
+
+#define OTA_STATE_MAGIC 0x4F544131 // "OTA1"
+#define OTA_STATE_SEC (SYSTEM_PARTITION_OTA_STATE_ADDR / SPI_FLASH_SEC_SIZE)
+#define OTA_REBOOT_DELAY_MS 1000 // give the status message time to leave
+
+// Persisted across reboots with system_param_save_with_protect()
+typedef struct {
+    uint32_t magic;
+    uint8_t trial; // 1 while the running image has not yet reached CONNACK
+    uint8_t boots; // boots since we switched to the trial image
+    uint8_t pad[2];
+    uint32_t trialCrc; // CRC of the trial image
+    uint32_t badCrc; // CRC of the last image that had to be rolled back
+} ota_state_t;
+
+static ota_state_t state;
+
+static struct {
+    uint8_t active; // an update is in progress
+    uint32_t base; // flash address of the bank being written
+    uint32_t size; // expected image size
+    uint32_t crc; // expected CRC32 of the image
+    uint8_t delta; // the image is being rebuilt from a delta against the running bank
+    uint32_t received; // image bytes accepted so far, the next expected offset for a full image
+    uint32_t streamReceived; // delta bytes accepted so far, the next expected offset for a delta
+    uint32_t written; // bytes flushed to flash
+    uint32_t stage[OTA_STAGE_LEN / 4]; // spi_flash_write() needs word aligned data
+    uint16_t stageLen;
+} ota;
+
+static os_timer_t otaRebootTimer;
+
+static void ICACHE_FLASH_ATTR ota_save_state(void) {
+    state.magic = OTA_STATE_MAGIC;
+    system_param_save_with_protect(OTA_STATE_SEC, &state, sizeof(state));
+}
+
+static void ICACHE_FLASH_ATTR ota_switch_bank(void *arg) {
+    // with the flag set, the reboot comes up in the other bank
+    system_upgrade_flag_set(UPGRADE_FLAG_FINISH);
+    system_upgrade_reboot();
+}
+
+uint32_t ICACHE_FLASH_ATTR ota_target_addr(void) {
+    return (system_upgrade_userbin_check() == UPGRADE_FW_BIN1) ? SYSTEM_PARTITION_OTA_2_ADDR : 0x1000;
+}
+
+static uint32_t ICACHE_FLASH_ATTR ota_running_addr(void) {
+    return (system_upgrade_userbin_check() == UPGRADE_FW_BIN1) ? 0x1000 : SYSTEM_PARTITION_OTA_2_ADDR;
+}
+
+void ICACHE_FLASH_ATTR ota_boot_check(void) {
+    system_param_load(OTA_STATE_SEC, 0, &state, sizeof(state));
+    if (state.magic != OTA_STATE_MAGIC) {
+        os_memset(&state, 0, sizeof(state));
+        return;
+    }
+    if (!state.trial) {
+        return;
+    }
+    state.boots++;
+    if (state.boots > OTA_MAX_TRIAL_BOOTS) {
+        os_printf("OTA image failed %d boots, rolling back\n", OTA_MAX_TRIAL_BOOTS);
+        state.badCrc = state.trialCrc;
+        state.trial = 0;
+        state.boots = 0;
+        ota_save_state();
+        // the SDK is not fully up yet, reboot from a timer
+        os_timer_disarm(&otaRebootTimer);
+        os_timer_setfn(&otaRebootTimer, (os_timer_func_t *)ota_switch_bank, NULL);
+        os_timer_arm(&otaRebootTimer, 100, 0);
+        return;
+    }
+    os_printf("OTA trial boot %d of %d\n", state.boots, OTA_MAX_TRIAL_BOOTS);
+    ota_save_state();
+}
+
+void ICACHE_FLASH_ATTR ota_confirm(void) {
+    if (state.trial) {
+        os_printf("OTA image confirmed after %d boots\n", state.boots);
+        state.trial = 0;
+        state.boots = 0;
+        ota_save_state();
+    }
+}
+
+static uint32_t ICACHE_FLASH_ATTR read_be32(const uint8_t *p) {
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+// Writes the staged bytes, erasing each sector as we first reach it.
+static ota_result_t ICACHE_FLASH_ATTR ota_flush(void) {
+    uint32_t addr = ota.base + ota.written;
+    if (ota.stageLen == 0) {
+        return OTA_OK;
+    }
+    if ((addr % SPI_FLASH_SEC_SIZE) == 0) {
+        if (spi_flash_erase_sector(addr / SPI_FLASH_SEC_SIZE) != SPI_FLASH_RESULT_OK) {
+            return OTA_ERR_FLASH;
+        }
+    }
+    // pad a short final write with the erased value
+    while (ota.stageLen % 4) {
+        ((uint8_t *)ota.stage)[ota.stageLen++] = 0xFF;
+    }
+    if (spi_flash_write(addr, ota.stage, ota.stageLen) != SPI_FLASH_RESULT_OK) {
+        return OTA_ERR_FLASH;
+    }
+    ota.written += ota.stageLen;
+    ota.stageLen = 0;
+    return OTA_OK;
+}
+
+static ota_result_t ICACHE_FLASH_ATTR ota_write(const uint8_t *data, uint32_t len) {
+    while (len > 0) {
+        uint32_t n = OTA_STAGE_LEN - ota.stageLen;
+        if (n > len) {
+            n = len;
+        }
+        os_memcpy((uint8_t *)ota.stage + ota.stageLen, data, n);
+        ota.stageLen += n;
+        data += n;
+        len -= n;
+        if (ota.stageLen == OTA_STAGE_LEN) {
+            ota_result_t res = ota_flush();
+            if (res != OTA_OK) {
+                return res;
+            }
+        }
+    }
+    return OTA_OK;
+}
+
+// Output of the delta decoder, the rebuilt image
+static int ICACHE_FLASH_ATTR ota_delta_out(const uint8_t *data, uint32_t len) {
+    if (ota.received + len > ota.size) {
+        return -1;
+    }
+    if (ota_write(data, len) != OTA_OK) {
+        return -1;
+    }
+    ota.received += len;
+    return 0;
+}
+
+// CRC of what actually landed in flash, not of what we were sent
+static uint32_t ICACHE_FLASH_ATTR ota_flash_crc(uint32_t addr, uint32_t size) {
+    uint32_t crc = 0;
+    while (size > 0) {
+        uint32_t n = (size > OTA_STAGE_LEN) ? OTA_STAGE_LEN : size;
+        spi_flash_read(addr, ota.stage, (n + 3) & ~3);
+        crc = crc32_update(crc, (uint8_t *)ota.stage, n);
+        addr += n;
+        size -= n;
+    }
+    return crc;
+}
+
+static ota_result_t ICACHE_FLASH_ATTR ota_fail(ota_result_t res) {
+    os_printf("OTA failed: %d at offset %d\n", res, ota.received);
+    ota.active = 0;
+    return res;
+}
+
+ota_result_t ICACHE_FLASH_ATTR ota_begin(uint32_t size, uint32_t crc) {
+    os_memset(&ota, 0, sizeof(ota));
+    ota.size = size;
+    ota.crc = crc;
+    if (ota.size == 0 || ota.size > SYSTEM_PARTITION_OTA_SIZE) {
+        return ota_fail(OTA_ERR_SIZE);
+    }
+    ota.base = ota_target_addr();
+    ota.active = 1;
+    system_upgrade_flag_set(UPGRADE_FLAG_START);
+    os_printf("OTA begin: %d bytes to 0x%x\n", ota.size, ota.base);
+    return OTA_OK;
+}
+
+ota_result_t ICACHE_FLASH_ATTR ota_begin_delta(uint32_t oldSize, uint32_t oldCrc, uint32_t size, uint32_t crc) {
+    os_memset(&ota, 0, sizeof(ota));
+    ota.size = size;
+    ota.crc = crc;
+    if (ota.size == 0 || ota.size > SYSTEM_PARTITION_OTA_SIZE || oldSize > SYSTEM_PARTITION_OTA_SIZE) {
+        return ota_fail(OTA_ERR_SIZE);
+    }
+    // the delta is useless against anything but the image it was made from
+    if (ota_flash_crc(ota_running_addr(), oldSize) != oldCrc) {
+        return ota_fail(OTA_ERR_VERIFY);
+    }
+    ota.base = ota_target_addr();
+    ota.delta = 1;
+    ota.active = 1;
+    delta_init(ota_running_addr(), oldSize, ota_delta_out);
+    system_upgrade_flag_set(UPGRADE_FLAG_START);
+    os_printf("OTA delta begin: %d bytes to 0x%x\n", ota.size, ota.base);
+    return OTA_OK;
+}
+
+ota_result_t ICACHE_FLASH_ATTR ota_data(uint32_t offset, const uint8_t *data, uint32_t len) {
+    ota_result_t res;
+    if (!ota.active) {
+        return OTA_ERR_STATE;
+    }
+    if (len > OTA_CHUNK_MAX) {
+        return ota_fail(OTA_ERR_SIZE);
+    }
+    if (ota.delta) {
+        if (offset != ota.streamReceived) {
+            return ota_fail(OTA_ERR_OFFSET);
+        }
+        if (delta_feed(data, len) != 0) {
+            return ota_fail(OTA_ERR_DELTA);
+        }
+        ota.streamReceived += len;
+        return OTA_OK;
+    }
+    if (offset != ota.received) {
+        return ota_fail(OTA_ERR_OFFSET);
+    }
+    if (ota.received + len > ota.size) {
+        return ota_fail(OTA_ERR_SIZE);
+    }
+    res = ota_write(data, len);
+    if (res != OTA_OK) {
+        return ota_fail(res);
+    }
+    ota.received += len;
+    return OTA_OK;
+}
+
+ota_result_t ICACHE_FLASH_ATTR ota_end(void) {
+    ota_result_t res;
+    if (ota.active && ota.delta && delta_finish() != 0) {
+        return ota_fail(OTA_ERR_DELTA);
+    }
+    if (!ota.active || ota.received != ota.size) {
+        return ota_fail(OTA_ERR_STATE);
+    }
+    res = ota_flush();
+    if (res != OTA_OK) {
+        return ota_fail(res);
+    }
+    if (ota_flash_crc(ota.base, ota.size) != ota.crc) {
+        system_upgrade_flag_set(UPGRADE_FLAG_IDLE);
+        return ota_fail(OTA_ERR_VERIFY);
+    }
+    ota.active = 0;
+    state.trial = 1;
+    state.boots = 0;
+    state.trialCrc = ota.crc;
+    ota_save_state();
+    os_printf("OTA image verified, switching bank\n");
+    os_timer_disarm(&otaRebootTimer);
+    os_timer_setfn(&otaRebootTimer, (os_timer_func_t *)ota_switch_bank, NULL);
+    os_timer_arm(&otaRebootTimer, OTA_REBOOT_DELAY_MS, 0);
+    return OTA_DONE;
+}
+
+void ICACHE_FLASH_ATTR ota_abort(void) {
+    if (ota.active) {
+        ota.active = 0;
+        system_upgrade_flag_set(UPGRADE_FLAG_IDLE);
+        os_printf("OTA abandoned\n");
+    }
+}
+
+uint32_t ICACHE_FLASH_ATTR ota_progress(void) {
+    return ota.received;
+}
+
+uint8_t ICACHE_FLASH_ATTR ota_is_bad(uint32_t crc) {
+    return (state.magic == OTA_STATE_MAGIC && crc == state.badCrc) ? 1 : 0;
+}
+
+ota_result_t ICACHE_FLASH_ATTR ota_handle(const uint8_t *data, uint32_t len) {
+    if (len < 1) {
+        return OTA_ERR_STATE;
+    }
+    switch (data[0]) {
+        case 'B':
+            if (len < 9) {
+                return OTA_ERR_STATE;
+            }
+            return ota_begin(read_be32(data + 1), read_be32(data + 5));
+        case 'P':
+            if (len < 17) {
+                return OTA_ERR_STATE;
+            }
+            return ota_begin_delta(read_be32(data + 1), read_be32(data + 5), read_be32(data + 9), read_be32(data + 13));
+        case 'D':
+            if (len < 5) {
+                return OTA_ERR_STATE;
+            }
+            return ota_data(read_be32(data + 1), data + 5, len - 5);
+        case 'E':
+            return ota_end();
+        case 'A':
+            ota_abort();
+            return OTA_OK;
+        default:
+            return OTA_ERR_STATE;
+    }
+}
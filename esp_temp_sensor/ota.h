@@ -0,0 +1,119 @@
+/**
+ * @file
+ * @brief Dual-bank firmware update streamed over MQTT.
+ *
+ * The image arrives as a series of messages on the OTA topic and is written
+ * straight into the bank we are not running from. Each message starts with a
+ * command byte, multi-byte numbers are big endian:
+ *
+ *   'B' size(4) crc32(4)   begin an update of size bytes
+ *   'P' oldSize(4) oldCrc32(4) size(4) crc32(4)
+ *                          begin an update rebuilt from a delta against the
+ *                          running image, see delta.h
+ *   'D' offset(4) data     image bytes, or delta bytes after 'P'; offsets
+ *                          must arrive in order
+ *   'E'                    verify the written bank and switch to it
+ *   'A'                    abandon the update in progress
+ *
+ * After switching, the new image is on trial: if it does not get a CONNACK
+ * within OTA_MAX_TRIAL_BOOTS boots we switch back to the old bank.
+ */
+#ifndef OTA_H
+#define OTA_H
+
+#include "os_type.h"
+
+#define OTA_CHUNK_MAX 1024 /**< Largest data chunk accepted in one message */
+#define OTA_STAGE_LEN 256 /**< Bytes collected before each flash write; must divide the sector size */
+#define OTA_MAX_TRIAL_BOOTS 3 /**< Boots a new image gets to reach CONNACK before we roll back */
+
+/**
+ * @typedef
+ * Result of handling one OTA message.
+ */
+typedef enum ota_result_enum {
+    OTA_OK = 0,
+    OTA_DONE = 1, /**< Image verified, the switch to the new bank is under way */
+    OTA_ERR_STATE = -1, /**< Message not valid in the current state */
+    OTA_ERR_SIZE = -2, /**< Image larger than a bank, or chunk larger than OTA_CHUNK_MAX */
+    OTA_ERR_OFFSET = -3, /**< Chunk did not continue where the last one ended */
+    OTA_ERR_FLASH = -4, /**< Flash erase or write failed */
+    OTA_ERR_VERIFY = -5, /**< CRC of the written bank, or of the delta source, did not match */
+    OTA_ERR_DELTA = -6, /**< Delta stream corrupt or ended part way through */
+} ota_result_t;
+
+/**
+ * Must be called early in user_init(). Counts boots of a trial image and
+ * rolls back to the previous bank when it has run out of chances.
+ */
+void ICACHE_FLASH_ATTR ota_boot_check(void);
+
+/**
+ * Marks the running image as good. Call this once the broker has accepted
+ * our CONNECT.
+ */
+void ICACHE_FLASH_ATTR ota_confirm(void);
+
+/**
+ * Starts writing a full image into the inactive bank.
+ * @param size the image size in bytes
+ * @param crc the CRC32 of the whole image
+ * @return one of ota_result_t
+ */
+ota_result_t ICACHE_FLASH_ATTR ota_begin(uint32_t size, uint32_t crc);
+
+/**
+ * Starts rebuilding an image into the inactive bank from a delta.
+ * @param oldSize the size of the image the delta was made against
+ * @param oldCrc the CRC32 of that image, checked against the running bank
+ * @param size the size of the rebuilt image
+ * @param crc the CRC32 of the rebuilt image
+ * @return one of ota_result_t
+ */
+ota_result_t ICACHE_FLASH_ATTR ota_begin_delta(uint32_t oldSize, uint32_t oldCrc, uint32_t size, uint32_t crc);
+
+/**
+ * Adds the next chunk of image or delta.
+ * @param offset where the chunk starts in the image or delta
+ * @param data pointer to the chunk
+ * @param len the chunk length, at most OTA_CHUNK_MAX
+ * @return one of ota_result_t
+ */
+ota_result_t ICACHE_FLASH_ATTR ota_data(uint32_t offset, const uint8_t *data, uint32_t len);
+
+/**
+ * Verifies the written bank and, if it is good, reboots into it.
+ * @return OTA_DONE if the switch is under way, otherwise an error
+ */
+ota_result_t ICACHE_FLASH_ATTR ota_end(void);
+
+/**
+ * Abandons the update in progress, if any.
+ */
+void ICACHE_FLASH_ATTR ota_abort(void);
+
+/**
+ * @return the number of image bytes written so far
+ */
+uint32_t ICACHE_FLASH_ATTR ota_progress(void);
+
+/**
+ * @param crc the CRC32 of an image
+ * @return 1 if an image with this CRC was rolled back before, so should not be installed again
+ */
+uint8_t ICACHE_FLASH_ATTR ota_is_bad(uint32_t crc);
+
+/**
+ * Handles one message received on the OTA topic.
+ * @param data pointer to the message payload
+ * @param len the length of the payload
+ * @return one of ota_result_t
+ */
+ota_result_t ICACHE_FLASH_ATTR ota_handle(const uint8_t *data, uint32_t len);
+
+/**
+ * @return the flash address of the bank an update would be written to
+ */
+uint32_t ICACHE_FLASH_ATTR ota_target_addr(void);
+
+#endif
@@ -0,0 +1,52 @@
+#!/usr/bin/env python3
+##
+# @file
+# @brief Pushes a firmware image to one device over MQTT
+#
+# Sends the begin/data/end messages described in ota.h to herps/<chip id>/ota.
+# Build both bank images with `make ota` and push the one for the bank the
+# device is not currently running from. A delta made by mkdelta.py can be
+# pushed in place of the image; it is sent with a 'P' begin message instead.
+#
+# usage: otapush.py <broker> <chip id in hex> <image.bin|update.delta> [--chunk 1024] [--delay 0.02]
+
+import argparse
+import struct
+import time
+import zlib
+
+import mqttlite
+
+OTA_CHUNK_MAX = 1024  # must match ota.h
+DELTA_MAGIC = b"HDLT"  # must match mkdelta.py
+DELTA_HEADER_LEN = 20
+
+parser = argparse.ArgumentParser(description="Push a firmware image over MQTT")
+parser.add_argument("broker")
+parser.add_argument("chip_id", help="device chip ID in hex, as in herps/<chip id>/ota")
+parser.add_argument("image")
+parser.add_argument("--port", type=int, default=1883)
+parser.add_argument("--chunk", type=int, default=OTA_CHUNK_MAX)
+parser.add_argument("--delay", type=float, default=0.02, help="seconds between chunks, so the device keeps up with flash writes")
+args = parser.parse_args()
+
+if args.chunk > OTA_CHUNK_MAX:
+    parser.error("chunk size is limited to {0} by the device".format(OTA_CHUNK_MAX))
+
+image = open(args.image, "rb").read()
+topic = "herps/{0:08x}/ota".format(int(args.chip_id, 16))
+client = mqttlite.Client(args.broker, args.port, client_id="herps-otapush")
+
+start = time.time()
+if image[:4] == DELTA_MAGIC:
+    # the header carries old size, old CRC, new size, new CRC in 'P' order
+    client.publish(topic, b"P" + image[4:DELTA_HEADER_LEN])
+    image = image[DELTA_HEADER_LEN:]
+else:
+    client.publish(topic, b"B" + struct.pack(">II", len(image), zlib.crc32(image)))
+for offset in range(0, len(image), args.chunk):
+    client.publish(topic, b"D" + struct.pack(">I", offset) + image[offset:offset + args.chunk])
+    time.sleep(args.delay)
+client.publish(topic, b"E")
+client.disconnect()
+print("Pushed {0} bytes to {1} in {2:.1f}s".format(len(image), topic, time.time() - start))
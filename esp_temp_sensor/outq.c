@@ -0,0 +1,215 @@
+#include "ets_sys.h"
+#include "osapi.h"
+#include "os_type.h"
+#include "mqtt.h"
+#include "twheel.h"
+#include "timebase.h"
+#include "power.h"
+#include "outq.h"
+
+typedef struct {
+    uint8_t data[OUTQ_READING_LEN];
+    uint8_t len;
+} outq_reading_t;
+
+typedef struct {
+    const uint8_t *topic;
+    uint16_t topicLen;
+    uint8_t data[OUTQ_ALARM_LEN];
+    uint8_t len;
+    uint8_t used;
+    uint8_t sent; // at least once, so the next send is a DUP
+    uint16_t packetId;
+    uint64_t raisedUs;
+} outq_alarm_t;
+
+static struct {
+    mqtt_session_t *session;
+    twheel_timer_t batchTimer;
+    twheel_timer_t ackTimer;
+    outq_reading_t readings[OUTQ_READINGS];
+    uint8_t readingCount;
+    outq_alarm_t alarms[OUTQ_ALARMS];
+    uint8_t alarmCount;
+    outq_stats_t st;
+} oq;
+
+// the whole telemetry lane, oldest first
+static void ICACHE_FLASH_ATTR send_readings(void) {
+    uint8_t i;
+    twheel_disarm(&oq.batchTimer);
+    if (oq.readingCount == 0) {
+        return;
+    }
+    for (i = 0; i < oq.readingCount; i++) {
+        if (mqttSend(oq.session, oq.readings[i].data, oq.readings[i].len, MQTT_MSG_TYPE_PUBLISH) != 0) {
+            break;
+        }
+    }
+    if (i > 0) {
+        oq.st.batches++;
+    }
+    if (i < oq.readingCount && oq.session->validConnection) {
+        // the send queue is full: the rest wait for the next batch
+        oq.readingCount -= i;
+        os_memmove(oq.readings, oq.readings + i, oq.readingCount * sizeof(oq.readings[0]));
+        twheel_arm(&oq.batchTimer, OUTQ_BATCH_MS, 0);
+        return;
+    }
+    oq.readingCount = 0;
+}
+
+static void ICACHE_FLASH_ATTR send_alarm(outq_alarm_t *a) {
+    if (a->packetId == 0) {
+        a->packetId = mqttNextPacketId(oq.session);
+    }
+    if (a->sent) {
+        oq.st.resends++;
+    }
+    // one that never left goes again as it is, from the ack timer
+    if (mqttPublishQos1(oq.session, a->topic, a->topicLen, a->data, a->len, a->sent ? MQTT_PUBLISH_DUP : 0, a->packetId) == 0) {
+        a->sent = 1;
+    }
+}
+
+// every alarm still waiting, then the ack timer for another go at them
+static void ICACHE_FLASH_ATTR send_alarms(void) {
+    uint8_t i;
+    if (oq.alarmCount == 0 || !oq.session->validConnection) {
+        return;
+    }
+    for (i = 0; i < OUTQ_ALARMS; i++) {
+        if (oq.alarms[i].used) {
+            send_alarm(&oq.alarms[i]);
+        }
+    }
+    twheel_arm(&oq.ackTimer, OUTQ_ACK_MS, 0);
+}
+
+static void ICACHE_FLASH_ATTR alarm_done(outq_alarm_t *a) {
+    a->used = 0;
+    if (--oq.alarmCount == 0) {
+        twheel_disarm(&oq.ackTimer);
+        power_release();
+    }
+}
+
+static void ICACHE_FLASH_ATTR puback(void *session, uint16_t packetId) {
+    uint8_t i;
+    for (i = 0; i < OUTQ_ALARMS; i++) {
+        outq_alarm_t *a = &oq.alarms[i];
+        if (a->used && a->sent && a->packetId == packetId) {
+            uint32_t ms = (uint32_t)((timebase_local_us() - a->raisedUs) / 1000);
+            oq.st.acked++;
+            oq.st.lastMs = ms;
+            if (ms > oq.st.maxMs) {
+                oq.st.maxMs = ms;
+            }
+            alarm_done(a);
+            return;
+        }
+    }
+}
+
+void ICACHE_FLASH_ATTR outq_init(mqtt_session_t *session) {
+    os_memset(&oq, 0, sizeof(oq));
+    oq.session = session;
+    session->puback_cb = puback;
+    twheel_setfn(&oq.batchTimer, (twheel_fn)send_readings, NULL);
+    twheel_setfn(&oq.ackTimer, (twheel_fn)send_alarms, NULL);
+}
+
+void ICACHE_FLASH_ATTR outq_connected(void) {
+    send_alarms();
+}
+
+void ICACHE_FLASH_ATTR outq_lost(void) {
+    twheel_disarm(&oq.ackTimer);
+    // nothing to wait for now, mqttSend() drops them like any reading without a session
+    send_readings();
+}
+
+sint8 ICACHE_FLASH_ATTR outq_reading(const uint8_t *data, uint32_t len) {
+    outq_reading_t *r;
+    if (len > OUTQ_READING_LEN) {
+        return -1;
+    }
+    oq.st.readings++;
+    if (!oq.session->validConnection) {
+        mqttSend(oq.session, (uint8_t *)data, len, MQTT_MSG_TYPE_PUBLISH);
+        return 0;
+    }
+    if (oq.readingCount == OUTQ_READINGS) {
+        // a full lane the send queue would not take, the newest reading matters more than the oldest
+        oq.readingCount--;
+        os_memmove(oq.readings, oq.readings + 1, oq.readingCount * sizeof(oq.readings[0]));
+    }
+    r = &oq.readings[oq.readingCount++];
+    os_memcpy(r->data, data, len);
+    r->len = len;
+    if (oq.readingCount == OUTQ_READINGS) {
+        send_readings();
+    } else if (oq.readingCount == 1) {
+        twheel_arm(&oq.batchTimer, OUTQ_BATCH_MS, 0);
+    }
+    return 0;
+}
+
+sint8 ICACHE_FLASH_ATTR outq_alarm(const uint8_t *topic, uint32_t topic_len, const uint8_t *data, uint32_t len) {
+    outq_alarm_t *a = NULL;
+    uint8_t i;
+    if (len > OUTQ_ALARM_LEN) {
+        return -1;
+    }
+    for (i = 0; i < OUTQ_ALARMS && a == NULL; i++) {
+        if (!oq.alarms[i].used) {
+            a = &oq.alarms[i];
+        }
+    }
+    if (a == NULL) {
+        // every slot is waiting on a PUBACK; the newest alarm matters more than the oldest
+        a = &oq.alarms[0];
+        for (i = 1; i < OUTQ_ALARMS; i++) {
+            if (oq.alarms[i].raisedUs < a->raisedUs) {
+                a = &oq.alarms[i];
+            }
+        }
+        oq.st.dropped++;
+        alarm_done(a);
+    }
+    if (oq.alarmCount++ == 0) {
+        power_hold(); // out of sleep now, and until the broker has them all
+    }
+    os_memset(a, 0, sizeof(*a));
+    a->used = 1;
+    a->topic = topic;
+    a->topicLen = topic_len;
+    os_memcpy(a->data, data, len);
+    a->len = len;
+    a->raisedUs = timebase_local_us();
+    oq.st.alarms++;
+    if (oq.session->validConnection) {
+        send_alarm(a);
+        twheel_arm(&oq.ackTimer, OUTQ_ACK_MS, 0);
+        // the radio is up for the alarm anyway
+        send_readings();
+    }
+    return 0;
+}
+
+uint8_t ICACHE_FLASH_ATTR outq_alarms_pending(void) {
+    return oq.alarmCount;
+}
+
+const outq_stats_t * ICACHE_FLASH_ATTR outq_stats(void) {
+    return &oq.st;
+}
+
+uint32_t ICACHE_FLASH_ATTR outq_report(char *buf, uint32_t len) {
+    if (len < 160) {
+        return 0;
+    }
+    return os_sprintf(buf, "readings=%d;batches=%d;alarms=%d;acked=%d;resends=%d;dropped=%d;last_ms=%d;max_ms=%d",
+                      oq.st.readings, oq.st.batches, oq.st.alarms, oq.st.acked, oq.st.resends, oq.st.dropped,
+                      oq.st.lastMs, oq.st.maxMs);
+}
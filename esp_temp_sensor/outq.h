@@ -0,0 +1,103 @@
+/**
+ * @file
+ * @brief Outbound publishes in two lanes: alarms ahead of telemetry.
+ *
+ * Readings go in the telemetry lane. The first one waits OUTQ_BATCH_MS for
+ * others to go out with it, so readings taken close together share one
+ * radio wake; a full lane goes at once. They are published at QoS 0 on the
+ * session topic through mqttSend(), which drops them as it always has when
+ * there is no session to send them on; a reading made without one, or still
+ * waiting when the session is lost, is handed over at once.
+ *
+ * Alarms skip the batch. outq_alarm() publishes at QoS 1 straight away,
+ * ahead of whatever readings are waiting, and power_hold() keeps the radio
+ * out of modem- and light-sleep until the broker's PUBACK for every alarm
+ * has come in. Readings still waiting go out behind the alarm, in the same
+ * wake. An alarm raised without a session is kept and goes out first when
+ * outq_connected() is called, before anything else the new session sends,
+ * and one without a PUBACK after OUTQ_ACK_MS is sent again with DUP. The
+ * time from outq_alarm() to the PUBACK is kept as the alarm's latency.
+ */
+#ifndef OUTQ_H
+#define OUTQ_H
+
+#include "os_type.h"
+#include "mqtt.h"
+
+#define OUTQ_READINGS 8 /**< Readings the telemetry lane holds; a full lane is sent without waiting */
+#define OUTQ_READING_LEN 20 /**< Longest reading */
+#define OUTQ_BATCH_MS 5000 /**< Longest a reading waits for others to go out with */
+#define OUTQ_ALARMS 4 /**< Alarms that can wait for a PUBACK at once; a new one pushes the oldest out */
+#define OUTQ_ALARM_LEN 48 /**< Longest alarm payload */
+#define OUTQ_ACK_MS 5000 /**< An alarm without a PUBACK this long is sent again */
+
+/**
+ * @struct outq_stats_t
+ * What went through the two lanes.
+ */
+typedef struct {
+    uint32_t readings; /**< Readings queued */
+    uint32_t batches; /**< Times the telemetry lane was sent */
+    uint32_t alarms; /**< Alarms raised */
+    uint32_t acked; /**< Alarms the broker acknowledged */
+    uint32_t resends; /**< Alarms sent again, after a reconnect or OUTQ_ACK_MS */
+    uint32_t dropped; /**< Alarms pushed out before they were acknowledged */
+    uint32_t lastMs; /**< Raised to PUBACK, for the latest alarm */
+    uint32_t maxMs; /**< The longest of those */
+} outq_stats_t;
+
+/**
+ * Sets the lanes up for a session, and its puback_cb.
+ * @param session the session readings and alarms go out on
+ */
+void ICACHE_FLASH_ATTR outq_init(mqtt_session_t *session);
+
+/**
+ * To be called from connack_cb once the broker has accepted the session,
+ * before anything else is sent: alarms still unacknowledged go first.
+ */
+void ICACHE_FLASH_ATTR outq_connected(void);
+
+/**
+ * To be called when the session is lost. Alarms are kept for the next one.
+ */
+void ICACHE_FLASH_ATTR outq_lost(void);
+
+/**
+ * Queues a reading for the session topic, copied.
+ * @param data the reading
+ * @param len its length, at most OUTQ_READING_LEN
+ * @return 0, or -1 if it is too long
+ */
+sint8 ICACHE_FLASH_ATTR outq_reading(const uint8_t *data, uint32_t len);
+
+/**
+ * Publishes an alarm now, at QoS 1, or as soon as there is a session.
+ * @param topic where, which must outlive the alarm
+ * @param topic_len its length
+ * @param data the alarm, copied
+ * @param len its length, at most OUTQ_ALARM_LEN
+ * @return 0, or -1 if it is too long
+ */
+sint8 ICACHE_FLASH_ATTR outq_alarm(const uint8_t *topic, uint32_t topic_len, const uint8_t *data, uint32_t len);
+
+/**
+ * @return the number of alarms waiting for a PUBACK
+ */
+uint8_t ICACHE_FLASH_ATTR outq_alarms_pending(void);
+
+/**
+ * @return the counters
+ */
+const outq_stats_t * ICACHE_FLASH_ATTR outq_stats(void);
+
+/**
+ * Formats the counters as readings=..;batches=..;alarms=..;acked=..;
+ * resends=..;dropped=..;last_ms=..;max_ms=..
+ * @param buf where to write
+ * @param len its size, at least 160
+ * @return the length written, 0 if buf is too small
+ */
+uint32_t ICACHE_FLASH_ATTR outq_report(char *buf, uint32_t len);
+
+#endif
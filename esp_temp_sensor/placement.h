@@ -0,0 +1,79 @@
+// Generated by placement.py, do not edit; see profile.h and "make placement".
+// No profile: everything in flash.
+#ifndef PLACEMENT_H
+#define PLACEMENT_H
+
+#include "c_types.h"
+
+#define PLACE(fn) PLACE_##fn
+#define PLACE_IRAM // no section attribute: .text, which the linker puts in IRAM
+#define PLACE_FLASH ICACHE_FLASH_ATTR
+
+#define PLACE_blink_timerfunc PLACE_FLASH
+#define PLACE_brokers_publish PLACE_FLASH
+#define PLACE_capture_command PLACE_FLASH
+#define PLACE_capture_publish PLACE_FLASH
+#define PLACE_check_alarm PLACE_FLASH
+#define PLACE_con PLACE_FLASH
+#define PLACE_connack PLACE_FLASH
+#define PLACE_connected_callback PLACE_FLASH
+#define PLACE_connection_lost PLACE_FLASH
+#define PLACE_data_recv_callback PLACE_FLASH
+#define PLACE_data_sent_callback PLACE_FLASH
+#define PLACE_decodeLength PLACE_FLASH
+#define PLACE_discon PLACE_FLASH
+#define PLACE_disconnected_callback PLACE_FLASH
+#define PLACE_discovery_publish PLACE_FLASH
+#define PLACE_encodeLength PLACE_FLASH
+#define PLACE_ftoa PLACE_FLASH
+#define PLACE_heat_timerfunc PLACE_FLASH
+#define PLACE_init_mqtt PLACE_FLASH
+#define PLACE_intToStr PLACE_FLASH
+#define PLACE_lost_connection PLACE_FLASH
+#define PLACE_memory_publish PLACE_FLASH
+#define PLACE_message_received PLACE_FLASH
+#define PLACE_mqttArmKeepAlive PLACE_FLASH
+#define PLACE_mqttAwaitReply PLACE_FLASH
+#define PLACE_mqttConnSend PLACE_FLASH
+#define PLACE_mqttConnTransmit PLACE_FLASH
+#define PLACE_mqttConnectFlags PLACE_FLASH
+#define PLACE_mqttDropConnection PLACE_FLASH
+#define PLACE_mqttFlashCopy PLACE_FLASH
+#define PLACE_mqttHandlePacket PLACE_FLASH
+#define PLACE_mqttNextPacketId PLACE_FLASH
+#define PLACE_mqttPublish PLACE_FLASH
+#define PLACE_mqttPublishBegin PLACE_FLASH
+#define PLACE_mqttPublishEnd PLACE_FLASH
+#define PLACE_mqttPublishQos1 PLACE_FLASH
+#define PLACE_mqttPutString PLACE_FLASH
+#define PLACE_mqttReplyTimeout PLACE_FLASH
+#define PLACE_mqttSend PLACE_FLASH
+#define PLACE_mqttSendBuilt PLACE_FLASH
+#define PLACE_mqttSendFlags PLACE_FLASH
+#define PLACE_mqttSendPrecompiled PLACE_FLASH
+#define PLACE_mqttSendTopic PLACE_FLASH
+#define PLACE_mqttSetSendQueue PLACE_FLASH
+#define PLACE_mqttTxReset PLACE_FLASH
+#define PLACE_outq_publish PLACE_FLASH
+#define PLACE_pingAlive PLACE_FLASH
+#define PLACE_power_report PLACE_FLASH
+#define PLACE_pubfloat PLACE_FLASH
+#define PLACE_publish_reading PLACE_FLASH
+#define PLACE_pubtemp PLACE_FLASH
+#define PLACE_pubuint PLACE_FLASH
+#define PLACE_read_temp PLACE_FLASH
+#define PLACE_reconnected_callback PLACE_FLASH
+#define PLACE_reverse PLACE_FLASH
+#define PLACE_rollup_publish PLACE_FLASH
+#define PLACE_sampler_publish PLACE_FLASH
+#define PLACE_sn_connack PLACE_FLASH
+#define PLACE_sn_lost PLACE_FLASH
+#define PLACE_state_publish PLACE_FLASH
+#define PLACE_sub PLACE_FLASH
+#define PLACE_tcpConnect PLACE_FLASH
+#define PLACE_tcp_lost PLACE_FLASH
+#define PLACE_tlsHandshakeDone PLACE_FLASH
+#define PLACE_tlsSampleHeap PLACE_FLASH
+#define PLACE_wifi_timer_cb PLACE_FLASH
+
+#endif
@@ -0,0 +1,188 @@
+#!/usr/bin/env python3
+##
+# @file
+# @brief Picks which functions run from IRAM, from a PROFILE=1 run
+#
+# Code in flash runs through a 32 KB cache; after Wi-Fi activity has evicted
+# it, every call stalls on the SPI bus. IRAM has no such stalls, but little
+# is left of it, so only the functions that run the most per byte go there.
+#
+#   resolve <serial.log> <image.nm>   turn the last PROF block of a profiling
+#                                     run into a .prof file, with names and
+#                                     sizes from "nm -S" of the same image
+#   generate [--profile run.prof]     write placement.h: the hottest small
+#                                     functions that fit --budget go to IRAM,
+#                                     the rest and everything in --cold to flash
+#   compare <before.prof> <after.prof>
+#                                     per-call cost of each function in two runs
+#
+# Functions are placed through PLACE(name) at their definitions, so only
+# functions written that way in --sources can move.
+
+import argparse
+import re
+import sys
+
+COLD = ["user_init", "user_pre_init", "wifi_init", "init_mqtt", "wifi_timer_cb", "tcpConnect"]
+PLACE = re.compile(r"\bPLACE\((\w+)\)")
+
+
+def read_log(path):
+    """Returns (mhz, {address: (calls, self_us, total_us, max_cycles)}) of the last complete dump"""
+    block, last, mhz = None, None, 80
+    for line in open(path, errors="replace"):
+        fields = line.split()
+        if len(fields) < 2 or fields[0] != "PROF":
+            continue
+        if fields[1] == "begin":
+            block = {}
+            mhz = int(fields[2]) if len(fields) > 2 else 80
+        elif fields[1] == "end" and block is not None:
+            last, block = (mhz, block), None
+        elif block is not None and len(fields) == 6:
+            block[int(fields[1], 16)] = tuple(int(f) for f in fields[2:])
+    if last is None:
+        sys.exit("{0}: no complete PROF block".format(path))
+    return last
+
+
+def read_nm(path):
+    """nm -S output: {address: (name, size)}"""
+    symbols = {}
+    for line in open(path):
+        fields = line.split()
+        if len(fields) == 4 and fields[2] in "tTwW":
+            symbols[int(fields[0], 16)] = (fields[3], int(fields[1], 16))
+    return symbols
+
+
+def read_prof(path):
+    """{name: dict(calls, self_us, total_us, max_cycles, size)} and the clock in MHz"""
+    funcs, mhz = {}, 80
+    for line in open(path):
+        fields = line.split()
+        if line.startswith("# mhz"):
+            mhz = int(fields[2])
+        if not fields or fields[0].startswith("#"):
+            continue
+        calls, self_us, total_us, max_cycles, size = (int(f) for f in fields[1:6])
+        funcs[fields[0]] = dict(calls=calls, self_us=self_us, total_us=total_us, max_cycles=max_cycles, size=size)
+    return funcs, mhz
+
+
+def cmd_resolve(args):
+    mhz, block = read_log(args.log)
+    symbols = read_nm(args.nm)
+    print("# mhz {0}".format(mhz))
+    print("# name calls self_us total_us max_cycles size")
+    for addr, (calls, self_us, total_us, max_cycles) in sorted(block.items(), key=lambda kv: -kv[1][1]):
+        name, size = symbols.get(addr, ("0x{0:08x}".format(addr), 0))
+        print("{0} {1} {2} {3} {4} {5}".format(name, calls, self_us, total_us, max_cycles, size))
+
+
+def choose(funcs, placeable, args):
+    """Greedy by self time per byte. Returns (chosen names, bytes used)"""
+    cold = set(COLD) | set(args.cold)
+    candidates = []
+    for name, f in funcs.items():
+        if name not in placeable or name in cold or f["size"] == 0:
+            continue
+        if f["calls"] < args.min_calls or f["size"] > args.max_size:
+            continue
+        cost = int(f["size"] * (1 + args.literal_overhead))
+        candidates.append((f["self_us"] / cost, name, cost))
+    chosen, used = set(), 0
+    for _, name, cost in sorted(candidates, reverse=True):
+        if used + cost <= args.budget:
+            chosen.add(name)
+            used += cost
+    return chosen, used
+
+
+def cmd_generate(args):
+    placeable = []
+    for path in args.sources:
+        for name in PLACE.findall(open(path).read()):
+            if name not in placeable:
+                placeable.append(name)
+    funcs = read_prof(args.profile)[0] if args.profile else {}
+    chosen, used = choose(funcs, placeable, args)
+
+    out = open(args.output, "w") if args.output else sys.stdout
+    out.write("// Generated by placement.py, do not edit; see profile.h and \"make placement\".\n")
+    if args.profile:
+        out.write("// Profile {0}, IRAM budget {1} bytes, {2} used.\n".format(args.profile, args.budget, used))
+    else:
+        out.write("// No profile: everything in flash.\n")
+    out.write("#ifndef PLACEMENT_H\n#define PLACEMENT_H\n\n#include \"c_types.h\"\n\n")
+    out.write("#define PLACE(fn) PLACE_##fn\n")
+    out.write("#define PLACE_IRAM // no section attribute: .text, which the linker puts in IRAM\n")
+    out.write("#define PLACE_FLASH ICACHE_FLASH_ATTR\n\n")
+    for name in sorted(placeable):
+        where = "PLACE_IRAM" if name in chosen else "PLACE_FLASH"
+        note = ""
+        if name in funcs:
+            f = funcs[name]
+            note = " // {0} calls, {1} us, {2} bytes".format(f["calls"], f["self_us"], f["size"])
+        out.write("#define PLACE_{0} {1}{2}\n".format(name, where, note))
+    out.write("\n#endif\n")
+    if args.output:
+        out.close()
+        print("{0}: {1} of {2} functions in IRAM, {3} of {4} bytes".format(
+            args.output, len(chosen), len(placeable), used, args.budget))
+
+
+def cmd_compare(args):
+    before, mhz_b = read_prof(args.before)
+    after, mhz_a = read_prof(args.after)
+    print("{0:<24} {1:>12} {2:>12} {3:>7} {4:>12} {5:>12}".format(
+        "function", "cycles/call", "after", "change", "max cycles", "after"))
+    for name in sorted(set(before) & set(after), key=lambda n: -before[n]["total_us"]):
+        b, a = before[name], after[name]
+        if b["calls"] == 0 or a["calls"] == 0:
+            continue
+        per_b = b["total_us"] * mhz_b / b["calls"]
+        per_a = a["total_us"] * mhz_a / a["calls"]
+        change = 100.0 * (per_a - per_b) / per_b if per_b else 0.0
+        print("{0:<24} {1:>12.0f} {2:>12.0f} {3:>+6.1f}% {4:>12} {5:>12}".format(
+            name, per_b, per_a, change, b["max_cycles"], a["max_cycles"]))
+    # only meaningful when both runs lasted equally long under the same load
+    total_b = sum(f["self_us"] for f in before.values())
+    total_a = sum(f["self_us"] for f in after.values())
+    if total_b:
+        print("\ntime in profiled code: {0} -> {1} us ({2:+.1f}%)".format(
+            total_b, total_a, 100.0 * (total_a - total_b) / total_b))
+
+
+def main():
+    parser = argparse.ArgumentParser(description="profile-guided IRAM placement")
+    sub = parser.add_subparsers(dest="command")
+    sub.required = True
+
+    p = sub.add_parser("resolve")
+    p.add_argument("log")
+    p.add_argument("nm")
+    p.set_defaults(func=cmd_resolve)
+
+    p = sub.add_parser("generate")
+    p.add_argument("--profile", help=".prof file from resolve; without it everything stays in flash")
+    p.add_argument("--sources", nargs="+", required=True, help="files with PLACE() definitions")
+    p.add_argument("--budget", type=int, default=2048, help="IRAM bytes to spend")
+    p.add_argument("--max-size", type=int, default=512, help="larger functions stay in flash")
+    p.add_argument("--min-calls", type=int, default=2, help="functions called less often are init code")
+    p.add_argument("--literal-overhead", type=float, default=0.25, help="IRAM taken by literal pools, as a fraction of code size")
+    p.add_argument("--cold", nargs="*", default=[], help="more functions that always stay in flash")
+    p.add_argument("-o", "--output")
+    p.set_defaults(func=cmd_generate)
+
+    p = sub.add_parser("compare")
+    p.add_argument("before")
+    p.add_argument("after")
+    p.set_defaults(func=cmd_compare)
+
+    args = parser.parse_args()
+    args.func(args)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,108 @@
+#include "ets_sys.h"
+#include "osapi.h"
+#include "os_type.h"
+#include "user_interface.h"
+#include "timebase.h"
+#include "twheel.h"
+#include "power.h"
+
+static struct {
+    uint8_t mode;
+    uint8_t holds;
+    uint64_t lastUs; // local time accounted up to
+    uint64_t activeUntil; // radio kept on by traffic until then
+    uint64_t phaseUs; // a DTIM beacon, or our best guess at one
+    uint64_t modeUs[3];
+    uint64_t radioUs;
+    uint8_t (*lightOk)(void);
+} pm;
+
+static power_stats_t stats;
+
+static void ICACHE_FLASH_ATTR account(uint64_t now) {
+    uint64_t elapsed = now - pm.lastUs;
+    pm.modeUs[pm.mode] += elapsed;
+    if (pm.mode == POWER_AWAKE) {
+        pm.radioUs += elapsed;
+    } else {
+        // one wake for every DTIM beacon in between
+        pm.radioUs += ((now - pm.phaseUs) / POWER_DTIM_US - (pm.lastUs - pm.phaseUs) / POWER_DTIM_US) * POWER_BEACON_US;
+    }
+    pm.lastUs = now;
+}
+
+static void ICACHE_FLASH_ATTR set_mode(uint8_t mode) {
+    static const uint8_t sdkType[] = { NONE_SLEEP_T, LIGHT_SLEEP_T, MODEM_SLEEP_T };
+    if (mode == pm.mode) {
+        return;
+    }
+    account(timebase_local_us());
+    wifi_set_sleep_type(sdkType[mode]);
+    // no point lining timers up for a radio that is on anyway
+    twheel_set_grid((mode == POWER_AWAKE) ? 0 : POWER_DTIM_US, pm.phaseUs);
+    pm.mode = mode;
+    stats.switches++;
+}
+
+// called by the wheel whenever its next wake moves
+static void ICACHE_FLASH_ATTR choose_mode(uint32_t nextMs) {
+    if (pm.holds > 0) {
+        set_mode(POWER_AWAKE);
+    } else if (nextMs >= POWER_LIGHT_MIN_MS && (pm.lightOk == NULL || pm.lightOk())) {
+        set_mode(POWER_LIGHT);
+    } else {
+        set_mode(POWER_MODEM);
+    }
+}
+
+void ICACHE_FLASH_ATTR power_init(void) {
+    pm.lastUs = pm.phaseUs = timebase_local_us();
+    pm.mode = POWER_AWAKE;
+    pm.holds = 1;
+    wifi_set_sleep_type(NONE_SLEEP_T);
+    twheel_set_schedule_cb(choose_mode);
+}
+
+void ICACHE_FLASH_ATTR power_hold(void) {
+    pm.holds++;
+    choose_mode(twheel_next_ms());
+}
+
+void ICACHE_FLASH_ATTR power_release(void) {
+    if (pm.holds > 0) {
+        pm.holds--;
+    }
+    choose_mode(twheel_next_ms());
+}
+
+void ICACHE_FLASH_ATTR power_set_light_check(uint8_t (*fn)(void)) {
+    pm.lightOk = fn;
+}
+
+void ICACHE_FLASH_ATTR power_packet(uint8_t rx) {
+    uint64_t now = timebase_local_us();
+    uint64_t from = (pm.activeUntil > now) ? pm.activeUntil : now;
+    account(now);
+    stats.packets++;
+    if (pm.mode == POWER_AWAKE) {
+        return;
+    }
+    if (rx && pm.activeUntil <= now) {
+        // nothing was outstanding, so this waited at the access point for a beacon
+        pm.phaseUs = now;
+        twheel_set_grid(POWER_DTIM_US, now);
+    }
+    pm.radioUs += now + POWER_TRAFFIC_US - from;
+    pm.activeUntil = now + POWER_TRAFFIC_US;
+}
+
+const power_stats_t * ICACHE_FLASH_ATTR power_stats(void) {
+    uint8_t i;
+    account(timebase_local_us());
+    for (i = 0; i < 3; i++) {
+        stats.modeMs[i] = (uint32_t)(pm.modeUs[i] / 1000);
+    }
+    stats.radioMs = (uint32_t)(pm.radioUs / 1000);
+    stats.mode = pm.mode;
+    return &stats;
+}
@@ -0,0 +1,91 @@
+/**
+ * @file
+ * @brief Radio power management for mains powered sensors that stay connected.
+ *
+ * Deep sleep saves the most but costs a Wi-Fi association and an MQTT
+ * connect on every wake. Here the station stays associated and the SDK's
+ * own sleep modes are used instead. In modem-sleep the radio only wakes for
+ * the DTIM beacons, where the access point announces buffered frames, and
+ * when there is something to send. Light-sleep also suspends the CPU
+ * between beacons, so it is only chosen when the timer wheel has nothing
+ * due for a while and the PWM outputs are settled.
+ *
+ * Timers at least one DTIM interval long are aligned to the DTIM grid
+ * through twheel_set_grid(), so publishes, keepalives and samples due close
+ * together go out in the same radio wake.
+ *
+ * The SDK does not report when the radio is on, so it is estimated: always
+ * without sleep, otherwise POWER_BEACON_US for each DTIM interval plus
+ * POWER_TRAFFIC_US after each packet sent or received. Measure a device's
+ * current once to calibrate the two and the totals compare modes fairly.
+ */
+#ifndef POWER_H
+#define POWER_H
+
+#include "os_type.h"
+
+#define POWER_BEACON_INTERVAL_US 102400 /**< The access point's beacon interval, 100 TU on almost all of them */
+#define POWER_DTIM_PERIOD 3 /**< Beacons per DTIM, as set on the access point */
+#define POWER_DTIM_US (POWER_BEACON_INTERVAL_US * POWER_DTIM_PERIOD)
+#define POWER_LIGHT_MIN_MS 1000 /**< Light-sleep only when the next timer is at least this far off */
+#define POWER_BEACON_US 3000 /**< Radio on time estimated for each DTIM beacon */
+#define POWER_TRAFFIC_US 50000 /**< Radio on time estimated after each packet */
+
+/**
+ * @typedef
+ * The SDK sleep types, in the order of enum sleep_type.
+ */
+typedef enum power_mode_enum {
+    POWER_AWAKE = 0, /**< NONE_SLEEP_T, the radio is always on */
+    POWER_LIGHT = 1, /**< LIGHT_SLEEP_T, radio and CPU sleep between DTIM beacons */
+    POWER_MODEM = 2, /**< MODEM_SLEEP_T, the radio sleeps between DTIM beacons */
+} power_mode_t;
+
+/**
+ * @struct power_stats_t
+ * Time spent in each mode and the estimated radio on time, in milliseconds.
+ */
+typedef struct {
+    uint32_t modeMs[3]; /**< Time in each power_mode_t */
+    uint32_t radioMs; /**< Estimated time the radio was on */
+    uint32_t packets; /**< Packets sent and received */
+    uint32_t switches; /**< Sleep type changes */
+    uint8_t mode; /**< The current power_mode_t */
+} power_stats_t;
+
+/**
+ * Starts in POWER_AWAKE, held until power_release(). Call from user_init()
+ * after twheel_init().
+ */
+void ICACHE_FLASH_ATTR power_init(void);
+
+/**
+ * Keeps the radio awake, e.g. while connecting. Holds nest.
+ */
+void ICACHE_FLASH_ATTR power_hold(void);
+
+/**
+ * Drops one power_hold(); sleep resumes when none are left.
+ */
+void ICACHE_FLASH_ATTR power_release(void);
+
+/**
+ * @param fn returns 0 while light-sleep would disturb something, such as
+ * PWM outputs driven from the CPU; NULL allows it always
+ */
+void ICACHE_FLASH_ATTR power_set_light_check(uint8_t (*fn)(void));
+
+/**
+ * Counts one packet sent or received towards the radio on time. A
+ * received packet that is not the reply to one we just sent was buffered
+ * by the access point until a DTIM beacon, so it moves the grid to that beacon.
+ * @param rx 1 for a received packet
+ */
+void ICACHE_FLASH_ATTR power_packet(uint8_t rx);
+
+/**
+ * @return the counters, brought up to date
+ */
+const power_stats_t * ICACHE_FLASH_ATTR power_stats(void);
+
+#endif
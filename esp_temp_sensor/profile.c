@@ -0,0 +1,116 @@
+#include "ets_sys.h"
+#include "osapi.h"
+#include "os_type.h"
+#include "user_interface.h"
+#include "profile.h"
+
+#ifdef PROFILE
+
+// The hooks run on every call in the instrumented files, so they stay in
+// IRAM and must not be instrumented themselves.
+#define NO_PROFILE __attribute__((no_instrument_function))
+
+typedef struct {
+    void *fn;
+    uint32_t calls;
+    uint64_t selfCycles; // excluding time spent in instrumented callees
+    uint64_t totalCycles;
+    uint32_t maxCycles; // longest single call, including callees
+} profile_entry_t;
+
+typedef struct {
+    profile_entry_t *entry;
+    uint32_t start;
+    uint32_t childCycles;
+} profile_frame_t;
+
+static profile_entry_t entries[PROFILE_MAX_FUNCS];
+static profile_frame_t stack[PROFILE_MAX_DEPTH];
+static uint8_t depth;
+static uint8_t overflow; // calls deeper than PROFILE_MAX_DEPTH still nesting
+static os_timer_t dumpTimer;
+
+static inline uint32_t NO_PROFILE ccount(void) {
+#ifdef __XTENSA__
+    uint32_t c;
+    __asm__ __volatile__("rsr %0, ccount" : "=a"(c));
+    return c;
+#else
+    return system_get_time() * system_get_cpu_freq();
+#endif
+}
+
+static profile_entry_t * NO_PROFILE profile_entry(void *fn) {
+    uint32_t i = ((uint32_t)(uintptr_t)fn >> 2) % PROFILE_MAX_FUNCS;
+    uint32_t n;
+    for (n = 0; n < PROFILE_MAX_FUNCS; n++) {
+        profile_entry_t *e = &entries[(i + n) % PROFILE_MAX_FUNCS];
+        if (e->fn == fn) {
+            return e;
+        }
+        if (e->fn == NULL) {
+            e->fn = fn;
+            return e;
+        }
+    }
+    return NULL;
+}
+
+void NO_PROFILE __cyg_profile_func_enter(void *fn, void *call_site) {
+    if (depth == PROFILE_MAX_DEPTH) {
+        overflow++;
+        return;
+    }
+    stack[depth].entry = profile_entry(fn);
+    stack[depth].childCycles = 0;
+    depth++;
+    stack[depth - 1].start = ccount(); // last, so the lookup is not counted
+}
+
+void NO_PROFILE __cyg_profile_func_exit(void *fn, void *call_site) {
+    uint32_t now = ccount();
+    profile_frame_t *f;
+    uint32_t cycles;
+    if (overflow > 0) {
+        overflow--;
+        return;
+    }
+    if (depth == 0) {
+        return;
+    }
+    f = &stack[--depth];
+    cycles = now - f->start;
+    if (f->entry != NULL) {
+        f->entry->calls++;
+        f->entry->selfCycles += cycles - f->childCycles;
+        f->entry->totalCycles += cycles;
+        if (cycles > f->entry->maxCycles) {
+            f->entry->maxCycles = cycles;
+        }
+    }
+    if (depth > 0) {
+        stack[depth - 1].childCycles += cycles;
+    }
+}
+
+void ICACHE_FLASH_ATTR NO_PROFILE profile_dump(void) {
+    uint32_t mhz = system_get_cpu_freq();
+    uint32_t i;
+    os_printf("PROF begin %d MHz\n", mhz);
+    for (i = 0; i < PROFILE_MAX_FUNCS; i++) {
+        profile_entry_t *e = &entries[i];
+        if (e->fn != NULL) {
+            os_printf("PROF %08x %d %d %d %d\n", (uint32_t)(uintptr_t)e->fn, e->calls, (uint32_t)(e->selfCycles / mhz),
+                      (uint32_t)(e->totalCycles / mhz), e->maxCycles);
+        }
+    }
+    os_printf("PROF end\n");
+}
+
+void ICACHE_FLASH_ATTR NO_PROFILE profile_init(void) {
+    os_timer_disarm(&dumpTimer);
+    os_timer_setfn(&dumpTimer, (os_timer_func_t *)profile_dump, NULL);
+    os_timer_arm(&dumpTimer, PROFILE_DUMP_MS, 1);
+}
+
+#endif
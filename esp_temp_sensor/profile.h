@@ -0,0 +1,34 @@
+/**
+ * @file
+ * @brief Per-function cycle counts for placement decisions.
+ *
+ * Built with "make PROFILE=1", mqtt.c and main.c are compiled with
+ * -finstrument-functions and every call is timed with the CCOUNT register.
+ * Every PROFILE_DUMP_MS the totals go to the serial port as lines of
+ *
+ *   PROF <address> <calls> <self us> <total us> <max cycles>
+ *
+ * between "PROF begin" and "PROF end". placement.py resolves the addresses
+ * against the profiled image and picks which functions go in IRAM.
+ */
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include "os_type.h"
+
+#define PROFILE_MAX_FUNCS 64 /**< Distinct functions tracked; calls to any more are not counted */
+#define PROFILE_MAX_DEPTH 16 /**< Deepest nesting timed; deeper calls are not counted */
+#define PROFILE_DUMP_MS 60000 /**< How often the totals are printed */
+
+/**
+ * Starts the periodic dump. Call from user_init(); counting itself starts
+ * with the first instrumented call.
+ */
+void ICACHE_FLASH_ATTR profile_init(void);
+
+/**
+ * Prints the totals so far.
+ */
+void ICACHE_FLASH_ATTR profile_dump(void);
+
+#endif
@@ -0,0 +1,197 @@
+#include "ets_sys.h"
+#include "osapi.h"
+#include "gpio.h"
+#include "os_type.h"
+#include "user_interface.h"
+#include "pwm_out.h"
+
+// hw_timer.c in the SDK driver_lib ships without a header
+typedef enum {
+    FRC1_SOURCE = 0,
+    NMI_SOURCE = 1,
+} FRC1_TIMER_SOURCE_TYPE;
+void hw_timer_init(FRC1_TIMER_SOURCE_TYPE source_type, u8 req);
+void hw_timer_arm(u32 val);
+void hw_timer_set_func(void (*user_hw_timer_cb_set)(void));
+
+#define PWM_EXP_SHIFT 3 // exponential ramp closes 1/8 of the gap per period
+
+typedef struct {
+    uint32_t mask; // GPIO bit for this channel
+    uint16_t phase; // tick at which the on-edge happens
+    volatile uint16_t duty; // duty currently being output
+    uint16_t target; // duty we are ramping towards
+    uint8_t profile; // one of pwm_ramp_t
+    int8_t dir; // +1 or -1 for linear ramps
+    uint16_t delta; // distance covered by the linear ramp
+    uint32_t periods; // number of PWM periods the linear ramp takes
+    uint32_t acc; // Bresenham accumulator for the linear ramp
+} pwm_channel_t;
+
+static pwm_channel_t channels[PWM_OUT_MAX_CHANNELS];
+static uint8_t channel_count;
+static uint16_t tick_count;
+static uint32_t last_tick_us;
+static pwm_out_stats_t stats;
+
+// Moves one channel one PWM period further along its ramp. Runs in the
+// timer interrupt, so it only uses adds, compares and shifts.
+static void pwm_ramp_step(pwm_channel_t *ch) {
+    uint16_t duty = ch->duty;
+    if (duty == ch->target) {
+        return;
+    }
+    switch (ch->profile) {
+        case PWM_RAMP_LINEAR:
+            ch->acc += ch->delta;
+            while (ch->acc >= ch->periods && duty != ch->target) {
+                ch->acc -= ch->periods;
+                duty += ch->dir;
+            }
+            break;
+        case PWM_RAMP_EXP: {
+            int32_t gap = (int32_t)ch->target - (int32_t)duty;
+            int32_t step = gap >> PWM_EXP_SHIFT;
+            if (step == 0) {
+                step = (gap > 0) ? 1 : -1;
+            }
+            duty += step;
+            break;
+        }
+        case PWM_RAMP_STEP:
+        default:
+            duty = ch->target;
+            break;
+    }
+    ch->duty = duty;
+}
+
+// Timer interrupt: no ICACHE_FLASH_ATTR, this must stay in IRAM
+static void pwm_out_tick(void) {
+    uint32_t now = system_get_time();
+    uint32_t set = 0;
+    uint32_t clear = 0;
+    uint8_t i;
+
+    if (stats.ticks != 0) {
+        int32_t jitter = (int32_t)(now - last_tick_us) - PWM_OUT_TICK_US;
+        // the first interval sets both, so a timer that is always late reports a positive minimum
+        if (stats.ticks == 1 || jitter < stats.min_jitter_us) stats.min_jitter_us = jitter;
+        if (stats.ticks == 1 || jitter > stats.max_jitter_us) stats.max_jitter_us = jitter;
+    }
+    last_tick_us = now;
+    stats.ticks++;
+
+    for (i = 0; i < channel_count; i++) {
+        pwm_channel_t *ch = &channels[i];
+        uint16_t pos = (tick_count >= ch->phase) ? tick_count - ch->phase : tick_count + PWM_OUT_STEPS - ch->phase;
+        if (pos < ch->duty) {
+            set |= ch->mask;
+        } else {
+            clear |= ch->mask;
+        }
+    }
+    GPIO_REG_WRITE(GPIO_OUT_W1TS_ADDRESS, set);
+    GPIO_REG_WRITE(GPIO_OUT_W1TC_ADDRESS, clear);
+
+    if (++tick_count == PWM_OUT_STEPS) {
+        tick_count = 0;
+        stats.periods++;
+        for (i = 0; i < channel_count; i++) {
+            pwm_ramp_step(&channels[i]);
+        }
+    }
+}
+
+void ICACHE_FLASH_ATTR pwm_out_init(const uint8_t *pins, uint8_t count) {
+    uint32_t enable = 0;
+    uint8_t i;
+    if (count > PWM_OUT_MAX_CHANNELS) {
+        count = PWM_OUT_MAX_CHANNELS;
+    }
+    os_memset(channels, 0, sizeof(channels));
+    os_memset(&stats, 0, sizeof(stats));
+    for (i = 0; i < count; i++) {
+        channels[i].mask = 1 << pins[i];
+        // stagger the on-edges evenly so loads never switch on together
+        channels[i].phase = (uint16_t)((i * PWM_OUT_STEPS) / count);
+        enable |= channels[i].mask;
+    }
+    channel_count = count;
+    tick_count = 0;
+    gpio_output_set(0, enable, enable, 0); // all outputs low and enabled
+
+    hw_timer_init(FRC1_SOURCE, 1); // auto reload
+    hw_timer_set_func(pwm_out_tick);
+    hw_timer_arm(PWM_OUT_TICK_US);
+#ifdef DEBUG
+    os_printf("PWM started: %d channels, %dus period\n", count, PWM_OUT_STEPS * PWM_OUT_TICK_US);
+#endif
+}
+
+void ICACHE_FLASH_ATTR pwm_out_set(uint8_t channel, uint16_t duty, pwm_ramp_t profile, uint32_t ramp_ms) {
+    if (channel >= channel_count) {
+        return;
+    }
+    if (duty > PWM_OUT_STEPS) {
+        duty = PWM_OUT_STEPS;
+    }
+    pwm_channel_t *ch = &channels[channel];
+    // the interrupt reads these as a set, so update them together
+    ETS_INTR_LOCK();
+    ch->target = duty;
+    ch->profile = profile;
+    ch->acc = 0;
+    ch->dir = (duty >= ch->duty) ? 1 : -1;
+    ch->delta = (duty >= ch->duty) ? duty - ch->duty : ch->duty - duty;
+    ch->periods = (ramp_ms * 1000) / (PWM_OUT_STEPS * PWM_OUT_TICK_US);
+    if (profile == PWM_RAMP_LINEAR && ch->periods == 0) {
+        ch->profile = PWM_RAMP_STEP;
+    }
+    ETS_INTR_UNLOCK();
+}
+
+void ICACHE_FLASH_ATTR pwm_out_proportional(uint8_t channel, int32_t setpoint, int32_t measured, int32_t band) {
+    int32_t error, duty;
+    if (measured == PWM_OUT_NO_MEASUREMENT) {
+        // without a temperature the error could be anything, so no heat at all
+        pwm_out_set(channel, 0, PWM_RAMP_STEP, 0);
+        return;
+    }
+    error = setpoint - measured;
+    if (band <= 0 || error <= 0) {
+        duty = 0;
+    } else if (error >= band) {
+        duty = PWM_OUT_STEPS;
+    } else {
+        duty = (error * PWM_OUT_STEPS) / band;
+    }
+    if (channel < channel_count && channels[channel].target != (uint16_t)duty) {
+        pwm_out_set(channel, (uint16_t)duty, PWM_RAMP_EXP, 0);
+    }
+}
+
+uint16_t ICACHE_FLASH_ATTR pwm_out_get_duty(uint8_t channel) {
+    return (channel < channel_count) ? channels[channel].duty : 0;
+}
+
+uint16_t ICACHE_FLASH_ATTR pwm_out_get_target(uint8_t channel) {
+    return (channel < channel_count) ? channels[channel].target : 0;
+}
+
+void ICACHE_FLASH_ATTR pwm_out_get_stats(pwm_out_stats_t *out) {
+    ETS_INTR_LOCK();
+    os_memcpy(out, &stats, sizeof(stats));
+    ETS_INTR_UNLOCK();
+}
+
+uint8_t ICACHE_FLASH_ATTR pwm_out_static(void) {
+    uint8_t i;
+    for (i = 0; i < channel_count; i++) {
+        uint16_t duty = channels[i].duty;
+        if (duty != channels[i].target || (duty != 0 && duty != PWM_OUT_STEPS)) {
+            return 0;
+        }
+    }
+    return 1;
+}
@@ -0,0 +1,80 @@
+/**
+ * @file
+ * @brief Multi-channel software PWM driven from the FRC1 hardware timer.
+ *
+ * Used for ceramic heat emitters and lamps, so heat output can be set
+ * proportionally instead of toggled on and off.
+ */
+#ifndef PWM_OUT_H
+#define PWM_OUT_H
+
+#include "os_type.h"
+
+#define PWM_OUT_MAX_CHANNELS 4 /**< Number of channels the driver can run */
+#define PWM_OUT_STEPS 100 /**< Duty resolution, in ticks per PWM period */
+#define PWM_OUT_TICK_US 200 /**< Hardware timer period; STEPS * TICK_US is the PWM period (20ms) */
+#define PWM_OUT_NO_MEASUREMENT ((int32_t)0x80000000) /**< pwm_out_proportional()'s measured when the sensor has failed */
+
+/**
+ * @typedef
+ * How a channel moves from its current duty to a new target.
+ */
+typedef enum pwm_ramp_enum {
+    PWM_RAMP_STEP = 0, /**< Jump straight to the target */
+    PWM_RAMP_LINEAR = 1, /**< Constant slope, reaching the target after ramp_ms */
+    PWM_RAMP_EXP = 2, /**< First order lag, closes 1/8 of the remaining gap every period */
+} pwm_ramp_t;
+
+/**
+ * @struct pwm_out_stats_t
+ * Timing statistics gathered by the timer interrupt.
+ */
+typedef struct {
+    uint32_t ticks; /**< Number of timer interrupts serviced */
+    uint32_t periods; /**< Number of full PWM periods */
+    int32_t min_jitter_us; /**< Smallest deviation from PWM_OUT_TICK_US, 0 until two ticks have run */
+    int32_t max_jitter_us; /**< Largest deviation from PWM_OUT_TICK_US, 0 until two ticks have run */
+} pwm_out_stats_t;
+
+/**
+ * Set up the channels and start the hardware timer.
+ * @param pins array of GPIO numbers, one per channel
+ * @param count the number of channels, at most PWM_OUT_MAX_CHANNELS
+ *
+ * Channel on-edges are spread evenly across the period, so channels switching
+ * heavy loads never turn on in the same tick.
+ */
+void ICACHE_FLASH_ATTR pwm_out_init(const uint8_t *pins, uint8_t count);
+
+/**
+ * Set a new target duty for a channel.
+ * @param channel the channel index
+ * @param duty the target duty, 0 to PWM_OUT_STEPS
+ * @param profile how to get there, one of pwm_ramp_t
+ * @param ramp_ms how long a linear ramp should take; ignored by the other profiles
+ */
+void ICACHE_FLASH_ATTR pwm_out_set(uint8_t channel, uint16_t duty, pwm_ramp_t profile, uint32_t ramp_ms);
+
+/**
+ * Proportional heat output.
+ * @param channel the channel index
+ * @param setpoint the wanted temperature, in centi-degrees
+ * @param measured the current temperature, in centi-degrees, or
+ *        PWM_OUT_NO_MEASUREMENT to turn the output off at the end of the period
+ * @param band the proportional band in centi-degrees; full output at setpoint - band
+ *
+ * The duty is ramped exponentially so a changing error does not slam the load.
+ */
+void ICACHE_FLASH_ATTR pwm_out_proportional(uint8_t channel, int32_t setpoint, int32_t measured, int32_t band);
+
+uint16_t ICACHE_FLASH_ATTR pwm_out_get_duty(uint8_t channel);
+uint16_t ICACHE_FLASH_ATTR pwm_out_get_target(uint8_t channel);
+void ICACHE_FLASH_ATTR pwm_out_get_stats(pwm_out_stats_t *stats);
+
+/**
+ * @return 1 if every channel has finished ramping and is fully off or fully
+ * on, so the outputs stay right while the timer interrupt is held off
+ */
+uint8_t ICACHE_FLASH_ATTR pwm_out_static(void);
+
+#endif
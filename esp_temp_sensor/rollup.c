@@ -0,0 +1,207 @@
+#include "ets_sys.h"
+#include "osapi.h"
+#include "os_type.h"
+#include "twheel.h"
+#include "timebase.h"
+#include "ntc.h"
+#include "rollup.h"
+
+#define CLOCK_WAIT_MS 60000 // between looks at the clock while it is unknown
+
+static const uint32_t periodsS[ROLLUP_LEVELS] = ROLLUP_PERIODS_S;
+static const char *const names[ROLLUP_LEVELS] = { "1m", "15m", "1h" };
+
+static struct {
+    rollup_window_t w[ROLLUP_LEVELS];
+    uint8_t open; // the windows have been aligned to a time
+    uint8_t holding; // held carries on from heldFromMs
+    int32_t held; // the last reading
+    uint64_t heldFromMs; // accounted up to here, never before the minute window's start
+    uint64_t lastMs; // the latest time seen, so a clock stepped back does not go back here
+    twheel_timer_t timer;
+    rollup_publish_fn publish;
+    void *arg;
+} ru;
+
+static void ICACHE_FLASH_ATTR window_reset(rollup_window_t *w, uint32_t startS) {
+    os_memset(w, 0, sizeof(*w));
+    w->startS = startS;
+    w->min = 0x7FFFFFFF;
+    w->max = -0x7FFFFFFF - 1;
+}
+
+static void ICACHE_FLASH_ATTR window_value(rollup_window_t *w, int32_t value) {
+    if (value < w->min) {
+        w->min = value;
+    }
+    if (value > w->max) {
+        w->max = value;
+    }
+}
+
+// the held reading's share of the minute window, up to ms; a value carried
+// over from the window before counts towards its minimum and maximum too
+static void ICACHE_FLASH_ATTR hold_until(uint64_t ms) {
+    uint32_t dt;
+    if (!ru.holding || ms <= ru.heldFromMs) {
+        return;
+    }
+    dt = (uint32_t)(ms - ru.heldFromMs);
+    window_value(&ru.w[0], ru.held);
+    ru.w[0].sum += (int64_t)ru.held * dt;
+    ru.w[0].heldMs += dt;
+    ru.heldFromMs = ms;
+}
+
+// publishes a window and hands it on to the next resolution
+static void ICACHE_FLASH_ATTR close_window(uint8_t level) {
+    rollup_window_t *w = &ru.w[level], *up;
+    if (w->count == 0 && w->heldMs == 0) {
+        return;
+    }
+    if (ru.publish != NULL) {
+        ru.publish(ru.arg, level, w);
+    }
+    if (level + 1 < ROLLUP_LEVELS) {
+        up = &ru.w[level + 1];
+        window_value(up, w->min);
+        window_value(up, w->max);
+        up->count += w->count;
+        up->heldMs += w->heldMs;
+        up->sum += w->sum;
+    }
+}
+
+static void ICACHE_FLASH_ATTR open_windows(uint64_t ms) {
+    uint32_t s = (uint32_t)(ms / 1000);
+    uint8_t level;
+    for (level = 0; level < ROLLUP_LEVELS; level++) {
+        window_reset(&ru.w[level], s - s % periodsS[level]);
+    }
+    ru.open = 1;
+    ru.holding = 0;
+}
+
+void ICACHE_FLASH_ATTR rollup_advance(uint64_t unixMs) {
+    uint64_t endMs;
+    uint32_t endS;
+    uint8_t level;
+    if (!ru.open) {
+        return;
+    }
+    endMs = (uint64_t)(ru.w[0].startS + periodsS[0]) * 1000;
+    if (unixMs >= endMs + (uint64_t)periodsS[ROLLUP_LEVELS - 1] * 1000) {
+        // nothing for longer than the longest window, or the clock jumped: close what there is and start again
+        hold_until(endMs);
+        for (level = 0; level < ROLLUP_LEVELS; level++) {
+            close_window(level);
+        }
+        ru.open = 0;
+        ru.holding = 0;
+        return;
+    }
+    while (unixMs >= endMs) {
+        hold_until(endMs);
+        endS = (uint32_t)(endMs / 1000);
+        // each window ends on a boundary of the ones below it, so they close finest first
+        for (level = 0; level < ROLLUP_LEVELS && ru.w[level].startS + periodsS[level] <= endS; level++) {
+            close_window(level);
+            window_reset(&ru.w[level], endS);
+        }
+        endMs += (uint64_t)periodsS[0] * 1000;
+    }
+}
+
+void ICACHE_FLASH_ATTR rollup_add_at(int32_t value, uint64_t unixMs) {
+    rollup_advance(unixMs);
+    if (!ru.open) {
+        open_windows(unixMs);
+    }
+    hold_until(unixMs);
+    window_value(&ru.w[0], value);
+    ru.w[0].count++;
+    ru.held = value;
+    ru.heldFromMs = unixMs;
+    ru.holding = 1;
+}
+
+void ICACHE_FLASH_ATTR rollup_pause_at(uint64_t unixMs) {
+    rollup_advance(unixMs);
+    hold_until(unixMs);
+    ru.holding = 0;
+}
+
+// Unix milliseconds now, never behind the last time used; 0 while the clock is unknown
+static uint64_t ICACHE_FLASH_ATTR now_ms(void) {
+    uint64_t ms = timebase_now_us() / 1000;
+    if (ms == 0) {
+        return 0;
+    }
+    if (ms < ru.lastMs) {
+        ms = ru.lastMs;
+    }
+    ru.lastMs = ms;
+    return ms;
+}
+
+// wakes just after the minute window ends, to close it without waiting for a reading
+static void ICACHE_FLASH_ATTR rollup_tick(void *arg) {
+    uint64_t ms = now_ms();
+    uint32_t periodMs = periodsS[0] * 1000;
+    if (ms == 0) {
+        twheel_arm(&ru.timer, CLOCK_WAIT_MS, 0);
+        return;
+    }
+    rollup_advance(ms);
+    twheel_arm(&ru.timer, periodMs - (uint32_t)(ms % periodMs), 0);
+}
+
+void ICACHE_FLASH_ATTR rollup_start(rollup_publish_fn publish, void *arg) {
+    ru.publish = publish;
+    ru.arg = arg;
+    twheel_disarm(&ru.timer);
+    twheel_setfn(&ru.timer, (twheel_fn)rollup_tick, NULL);
+    rollup_tick(NULL);
+}
+
+void ICACHE_FLASH_ATTR rollup_add(int32_t value) {
+    uint64_t ms = now_ms();
+    if (ms != 0) {
+        rollup_add_at(value, ms);
+    }
+}
+
+void ICACHE_FLASH_ATTR rollup_pause(void) {
+    uint64_t ms = now_ms();
+    if (ms != 0) {
+        rollup_pause_at(ms);
+    }
+}
+
+uint32_t ICACHE_FLASH_ATTR rollup_period_s(uint8_t level) {
+    return periodsS[level];
+}
+
+const char * ICACHE_FLASH_ATTR rollup_name(uint8_t level) {
+    return names[level];
+}
+
+int32_t ICACHE_FLASH_ATTR rollup_average(const rollup_window_t *w) {
+    int64_t half = w->heldMs / 2;
+    if (w->heldMs == 0) {
+        // only readings at the very end, with no time to hold
+        return (w->count > 0) ? w->max : 0;
+    }
+    return (int32_t)(((w->sum < 0) ? w->sum - half : w->sum + half) / w->heldMs);
+}
+
+uint32_t ICACHE_FLASH_ATTR rollup_format(const rollup_window_t *w, char *buf) {
+    uint32_t len = os_sprintf(buf, "start=%u;count=%u;min=", w->startS, w->count);
+    len += ntc_format(w->min, buf + len);
+    len += os_sprintf(buf + len, ";max=");
+    len += ntc_format(w->max, buf + len);
+    len += os_sprintf(buf + len, ";avg=");
+    len += ntc_format(rollup_average(w), buf + len);
+    len += os_sprintf(buf + len, ";held_s=%u", w->heldMs / 1000);
+    return len;
+}
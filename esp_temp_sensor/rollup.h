@@ -0,0 +1,117 @@
+/**
+ * @file
+ * @brief Minute, quarter-hour and hourly min/max/average of the readings.
+ *
+ * Each resolution keeps one window: its start, minimum, maximum, count and
+ * sum, in integer hundredths, so memory does not grow with the readings.
+ * Only the minute window sees readings. When it closes it is merged into
+ * the quarter-hour one, and that into the hour, so a reading costs the
+ * same however many resolutions there are.
+ *
+ * Readings are not taken at a fixed rate (see sampler.h), so the average is
+ * over time rather than over readings: each reading is taken to hold until
+ * the next, and the sum is of value times milliseconds held. A window's
+ * minimum and maximum include the value carried into it from the window
+ * before. rollup_pause() ends the hold when the readings stop.
+ *
+ * Windows are aligned to Unix time, so the minute closes on the minute and
+ * the hour on the hour wherever the device is, and each window is handed to
+ * the publish callback as it closes; windows with nothing in them are left
+ * out. A timer closes them on time between readings. Readings taken before
+ * the clock is known are not rolled up.
+ */
+#ifndef ROLLUP_H
+#define ROLLUP_H
+
+#include "os_type.h"
+
+#define ROLLUP_LEVELS 3 /**< Resolutions kept */
+#define ROLLUP_PERIODS_S { 60, 900, 3600 } /**< Their window lengths; each divides the next */
+#define ROLLUP_FORMAT_LEN 112 /**< Room rollup_format() needs */
+
+/**
+ * @struct rollup_window_t
+ * One window of one resolution.
+ */
+typedef struct {
+    uint32_t startS; /**< Unix time the window starts */
+    uint32_t count; /**< Readings taken in it */
+    int32_t min; /**< Lowest value, in hundredths */
+    int32_t max; /**< Highest value */
+    uint32_t heldMs; /**< Time covered by a value, up to the window length */
+    int64_t sum; /**< Value times milliseconds held, for the average */
+} rollup_window_t;
+
+/**
+ * @typedef rollup_publish_fn
+ * Called for each window as it closes.
+ * @param level 0 for the finest resolution, up to ROLLUP_LEVELS - 1
+ */
+typedef void (*rollup_publish_fn)(void *arg, uint8_t level, const rollup_window_t *w);
+
+/**
+ * Starts the timer that closes windows on time.
+ * @param publish called with each window that closes
+ * @param arg passed to publish
+ */
+void ICACHE_FLASH_ATTR rollup_start(rollup_publish_fn publish, void *arg);
+
+/**
+ * Adds a reading taken now.
+ * @param value in hundredths
+ */
+void ICACHE_FLASH_ATTR rollup_add(int32_t value);
+
+/**
+ * Ends the hold on the last reading, such as when the readings stop for
+ * want of a session.
+ */
+void ICACHE_FLASH_ATTR rollup_pause(void);
+
+/**
+ * Adds a reading taken at a given time, for rollup_add() and the host tools.
+ * @param value in hundredths
+ * @param unixMs when, no earlier than the last call
+ */
+void ICACHE_FLASH_ATTR rollup_add_at(int32_t value, uint64_t unixMs);
+
+/**
+ * Closes every window that has ended by a given time.
+ * @param unixMs the time, no earlier than the last call
+ */
+void ICACHE_FLASH_ATTR rollup_advance(uint64_t unixMs);
+
+/**
+ * rollup_pause() at a given time.
+ * @param unixMs the time, no earlier than the last call
+ */
+void ICACHE_FLASH_ATTR rollup_pause_at(uint64_t unixMs);
+
+/**
+ * @param level which resolution
+ * @return its length in seconds
+ */
+uint32_t ICACHE_FLASH_ATTR rollup_period_s(uint8_t level);
+
+/**
+ * @param level which resolution
+ * @return its name for topics: "1m", "15m" or "1h"
+ */
+const char * ICACHE_FLASH_ATTR rollup_name(uint8_t level);
+
+/**
+ * @param w a window
+ * @return its time-weighted average in hundredths, rounded to nearest
+ */
+int32_t ICACHE_FLASH_ATTR rollup_average(const rollup_window_t *w);
+
+/**
+ * Formats a window as start=..;count=..;min=..;max=..;avg=..;held_s=..
+ * with the values in units to two decimals, such as min=21.05.
+ * @param w the window
+ * @param buf at least ROLLUP_FORMAT_LEN bytes
+ * @return the length written
+ */
+uint32_t ICACHE_FLASH_ATTR rollup_format(const rollup_window_t *w, char *buf);
+
+#endif
@@ -0,0 +1,173 @@
+#include "ets_sys.h"
+#include "osapi.h"
+#include "os_type.h"
+#include "twheel.h"
+#include "timebase.h"
+#include "sampler.h"
+
+#define TOKEN 1000 // a publish, in the thousandths the budget is kept in
+
+static struct {
+    twheel_timer_t timer;
+    sampler_read_fn read;
+    sampler_publish_fn publish;
+    sampler_report_fn report;
+    void *arg;
+    sampler_stats_t st;
+    uint64_t lastUs; // when st.last was read
+    uint64_t publishedUs;
+    uint64_t refilledUs; // when the budget was last topped up
+    int32_t publishedValue;
+    uint8_t level; // the period is SAMPLER_MIN_MS << level, up to SAMPLER_MAX_MS
+    uint8_t maxLevel;
+    uint8_t started;
+    uint8_t haveLast;
+    uint8_t havePublished;
+    uint8_t reportPending;
+} smp;
+
+static uint32_t ICACHE_FLASH_ATTR level_ms(uint8_t level) {
+    uint32_t ms = SAMPLER_MIN_MS << level;
+    return (ms > SAMPLER_MAX_MS) ? SAMPLER_MAX_MS : ms;
+}
+
+// the longest period no longer than ms
+static uint8_t ICACHE_FLASH_ATTR level_for(uint32_t ms) {
+    uint8_t level = 0;
+    while (level < smp.maxLevel && level_ms(level + 1) <= ms) {
+        level++;
+    }
+    return level;
+}
+
+static void ICACHE_FLASH_ATTR refill(uint64_t now) {
+    uint64_t add = (now - smp.refilledUs) * SAMPLER_BUDGET_PER_HOUR / 3600000;
+    smp.refilledUs = now;
+    if (smp.st.tokens + add > SAMPLER_BURST * TOKEN) {
+        smp.st.tokens = SAMPLER_BURST * TOKEN;
+    } else {
+        smp.st.tokens += add;
+    }
+}
+
+static uint8_t ICACHE_FLASH_ATTR take_token(void) {
+    if (smp.st.tokens < TOKEN) {
+        return 0;
+    }
+    smp.st.tokens -= TOKEN;
+    return 1;
+}
+
+// the slope since the last reading, smoothed, and the period it calls for
+static void ICACHE_FLASH_ATTR adapt(int32_t value, uint64_t now) {
+    uint32_t ms = (now - smp.lastUs) / 1000, wantMs, steep;
+    int32_t diff = value - smp.st.last, slope;
+    uint8_t target;
+    if (ms == 0) {
+        ms = 1;
+    }
+    if (diff >= -SAMPLER_NOISE_CENTI && diff <= SAMPLER_NOISE_CENTI) {
+        diff = 0;
+    }
+    slope = (int32_t)((int64_t)diff * 60000 / ms);
+    smp.st.slope += (slope - smp.st.slope) / (1 << SAMPLER_SLOPE_SHIFT);
+    if (diff == 0 && smp.st.slope > -(1 << SAMPLER_SLOPE_SHIFT) && smp.st.slope < (1 << SAMPLER_SLOPE_SHIFT)) {
+        smp.st.slope = 0; // the division stops short of settling there
+    }
+    steep = (smp.st.slope < 0) ? -smp.st.slope : smp.st.slope;
+    if (diff >= SAMPLER_JUMP_CENTI || diff <= -SAMPLER_JUMP_CENTI) {
+        target = 0;
+    } else if (steep == 0) {
+        target = smp.maxLevel;
+    } else {
+        // time for the reading to move SAMPLER_RESOLUTION_CENTI at this slope
+        wantMs = (uint32_t)SAMPLER_RESOLUTION_CENTI * 60000 / steep;
+        target = level_for(wantMs);
+    }
+    if (target < smp.level) {
+        smp.level = target;
+    } else if (target > smp.level) {
+        smp.level++;
+    }
+}
+
+static void ICACHE_FLASH_ATTR sampler_tick(void *arg) {
+    uint64_t now = timebase_local_us();
+    uint32_t periodMs;
+    int32_t value, moved;
+    refill(now);
+    value = smp.read();
+    smp.st.samples++;
+    if (smp.haveLast) {
+        adapt(value, now);
+    }
+    smp.haveLast = 1;
+    smp.st.last = value;
+    smp.lastUs = now;
+
+    moved = value - smp.publishedValue;
+    if (!smp.havePublished || moved >= SAMPLER_RESOLUTION_CENTI || moved <= -SAMPLER_RESOLUTION_CENTI ||
+        now - smp.publishedUs >= (uint64_t)SAMPLER_HEARTBEAT_MS * 1000) {
+        if (take_token()) {
+            smp.publish(smp.arg, value);
+            smp.st.published++;
+            smp.publishedValue = value;
+            smp.publishedUs = now;
+            smp.havePublished = 1;
+        } else {
+            smp.st.suppressed++;
+        }
+    }
+
+    periodMs = level_ms(smp.level);
+    if (periodMs != smp.st.periodMs) {
+        smp.st.periodMs = periodMs;
+        smp.st.changes++;
+        smp.reportPending = 1;
+    }
+    if (smp.reportPending && smp.report != NULL && take_token()) {
+        smp.report(smp.arg);
+        smp.st.reports++;
+        smp.reportPending = 0;
+    }
+    twheel_arm(&smp.timer, smp.st.periodMs, 0);
+}
+
+void ICACHE_FLASH_ATTR sampler_start(sampler_read_fn read, sampler_publish_fn publish, sampler_report_fn report,
+                                     void *arg) {
+    if (!smp.started) {
+        os_memset(&smp, 0, sizeof(smp));
+        smp.started = 1;
+        while (SAMPLER_MIN_MS << smp.maxLevel < SAMPLER_MAX_MS) {
+            smp.maxLevel++;
+        }
+        smp.level = level_for(SAMPLER_START_MS);
+        smp.st.periodMs = level_ms(smp.level);
+        smp.st.tokens = SAMPLER_BURST * TOKEN;
+        smp.refilledUs = timebase_local_us();
+    }
+    smp.read = read;
+    smp.publish = publish;
+    smp.report = report;
+    smp.arg = arg;
+    twheel_disarm(&smp.timer);
+    twheel_setfn(&smp.timer, (twheel_fn)sampler_tick, NULL);
+    sampler_tick(NULL);
+}
+
+void ICACHE_FLASH_ATTR sampler_stop(void) {
+    twheel_disarm(&smp.timer);
+}
+
+const sampler_stats_t * ICACHE_FLASH_ATTR sampler_stats(void) {
+    return &smp.st;
+}
+
+uint32_t ICACHE_FLASH_ATTR sampler_report(char *buf, uint32_t len) {
+    if (len < 160) {
+        return 0;
+    }
+    return os_sprintf(buf, "period_ms=%d;slope=%d;samples=%d;published=%d;suppressed=%d;changes=%d;budget=%d",
+                      smp.st.periodMs, smp.st.slope, smp.st.samples, smp.st.published, smp.st.suppressed,
+                      smp.st.changes, smp.st.tokens / TOKEN);
+}
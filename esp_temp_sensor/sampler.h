@@ -0,0 +1,103 @@
+/**
+ * @file
+ * @brief Readings taken faster while they change, slower while they do not.
+ *
+ * The sampling period is SAMPLER_MIN_MS doubled some number of times, up to
+ * SAMPLER_MAX_MS. After each reading the slope since the one before is
+ * worked out in centi-degrees a minute, with changes inside the noise band
+ * taken as none, and smoothed with weight 1/2^SAMPLER_SLOPE_SHIFT for the
+ * newest. The period becomes the longest step that keeps the reading from
+ * moving more than SAMPLER_RESOLUTION_CENTI between samples at that slope.
+ * Speeding up happens at once, and so does a drop to the shortest period on
+ * a jump of SAMPLER_JUMP_CENTI. Slowing down goes one step a sample, so a
+ * transient is followed to its end.
+ *
+ * A reading is published when it has moved SAMPLER_RESOLUTION_CENTI from
+ * the last one published, or SAMPLER_HEARTBEAT_MS after it. Publishes come
+ * out of a budget of SAMPLER_BUDGET_PER_HOUR, saved up to SAMPLER_BURST, and
+ * readings that find the budget spent are counted and left out. Every
+ * change of period is handed to the report callback, from the same budget;
+ * a report that has to wait goes out with the next reading that can.
+ */
+#ifndef SAMPLER_H
+#define SAMPLER_H
+
+#include "os_type.h"
+
+#define SAMPLER_MIN_MS 500 /**< Shortest period, during fast changes */
+#define SAMPLER_MAX_MS 60000 /**< Longest period, while the reading is steady */
+#define SAMPLER_START_MS 20000 /**< Period before there is a slope to go by */
+#define SAMPLER_RESOLUTION_CENTI 10 /**< Change worth a sample, and worth a publish */
+#define SAMPLER_NOISE_CENTI 3 /**< Changes this small between samples count as none */
+#define SAMPLER_JUMP_CENTI 50 /**< A change this big between samples goes straight to SAMPLER_MIN_MS */
+#define SAMPLER_SLOPE_SHIFT 2 /**< The slope is smoothed with weight 1/4 for the newest */
+#define SAMPLER_HEARTBEAT_MS 600000 /**< Longest time without a publish */
+#define SAMPLER_BUDGET_PER_HOUR 360 /**< Publishes an hour, readings and reports together */
+#define SAMPLER_BURST 60 /**< Publishes that can be saved up for a transient */
+
+/**
+ * @struct sampler_stats_t
+ * Where the sampler is and what it has done.
+ */
+typedef struct {
+    uint32_t periodMs; /**< The current period */
+    int32_t slope; /**< Smoothed slope, centi-degrees a minute */
+    int32_t last; /**< The latest reading */
+    uint32_t samples; /**< Readings taken */
+    uint32_t published; /**< Readings published */
+    uint32_t suppressed; /**< Readings that were due to be published when the budget was spent */
+    uint32_t changes; /**< Changes of period */
+    uint32_t reports; /**< Reports published */
+    uint32_t tokens; /**< What is left of the budget, in thousandths of a publish */
+} sampler_stats_t;
+
+/**
+ * @typedef sampler_read_fn
+ * Takes a reading, in centi-degrees.
+ */
+typedef int32_t (*sampler_read_fn)(void);
+
+/**
+ * @typedef sampler_publish_fn
+ * Publishes a reading.
+ */
+typedef void (*sampler_publish_fn)(void *arg, int32_t centi);
+
+/**
+ * @typedef sampler_report_fn
+ * Publishes the sampler's state after its period changed, see sampler_report().
+ */
+typedef void (*sampler_report_fn)(void *arg);
+
+/**
+ * Starts sampling, with the first reading straight away. The first call
+ * sets the sampler up; later ones, after sampler_stop(), carry on with the
+ * period and budget it had.
+ * @param read takes a reading
+ * @param publish publishes one
+ * @param report publishes the state, may be NULL
+ * @param arg passed to publish and report
+ */
+void ICACHE_FLASH_ATTR sampler_start(sampler_read_fn read, sampler_publish_fn publish, sampler_report_fn report,
+                                     void *arg);
+
+/**
+ * Stops sampling, such as while there is no session to publish on.
+ */
+void ICACHE_FLASH_ATTR sampler_stop(void);
+
+/**
+ * @return the sampler's state and counters
+ */
+const sampler_stats_t * ICACHE_FLASH_ATTR sampler_stats(void);
+
+/**
+ * Formats the state, as period_ms=..;slope=..;samples=..;published=..;
+ * suppressed=..;changes=..;budget=..
+ * @param buf where to write
+ * @param len its size, at least 160
+ * @return the length written, 0 if buf is too small
+ */
+uint32_t ICACHE_FLASH_ATTR sampler_report(char *buf, uint32_t len);
+
+#endif
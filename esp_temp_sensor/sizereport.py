@@ -0,0 +1,259 @@
+#!/usr/bin/env python3
+##
+# @file
+# @brief Reports IRAM, DRAM and flash (irom0) use from the linker map
+#
+# Every function or variable in the map is placed in a region by its address.
+# Region totals and where our own objects put code in IRAM are compared with
+# a baseline file; anything that grew fails the run, so a change that moves
+# code into IRAM or eats RAM has to be accepted on purpose with
+# "make size-baseline".
+#
+# Static functions only show up individually when built with
+# -ffunction-sections, which the Makefile does; functions with
+# ICACHE_FLASH_ATTR share one .irom0.text section per object file and are
+# listed under the object.
+#
+# usage: sizereport.py <map> [--baseline FILE | --write-baseline FILE]
+#                      [--objects a.o b.o ...] [--top N] [--tolerance BYTES]
+
+import argparse
+import os
+import re
+import sys
+
+# ESP8266 address map
+REGIONS = [
+    ("iram", 0x40100000, 0x8000),  # instruction RAM the SDK leaves us, code that must not wait for flash
+    ("dram", 0x3FFE8000, 0x14000),  # data RAM: .data, .rodata and .bss
+    ("irom0", 0x40200000, 0x100000),  # flash mapped through the cache
+]
+
+OUT_SECTION = re.compile(r"^(\.\S+)(?:\s+0x([0-9a-f]+)\s+0x([0-9a-f]+))?\s*$")
+IN_SECTION = re.compile(r"^ (\.\S+|COMMON)(?:\s+0x([0-9a-f]+)\s+0x([0-9a-f]+)\s+(.+))?\s*$")
+WRAPPED = re.compile(r"^\s+0x([0-9a-f]+)\s+0x([0-9a-f]+)(?:\s+(.+))?\s*$")
+SYMBOL = re.compile(r"^\s+0x([0-9a-f]+)\s+([A-Za-z_][\w.$]*)\s*$")
+
+
+def region_of(addr):
+    for name, start, size in REGIONS:
+        if start <= addr < start + size:
+            return name
+    return None
+
+
+def short_file(path):
+    """libmain.a(user_interface.o) stays as is, object paths lose their directory"""
+    return path if "(" in path else os.path.basename(path)
+
+
+def parse_map(path):
+    """Returns output sections [(name, addr, size)] and pieces, one per input
+    section: dict(section, out, addr, size, file, symbols=[(addr, name)])"""
+    sections, pieces = [], []
+    out = None
+    piece = None
+    pending = None  # section name whose address is on the next line
+    started = False
+    for line in open(path, errors="replace"):
+        line = line.rstrip("\n")
+        if not started:
+            started = line.startswith("Linker script and memory map")
+            continue
+        if pending is not None:
+            m = WRAPPED.match(line)
+            kind, name = pending
+            pending = None
+            if m:
+                addr, size = int(m.group(1), 16), int(m.group(2), 16)
+                if kind == "out":
+                    out = name
+                    sections.append((name, addr, size))
+                elif m.group(3):
+                    piece = dict(section=name, out=out, addr=addr, size=size, file=short_file(m.group(3)), symbols=[])
+                    pieces.append(piece)
+                continue
+        m = OUT_SECTION.match(line)
+        if m:
+            piece = None
+            if m.group(2) is None:
+                pending = ("out", m.group(1))
+            else:
+                out = m.group(1)
+                sections.append((out, int(m.group(2), 16), int(m.group(3), 16)))
+            continue
+        m = IN_SECTION.match(line)
+        if m:
+            piece = None
+            if m.group(2) is None:
+                pending = ("in", m.group(1))
+            else:
+                piece = dict(section=m.group(1), out=out, addr=int(m.group(2), 16), size=int(m.group(3), 16),
+                             file=short_file(m.group(4)), symbols=[])
+                pieces.append(piece)
+            continue
+        m = SYMBOL.match(line)
+        if m and piece is not None:
+            addr = int(m.group(1), 16)
+            if piece["addr"] <= addr < piece["addr"] + piece["size"]:
+                piece["symbols"].append((addr, m.group(2)))
+    return sections, [p for p in pieces if p["size"] > 0]
+
+
+def section_symbol(section):
+    """.text.ftoa -> ftoa, .irom0.text -> None"""
+    for prefix in (".text.", ".literal.", ".data.", ".rodata.", ".bss.", ".irom0.text."):
+        if section.startswith(prefix) and len(section) > len(prefix):
+            return section[len(prefix):]
+    return None
+
+
+def symbols(pieces):
+    """Splits pieces at their symbols. Returns (region, file, name, size)"""
+    result = []
+    for p in pieces:
+        region = region_of(p["addr"])
+        if region is None:
+            continue
+        end = p["addr"] + p["size"]
+        marks = sorted(set(p["symbols"]))
+        fallback = section_symbol(p["section"]) or p["section"]
+        if not marks or marks[0][0] > p["addr"]:
+            marks.insert(0, (p["addr"], fallback))
+        for i, (addr, name) in enumerate(marks):
+            stop = marks[i + 1][0] if i + 1 < len(marks) else end
+            if stop > addr:
+                result.append((region, p["file"], name, stop - addr))
+    return result
+
+
+def totals(pieces):
+    used = {name: 0 for name, _, _ in REGIONS}
+    for p in pieces:
+        region = region_of(p["addr"])
+        if region is not None:
+            used[region] += p["size"]
+    return used
+
+
+def own_iram(syms, objects):
+    """Our own functions in IRAM, keyed file:name"""
+    own = {}
+    for region, file, name, size in syms:
+        if region == "iram" and file in objects:
+            key = "{0}:{1}".format(file, name)
+            own[key] = own.get(key, 0) + size
+    return own
+
+
+def report(sections, pieces, syms, objects, top):
+    used = totals(pieces)
+    print("{0:<8} {1:>9} {2:>9} {3:>6}".format("region", "used", "size", "full"))
+    for name, _, size in REGIONS:
+        print("{0:<8} {1:>9} {2:>9} {3:>5.1f}%".format(name, used[name], size, 100.0 * used[name] / size))
+
+    print("\n{0:<24} {1:<8} {2:>9}".format("section", "region", "bytes"))
+    for name, addr, size in sections:
+        region = region_of(addr)
+        if region is not None and size > 0:
+            print("{0:<24} {1:<8} {2:>9}".format(name, region, size))
+
+    print("\n{0:<8} {1:<28} {2:>9}".format("region", "object", "bytes"))
+    per_object = {}
+    for region, file, name, size in syms:
+        if file in objects:
+            per_object[(region, file)] = per_object.get((region, file), 0) + size
+    for (region, file), size in sorted(per_object.items()):
+        print("{0:<8} {1:<28} {2:>9}".format(region, file, size))
+
+    for region, _, _ in REGIONS:
+        ranked = sorted((s for s in syms if s[0] == region), key=lambda s: -s[3])[:top]
+        if not ranked:
+            continue
+        print("\nlargest in {0}:".format(region))
+        for _, file, name, size in ranked:
+            mark = "*" if file in objects else " "
+            print("  {0} {1:>7}  {2:<32} {3}".format(mark, size, name, file))
+    if objects:
+        print("\n* our own code")
+
+
+def read_baseline(path):
+    regions, iram = {}, {}
+    for line in open(path):
+        fields = line.split()
+        if len(fields) != 3 or fields[0].startswith("#"):
+            continue
+        kind, key, value = fields
+        (regions if kind == "region" else iram)[key] = int(value)
+    return regions, iram
+
+
+def write_baseline(path, used, own):
+    with open(path, "w") as f:
+        f.write("# written by sizereport.py --write-baseline; region totals and our IRAM functions\n")
+        for name, _, _ in REGIONS:
+            f.write("region {0} {1}\n".format(name, used[name]))
+        for key in sorted(own):
+            f.write("iram {0} {1}\n".format(key, own[key]))
+
+
+def compare(baseline, used, own, tolerance):
+    """Prints differences from the baseline, returns the number of regressions"""
+    regions, iram = baseline
+    failures = 0
+    print("\nagainst baseline:")
+    for name, _, _ in REGIONS:
+        old = regions.get(name)
+        if old is None:
+            continue
+        delta = used[name] - old
+        flag = ""
+        if delta > tolerance:
+            flag = "  REGRESSION"
+            failures += 1
+        if delta != 0:
+            print("  {0:<8} {1:>9} -> {2:>9} ({3:+d}){4}".format(name, old, used[name], delta, flag))
+    for key in sorted(set(iram) | set(own)):
+        old, new = iram.get(key, 0), own.get(key, 0)
+        if new > old:
+            print("  iram {0}: {1} -> {2}  REGRESSION".format(key, old, new))
+            failures += 1
+        elif new < old:
+            print("  iram {0}: {1} -> {2}".format(key, old, new))
+    if failures == 0:
+        print("  no regressions")
+    return failures
+
+
+def main():
+    parser = argparse.ArgumentParser(description="ESP8266 IRAM/DRAM/flash report from a linker map")
+    parser.add_argument("map")
+    parser.add_argument("--baseline", help="fail if anything grew compared with this file")
+    parser.add_argument("--write-baseline", help="record the current numbers in this file")
+    parser.add_argument("--objects", nargs="*", default=[], help="our own object files")
+    parser.add_argument("--top", type=int, default=15, help="largest symbols listed per region")
+    parser.add_argument("--tolerance", type=int, default=0, help="bytes a region may grow before it counts")
+    args = parser.parse_args()
+
+    sections, pieces = parse_map(args.map)
+    if not pieces:
+        sys.exit("{0}: no memory map found".format(args.map))
+    objects = set(os.path.basename(o) for o in args.objects)
+    syms = symbols(pieces)
+    used = totals(pieces)
+    own = own_iram(syms, objects)
+    report(sections, pieces, syms, objects, args.top)
+
+    if args.write_baseline:
+        write_baseline(args.write_baseline, used, own)
+        print("\nbaseline written to {0}".format(args.write_baseline))
+    elif args.baseline:
+        if not os.path.exists(args.baseline):
+            sys.exit("\nno baseline at {0}, make one with make size-baseline".format(args.baseline))
+        if compare(read_baseline(args.baseline), used, own, args.tolerance):
+            sys.exit(1)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,68 @@
+#!/usr/bin/env python3
+##
+# @file
+# @brief Local SNTP server standing in for a real one, see timebase.h
+#
+# Answers SNTP requests with this machine's clock, optionally shifted by a
+# fixed offset and running fast or slow by some ppm, so the firmware's step
+# and drift correction can be tried without a real time server. It can also
+# drop or delay replies.
+#
+# usage: sntpd.py [--port 12300] [--offset S] [--drift-ppm P] [--drop F] [--delay MS]
+
+import argparse
+import random
+import socket
+import struct
+import sys
+import time
+
+NTP_UNIX_OFFSET = 2208988800  # seconds from 1900 to 1970
+
+
+def to_ntp(t):
+    """Unix seconds to a 64-bit NTP timestamp"""
+    sec = int(t)
+    frac = int((t - sec) * (1 << 32)) & 0xFFFFFFFF
+    return ((sec + NTP_UNIX_OFFSET) & 0xFFFFFFFF) << 32 | frac
+
+
+def main():
+    parser = argparse.ArgumentParser(description="SNTP stand-in")
+    parser.add_argument("--port", type=int, default=12300)
+    parser.add_argument("--offset", type=float, default=0.0, help="seconds added to this machine's clock")
+    parser.add_argument("--drift-ppm", type=float, default=0.0, help="our clock gains this much on the real one")
+    parser.add_argument("--drop", type=float, default=0.0, help="fraction of requests not answered")
+    parser.add_argument("--delay", type=float, default=0.0, help="milliseconds to hold each reply")
+    parser.add_argument("--stratum", type=int, default=2, help="0 sends kiss-o'-death replies")
+    args = parser.parse_args()
+
+    start = time.time()
+
+    def now():
+        t = time.time()
+        return t + args.offset + (t - start) * args.drift_ppm * 1e-6
+
+    sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    sock.bind(("0.0.0.0", args.port))
+    print("SNTP on udp/{0}, offset {1} s, drift {2} ppm".format(args.port, args.offset, args.drift_ppm))
+    sys.stdout.flush()
+    while True:
+        data, peer = sock.recvfrom(512)
+        received = now()
+        if len(data) < 48 or data[0] & 0x07 != 3:
+            continue
+        if random.random() < args.drop:
+            continue
+        if args.delay:
+            time.sleep(args.delay / 1000.0)
+        origin = struct.unpack(">Q", data[40:48])[0]
+        reply = struct.pack(">BBbbII4sQQQQ",
+                            0x24,  # no leap warning, version 4, server
+                            args.stratum, 6, -20, 0, 0, b"LOCL",
+                            to_ntp(received), origin, to_ntp(received), to_ntp(now()))
+        sock.sendto(reply, peer)
+
+
+if __name__ == "__main__":
+    main()
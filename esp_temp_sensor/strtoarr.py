@@ -19,14 +19,19 @@
 import sys
 import os
 
-inString = str(sys.argv[1]);
 
-print("static const char {0}[{1}] = {{ ".format(sys.argv[2], len(inString)), end='')
-for letter in inString[:-1]:
-    p = ord(letter)
-    print("{0:#x}, ".format(p), end='')
+def c_array(name, data, ctype="char", attrs=""):
+    """The C declaration of a byte array holding data, a str or bytes"""
+    if isinstance(data, str):
+        comment = " // " + data
+        data = data.encode()
+    else:
+        comment = ""
+    body = ", ".join("{0:#x}".format(b) for b in data)
+    return "static const {0} {1}[{2}]{3} = {{ {4} }};{5}".format(ctype, name, len(data), attrs, body, comment)
 
-p = ord(inString[-1])
-print("{0:#x} ".format(int(p)), end='')
-print("}; // " + inString)
-print("static const uint8_t {0}_len = {1};".format(sys.argv[2], len(inString)))
\ No newline at end of file
+
+if __name__ == "__main__":
+    inString = str(sys.argv[1])
+    print(c_array(sys.argv[2], inString))
+    print("static const uint8_t {0}_len = {1};".format(sys.argv[2], len(inString)))
\ No newline at end of file
@@ -0,0 +1,281 @@
+#include "ets_sys.h"
+#include "osapi.h"
+#include "os_type.h"
+#include "user_interface.h"
+#include "espconn.h"
+#include "timebase.h"
+#include "twheel.h"
+
+#define NTP_PACKET_LEN 48
+#define NTP_UNIX_OFFSET 2208988800ULL // seconds from 1900, the NTP epoch, to 1970
+#define TIMEBASE_RTC_MAGIC 0x54494D31 // "TIM1"
+
+// Kept in RTC memory across deep sleep, see timebase_save()
+typedef struct {
+    uint32_t magic;
+    uint32_t unixHi; // Unix microseconds when saved
+    uint32_t unixLo;
+    uint32_t rtcCycles; // system_get_rtc_time() at the same moment
+    uint32_t cali; // system_rtc_clock_cali_proc(): microseconds per RTC cycle, 12 fractional bits
+    int32_t driftPpb;
+    uint32_t check; // XOR of the words above
+} timebase_rtc_t;
+
+static struct {
+    uint32_t high; // upper half of the 64-bit local clock
+    uint32_t lastLow; // system_get_time() when it was last read
+    uint8_t valid; // baseUnix is known
+    uint64_t baseLocal; // local clock at the last sync
+    uint64_t baseUnix; // Unix time at baseLocal
+    uint8_t anchored; // anchorLocal/anchorUnix hold an SNTP sample from this boot
+    uint64_t anchorLocal; // the sample drift is measured from
+    uint64_t anchorUnix;
+    uint8_t haveDrift;
+    uint8_t busy; // an exchange is running
+    uint8_t tries;
+    uint64_t sentLocal; // local clock when the request left, also its transmit timestamp
+    uint8_t ip[4];
+    uint16_t port;
+} tb;
+
+static timebase_stats_t stats;
+static struct espconn ntpConn;
+static esp_udp ntpUdp;
+static twheel_timer_t tickTimer;
+static twheel_timer_t replyTimer;
+static void (*syncCb)(uint8_t ok);
+
+static uint32_t ICACHE_FLASH_ATTR get_be32(const uint8_t *p) {
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+static void ICACHE_FLASH_ATTR put_be32(uint8_t *p, uint32_t v) {
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+// NTP timestamp, 32.32 fixed point seconds since 1900, to Unix microseconds
+static uint64_t ICACHE_FLASH_ATTR ntp_to_unix_us(const uint8_t *p) {
+    uint64_t sec = get_be32(p);
+    uint64_t frac = get_be32(p + 4);
+    if (sec < 0x80000000ULL) {
+        sec += 0x100000000ULL; // era 1, from February 2036
+    }
+    return (sec - NTP_UNIX_OFFSET) * 1000000ULL + ((frac * 1000000ULL) >> 32);
+}
+
+uint64_t ICACHE_FLASH_ATTR timebase_local_us(void) {
+    uint32_t now = system_get_time();
+    if (now < tb.lastLow) {
+        tb.high++;
+    }
+    tb.lastLow = now;
+    return ((uint64_t)tb.high << 32) | now;
+}
+
+static uint64_t ICACHE_FLASH_ATTR local_to_unix(uint64_t local) {
+    int64_t elapsed = (int64_t)(local - tb.baseLocal);
+    return tb.baseUnix + elapsed + elapsed * stats.driftPpb / 1000000000LL;
+}
+
+uint64_t ICACHE_FLASH_ATTR timebase_now_us(void) {
+    return tb.valid ? local_to_unix(timebase_local_us()) : 0;
+}
+
+uint64_t ICACHE_FLASH_ATTR timebase_to_unix_us(uint32_t tick) {
+    uint64_t now, local;
+    if (!tb.valid) {
+        return 0;
+    }
+    now = timebase_local_us();
+    local = (now & 0xFFFFFFFF00000000ULL) | tick;
+    if (local > now) {
+        local -= 0x100000000ULL; // taken before the last wrap
+    }
+    return local_to_unix(local);
+}
+
+uint8_t ICACHE_FLASH_ATTR timebase_valid(void) {
+    return tb.valid;
+}
+
+const timebase_stats_t * ICACHE_FLASH_ATTR timebase_stats(void) {
+    return &stats;
+}
+
+void ICACHE_FLASH_ATTR timebase_set_sync_cb(void (*cb)(uint8_t ok)) {
+    syncCb = cb;
+}
+
+static void ICACHE_FLASH_ATTR timebase_tick(void *arg) {
+    timebase_local_us();
+}
+
+// One good SNTP sample: the server's Unix time at local clock local
+static void ICACHE_FLASH_ATTR timebase_apply(uint64_t local, uint64_t server) {
+    if (tb.valid) {
+        int64_t step = (int64_t)(server - local_to_unix(local));
+        stats.lastStepUs = (step > 0x7FFFFFFFLL) ? 0x7FFFFFFF : (step < -0x7FFFFFFFLL) ? -0x7FFFFFFF : (int32_t)step;
+    }
+    if (!tb.anchored) {
+        tb.anchored = 1;
+        tb.anchorLocal = local;
+        tb.anchorUnix = server;
+    } else if (local - tb.anchorLocal >= TIMEBASE_MIN_SPAN_US) {
+        // closer syncs keep the older anchor, so network jitter does not
+        // swamp the rate
+        int64_t span = (int64_t)(local - tb.anchorLocal);
+        int64_t measured = ((int64_t)(server - tb.anchorUnix) - span) * 1000000000LL / span;
+        if (measured > TIMEBASE_MAX_DRIFT_PPB) {
+            measured = TIMEBASE_MAX_DRIFT_PPB;
+        } else if (measured < -TIMEBASE_MAX_DRIFT_PPB) {
+            measured = -TIMEBASE_MAX_DRIFT_PPB;
+        }
+        // smoothed, one noisy sample only moves it a quarter of the way
+        stats.driftPpb = tb.haveDrift ? (int32_t)((3 * (int64_t)stats.driftPpb + measured) / 4) : (int32_t)measured;
+        tb.haveDrift = 1;
+        tb.anchorLocal = local;
+        tb.anchorUnix = server;
+    }
+    tb.baseLocal = local;
+    tb.baseUnix = server;
+    tb.valid = 1;
+    stats.restored = 0;
+    stats.syncs++;
+}
+
+static void ICACHE_FLASH_ATTR timebase_done(uint8_t ok) {
+    twheel_disarm(&replyTimer);
+    tb.busy = 0;
+    if (!ok) {
+        stats.failures++;
+    }
+    if (syncCb != NULL) {
+        syncCb(ok);
+    }
+}
+
+static void ICACHE_FLASH_ATTR timebase_send(void) {
+    uint8_t packet[NTP_PACKET_LEN];
+    os_memset(packet, 0, sizeof(packet));
+    packet[0] = 0x23; // no leap warning, version 4, client
+    tb.sentLocal = timebase_local_us();
+    // the server echoes our transmit timestamp, so it identifies the reply
+    put_be32(packet + 40, (uint32_t)(tb.sentLocal >> 32));
+    put_be32(packet + 44, (uint32_t)tb.sentLocal);
+    os_memcpy(ntpUdp.remote_ip, tb.ip, 4);
+    ntpUdp.remote_port = tb.port;
+    tb.tries++;
+    espconn_send(&ntpConn, packet, sizeof(packet));
+    twheel_arm(&replyTimer, TIMEBASE_TIMEOUT_MS, 0);
+}
+
+static void ICACHE_FLASH_ATTR timebase_timeout(void *arg) {
+    if (tb.tries < TIMEBASE_RETRIES) {
+        timebase_send();
+    } else {
+        os_printf("SNTP: no reply after %d tries\n", tb.tries);
+        timebase_done(0);
+    }
+}
+
+static void ICACHE_FLASH_ATTR timebase_recv(void *arg, char *pdata, unsigned short len) {
+    const uint8_t *p = (const uint8_t *)pdata;
+    uint64_t received, t2, t3, server;
+    int64_t rtt;
+    received = timebase_local_us();
+    if (!tb.busy || len < NTP_PACKET_LEN) {
+        return;
+    }
+    if ((p[0] & 0x07) != 4 || p[1] == 0) {
+        return; // not a server reply, or a kiss-o'-death
+    }
+    if (get_be32(p + 24) != (uint32_t)(tb.sentLocal >> 32) || get_be32(p + 28) != (uint32_t)tb.sentLocal) {
+        return; // reply to an earlier request
+    }
+    t2 = ntp_to_unix_us(p + 32); // request reached the server
+    t3 = ntp_to_unix_us(p + 40); // reply left the server
+    rtt = (int64_t)(received - tb.sentLocal) - (int64_t)(t3 - t2);
+    if (rtt < 0 || rtt > TIMEBASE_MAX_RTT_US) {
+        return; // wait for the timeout to ask again
+    }
+    stats.lastRttUs = (uint32_t)rtt;
+    // assume the reply took half the round trip
+    server = t3 + rtt / 2;
+    timebase_apply(received, server);
+    os_printf("SNTP: rtt %d us, step %d us, drift %d ppb\n", stats.lastRttUs, stats.lastStepUs, stats.driftPpb);
+    timebase_done(1);
+}
+
+void ICACHE_FLASH_ATTR timebase_sync(const uint8_t ip[4], uint16_t port) {
+    if (tb.busy) {
+        return;
+    }
+    if (ntpConn.type == ESPCONN_INVALID) {
+        ntpConn.type = ESPCONN_UDP;
+        ntpConn.proto.udp = &ntpUdp;
+        ntpUdp.local_port = espconn_port();
+        os_memcpy(ntpUdp.remote_ip, ip, 4);
+        ntpUdp.remote_port = port;
+        espconn_regist_recvcb(&ntpConn, timebase_recv);
+        espconn_create(&ntpConn);
+        twheel_setfn(&replyTimer, (twheel_fn)timebase_timeout, NULL);
+    }
+    os_memcpy(tb.ip, ip, 4);
+    tb.port = port;
+    tb.busy = 1;
+    tb.tries = 0;
+    timebase_send();
+}
+
+static uint32_t ICACHE_FLASH_ATTR rtc_check(const timebase_rtc_t *r) {
+    return r->magic ^ r->unixHi ^ r->unixLo ^ r->rtcCycles ^ r->cali ^ (uint32_t)r->driftPpb;
+}
+
+void ICACHE_FLASH_ATTR timebase_save(void) {
+    timebase_rtc_t r;
+    uint64_t now;
+    os_memset(&r, 0, sizeof(r));
+    if (tb.valid) {
+        now = timebase_now_us();
+        r.magic = TIMEBASE_RTC_MAGIC;
+        r.unixHi = (uint32_t)(now >> 32);
+        r.unixLo = (uint32_t)now;
+        r.rtcCycles = system_get_rtc_time();
+        r.cali = system_rtc_clock_cali_proc();
+        r.driftPpb = stats.driftPpb;
+        r.check = rtc_check(&r);
+    }
+    system_rtc_mem_write(TIMEBASE_RTC_BLOCK, &r, sizeof(r));
+}
+
+void ICACHE_FLASH_ATTR timebase_init(void) {
+    timebase_rtc_t r;
+    struct rst_info *rst = system_get_rst_info();
+
+    timebase_local_us();
+    twheel_disarm(&tickTimer);
+    twheel_setfn(&tickTimer, (twheel_fn)timebase_tick, NULL);
+    twheel_arm(&tickTimer, TIMEBASE_TICK_MS, 1);
+
+    // the RTC counter only survives deep sleep; after any other reset the
+    // record, if there is one, is from before a gap we cannot measure
+    if (rst->reason != REASON_DEEP_SLEEP_AWAKE || !system_rtc_mem_read(TIMEBASE_RTC_BLOCK, &r, sizeof(r))) {
+        return;
+    }
+    if (r.magic == TIMEBASE_RTC_MAGIC && r.check == rtc_check(&r)) {
+        uint64_t slept = ((uint64_t)(system_get_rtc_time() - r.rtcCycles) * r.cali) >> 12;
+        tb.baseLocal = timebase_local_us();
+        tb.baseUnix = (((uint64_t)r.unixHi << 32) | r.unixLo) + slept;
+        tb.valid = 1;
+        stats.driftPpb = r.driftPpb;
+        tb.haveDrift = 1;
+        stats.restored = 1;
+        os_printf("Time restored after %d ms of deep sleep\n", (uint32_t)(slept / 1000));
+    }
+    // use the record once
+    os_memset(&r, 0, sizeof(r));
+    system_rtc_mem_write(TIMEBASE_RTC_BLOCK, &r, sizeof(r));
+}
@@ -0,0 +1,97 @@
+/**
+ * @file
+ * @brief Wall clock for sample timestamps, kept in step with an SNTP server.
+ *
+ * system_get_time() counts microseconds in 32 bits and wraps every 71
+ * minutes. timebase_local_us() extends it to 64 bits; a timer reads it often
+ * enough that no wrap is missed. One SNTP exchange per MQTT connection maps
+ * that local clock to Unix time, and successive exchanges measure how fast
+ * the crystal runs so the time between them is corrected for drift.
+ *
+ * Recording a sample only needs the 32-bit system_get_time() value; it is
+ * turned into Unix time with timebase_to_unix_us() when the sample is sent,
+ * as long as that is within 71 minutes.
+ *
+ * Deep sleep resets system_get_time(), but the RTC keeps counting and RTC
+ * memory keeps its contents. timebase_save() records the clock there before
+ * sleeping and timebase_init() picks it up again on wake.
+ */
+#ifndef TIMEBASE_H
+#define TIMEBASE_H
+
+#include "os_type.h"
+
+#define TIMEBASE_NTP_PORT 123 /**< Standard SNTP server port */
+#define TIMEBASE_TIMEOUT_MS 2000 /**< Wait for a reply before asking again */
+#define TIMEBASE_RETRIES 3 /**< Requests sent per sync before giving up */
+#define TIMEBASE_MAX_RTT_US 500000 /**< Replies that took longer are too uncertain to use */
+#define TIMEBASE_TICK_MS 600000 /**< How often the 64-bit clock is extended, well inside the 71 minute wrap */
+#define TIMEBASE_MIN_SPAN_US 60000000ULL /**< Two syncs must be this far apart to measure drift */
+#define TIMEBASE_MAX_DRIFT_PPB 500000 /**< Larger measured drift is clamped, the crystal is specified far better */
+#define TIMEBASE_RTC_BLOCK 64 /**< First RTC memory block used, the first 64 belong to the SDK */
+
+/**
+ * @struct timebase_stats_t
+ * How well the clock is tracking the server.
+ */
+typedef struct {
+    uint32_t syncs; /**< Successful SNTP exchanges */
+    uint32_t failures; /**< Syncs that got no usable reply */
+    uint32_t lastRttUs; /**< Round trip of the last exchange */
+    int32_t lastStepUs; /**< How far the clock was off at the last sync, server minus us */
+    int32_t driftPpb; /**< Measured rate error of the local clock, positive when it runs slow */
+    uint8_t restored; /**< Time was carried over from RTC memory and has not been synced since */
+} timebase_stats_t;
+
+/**
+ * Starts the 64-bit clock. Call once from user_init(); after a deep sleep
+ * wake it restores the time saved by timebase_save().
+ */
+void ICACHE_FLASH_ATTR timebase_init(void);
+
+/**
+ * Starts one SNTP exchange, unless one is already running. The result
+ * arrives later, see timebase_set_sync_cb().
+ * @param ip the server address
+ * @param port the server port, normally TIMEBASE_NTP_PORT
+ */
+void ICACHE_FLASH_ATTR timebase_sync(const uint8_t ip[4], uint16_t port);
+
+/**
+ * @param cb called when a sync finishes, with 1 if the clock was set
+ */
+void ICACHE_FLASH_ATTR timebase_set_sync_cb(void (*cb)(uint8_t ok));
+
+/**
+ * @return microseconds since boot, never wrapping. Not for interrupt handlers.
+ */
+uint64_t ICACHE_FLASH_ATTR timebase_local_us(void);
+
+/**
+ * @return microseconds since the Unix epoch, or 0 while the time is unknown
+ */
+uint64_t ICACHE_FLASH_ATTR timebase_now_us(void);
+
+/**
+ * Converts a system_get_time() value taken in the last 71 minutes.
+ * @param tick the 32-bit microsecond count recorded with a sample
+ * @return microseconds since the Unix epoch, or 0 while the time is unknown
+ */
+uint64_t ICACHE_FLASH_ATTR timebase_to_unix_us(uint32_t tick);
+
+/**
+ * @return 1 once the time is known, from SNTP or from RTC memory
+ */
+uint8_t ICACHE_FLASH_ATTR timebase_valid(void);
+
+/**
+ * Records the clock in RTC memory. Call just before system_deep_sleep().
+ */
+void ICACHE_FLASH_ATTR timebase_save(void);
+
+/**
+ * @return sync counters and the current drift estimate
+ */
+const timebase_stats_t * ICACHE_FLASH_ATTR timebase_stats(void);
+
+#endif
@@ -0,0 +1,308 @@
+#include "ets_sys.h"
+#include "osapi.h"
+#include "os_type.h"
+#include "timebase.h"
+#include "twheel.h"
+
+#define L0_SIZE (1 << TWHEEL_L0_BITS)
+#define L0_MASK (L0_SIZE - 1)
+#define LN_SIZE (1 << TWHEEL_LN_BITS)
+#define LN_MASK (LN_SIZE - 1)
+#define LEVEL_SHIFT(level) (TWHEEL_L0_BITS + ((level) - 1) * TWHEEL_LN_BITS)
+#define MAX_TICKS ((1UL << LEVEL_SHIFT(TWHEEL_LEVELS)) - 1)
+#define TICK_US (TWHEEL_TICK_MS * 1000)
+
+static twheel_timer_t *l0[L0_SIZE];
+static twheel_timer_t *ln[TWHEEL_LEVELS - 1][LN_SIZE];
+static uint32_t l0Map[L0_SIZE / 32]; // a bit for each first level slot with timers in it
+static uint32_t levelCount[TWHEEL_LEVELS];
+
+static struct {
+    uint32_t now; // last tick processed
+    uint32_t hwTick; // tick the SDK timer is armed for
+    uint8_t hwArmed;
+    uint8_t running; // expiring timers, scheduling waits until the end
+    uint32_t gridUs; // between grid points, 0 for no alignment
+    uint64_t gridPhaseUs; // a local time on the grid
+} wheel;
+
+static os_timer_t hwTimer;
+static twheel_stats_t stats;
+static twheel_schedule_fn scheduleCb;
+
+static uint32_t ICACHE_FLASH_ATTR current_tick(void) {
+    return (uint32_t)(timebase_local_us() / TICK_US);
+}
+
+// the tick of the grid point nearest the start of tick due
+static uint32_t ICACHE_FLASH_ATTR grid_snap(uint32_t due) {
+    uint64_t nowUs = timebase_local_us();
+    uint64_t dueUs = nowUs - nowUs % TICK_US + (int64_t)(int32_t)(due - (uint32_t)(nowUs / TICK_US)) * TICK_US;
+    int64_t off = (int64_t)(dueUs - wheel.gridPhaseUs) + wheel.gridUs / 2;
+    int64_t steps = off / wheel.gridUs;
+    if (off < 0 && off % wheel.gridUs != 0) {
+        steps--; // rounded down, for a deadline before the phase
+    }
+    return (uint32_t)((wheel.gridPhaseUs + steps * wheel.gridUs + TICK_US - 1) / TICK_US);
+}
+
+static uint8_t ICACHE_FLASH_ATTR level_of(const twheel_timer_t *t) {
+    uint32_t delta = t->expires - wheel.now;
+    uint8_t level;
+    if (delta < L0_SIZE) {
+        return 0;
+    }
+    for (level = 1; level < TWHEEL_LEVELS - 1; level++) {
+        if (delta < (1UL << LEVEL_SHIFT(level + 1))) {
+            break;
+        }
+    }
+    return level;
+}
+
+// due is 1 when a timer for the tick being processed may still go in its
+// slot, which is only so while moving timers down before the slot is run
+static void ICACHE_FLASH_ATTR wheel_add(twheel_timer_t *t, uint8_t due) {
+    twheel_timer_t **head;
+    uint32_t delta = t->expires - wheel.now;
+    uint32_t slot;
+    uint8_t level;
+
+    if ((delta == 0 && !due) || delta > 0x80000000UL) {
+        t->expires = wheel.now + 1; // overdue, run on the next tick
+    } else if (delta > MAX_TICKS) {
+        t->expires = wheel.now + MAX_TICKS;
+    }
+    level = level_of(t);
+    if (level == 0) {
+        slot = t->expires & L0_MASK;
+        head = &l0[slot];
+        l0Map[slot >> 5] |= 1UL << (slot & 31);
+    } else {
+        head = &ln[level - 1][(t->expires >> LEVEL_SHIFT(level)) & LN_MASK];
+    }
+    t->next = *head;
+    if (t->next != NULL) {
+        t->next->pprev = &t->next;
+    }
+    *head = t;
+    t->pprev = head;
+    t->level = level;
+    levelCount[level]++;
+    stats.armed++;
+}
+
+static void ICACHE_FLASH_ATTR wheel_del(twheel_timer_t *t) {
+    uint32_t slot;
+    *t->pprev = t->next;
+    if (t->next != NULL) {
+        t->next->pprev = t->pprev;
+    }
+    t->pprev = NULL;
+    t->next = NULL;
+    levelCount[t->level]--;
+    stats.armed--;
+    if (t->level == 0) {
+        slot = t->expires & L0_MASK;
+        if (l0[slot] == NULL) {
+            l0Map[slot >> 5] &= ~(1UL << (slot & 31));
+        }
+    }
+}
+
+// ticks from tick slot "from" to the first first-level slot with timers, L0_SIZE if none
+static uint32_t ICACHE_FLASH_ATTR l0_next(uint32_t from) {
+    uint32_t i = 0, slot, word;
+    while (i < L0_SIZE) {
+        slot = (from + i) & L0_MASK;
+        word = l0Map[slot >> 5] >> (slot & 31);
+        if (word != 0) {
+            i += __builtin_ctz(word);
+            return (i < L0_SIZE) ? i : L0_SIZE;
+        }
+        i += 32 - (slot & 31);
+    }
+    return L0_SIZE;
+}
+
+// milliseconds from now to the start of a tick, rounded up
+static uint32_t ICACHE_FLASH_ATTR ms_until(uint32_t tick) {
+    uint64_t nowUs = timebase_local_us();
+    int32_t ahead = (int32_t)(tick - (uint32_t)(nowUs / TICK_US));
+    if (ahead <= 0) {
+        return 0;
+    }
+    return (uint32_t)(((uint64_t)ahead * TICK_US - nowUs % TICK_US + 999) / 1000);
+}
+
+static void ICACHE_FLASH_ATTR wheel_schedule(void) {
+    uint32_t next, target;
+    uint8_t level;
+
+    if (stats.armed == 0) {
+        if (wheel.hwArmed) {
+            os_timer_disarm(&hwTimer);
+            wheel.hwArmed = 0;
+            if (scheduleCb != NULL) {
+                scheduleCb(0xFFFFFFFF);
+            }
+        }
+        return;
+    }
+    next = 1 + l0_next((wheel.now + 1) & L0_MASK);
+    for (level = 1; level < TWHEEL_LEVELS; level++) {
+        if (levelCount[level] > 0) {
+            // wake when the first level wraps, to move timers down
+            uint32_t boundary = L0_SIZE - (wheel.now & L0_MASK);
+            if (boundary < next) {
+                next = boundary;
+            }
+            break;
+        }
+    }
+    target = wheel.now + next;
+    if (wheel.hwArmed && wheel.hwTick == target) {
+        return;
+    }
+    os_timer_disarm(&hwTimer);
+    next = ms_until(target);
+    os_timer_arm(&hwTimer, next, 0);
+    wheel.hwTick = target;
+    wheel.hwArmed = 1;
+    if (scheduleCb != NULL) {
+        scheduleCb(next);
+    }
+}
+
+static void ICACHE_FLASH_ATTR wheel_cascade(uint8_t level, uint32_t idx) {
+    twheel_timer_t *list = ln[level - 1][idx];
+    twheel_timer_t *t;
+    ln[level - 1][idx] = NULL;
+    if (list != NULL) {
+        list->pprev = &list;
+    }
+    while ((t = list) != NULL) {
+        wheel_del(t);
+        stats.cascaded++;
+        // one due on this very tick lands in the slot wheel_tick() runs next
+        wheel_add(t, 1);
+    }
+}
+
+static void ICACHE_FLASH_ATTR wheel_tick(void) {
+    twheel_timer_t *list, *t;
+    uint32_t idx, lidx;
+    uint8_t level;
+
+    wheel.now++;
+    idx = wheel.now & L0_MASK;
+    if (idx == 0) {
+        for (level = 1; level < TWHEEL_LEVELS; level++) {
+            lidx = (wheel.now >> LEVEL_SHIFT(level)) & LN_MASK;
+            wheel_cascade(level, lidx);
+            if (lidx != 0) {
+                break;
+            }
+        }
+    }
+    if (l0[idx] == NULL) {
+        return;
+    }
+    // take the whole slot, so timers armed by callbacks land in the wheel
+    // and callbacks can still disarm timers further down this list
+    list = l0[idx];
+    l0[idx] = NULL;
+    list->pprev = &list;
+    l0Map[idx >> 5] &= ~(1UL << (idx & 31));
+    while ((t = list) != NULL) {
+        wheel_del(t);
+        if (t->period != 0) {
+            // from when it was due rather than when it ran or the grid point
+            // it ran on, so the runs cannot drift
+            t->due += t->period;
+            t->expires = (wheel.gridUs != 0 && (uint64_t)t->period * TICK_US >= wheel.gridUs) ? grid_snap(t->due) : t->due;
+            wheel_add(t, 0);
+        }
+        stats.expired++;
+        t->fn(t->arg);
+    }
+}
+
+static void ICACHE_FLASH_ATTR wheel_run(void *arg) {
+    uint32_t target = current_tick();
+    wheel.hwArmed = 0;
+    wheel.running = 1;
+    stats.wakes++;
+    while ((int32_t)(target - wheel.now) > 0) {
+        wheel_tick();
+    }
+    wheel.running = 0;
+    wheel_schedule();
+}
+
+void ICACHE_FLASH_ATTR twheel_init(void) {
+    os_timer_disarm(&hwTimer);
+    os_timer_setfn(&hwTimer, (os_timer_func_t *)wheel_run, NULL);
+    wheel.now = current_tick();
+}
+
+void ICACHE_FLASH_ATTR twheel_setfn(twheel_timer_t *t, twheel_fn fn, void *arg) {
+    t->fn = fn;
+    t->arg = arg;
+}
+
+void ICACHE_FLASH_ATTR twheel_disarm(twheel_timer_t *t) {
+    if (t->pprev == NULL) {
+        return;
+    }
+    wheel_del(t);
+    if (!wheel.running) {
+        wheel_schedule();
+    }
+}
+
+void ICACHE_FLASH_ATTR twheel_arm(twheel_timer_t *t, uint32_t ms, uint8_t repeat) {
+    uint64_t nowUs;
+    if (t->pprev != NULL) {
+        wheel_del(t);
+    }
+    nowUs = timebase_local_us();
+    if (stats.armed == 0 && !wheel.running) {
+        wheel.now = (uint32_t)(nowUs / TICK_US); // idle, nothing to catch up on
+    }
+    // the first run is at or after the deadline, at the start of a tick, unless the grid moves it
+    t->expires = (uint32_t)((nowUs + (uint64_t)ms * 1000 + TICK_US - 1) / TICK_US);
+    t->period = repeat ? (ms + TWHEEL_TICK_MS - 1) / TWHEEL_TICK_MS : 0;
+    if (repeat && t->period == 0) {
+        t->period = 1;
+    }
+    t->due = t->expires;
+    if (wheel.gridUs != 0 && (uint64_t)ms * 1000 >= wheel.gridUs) {
+        t->expires = grid_snap(t->due);
+    }
+    wheel_add(t, 0);
+    if (!wheel.running) {
+        wheel_schedule();
+    }
+}
+
+void ICACHE_FLASH_ATTR twheel_set_grid(uint32_t gridUs, uint64_t phaseUs) {
+    wheel.gridUs = gridUs;
+    wheel.gridPhaseUs = phaseUs;
+}
+
+void ICACHE_FLASH_ATTR twheel_set_schedule_cb(twheel_schedule_fn fn) {
+    scheduleCb = fn;
+}
+
+uint8_t ICACHE_FLASH_ATTR twheel_armed(const twheel_timer_t *t) {
+    return t->pprev != NULL;
+}
+
+uint32_t ICACHE_FLASH_ATTR twheel_next_ms(void) {
+    return wheel.hwArmed ? ms_until(wheel.hwTick) : 0xFFFFFFFF;
+}
+
+const twheel_stats_t * ICACHE_FLASH_ATTR twheel_stats(void) {
+    return &stats;
+}
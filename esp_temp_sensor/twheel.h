@@ -0,0 +1,124 @@
+/**
+ * @file
+ * @brief Software timers multiplexed onto one os_timer through a timer wheel.
+ *
+ * Drop-in for os_timer_t: twheel_setfn(), twheel_arm() and twheel_disarm()
+ * behave like their os_timer counterparts, but arming and disarming are
+ * constant time and only one SDK timer is ever armed.
+ *
+ * Time is counted in ticks of TWHEEL_TICK_MS, and deadlines are rounded up to
+ * a whole tick, so timers due within the same tick all run from one wake.
+ * The wheel has four levels. The first holds the next 256 ticks, one slot
+ * per tick. Each further level holds 64 slots, each as long as the whole
+ * level below; its timers move down a level when their slot comes round.
+ * With 10 ms ticks that reaches 7.7 days ahead; longer timers are clamped.
+ *
+ * The SDK timer is armed one-shot for the next tick that has work, either
+ * a first level slot with timers in it or the next move down from a higher
+ * level. With nothing armed it is not armed at all, so the CPU is not woken
+ * for empty ticks.
+ *
+ * A grid can be set with twheel_set_grid(). Timers at least one grid step
+ * long then run on the grid point nearest their deadline, so unrelated long
+ * timers expire together and the radio can sleep in between.
+ */
+#ifndef TWHEEL_H
+#define TWHEEL_H
+
+#include "os_type.h"
+
+#define TWHEEL_TICK_MS 10 /**< Resolution of every timer */
+#define TWHEEL_L0_BITS 8 /**< 256 one-tick slots on the first level */
+#define TWHEEL_LN_BITS 6 /**< 64 slots on each higher level */
+#define TWHEEL_LEVELS 4
+
+typedef void (*twheel_fn)(void *arg);
+typedef void (*twheel_schedule_fn)(uint32_t nextMs);
+
+/**
+ * @struct twheel_timer_t
+ * One logical timer. Owned by the caller, like os_timer_t, and must stay
+ * valid while armed.
+ */
+typedef struct twheel_timer {
+    struct twheel_timer *next; /**< Next timer in the same slot */
+    struct twheel_timer **pprev; /**< The pointer that points at us, NULL when not armed */
+    uint32_t expires; /**< Tick the timer runs on */
+    uint32_t due; /**< Tick it is due, before it was moved to the grid */
+    uint32_t period; /**< Ticks between runs of a repeating timer, 0 for one-shot */
+    uint8_t level; /**< Wheel level the timer is on */
+    twheel_fn fn; /**< Called when the timer expires */
+    void *arg; /**< Passed to fn */
+} twheel_timer_t;
+
+/**
+ * @struct twheel_stats_t
+ * Counters for comparing wakes against the timers they served.
+ */
+typedef struct {
+    uint32_t armed; /**< Timers currently armed */
+    uint32_t wakes; /**< Times the SDK timer fired */
+    uint32_t expired; /**< Timer callbacks run */
+    uint32_t cascaded; /**< Timers moved down a level */
+} twheel_stats_t;
+
+/**
+ * Sets up the wheel. Call once from user_init(), before any timer is armed.
+ */
+void ICACHE_FLASH_ATTR twheel_init(void);
+
+/**
+ * Sets the callback; the timer must not be armed.
+ * @param t the timer
+ * @param fn called on expiry, from the SDK timer callback
+ * @param arg passed to fn
+ */
+void ICACHE_FLASH_ATTR twheel_setfn(twheel_timer_t *t, twheel_fn fn, void *arg);
+
+/**
+ * Arms the timer, rearming it if it was armed already.
+ * @param t the timer
+ * @param ms delay, rounded up to a whole tick
+ * @param repeat 1 to run every ms from then on
+ */
+void ICACHE_FLASH_ATTR twheel_arm(twheel_timer_t *t, uint32_t ms, uint8_t repeat);
+
+/**
+ * Disarms the timer; does nothing if it is not armed.
+ */
+void ICACHE_FLASH_ATTR twheel_disarm(twheel_timer_t *t);
+
+/**
+ * Aligns long timers to a grid. Only affects timers armed, or repeating
+ * timers run, from now on.
+ * @param gridUs grid step in microseconds, kept exactly; 0 turns alignment off
+ * @param phaseUs a timebase_local_us() time that lies on the grid
+ * A timer of at least gridUs runs in the tick of the grid point nearest its
+ * deadline, up to half a step early or late. A repeating one keeps its
+ * period and picks the nearest point afresh on every run, so it never
+ * drifts from its deadlines however the period and the step divide.
+ */
+void ICACHE_FLASH_ATTR twheel_set_grid(uint32_t gridUs, uint64_t phaseUs);
+
+/**
+ * Sets a function to be told whenever the next wake changes.
+ * @param fn called with twheel_next_ms(), or NULL
+ */
+void ICACHE_FLASH_ATTR twheel_set_schedule_cb(twheel_schedule_fn fn);
+
+/**
+ * @return 1 if the timer is armed
+ */
+uint8_t ICACHE_FLASH_ATTR twheel_armed(const twheel_timer_t *t);
+
+/**
+ * @return milliseconds until the SDK timer next fires, 0xFFFFFFFF if nothing is armed
+ */
+uint32_t ICACHE_FLASH_ATTR twheel_next_ms(void);
+
+/**
+ * @return wake and expiry counters
+ */
+const twheel_stats_t * ICACHE_FLASH_ATTR twheel_stats(void);
+
+#endif
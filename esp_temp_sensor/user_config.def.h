@@ -2,6 +2,50 @@
 #define wifi_ssid <SSID_HERE>
 #define wifi_password <Password_Here>
 
+//Brokers in order of preference, the first is the primary, see brokers.h
+#define broker_ips { { 10, 0, 81, 146 } }
+
+//SNTP server timebase.c sets the clock from once a session is up, see sntpd.py
+#define sntp_server_ip { 10, 0, 81, 146 }
+
+//Define MQTT Info, serialized into packets.h by mkpackets.py at build time
+#define mqtt_client_id "" // empty: the broker assigns one
+#define mqtt_username ""
+#define mqtt_password ""
+#define mqtt_topic "test"
+#define mqtt_keepalive 50 // seconds
+#define mqtt_persistent 1 // the broker keeps our subscriptions between connections; "" client id becomes herps-<chip id>
+#define mqtt_status_topic "" // retained online/offline, the offline as our will; "" for herps/<chip id>/status
+#define mqtt_status_online "online"
+#define mqtt_status_offline "offline"
+
+//With make TRANSPORT=mqttsn: topic IDs predefined at the MQTT-SN gateway
+#define mqttsn_topic_id 1 // mqtt_topic
+#define mqttsn_power_topic_id 2 // the power report
+#define mqttsn_qos -1 // 0: stay connected, -1: sleep and publish without a connection
+
+//With make NTC=1: an NTC thermistor on the ADC, tabulated into ntc_table.h by mkntc.py.
+//The thermistor goes from the supply to TOUT, the series resistor from TOUT to ground.
+#define ntc_r25 10000 // ohms at 25 C
+#define ntc_beta 3950 // kelvin, B25/85
+#define ntc_series 10000 // ohms
+#define ntc_supply_mv 3300
+#define ntc_adc_mv 3200 // TOUT at full scale: 1000 on a bare module, 3200 behind a NodeMCU's 220k/100k divider
+#define ntc_min_c -40 // readings are clamped to the probe's range
+#define ntc_max_c 125
+//Alarms on the thermistor's readings, published at QoS 1 on herps/<chip id>/alarm ahead of the readings
+#define alarm_high_c 35 // over-temperature
+#define alarm_low_c 15 // under-temperature
+#define alarm_hysteresis_centi 50 // how far back inside the limits a reading has to come to clear the alarm
+//Proportional heat on PWM channel 1 from the thermistor: off at the setpoint, full power heat_band_centi below it
+#define heat_pin 4 // GPIO4 or GPIO5, which are GPIOs out of reset, to the emitter's solid state relay
+#define heat_setpoint_c 28
+#define heat_band_centi 200
+
+//Home Assistant MQTT discovery, retained configs for the channels on herps/<chip id>/state, see discovery.h
+#define ha_discovery_prefix "homeassistant" // "" to leave discovery off
+#define ha_discovery_version 1 // raise to send every config again, such as after the broker lost its retained messages
+
 // Define Pin GPIO_2 as the LED test Pin
 static const int pin = 2;
 
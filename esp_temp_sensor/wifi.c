@@ -3,6 +3,7 @@
 #include "os_type.h"
 #include "ets_sys.h"
 #include "osapi.h"
+#include "user_config.h"
 
 // Init Wifi
 const char ssid[32] = wifi_ssid;